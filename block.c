@@ -26,6 +26,8 @@
 #include "block/trace.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
+#include "block/status-cache.h"
+#include "block/bitmap-store.h"
 #include "block/nbd.h"
 #include "qemu/error-report.h"
 #include "module_block.h"
@@ -886,6 +888,7 @@ static void bdrv_inherited_options(int *child_flags, QDict *child_options,
     qdict_copy_default(child_options, parent_options, BDRV_OPT_CACHE_DIRECT);
     qdict_copy_default(child_options, parent_options, BDRV_OPT_CACHE_NO_FLUSH);
     qdict_copy_default(child_options, parent_options, BDRV_OPT_FORCE_SHARE);
+    qdict_copy_default(child_options, parent_options, BDRV_OPT_LAZY_OPEN);
 
     /* Inherit the read-only option from the parent if it's not set */
     qdict_copy_default(child_options, parent_options, BDRV_OPT_READ_ONLY);
@@ -1005,6 +1008,7 @@ static void bdrv_backing_options(int *child_flags, QDict *child_options,
     qdict_copy_default(child_options, parent_options, BDRV_OPT_CACHE_DIRECT);
     qdict_copy_default(child_options, parent_options, BDRV_OPT_CACHE_NO_FLUSH);
     qdict_copy_default(child_options, parent_options, BDRV_OPT_FORCE_SHARE);
+    qdict_copy_default(child_options, parent_options, BDRV_OPT_LAZY_OPEN);
 
     /* backing files always opened read-only */
     qdict_set_default_str(child_options, BDRV_OPT_READ_ONLY, "on");
@@ -1325,6 +1329,17 @@ QemuOptsList bdrv_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "always accept other writers (default: off)",
         },
+        {
+            .name = BDRV_OPT_BITMAP_STORE,
+            .type = QEMU_OPT_STRING,
+            .help = "file holding the persistent dirty bitmaps of the node",
+        },
+        {
+            .name = BDRV_OPT_LAZY_OPEN,
+            .type = QEMU_OPT_BOOL,
+            .help = "load metadata of read-only images on first use "
+                    "(default: off)",
+        },
         { /* end of list */ }
     },
 };
@@ -1343,6 +1358,7 @@ static int bdrv_open_common(BlockDriverState *bs, BlockBackend *file,
     const char *node_name = NULL;
     const char *discard;
     const char *detect_zeroes;
+    const char *bitmap_store;
     QemuOpts *opts;
     BlockDriver *drv;
     Error *local_err = NULL;
@@ -1365,6 +1381,7 @@ static int bdrv_open_common(BlockDriverState *bs, BlockBackend *file,
     assert(drv != NULL);
 
     bs->force_share = qemu_opt_get_bool(opts, BDRV_OPT_FORCE_SHARE, false);
+    bs->lazy_open = qemu_opt_get_bool(opts, BDRV_OPT_LAZY_OPEN, false);
 
     if (bs->force_share && (bs->open_flags & BDRV_O_RDWR)) {
         error_setg(errp,
@@ -1456,6 +1473,14 @@ static int bdrv_open_common(BlockDriverState *bs, BlockBackend *file,
         bs->detect_zeroes = value;
     }
 
+    bitmap_store = qemu_opt_get(opts, BDRV_OPT_BITMAP_STORE);
+    if (bitmap_store && drv->bdrv_can_store_new_dirty_bitmap) {
+        error_setg(errp, "Driver '%s' stores persistent bitmaps in the image",
+                   drv->format_name);
+        ret = -EINVAL;
+        goto fail_opts;
+    }
+
     if (filename != NULL) {
         pstrcpy(bs->filename, sizeof(bs->filename), filename);
     } else {
@@ -1473,6 +1498,17 @@ static int bdrv_open_common(BlockDriverState *bs, BlockBackend *file,
         goto fail_opts;
     }
 
+    if (bitmap_store) {
+        bs->bitmap_store = g_strdup(bitmap_store);
+        ret = bdrv_bitmap_store_load(bs, errp);
+        if (ret < 0) {
+            /* Don't let bdrv_close() overwrite the store */
+            g_free(bs->bitmap_store);
+            bs->bitmap_store = NULL;
+            goto fail_opts;
+        }
+    }
+
     qemu_opts_del(opts);
     return 0;
 
@@ -2076,6 +2112,12 @@ static void bdrv_replace_child_noperm(BdrvChild *child,
             child->role->attach(child);
         }
     }
+
+    /* Block status cached above this link no longer describes the chain */
+    if (child->role == &child_backing || child->role == &child_file ||
+        child->role == &child_format) {
+        bdrv_bsc_invalidate(child->opaque);
+    }
 }
 
 /*
@@ -3357,10 +3399,22 @@ static void bdrv_close(BlockDriverState *bs)
     bdrv_flush(bs);
     bdrv_drain(bs); /* in case flush left pending I/O */
 
+    bdrv_bsc_disable(bs);
+
     if (bs->drv) {
+        if (bs->bitmap_store && !(bs->open_flags & BDRV_O_INACTIVE)) {
+            Error *local_err = NULL;
+
+            if (bdrv_bitmap_store_save(bs, &local_err) < 0) {
+                error_reportf_err(local_err, "Lost persistent bitmaps of "
+                                  "node '%s': ", bdrv_get_node_name(bs));
+            }
+        }
         bs->drv->bdrv_close(bs);
         bs->drv = NULL;
     }
+    g_free(bs->bitmap_store);
+    bs->bitmap_store = NULL;
 
     bdrv_set_backing_hd(bs, NULL, &error_abort);
 
@@ -3819,6 +3873,7 @@ int bdrv_truncate(BdrvChild *child, int64_t offset, PreallocMode prealloc,
     }
     bdrv_dirty_bitmap_truncate(bs, offset);
     bdrv_parent_cb_resize(bs);
+    bdrv_bsc_invalidate(bs);
     atomic_inc(&bs->write_gen);
     return ret;
 }
@@ -4430,6 +4485,16 @@ static void coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs,
         return;
     }
 
+    /* Inactivation saved and released the bitmaps, pick them up again */
+    if (bs->bitmap_store) {
+        ret = bdrv_bitmap_store_load(bs, &local_err);
+        if (ret < 0) {
+            bs->open_flags |= BDRV_O_INACTIVE;
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+
     QLIST_FOREACH(parent, &bs->parents, next_parent) {
         if (parent->role->activate) {
             parent->role->activate(parent, &local_err);
@@ -4493,6 +4558,63 @@ void bdrv_invalidate_cache_all(Error **errp)
     }
 }
 
+int coroutine_fn bdrv_co_load_metadata(BlockDriverState *bs, Error **errp)
+{
+    BdrvChild *child;
+    int ret;
+
+    if (!bs->drv) {
+        return 0;
+    }
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        ret = bdrv_co_load_metadata(child->bs, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (bs->drv->bdrv_co_load_metadata) {
+        ret = bs->drv->bdrv_co_load_metadata(bs, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+typedef struct LoadMetadataCo {
+    BlockDriverState *bs;
+    Error **errp;
+    int ret;
+} LoadMetadataCo;
+
+static void coroutine_fn bdrv_load_metadata_co_entry(void *opaque)
+{
+    LoadMetadataCo *lmco = opaque;
+    lmco->ret = bdrv_co_load_metadata(lmco->bs, lmco->errp);
+}
+
+int bdrv_load_metadata(BlockDriverState *bs, Error **errp)
+{
+    Coroutine *co;
+    LoadMetadataCo lmco = {
+        .bs = bs,
+        .errp = errp,
+        .ret = -EINPROGRESS,
+    };
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_load_metadata_co_entry(&lmco);
+    } else {
+        co = qemu_coroutine_create(bdrv_load_metadata_co_entry, &lmco);
+        bdrv_coroutine_enter(bs, co);
+        BDRV_POLL_WHILE(bs, lmco.ret == -EINPROGRESS);
+    }
+    return lmco.ret;
+}
+
 static int bdrv_inactivate_recurse(BlockDriverState *bs,
                                    bool setting_flag)
 {
@@ -4510,6 +4632,19 @@ static int bdrv_inactivate_recurse(BlockDriverState *bs,
         }
     }
 
+    if (!setting_flag && bs->bitmap_store &&
+        !(bs->open_flags & BDRV_O_INACTIVE)) {
+        Error *local_err = NULL;
+
+        ret = bdrv_bitmap_store_save(bs, &local_err);
+        if (ret < 0) {
+            error_reportf_err(local_err, "Lost persistent bitmaps during "
+                              "inactivation of node '%s': ",
+                              bdrv_get_node_name(bs));
+            return ret;
+        }
+    }
+
     if (setting_flag && !(bs->open_flags & BDRV_O_INACTIVE)) {
         uint64_t perm, shared_perm;
 
@@ -4538,7 +4673,7 @@ static int bdrv_inactivate_recurse(BlockDriverState *bs,
     }
 
     /* At this point persistent bitmaps should be already stored by the format
-     * driver */
+     * driver or in the bitmap store */
     bdrv_release_persistent_dirty_bitmaps(bs);
 
     return 0;
@@ -5365,6 +5500,10 @@ bool bdrv_can_store_new_dirty_bitmap(BlockDriverState *bs, const char *name,
         return false;
     }
 
+    if (bs->bitmap_store) {
+        return bdrv_bitmap_store_can_store(bs, name, granularity, errp);
+    }
+
     if (!drv->bdrv_can_store_new_dirty_bitmap) {
         error_setg_errno(errp, ENOTSUP,
                          "Can't store persistent bitmaps to %s",
@@ -32,8 +32,56 @@
 static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
 static const int qtest_latency_ns = NANOSECONDS_PER_SECOND / 1000;
 
+/* The first threads to do I/O own a shard each; any further ones share
+ * the last shard.
+ */
+#define BLOCK_ACCT_SHARED_SHARD (BLOCK_ACCT_SHARDS - 1)
+
+static unsigned next_shard;
+static __thread int thread_shard = -1;
+
+static BlockAcctShard *block_acct_shard(BlockAcctStats *stats)
+{
+    if (thread_shard < 0) {
+        thread_shard = MIN(atomic_fetch_inc(&next_shard),
+                           BLOCK_ACCT_SHARED_SHARD);
+    }
+    return &stats->shards[thread_shard];
+}
+
+/* A shard with a single writer needs no read-modify-write atomics, only
+ * stores that readers cannot see torn.
+ */
+static inline void block_acct_add(Stat64 *s, uint64_t value)
+{
+#ifdef CONFIG_ATOMIC64
+    if (thread_shard != BLOCK_ACCT_SHARED_SHARD) {
+        atomic_set__nocheck(&s->value, s->value + value);
+        return;
+    }
+#endif
+    stat64_add(s, value);
+}
+
+static inline void block_acct_max(Stat64 *s, uint64_t value)
+{
+#ifdef CONFIG_ATOMIC64
+    if (thread_shard != BLOCK_ACCT_SHARED_SHARD) {
+        if (s->value < value) {
+            atomic_set__nocheck(&s->value, value);
+        }
+        return;
+    }
+#endif
+    stat64_max(s, value);
+}
+
 void block_acct_init(BlockAcctStats *stats)
 {
+    size_t size = BLOCK_ACCT_SHARDS * sizeof(BlockAcctShard);
+
+    stats->shards = qemu_memalign(__alignof__(BlockAcctShard), size);
+    memset(stats->shards, 0, size);
     qemu_mutex_init(&stats->lock);
     if (qtest_enabled()) {
         clock_type = QEMU_CLOCK_VIRTUAL;
@@ -53,6 +101,8 @@ void block_acct_cleanup(BlockAcctStats *stats)
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    block_latency_histograms_clear(stats);
+    qemu_vfree(stats->shards);
     qemu_mutex_destroy(&stats->lock);
 }
 
@@ -110,23 +160,23 @@ static int block_latency_histogram_compare_func(const void *key, const void *it)
 }
 
 static void block_latency_histogram_account(BlockLatencyHistogram *hist,
-                                            int64_t latency_ns)
+                                            Stat64 *bins, int64_t latency_ns)
 {
     uint64_t *pos;
 
-    if (hist->bins == NULL) {
+    if (bins == NULL) {
         /* histogram disabled */
         return;
     }
 
 
     if (latency_ns < hist->boundaries[0]) {
-        hist->bins[0]++;
+        block_acct_add(&bins[0], 1);
         return;
     }
 
     if (latency_ns >= hist->boundaries[hist->nbins - 2]) {
-        hist->bins[hist->nbins - 1]++;
+        block_acct_add(&bins[hist->nbins - 1], 1);
         return;
     }
 
@@ -135,7 +185,7 @@ static void block_latency_histogram_account(BlockLatencyHistogram *hist,
                   block_latency_histogram_compare_func);
     assert(pos != NULL);
 
-    hist->bins[pos - hist->boundaries + 1]++;
+    block_acct_add(&bins[pos - hist->boundaries + 1], 1);
 }
 
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
@@ -146,6 +196,7 @@ int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
     uint64_t *ptr;
     uint64_t prev = 0;
     int new_nbins = 1;
+    int i;
 
     for (entry = boundaries; entry; entry = entry->next) {
         if (entry->value <= prev) {
@@ -164,27 +215,60 @@ int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
         *ptr = entry->value;
     }
 
-    g_free(hist->bins);
-    hist->bins = g_new0(uint64_t, hist->nbins);
+    for (i = 0; i < BLOCK_ACCT_SHARDS; i++) {
+        g_free(stats->shards[i].latency_bins[type]);
+        stats->shards[i].latency_bins[type] = g_new0(Stat64, hist->nbins);
+    }
 
     return 0;
 }
 
 void block_latency_histograms_clear(BlockAcctStats *stats)
 {
-    int i;
+    int i, j;
 
     for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
         BlockLatencyHistogram *hist = &stats->latency_histogram[i];
-        g_free(hist->bins);
         g_free(hist->boundaries);
         memset(hist, 0, sizeof(*hist));
+
+        for (j = 0; j < BLOCK_ACCT_SHARDS; j++) {
+            g_free(stats->shards[j].latency_bins[i]);
+            stats->shards[j].latency_bins[i] = NULL;
+        }
     }
 }
 
+/* Sums up the shards into @hist, which the caller frees */
+bool block_latency_histogram_get(BlockAcctStats *stats,
+                                 enum BlockAcctType type,
+                                 BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogram *config = &stats->latency_histogram[type];
+    int i, j;
+
+    if (!stats->shards[0].latency_bins[type]) {
+        return false;
+    }
+
+    hist->nbins = config->nbins;
+    hist->boundaries = g_memdup(config->boundaries,
+                                (config->nbins - 1) * sizeof(uint64_t));
+    hist->bins = g_new0(uint64_t, config->nbins);
+    for (i = 0; i < BLOCK_ACCT_SHARDS; i++) {
+        Stat64 *bins = stats->shards[i].latency_bins[type];
+
+        for (j = 0; j < config->nbins; j++) {
+            hist->bins[j] += stat64_get(&bins[j]);
+        }
+    }
+    return true;
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
+    BlockAcctShard *shard = block_acct_shard(stats);
     BlockAcctTimedStats *s;
     int64_t time_ns = qemu_clock_get_ns(clock_type);
     int64_t latency_ns = time_ns - cookie->start_time_ns;
@@ -195,28 +279,30 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
     assert(cookie->type < BLOCK_MAX_IOTYPE);
 
-    qemu_mutex_lock(&stats->lock);
-
     if (failed) {
-        stats->failed_ops[cookie->type]++;
+        block_acct_add(&shard->failed_ops[cookie->type], 1);
     } else {
-        stats->nr_bytes[cookie->type] += cookie->bytes;
-        stats->nr_ops[cookie->type]++;
+        block_acct_add(&shard->nr_bytes[cookie->type], cookie->bytes);
+        block_acct_add(&shard->nr_ops[cookie->type], 1);
     }
 
     block_latency_histogram_account(&stats->latency_histogram[cookie->type],
+                                    shard->latency_bins[cookie->type],
                                     latency_ns);
 
     if (!failed || stats->account_failed) {
-        stats->total_time_ns[cookie->type] += latency_ns;
-        stats->last_access_time_ns = time_ns;
-
-        QSLIST_FOREACH(s, &stats->intervals, entries) {
-            timed_average_account(&s->latency[cookie->type], latency_ns);
+        block_acct_add(&shard->total_time_ns[cookie->type], latency_ns);
+        block_acct_max(&shard->last_access_time_ns, time_ns);
+
+        /* Intervals are only added during setup */
+        if (!QSLIST_EMPTY(&stats->intervals)) {
+            qemu_mutex_lock(&stats->lock);
+            QSLIST_FOREACH(s, &stats->intervals, entries) {
+                timed_average_account(&s->latency[cookie->type], latency_ns);
+            }
+            qemu_mutex_unlock(&stats->lock);
         }
     }
-
-    qemu_mutex_unlock(&stats->lock);
 }
 
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
@@ -237,13 +323,14 @@ void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type)
      * not.  The reason is that invalid requests are accounted during their
      * submission, therefore there's no actual I/O involved.
      */
-    qemu_mutex_lock(&stats->lock);
-    stats->invalid_ops[type]++;
+    BlockAcctShard *shard = block_acct_shard(stats);
+
+    block_acct_add(&shard->invalid_ops[type], 1);
 
     if (stats->account_invalid) {
-        stats->last_access_time_ns = qemu_clock_get_ns(clock_type);
+        block_acct_max(&shard->last_access_time_ns,
+                   qemu_clock_get_ns(clock_type));
     }
-    qemu_mutex_unlock(&stats->lock);
 }
 
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
@@ -251,14 +338,48 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
 {
     assert(type < BLOCK_MAX_IOTYPE);
 
-    qemu_mutex_lock(&stats->lock);
-    stats->merged[type] += num_requests;
-    qemu_mutex_unlock(&stats->lock);
+    block_acct_add(&block_acct_shard(stats)->merged[type], num_requests);
+}
+
+/* Sums up the shards; each counter is exact, but they are not read at
+ * the same instant.
+ */
+void block_acct_get_counters(BlockAcctStats *stats,
+                             BlockAcctCounters *counters)
+{
+    BlockAcctShard *shard;
+    int i, type;
+
+    memset(counters, 0, sizeof(*counters));
+    for (i = 0; i < BLOCK_ACCT_SHARDS; i++) {
+        shard = &stats->shards[i];
+        for (type = 0; type < BLOCK_MAX_IOTYPE; type++) {
+            counters->nr_bytes[type] += stat64_get(&shard->nr_bytes[type]);
+            counters->nr_ops[type] += stat64_get(&shard->nr_ops[type]);
+            counters->invalid_ops[type] +=
+                stat64_get(&shard->invalid_ops[type]);
+            counters->failed_ops[type] += stat64_get(&shard->failed_ops[type]);
+            counters->total_time_ns[type] +=
+                stat64_get(&shard->total_time_ns[type]);
+            counters->merged[type] += stat64_get(&shard->merged[type]);
+        }
+        counters->last_access_time_ns =
+            MAX(counters->last_access_time_ns,
+                (int64_t)stat64_get(&shard->last_access_time_ns));
+    }
 }
 
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats)
 {
-    return qemu_clock_get_ns(clock_type) - stats->last_access_time_ns;
+    int64_t last_access_time_ns = 0;
+    int i;
+
+    for (i = 0; i < BLOCK_ACCT_SHARDS; i++) {
+        last_access_time_ns =
+            MAX(last_access_time_ns,
+                (int64_t)stat64_get(&stats->shards[i].last_access_time_ns));
+    }
+    return qemu_clock_get_ns(clock_type) - last_access_time_ns;
 }
 
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
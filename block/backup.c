@@ -27,6 +27,8 @@
 #include "qemu/error-report.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_CHUNK_DEFAULT (1 << 20)
+#define BACKUP_MAX_WORKERS_DEFAULT 16
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct BackupBlockJob {
@@ -46,8 +48,33 @@ typedef struct BackupBlockJob {
     QLIST_HEAD(, CowRequest) inflight_reqs;
 
     HBitmap *copy_bitmap;
+
+    /* Background copy, up to @max_workers runs of at most @max_chunk bytes */
+    int max_workers;
+    int64_t max_chunk;
+    int in_flight;
+    bool waiting_for_io;
+    QTAILQ_HEAD(, BackupOp) failed;
+
+    /* Guest writes waiting for copy before write, the background copy
+     * does not start new operations while there are any */
+    int cow_in_flight;
+    CoQueue cow_queue;
+
+    /* Bounce buffers of @max_chunk bytes, shared by all copies */
+    void **free_bufs;
+    int nb_free_bufs;
 } BackupBlockJob;
 
+typedef struct BackupOp {
+    BackupBlockJob *job;
+    int64_t offset;
+    int64_t bytes;
+    bool error_is_read;
+    int ret;
+    QTAILQ_ENTRY(BackupOp) next;
+} BackupOp;
+
 /* See if in-flight requests overlap and wait for them to complete */
 static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
                                                        int64_t start,
@@ -85,19 +112,132 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+static void *backup_buffer_get(BackupBlockJob *job)
+{
+    if (job->nb_free_bufs) {
+        return job->free_bufs[--job->nb_free_bufs];
+    }
+    return blk_blockalign(job->common.blk, job->max_chunk);
+}
+
+static void backup_buffer_put(BackupBlockJob *job, void *buf)
+{
+    if (job->nb_free_bufs < job->max_workers) {
+        job->free_bufs[job->nb_free_bufs++] = buf;
+    } else {
+        qemu_vfree(buf);
+    }
+}
+
+static void backup_buffer_pool_free(BackupBlockJob *job)
+{
+    while (job->nb_free_bufs) {
+        qemu_vfree(job->free_bufs[--job->nb_free_bufs]);
+    }
+    g_free(job->free_bufs);
+    job->free_bufs = NULL;
+}
+
+/* Write @bytes from @buf, using write zeroes for clusters that are zero */
+static int coroutine_fn backup_write(BackupBlockJob *job, int64_t start,
+                                     int64_t bytes, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t pos, next;
+    int ret = 0;
+
+    for (pos = 0; pos < bytes && ret >= 0; pos = next) {
+        bool zero = buffer_is_zero(buf + pos,
+                                   MIN(job->cluster_size, bytes - pos));
+
+        for (next = pos + job->cluster_size; next < bytes; next +=
+             job->cluster_size) {
+            if (buffer_is_zero(buf + next, MIN(job->cluster_size,
+                                               bytes - next)) != zero) {
+                break;
+            }
+        }
+        next = MIN(next, bytes);
+
+        if (zero) {
+            ret = blk_co_pwrite_zeroes(job->target, start + pos, next - pos,
+                                       BDRV_REQ_MAY_UNMAP);
+        } else {
+            iov.iov_base = buf + pos;
+            iov.iov_len = next - pos;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = blk_co_pwritev(job->target, start + pos, qiov.size, &qiov,
+                                 job->compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
+        }
+    }
+    return ret;
+}
+
+/* Copy the clusters in [start, end), all of which are still to be copied */
+static int coroutine_fn backup_copy_run(BackupBlockJob *job,
+                                        int64_t start, int64_t end,
+                                        bool *error_is_read,
+                                        bool is_write_notifier)
+{
+    BlockBackend *blk = job->common.blk;
+    int64_t cluster = start / job->cluster_size;
+    int64_t nb_clusters = DIV_ROUND_UP(end - start, job->cluster_size);
+    int64_t n = MIN(end, job->common.len) - start;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    void *bounce_buffer;
+    int ret;
+
+    hbitmap_reset(job->copy_bitmap, cluster, nb_clusters);
+    trace_backup_do_cow_process(job, start, n);
+
+    bounce_buffer = backup_buffer_get(job);
+    iov.iov_base = bounce_buffer;
+    iov.iov_len = n;
+    qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+    ret = blk_co_preadv(blk, start, bounce_qiov.size, &bounce_qiov,
+                        is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
+    if (ret < 0) {
+        trace_backup_do_cow_read_fail(job, start, ret);
+        if (error_is_read) {
+            *error_is_read = true;
+        }
+        goto fail;
+    }
+
+    ret = backup_write(job, start, n, bounce_buffer);
+    if (ret < 0) {
+        trace_backup_do_cow_write_fail(job, start, ret);
+        if (error_is_read) {
+            *error_is_read = false;
+        }
+        goto fail;
+    }
+    backup_buffer_put(job, bounce_buffer);
+
+    /* Publish progress, guest I/O counts as progress too.  Note that the
+     * offset field is an opaque progress value, it is not a disk offset.
+     */
+    job->bytes_read += n;
+    job->common.offset += n;
+    return 0;
+
+fail:
+    backup_buffer_put(job, bounce_buffer);
+    hbitmap_set(job->copy_bitmap, cluster, nb_clusters);
+    return ret;
+}
+
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       int64_t offset, uint64_t bytes,
                                       bool *error_is_read,
                                       bool is_write_notifier)
 {
-    BlockBackend *blk = job->common.blk;
     CowRequest cow_request;
-    struct iovec iov;
-    QEMUIOVector bounce_qiov;
-    void *bounce_buffer = NULL;
     int ret = 0;
     int64_t start, end; /* bytes */
-    int n; /* bytes */
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
@@ -109,62 +249,27 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start += job->cluster_size) {
+    while (start < end) {
+        int64_t run_end;
+
         if (!hbitmap_get(job->copy_bitmap, start / job->cluster_size)) {
             trace_backup_do_cow_skip(job, start);
+            start += job->cluster_size;
             continue; /* already copied */
         }
-        hbitmap_reset(job->copy_bitmap, start / job->cluster_size, 1);
 
-        trace_backup_do_cow_process(job, start);
+        /* Copy the whole run of clusters still to be copied at once */
+        run_end = hbitmap_next_zero(job->copy_bitmap,
+                                    start / job->cluster_size);
+        run_end = run_end < 0 ? end : MIN(run_end * job->cluster_size, end);
+        run_end = MIN(run_end, start + job->max_chunk);
 
-        n = MIN(job->cluster_size, job->common.len - start);
-
-        if (!bounce_buffer) {
-            bounce_buffer = blk_blockalign(blk, job->cluster_size);
-        }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
-
-        ret = blk_co_preadv(blk, start, bounce_qiov.size, &bounce_qiov,
-                            is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
+        ret = backup_copy_run(job, start, run_end, error_is_read,
+                              is_write_notifier);
         if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
-            }
-            hbitmap_set(job->copy_bitmap, start / job->cluster_size, 1);
-            goto out;
-        }
-
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
-            ret = blk_co_pwrite_zeroes(job->target, start,
-                                       bounce_qiov.size, BDRV_REQ_MAY_UNMAP);
-        } else {
-            ret = blk_co_pwritev(job->target, start,
-                                 bounce_qiov.size, &bounce_qiov,
-                                 job->compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
-        }
-        if (ret < 0) {
-            trace_backup_do_cow_write_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = false;
-            }
-            hbitmap_set(job->copy_bitmap, start / job->cluster_size, 1);
-            goto out;
+            break;
         }
-
-        /* Publish progress, guest I/O counts as progress too.  Note that the
-         * offset field is an opaque progress value, it is not a disk offset.
-         */
-        job->bytes_read += n;
-        job->common.offset += n;
-    }
-
-out:
-    if (bounce_buffer) {
-        qemu_vfree(bounce_buffer);
+        start = run_end;
     }
 
     cow_request_end(&cow_request);
@@ -182,12 +287,18 @@ static int coroutine_fn backup_before_write_notify(
 {
     BackupBlockJob *job = container_of(notifier, BackupBlockJob, before_write);
     BdrvTrackedRequest *req = opaque;
+    int ret;
 
     assert(req->bs == blk_bs(job->common.blk));
     assert(QEMU_IS_ALIGNED(req->offset, BDRV_SECTOR_SIZE));
     assert(QEMU_IS_ALIGNED(req->bytes, BDRV_SECTOR_SIZE));
 
-    return backup_do_cow(job, req->offset, req->bytes, NULL, true);
+    job->cow_in_flight++;
+    ret = backup_do_cow(job, req->offset, req->bytes, NULL, true);
+    if (--job->cow_in_flight == 0) {
+        qemu_co_queue_restart_all(&job->cow_queue);
+    }
+    return ret;
 }
 
 static void backup_set_speed(BlockJob *job, int64_t speed, Error **errp)
@@ -360,30 +471,199 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
-static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
+static void coroutine_fn backup_co_op(void *opaque)
 {
+    BackupOp *op = opaque;
+    BackupBlockJob *job = op->job;
     int ret;
-    bool error_is_read;
-    int64_t cluster;
+
+    ret = backup_do_cow(job, op->offset, op->bytes, &op->error_is_read, false);
+    job->in_flight--;
+
+    if (ret < 0) {
+        /* The job coroutine decides whether to retry */
+        op->ret = ret;
+        QTAILQ_INSERT_TAIL(&job->failed, op, next);
+    } else {
+        g_free(op);
+    }
+
+    if (job->waiting_for_io) {
+        aio_co_wake(job->common.co);
+    }
+}
+
+static void coroutine_fn backup_wait_for_io(BackupBlockJob *job)
+{
+    assert(!job->waiting_for_io);
+    job->waiting_for_io = true;
+    qemu_coroutine_yield();
+    job->waiting_for_io = false;
+}
+
+static void coroutine_fn backup_issue(BackupBlockJob *job, int64_t offset,
+                                      int64_t bytes)
+{
+    BackupOp *op;
+    Coroutine *co;
+
+    while (job->in_flight >= job->max_workers) {
+        backup_wait_for_io(job);
+    }
+
+    op = g_new(BackupOp, 1);
+    *op = (BackupOp) {
+        .job    = job,
+        .offset = offset,
+        .bytes  = bytes,
+    };
+    job->in_flight++;
+    co = qemu_coroutine_create(backup_co_op, op);
+    qemu_coroutine_enter(co);
+}
+
+/*
+ * Decide what to do about the copies that failed since the last call.  Their
+ * clusters are marked in copy_bitmap again, so retrying just means moving
+ * @cluster back.  Returns a negative errno if the job must stop, 1 if a retry
+ * is needed and 0 if nothing failed.
+ */
+static int coroutine_fn backup_handle_failed(BackupBlockJob *job,
+                                             int64_t *cluster)
+{
+    BackupOp *op;
+    int ret = 0;
+
+    while ((op = QTAILQ_FIRST(&job->failed)) != NULL) {
+        QTAILQ_REMOVE(&job->failed, op, next);
+        if (ret >= 0) {
+            if (backup_error_action(job, op->error_is_read, -op->ret) ==
+                BLOCK_ERROR_ACTION_REPORT) {
+                ret = op->ret;
+            } else {
+                *cluster = MIN(*cluster, op->offset / job->cluster_size);
+                ret = 1;
+            }
+        }
+        g_free(op);
+    }
+    return ret;
+}
+
+/*
+ * For sync=top, find out whether the clusters starting at @offset have to be
+ * copied.  Returns 1 if the first @pnum bytes are allocated in the topmost
+ * image and must be copied, 0 if they can be skipped, or a negative errno.
+ */
+static int backup_top_run(BackupBlockJob *job, int64_t offset, int64_t bytes,
+                          int64_t *pnum)
+{
+    BlockDriverState *bs = blk_bs(job->common.blk);
+    int64_t n;
+    int i, ret;
+
+    ret = bdrv_is_allocated(bs, offset, bytes, &n);
+    if (ret < 0) {
+        return ret;
+    } else if (ret) {
+        *pnum = QEMU_ALIGN_UP(n, job->cluster_size);
+        return 1;
+    } else if (n >= job->cluster_size) {
+        *pnum = QEMU_ALIGN_DOWN(n, job->cluster_size);
+        return 0;
+    }
+
+    /* bdrv_is_allocated() only returns true/false based on the first set of
+     * sectors it comes across that are are all in the same state.  For that
+     * reason we must verify each sector in the backup cluster length.  We
+     * end up copying more than needed but at some point that is always the
+     * case. */
+    *pnum = job->cluster_size;
+    for (i = n; n && i < job->cluster_size; i += n) {
+        ret = bdrv_is_allocated(bs, offset + i, job->cluster_size - i, &n);
+        if (ret) {
+            break;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Copy everything that is set in copy_bitmap, for all sync modes but 'none'.
+ * Runs of consecutive clusters are copied by up to max_workers operations in
+ * parallel; copy before write for guest requests takes priority and only
+ * waits for the operations that overlap it.
+ */
+static int coroutine_fn backup_loop(BackupBlockJob *job)
+{
+    int64_t nb_clusters = DIV_ROUND_UP(job->common.len, job->cluster_size);
+    int64_t cluster = 0, next, end, offset, bytes, n;
     HBitmapIter hbi;
+    int ret;
+
+    for (;;) {
+        if (yield_and_check(job)) {
+            return 0;
+        }
 
-    hbitmap_iter_init(&hbi, job->copy_bitmap, 0);
-    while ((cluster = hbitmap_iter_next(&hbi)) != -1) {
-        do {
-            if (yield_and_check(job)) {
-                return 0;
+        ret = backup_handle_failed(job, &cluster);
+        if (ret < 0) {
+            return ret;
+        } else if (ret > 0) {
+            /* Go through the pause point again before retrying */
+            continue;
+        }
+
+        while (job->cow_in_flight) {
+            qemu_co_queue_wait(&job->cow_queue, NULL);
+        }
+
+        next = -1;
+        if (cluster < nb_clusters) {
+            hbitmap_iter_init(&hbi, job->copy_bitmap, cluster);
+            next = hbitmap_iter_next(&hbi);
+        }
+        if (next < 0) {
+            /* Done, unless copies that are still running fail */
+            cluster = nb_clusters;
+            if (!job->in_flight) {
+                if (QTAILQ_EMPTY(&job->failed)) {
+                    return 0;
+                }
+                continue;
             }
-            ret = backup_do_cow(job, cluster * job->cluster_size,
-                                job->cluster_size, &error_is_read, false);
-            if (ret < 0 && backup_error_action(job, error_is_read, -ret) ==
-                           BLOCK_ERROR_ACTION_REPORT)
-            {
-                return ret;
+            backup_wait_for_io(job);
+            continue;
+        }
+
+        end = hbitmap_next_zero(job->copy_bitmap, next);
+        if (end < 0) {
+            end = nb_clusters;
+        }
+        offset = next * job->cluster_size;
+        bytes = MIN((end - next) * job->cluster_size, job->max_chunk);
+
+        if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
+            ret = backup_top_run(job, offset, bytes, &n);
+            if (ret < 0) {
+                /* Depending on error action, fail now or retry cluster */
+                if (backup_error_action(job, true, -ret) ==
+                    BLOCK_ERROR_ACTION_REPORT) {
+                    return ret;
+                }
+                cluster = next;
+                continue;
+            } else if (ret == 0) {
+                /* Not in the topmost image, skip it */
+                cluster = next + n / job->cluster_size;
+                continue;
             }
-        } while (ret < 0);
-    }
+            bytes = MIN(bytes, n);
+        }
 
-    return 0;
+        backup_issue(job, offset, bytes);
+        cluster = next + bytes / job->cluster_size;
+    }
 }
 
 /* init copy_bitmap from sync_bitmap */
@@ -431,11 +711,14 @@ static void coroutine_fn backup_run(void *opaque)
     BackupBlockJob *job = opaque;
     BackupCompleteData *data;
     BlockDriverState *bs = blk_bs(job->common.blk);
-    int64_t offset, nb_clusters;
+    int64_t nb_clusters;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
+    QTAILQ_INIT(&job->failed);
+    qemu_co_queue_init(&job->cow_queue);
+    job->free_bufs = g_new(void *, job->max_workers);
 
     nb_clusters = DIV_ROUND_UP(job->common.len, job->cluster_size);
     job->copy_bitmap = hbitmap_alloc(nb_clusters, 0);
@@ -457,68 +740,19 @@ static void coroutine_fn backup_run(void *opaque)
              * notify callback service CoW requests. */
             block_job_yield(&job->common);
         }
-    } else if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
-        ret = backup_run_incremental(job);
     } else {
-        /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (offset = 0; offset < job->common.len;
-             offset += job->cluster_size) {
-            bool error_is_read;
-            int alloced = 0;
-
-            if (yield_and_check(job)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i;
-                int64_t n;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < job->cluster_size;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs, offset + i,
-                                          job->cluster_size - i, &n);
-                    i += n;
-
-                    if (alloced || n == 0) {
-                        break;
-                    }
-                }
+        /* FULL, TOP and INCREMENTAL only differ in what they copy */
+        ret = backup_loop(job);
+    }
 
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            if (alloced < 0) {
-                ret = alloced;
-            } else {
-                ret = backup_do_cow(job, offset, job->cluster_size,
-                                    &error_is_read, false);
-            }
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    offset -= job->cluster_size;
-                    continue;
-                }
-            }
-        }
+    /* wait until the background copies have completed */
+    while (job->in_flight) {
+        backup_wait_for_io(job);
+    }
+    while (!QTAILQ_EMPTY(&job->failed)) {
+        BackupOp *op = QTAILQ_FIRST(&job->failed);
+        QTAILQ_REMOVE(&job->failed, op, next);
+        g_free(op);
     }
 
     notifier_with_return_remove(&job->before_write);
@@ -527,6 +761,7 @@ static void coroutine_fn backup_run(void *opaque)
     qemu_co_rwlock_wrlock(&job->flush_rwlock);
     qemu_co_rwlock_unlock(&job->flush_rwlock);
     hbitmap_free(job->copy_bitmap);
+    backup_buffer_pool_free(job);
 
     data = g_malloc(sizeof(*data));
     data->ret = ret;
@@ -548,7 +783,7 @@ static const BlockJobDriver backup_job_driver = {
 BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
-                  bool compress,
+                  bool compress, int64_t max_workers, int64_t max_chunk,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   int creation_flags,
@@ -586,6 +821,19 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         return NULL;
     }
 
+    if (max_workers < 0 || max_workers > BLOCK_JOB_MAX_IN_FLIGHT) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value between 0 (default) and "
+                   stringify(BLOCK_JOB_MAX_IN_FLIGHT));
+        return NULL;
+    }
+
+    if (max_chunk < 0 || max_chunk > BDRV_REQUEST_MAX_BYTES) {
+        error_setg(errp, "max-chunk must be at most %" PRId64 " bytes",
+                   (int64_t)BDRV_REQUEST_MAX_BYTES);
+        return NULL;
+    }
+
     if (bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_BACKUP_SOURCE, errp)) {
         return NULL;
     }
@@ -673,6 +921,15 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         job->cluster_size = MAX(BACKUP_CLUSTER_SIZE_DEFAULT, bdi.cluster_size);
     }
 
+    /* Compressed writes must be exactly one cluster */
+    job->max_workers = max_workers ?: BACKUP_MAX_WORKERS_DEFAULT;
+    if (compress) {
+        job->max_chunk = job->cluster_size;
+    } else {
+        job->max_chunk = QEMU_ALIGN_UP(max_chunk ?: BACKUP_MAX_CHUNK_DEFAULT,
+                                       job->cluster_size);
+    }
+
     /* Required permissions are already taken with target's blk_new() */
     block_job_add_bdrv(&job->common, "target", target, 0, BLK_PERM_ALL,
                        &error_abort);
@@ -0,0 +1,559 @@
+/*
+ * Sidecar file for persistent dirty bitmaps
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ * Only qcow2 can keep persistent dirty bitmaps inside the image.  Nodes of
+ * any other format (raw, or a VHD exported to us over NBD) can instead name
+ * a sidecar file with the "bitmap-store" option; the bitmaps are loaded from
+ * it on open and written back on close and on inactivation.
+ *
+ * The file is a header followed by one record per bitmap, all fields little
+ * endian and every part aligned to 8 bytes:
+ *
+ *   header:  BitmapStoreHeader
+ *   record:  BitmapStoreEntry, name, chunk map, data of the non-zero chunks
+ *
+ * A chunk is BITMAP_STORE_CHUNK_SIZE bytes of serialized bitmap.  The chunk
+ * map has one byte per chunk, 1 if its data follows and 0 if it is all
+ * zeroes, so that mostly clean bitmaps take little space and loading stays a
+ * single sequential pass over the file.
+ *
+ * While a writable node has the store loaded, the header carries the IN_USE
+ * flag.  Bitmaps found in a file that still has it set missed writes when
+ * QEMU went away uncleanly, so they are dropped rather than trusted.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/cutils.h"
+#include "block/block_int.h"
+#include "block/dirty-bitmap.h"
+#include "block/bitmap-store.h"
+
+#define BITMAP_STORE_MAGIC          "QDPBMAP"
+#define BITMAP_STORE_VERSION        1
+#define BITMAP_STORE_CHUNK_SIZE     65536
+
+#define BITMAP_STORE_FLAG_IN_USE    (1U << 0)
+#define BITMAP_STORE_ENTRY_ENABLED  (1U << 0)
+#define BITMAP_STORE_ENTRY_SPARSE   (1U << 1)
+
+#define BITMAP_STORE_MAX_NAME_SIZE  1023
+#define BITMAP_STORE_MIN_GRAN_BITS  9
+#define BITMAP_STORE_MAX_GRAN_BITS  31
+
+typedef struct QEMU_PACKED BitmapStoreHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t nb_bitmaps;
+    uint32_t reserved32;
+    uint64_t reserved64;
+} BitmapStoreHeader;
+
+typedef struct QEMU_PACKED BitmapStoreEntry {
+    uint64_t size;          /* bytes covered by the bitmap */
+    uint64_t data_size;     /* bytes following the entry, padding included */
+    uint32_t granularity;
+    uint32_t flags;
+    uint32_t name_size;
+    uint32_t nb_chunks;
+} BitmapStoreEntry;
+
+QEMU_BUILD_BUG_ON(sizeof(BitmapStoreHeader) != 32);
+QEMU_BUILD_BUG_ON(sizeof(BitmapStoreEntry) != 32);
+
+static const uint8_t zero_pad[8];
+
+/* Bytes of guest data covered by one chunk */
+static uint64_t bitmap_store_chunk_bytes(uint32_t granularity)
+{
+    return (uint64_t)BITMAP_STORE_CHUNK_SIZE * BITS_PER_BYTE * granularity;
+}
+
+static int bitmap_store_read(FILE *f, void *buf, size_t size)
+{
+    if (size && fread(buf, size, 1, f) != 1) {
+        return ferror(f) ? -EIO : -EINVAL;
+    }
+    return 0;
+}
+
+static int bitmap_store_skip_pad(FILE *f, uint64_t size)
+{
+    uint8_t pad[8];
+
+    return bitmap_store_read(f, pad, ROUND_UP(size, 8) - size);
+}
+
+static int bitmap_store_write(FILE *f, const void *buf, size_t size)
+{
+    if (size && fwrite(buf, size, 1, f) != 1) {
+        return errno ? -errno : -EIO;
+    }
+    return 0;
+}
+
+static int bitmap_store_write_pad(FILE *f, uint64_t size)
+{
+    return bitmap_store_write(f, zero_pad, ROUND_UP(size, 8) - size);
+}
+
+static int bitmap_store_sync(FILE *f)
+{
+    if (fflush(f) || qemu_fdatasync(fileno(f))) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int bitmap_store_sync_dir(const char *path)
+{
+    char *dir = g_path_get_dirname(path);
+    int fd, ret = 0;
+
+    fd = qemu_open(dir, O_RDONLY);
+    if (fd < 0 || fsync(fd)) {
+        ret = -errno;
+    }
+    if (fd >= 0) {
+        qemu_close(fd);
+    }
+    g_free(dir);
+    return ret;
+}
+
+static void bitmap_store_header_to_cpus(BitmapStoreHeader *h)
+{
+    le32_to_cpus(&h->version);
+    le32_to_cpus(&h->flags);
+    le32_to_cpus(&h->nb_bitmaps);
+}
+
+static void bitmap_store_entry_to_cpus(BitmapStoreEntry *e)
+{
+    le64_to_cpus(&e->size);
+    le64_to_cpus(&e->data_size);
+    le32_to_cpus(&e->granularity);
+    le32_to_cpus(&e->flags);
+    le32_to_cpus(&e->name_size);
+    le32_to_cpus(&e->nb_chunks);
+}
+
+static void bitmap_store_entry_to_le(BitmapStoreEntry *e)
+{
+    cpu_to_le64s(&e->size);
+    cpu_to_le64s(&e->data_size);
+    cpu_to_le32s(&e->granularity);
+    cpu_to_le32s(&e->flags);
+    cpu_to_le32s(&e->name_size);
+    cpu_to_le32s(&e->nb_chunks);
+}
+
+static int bitmap_store_write_header(FILE *f, uint32_t flags,
+                                     uint32_t nb_bitmaps)
+{
+    BitmapStoreHeader h = {
+        .magic = BITMAP_STORE_MAGIC,
+        .version = cpu_to_le32(BITMAP_STORE_VERSION),
+        .flags = cpu_to_le32(flags),
+        .nb_bitmaps = cpu_to_le32(nb_bitmaps),
+    };
+
+    return bitmap_store_write(f, &h, sizeof(h));
+}
+
+static bool bitmap_store_entry_valid(const BitmapStoreEntry *e)
+{
+    if (e->name_size == 0 || e->name_size > BITMAP_STORE_MAX_NAME_SIZE ||
+        !is_power_of_2(e->granularity) ||
+        ctz32(e->granularity) < BITMAP_STORE_MIN_GRAN_BITS ||
+        ctz32(e->granularity) > BITMAP_STORE_MAX_GRAN_BITS) {
+        return false;
+    }
+    return e->nb_chunks ==
+           DIV_ROUND_UP(e->size, bitmap_store_chunk_bytes(e->granularity));
+}
+
+/* Read the chunk map and the chunk data of @e into @bitmap */
+static int bitmap_store_load_data(FILE *f, const BitmapStoreEntry *e,
+                                  BdrvDirtyBitmap *bitmap)
+{
+    uint64_t chunk_bytes = bitmap_store_chunk_bytes(e->granularity);
+    uint64_t data_size = ROUND_UP(e->nb_chunks, 8);
+    uint8_t *map = g_malloc(e->nb_chunks);
+    uint8_t *buf = g_malloc(BITMAP_STORE_CHUNK_SIZE);
+    uint32_t i;
+    int ret;
+
+    ret = bitmap_store_read(f, map, e->nb_chunks);
+    if (ret == 0) {
+        ret = bitmap_store_skip_pad(f, e->nb_chunks);
+    }
+
+    for (i = 0; ret == 0 && i < e->nb_chunks; i++) {
+        uint64_t offset = i * chunk_bytes;
+        uint64_t bytes = MIN(e->size - offset, chunk_bytes);
+        uint64_t size;
+
+        if (map[i] == 0) {
+            bdrv_dirty_bitmap_deserialize_zeroes(bitmap, offset, bytes, false);
+            continue;
+        }
+        if (map[i] != 1) {
+            ret = -EINVAL;
+            break;
+        }
+
+        size = bdrv_dirty_bitmap_serialization_size(bitmap, offset, bytes);
+        data_size += size;
+        ret = bitmap_store_read(f, buf, size);
+        if (ret == 0) {
+            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, offset, bytes,
+                                               false);
+        }
+    }
+
+    if (ret == 0) {
+        ret = bitmap_store_skip_pad(f, data_size);
+        data_size = ROUND_UP(data_size, 8);
+    }
+    if (ret == 0 && data_size != e->data_size) {
+        ret = -EINVAL;
+    }
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+
+    g_free(buf);
+    g_free(map);
+    return ret;
+}
+
+static int bitmap_store_load_entry(BlockDriverState *bs, FILE *f,
+                                   int64_t len, Error **errp)
+{
+    BitmapStoreEntry e;
+    BdrvDirtyBitmap *bitmap;
+    char *name;
+    int ret;
+
+    ret = bitmap_store_read(f, &e, sizeof(e));
+    if (ret < 0) {
+        goto fail_read;
+    }
+    bitmap_store_entry_to_cpus(&e);
+    if (!bitmap_store_entry_valid(&e)) {
+        ret = -EINVAL;
+        goto fail_read;
+    }
+
+    name = g_malloc0(e.name_size + 1);
+    ret = bitmap_store_read(f, name, e.name_size);
+    if (ret == 0) {
+        ret = bitmap_store_skip_pad(f, e.name_size);
+    }
+    if (ret < 0) {
+        g_free(name);
+        goto fail_read;
+    }
+
+    if (e.size != len) {
+        warn_report("Dirty bitmap '%s' in '%s' is for a disk of %" PRIu64
+                    " bytes, not %" PRId64 "; dropping it",
+                    name, bs->bitmap_store, e.size, len);
+        g_free(name);
+        if (fseeko(f, e.data_size, SEEK_CUR)) {
+            ret = -errno;
+            goto fail_read;
+        }
+        return 0;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, e.granularity, name, errp);
+    g_free(name);
+    if (!bitmap) {
+        return -EINVAL;
+    }
+    if (e.flags & BITMAP_STORE_ENTRY_SPARSE) {
+        /* Before loading, so that clean chunks are never allocated */
+        bdrv_dirty_bitmap_set_sparse(bitmap, true);
+    }
+
+    ret = bitmap_store_load_data(f, &e, bitmap);
+    if (ret < 0) {
+        bdrv_release_dirty_bitmap(bs, bitmap);
+        goto fail_read;
+    }
+
+    bdrv_dirty_bitmap_set_persistance(bitmap, true);
+    if (!(e.flags & BITMAP_STORE_ENTRY_ENABLED)) {
+        bdrv_disable_dirty_bitmap(bitmap);
+    }
+    if (bdrv_is_read_only(bs)) {
+        bdrv_dirty_bitmap_set_readonly(bitmap, true);
+    }
+    return 0;
+
+fail_read:
+    error_setg_errno(errp, -ret, "Could not read dirty bitmaps from '%s'",
+                     bs->bitmap_store);
+    return ret;
+}
+
+int bdrv_bitmap_store_load(BlockDriverState *bs, Error **errp)
+{
+    const char *path = bs->bitmap_store;
+    bool read_only = bdrv_is_read_only(bs);
+    BitmapStoreHeader h;
+    int64_t len;
+    uint32_t i;
+    FILE *f;
+    int ret;
+
+    f = fopen(path, read_only ? "rb" : "r+b");
+    if (!f) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not open '%s'", path);
+        return ret;
+    }
+
+    ret = bitmap_store_read(f, &h, sizeof(h));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read dirty bitmaps from '%s'",
+                         path);
+        goto out;
+    }
+    bitmap_store_header_to_cpus(&h);
+    if (memcmp(h.magic, BITMAP_STORE_MAGIC, sizeof(h.magic))) {
+        error_setg(errp, "'%s' is not a dirty bitmap store", path);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (h.version != BITMAP_STORE_VERSION) {
+        error_setg(errp, "Unsupported dirty bitmap store version %" PRIu32
+                   " in '%s'", h.version, path);
+        ret = -ENOTSUP;
+        goto out;
+    }
+
+    if (h.flags & BITMAP_STORE_FLAG_IN_USE) {
+        warn_report("Dirty bitmaps in '%s' were not saved cleanly; "
+                    "dropping them", path);
+        ret = 0;
+        goto out;
+    }
+
+    len = bdrv_getlength(bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the size of the node");
+        ret = len;
+        goto out;
+    }
+
+    for (i = 0; i < h.nb_bitmaps; i++) {
+        ret = bitmap_store_load_entry(bs, f, len, errp);
+        if (ret < 0) {
+            bdrv_release_persistent_dirty_bitmaps(bs);
+            goto out;
+        }
+    }
+
+    if (!read_only) {
+        /* Anything after this point must go through bdrv_bitmap_store_save */
+        rewind(f);
+        ret = bitmap_store_write_header(f, BITMAP_STORE_FLAG_IN_USE,
+                                        h.nb_bitmaps);
+        if (ret == 0) {
+            ret = bitmap_store_sync(f);
+        }
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not mark '%s' in use", path);
+            bdrv_release_persistent_dirty_bitmaps(bs);
+        }
+    }
+
+out:
+    fclose(f);
+    return ret;
+}
+
+/* Write the entry, name, chunk map and chunk data of @bitmap */
+static int bitmap_store_save_bitmap(FILE *f, BdrvDirtyBitmap *bitmap,
+                                    uint8_t *buf)
+{
+    const char *name = bdrv_dirty_bitmap_name(bitmap);
+    uint32_t granularity = bdrv_dirty_bitmap_granularity(bitmap);
+    uint64_t chunk_bytes = bitmap_store_chunk_bytes(granularity);
+    uint64_t size = bdrv_dirty_bitmap_size(bitmap);
+    uint32_t nb_chunks = DIV_ROUND_UP(size, chunk_bytes);
+    uint8_t *map = g_malloc0(nb_chunks);
+    BdrvDirtyBitmapIter *iter;
+    BitmapStoreEntry e;
+    uint64_t data_size = ROUND_UP(nb_chunks, 8);
+    int64_t offset;
+    uint32_t i;
+    int ret;
+
+    /* Only visit chunks that have dirty bits */
+    iter = bdrv_dirty_iter_new(bitmap);
+    while ((offset = bdrv_dirty_iter_next(iter)) >= 0) {
+        i = offset / chunk_bytes;
+        map[i] = 1;
+        data_size += bdrv_dirty_bitmap_serialization_size(
+            bitmap, i * chunk_bytes, MIN(size - i * chunk_bytes, chunk_bytes));
+        if ((i + 1) * chunk_bytes >= size) {
+            break;
+        }
+        bdrv_set_dirty_iter(iter, (i + 1) * chunk_bytes);
+    }
+    bdrv_dirty_iter_free(iter);
+
+    e = (BitmapStoreEntry) {
+        .size = size,
+        .data_size = ROUND_UP(data_size, 8),
+        .granularity = granularity,
+        .flags = (bdrv_dirty_bitmap_enabled(bitmap) ?
+                  BITMAP_STORE_ENTRY_ENABLED : 0) |
+                 (bdrv_dirty_bitmap_get_sparse(bitmap) ?
+                  BITMAP_STORE_ENTRY_SPARSE : 0),
+        .name_size = strlen(name),
+        .nb_chunks = nb_chunks,
+    };
+    bitmap_store_entry_to_le(&e);
+
+    ret = bitmap_store_write(f, &e, sizeof(e));
+    if (ret == 0) {
+        ret = bitmap_store_write(f, name, strlen(name));
+    }
+    if (ret == 0) {
+        ret = bitmap_store_write_pad(f, strlen(name));
+    }
+    if (ret == 0) {
+        ret = bitmap_store_write(f, map, nb_chunks);
+    }
+    if (ret == 0) {
+        ret = bitmap_store_write_pad(f, nb_chunks);
+    }
+
+    data_size = 0;
+    for (i = 0; ret == 0 && i < nb_chunks; i++) {
+        uint64_t bytes = MIN(size - i * chunk_bytes, chunk_bytes);
+        uint64_t len;
+
+        if (!map[i]) {
+            continue;
+        }
+        len = bdrv_dirty_bitmap_serialization_size(bitmap, i * chunk_bytes,
+                                                   bytes);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, i * chunk_bytes, bytes);
+        ret = bitmap_store_write(f, buf, len);
+        data_size += len;
+    }
+    if (ret == 0) {
+        ret = bitmap_store_write_pad(f, data_size);
+    }
+
+    g_free(map);
+    return ret;
+}
+
+int bdrv_bitmap_store_save(BlockDriverState *bs, Error **errp)
+{
+    const char *path = bs->bitmap_store;
+    BdrvDirtyBitmap *bitmap;
+    uint32_t nb_bitmaps = 0;
+    char *tmp_path;
+    uint8_t *buf;
+    FILE *f;
+    int ret;
+
+    if (bdrv_is_read_only(bs)) {
+        return 0;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        if (bdrv_dirty_bitmap_get_persistance(bitmap)) {
+            nb_bitmaps++;
+        }
+    }
+
+    tmp_path = g_strdup_printf("%s.tmp", path);
+    f = fopen(tmp_path, "wb");
+    if (!f) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not create '%s'", tmp_path);
+        g_free(tmp_path);
+        return ret;
+    }
+
+    buf = g_malloc(BITMAP_STORE_CHUNK_SIZE);
+    ret = bitmap_store_write_header(f, 0, nb_bitmaps);
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); ret == 0 && bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        if (bdrv_dirty_bitmap_get_persistance(bitmap)) {
+            ret = bitmap_store_save_bitmap(f, bitmap, buf);
+        }
+    }
+    g_free(buf);
+
+    if (ret == 0) {
+        ret = bitmap_store_sync(f);
+    }
+    if (fclose(f) && ret == 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write '%s'", tmp_path);
+        goto fail;
+    }
+
+    /* The old file stays valid (or marked in use) until the rename */
+    if (rename(tmp_path, path)) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not rename '%s' to '%s'",
+                         tmp_path, path);
+        goto fail;
+    }
+    g_free(tmp_path);
+
+    ret = bitmap_store_sync_dir(path);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not sync the directory of '%s'",
+                         path);
+    }
+    return ret;
+
+fail:
+    unlink(tmp_path);
+    g_free(tmp_path);
+    return ret;
+}
+
+bool bdrv_bitmap_store_can_store(BlockDriverState *bs, const char *name,
+                                 uint32_t granularity, Error **errp)
+{
+    if (bdrv_is_read_only(bs)) {
+        error_setg(errp, "Can't store persistent bitmaps to read-only node "
+                   "'%s'", bdrv_get_device_or_node_name(bs));
+        return false;
+    }
+    if (strlen(name) > BITMAP_STORE_MAX_NAME_SIZE) {
+        error_setg(errp, "Bitmap name is longer than %d bytes",
+                   BITMAP_STORE_MAX_NAME_SIZE);
+        return false;
+    }
+    if (ctz32(granularity) < BITMAP_STORE_MIN_GRAN_BITS) {
+        error_setg(errp, "Granularity must be at least %d bytes",
+                   1 << BITMAP_STORE_MIN_GRAN_BITS);
+        return false;
+    }
+    return true;
+}
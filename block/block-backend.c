@@ -15,6 +15,7 @@
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/throttle-groups.h"
+#include "block/flight-recorder.h"
 #include "sysemu/blockdev.h"
 #include "sysemu/sysemu.h"
 #include "qapi/error.h"
@@ -31,6 +32,8 @@
 
 static AioContext *blk_aiocb_get_aio_context(BlockAIOCB *acb);
 
+typedef struct BlkMergeReq BlkMergeReq;
+
 typedef struct BlockBackendAioNotifier {
     void (*attached_aio_context)(AioContext *new_context, void *opaque);
     void (*detach_aio_context)(void *opaque);
@@ -52,6 +55,8 @@ struct BlockBackend {
     /* TODO change to DeviceState when all users are qdevified */
     const BlockDevOps *dev_ops;
     void *dev_opaque;
+    BlkQueueStatsFn *queue_stats_fn;
+    void *queue_stats_opaque;
 
     /* the block size for which the guest device expects atomicity */
     int guest_block_size;
@@ -89,6 +94,21 @@ struct BlockBackend {
      */
     unsigned int in_flight;
     AioWait wait;
+
+    /* Merging of adjacent aio requests, see blk_set_merge() */
+    bool merge_enabled;
+    int64_t merge_window_ns;
+    unsigned int plug_depth;
+    BlkMergeReq *merge;         /* batch being built, if any */
+    QEMUTimer *merge_timer;
+    AioContext *merge_timer_ctx;
+
+    /* Latency-driven admission control, see blk_set_latency_qos() */
+    LatencyQosMember *latency_qos;
+
+    /* Device and request ids in the flight recorder */
+    uint32_t flight_id;
+    uint32_t flight_seq;
 };
 
 typedef struct BlockBackendAIOCB {
@@ -104,6 +124,7 @@ static const AIOCBInfo block_backend_aiocb_info = {
 
 static void drive_info_del(DriveInfo *dinfo);
 static BlockBackend *bdrv_first_blk(BlockDriverState *bs);
+static void blk_merge_submit(BlockBackend *blk);
 
 /* All BlockBackends */
 static QTAILQ_HEAD(, BlockBackend) block_backends =
@@ -114,6 +135,9 @@ static QTAILQ_HEAD(, BlockBackend) block_backends =
 static QTAILQ_HEAD(, BlockBackend) monitor_block_backends =
     QTAILQ_HEAD_INITIALIZER(monitor_block_backends);
 
+/* Device ids in the flight recorder, protected by the global QEMU mutex */
+static uint32_t blk_flight_ids;
+
 static void blk_root_inherit_options(int *child_flags, QDict *child_options,
                                      int parent_flags, QDict *parent_options)
 {
@@ -322,6 +346,7 @@ BlockBackend *blk_new(uint64_t perm, uint64_t shared_perm)
     blk->refcnt = 1;
     blk->perm = perm;
     blk->shared_perm = shared_perm;
+    blk->flight_id = ++blk_flight_ids;
     blk_set_enable_write_cache(blk, true);
 
     block_acct_init(&blk->stats);
@@ -400,6 +425,13 @@ static void blk_delete(BlockBackend *blk)
     if (blk->root) {
         blk_remove_bs(blk);
     }
+    assert(!blk->merge);
+    if (blk->merge_timer) {
+        timer_free(blk->merge_timer);
+    }
+    if (blk->latency_qos) {
+        latency_qos_unregister(blk->latency_qos);
+    }
     if (blk->vmsh) {
         qemu_del_vm_change_state_handler(blk->vmsh);
         blk->vmsh = NULL;
@@ -758,6 +790,7 @@ void blk_remove_bs(BlockBackend *blk)
     BlockDriverState *bs;
 
     notifier_list_notify(&blk->remove_bs_notifiers, blk);
+    blk_merge_submit(blk);
     if (tgm->throttle_state) {
         bs = blk_bs(blk);
         bdrv_drained_begin(bs);
@@ -875,11 +908,41 @@ void blk_detach_dev(BlockBackend *blk, void *dev)
     blk->dev = NULL;
     blk->dev_ops = NULL;
     blk->dev_opaque = NULL;
+    blk->queue_stats_fn = NULL;
+    blk->queue_stats_opaque = NULL;
     blk->guest_block_size = 512;
     blk_set_perm(blk, 0, BLK_PERM_ALL, &error_abort);
     blk_unref(blk);
 }
 
+/*
+ * Let the attached device report how many guest requests it holds.  Unlike
+ * BlockDevOps this is available to legacy devices.  Detaching the device
+ * unsets it.
+ */
+void blk_set_queue_stats_fn(BlockBackend *blk, BlkQueueStatsFn *fn,
+                            void *opaque)
+{
+    assert(blk->dev);
+    blk->queue_stats_fn = fn;
+    blk->queue_stats_opaque = opaque;
+}
+
+/*
+ * Return the number of guest requests the device attached to @blk has
+ * taken and not completed in @inflight, and the most it can take in
+ * @size.  Return false if the device does not say.
+ */
+bool blk_get_queue_stats(BlockBackend *blk, unsigned *inflight,
+                         unsigned *size)
+{
+    if (!blk->queue_stats_fn) {
+        return false;
+    }
+    blk->queue_stats_fn(blk->queue_stats_opaque, inflight, size);
+    return true;
+}
+
 /*
  * Return the device model attached to @blk if any, else null.
  */
@@ -1133,11 +1196,45 @@ static int blk_check_byte_request(BlockBackend *blk, int64_t offset,
     return 0;
 }
 
+/* Returns the start timestamp for blk_flight_record_complete(), 0 if the
+ * flight recorder is disabled */
+static int64_t blk_flight_record_submit(BlockBackend *blk,
+                                        FlightRecorderOp op, int64_t offset,
+                                        unsigned int bytes, uint32_t *id)
+{
+    if (likely(!atomic_read(&flight_recorder_enabled))) {
+        return 0;
+    }
+    *id = atomic_fetch_inc(&blk->flight_seq);
+    return flight_recorder_do_record(FLIGHT_RECORDER_BLK_SUBMIT, op,
+                                     blk->flight_id, *id, offset, bytes, 0);
+}
+
+static void blk_flight_record_complete(BlockBackend *blk,
+                                       FlightRecorderOp op, int64_t offset,
+                                       unsigned int bytes, uint32_t id,
+                                       int ret, int64_t start_ns)
+{
+    if (!start_ns) {
+        return;
+    }
+    flight_recorder_record(FLIGHT_RECORDER_BLK_COMPLETE, op, blk->flight_id,
+                           id, offset, bytes, ret);
+    flight_recorder_check_latency(start_ns);
+}
+
+uint32_t blk_get_flight_id(BlockBackend *blk)
+{
+    return blk->flight_id;
+}
+
 int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
                                unsigned int bytes, QEMUIOVector *qiov,
                                BdrvRequestFlags flags)
 {
     int ret;
+    int64_t start_ns = 0, fr_start_ns;
+    uint32_t fr_id = 0;
     BlockDriverState *bs = blk_bs(blk);
 
     trace_blk_co_preadv(blk, bs, offset, bytes, flags);
@@ -1155,7 +1252,19 @@ int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
                 bytes, false);
     }
 
+    if (blk->latency_qos) {
+        start_ns = latency_qos_co_admit(blk->latency_qos);
+    }
+
+    fr_start_ns = blk_flight_record_submit(blk, FLIGHT_RECORDER_READ, offset,
+                                           bytes, &fr_id);
     ret = bdrv_co_preadv(blk->root, offset, bytes, qiov, flags);
+    blk_flight_record_complete(blk, FLIGHT_RECORDER_READ, offset, bytes,
+                               fr_id, ret, fr_start_ns);
+
+    if (blk->latency_qos) {
+        latency_qos_co_complete(blk->latency_qos, start_ns);
+    }
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -1165,6 +1274,8 @@ int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
                                 BdrvRequestFlags flags)
 {
     int ret;
+    int64_t start_ns = 0, fr_start_ns;
+    uint32_t fr_id = 0;
     BlockDriverState *bs = blk_bs(blk);
 
     trace_blk_co_pwritev(blk, bs, offset, bytes, flags);
@@ -1181,11 +1292,23 @@ int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
                 bytes, true);
     }
 
+    if (blk->latency_qos) {
+        start_ns = latency_qos_co_admit(blk->latency_qos);
+    }
+
     if (!blk->enable_write_cache) {
         flags |= BDRV_REQ_FUA;
     }
 
+    fr_start_ns = blk_flight_record_submit(blk, FLIGHT_RECORDER_WRITE, offset,
+                                           bytes, &fr_id);
     ret = bdrv_co_pwritev(blk->root, offset, bytes, qiov, flags);
+    blk_flight_record_complete(blk, FLIGHT_RECORDER_WRITE, offset, bytes,
+                               fr_id, ret, fr_start_ns);
+
+    if (blk->latency_qos) {
+        latency_qos_co_complete(blk->latency_qos, start_ns);
+    }
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -1318,8 +1441,23 @@ typedef struct BlkAioEmAIOCB {
     BlkRwCo rwco;
     int bytes;
     bool has_returned;
+    QSIMPLEQ_ENTRY(BlkAioEmAIOCB) merge_next;
 } BlkAioEmAIOCB;
 
+/* Adjacent reads or writes submitted as one request */
+struct BlkMergeReq {
+    BlockBackend *blk;
+    bool is_write;
+    int64_t offset;
+    int64_t bytes;
+    int niov;
+    unsigned int nb_reqs;
+    QEMUIOVector qiov;
+    QSIMPLEQ_HEAD(, BlkAioEmAIOCB) reqs;
+    bool done;
+    bool has_returned;
+};
+
 static const AIOCBInfo blk_aio_em_aiocb_info = {
     .aiocb_size         = sizeof(BlkAioEmAIOCB),
 };
@@ -1348,6 +1486,9 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     BlkAioEmAIOCB *acb;
     Coroutine *co;
 
+    /* Keep the order of requests: whatever was queued for merging goes first */
+    blk_merge_submit(blk);
+
     blk_inc_in_flight(blk);
     acb = blk_aio_get(&blk_aio_em_aiocb_info, blk, cb, opaque);
     acb->rwco = (BlkRwCo) {
@@ -1451,10 +1592,187 @@ int64_t blk_nb_sectors(BlockBackend *blk)
     return bdrv_nb_sectors(blk_bs(blk));
 }
 
+static void blk_merge_complete(BlkMergeReq *m)
+{
+    BlkAioEmAIOCB *acb;
+
+    while ((acb = QSIMPLEQ_FIRST(&m->reqs)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&m->reqs, merge_next);
+        blk_aio_complete(acb);
+    }
+    qemu_iovec_destroy(&m->qiov);
+    g_free(m);
+}
+
+static void blk_merge_complete_bh(void *opaque)
+{
+    BlkMergeReq *m = opaque;
+    assert(m->has_returned);
+    blk_merge_complete(m);
+}
+
+static void blk_aio_merged_entry(void *opaque)
+{
+    BlkMergeReq *m = opaque;
+    BlockBackend *blk = m->blk;
+    BlkAioEmAIOCB *acb;
+    int ret;
+
+    if (m->is_write) {
+        ret = blk_co_pwritev(blk, m->offset, m->bytes, &m->qiov, 0);
+    } else {
+        ret = blk_co_preadv(blk, m->offset, m->bytes, &m->qiov, 0);
+    }
+
+    QSIMPLEQ_FOREACH(acb, &m->reqs, merge_next) {
+        BlkRwCo *rwco = &acb->rwco;
+
+        if (ret >= 0 || m->nb_reqs == 1) {
+            rwco->ret = ret;
+        } else if (m->is_write) {
+            /* Retry one by one so that each caller gets its own error */
+            rwco->ret = blk_co_pwritev(blk, rwco->offset, acb->bytes,
+                                       rwco->iobuf, 0);
+        } else {
+            rwco->ret = blk_co_preadv(blk, rwco->offset, acb->bytes,
+                                      rwco->iobuf, 0);
+        }
+    }
+
+    m->done = true;
+    if (m->has_returned) {
+        blk_merge_complete(m);
+    }
+}
+
+/* Submit the batch of merged requests that is being built, if any */
+static void blk_merge_submit(BlockBackend *blk)
+{
+    BlkMergeReq *m = blk->merge;
+    BlkAioEmAIOCB *acb;
+    Coroutine *co;
+
+    if (!m) {
+        return;
+    }
+    blk->merge = NULL;
+    if (blk->merge_timer) {
+        timer_del(blk->merge_timer);
+    }
+
+    qemu_iovec_init(&m->qiov, m->niov);
+    QSIMPLEQ_FOREACH(acb, &m->reqs, merge_next) {
+        qemu_iovec_concat(&m->qiov, acb->rwco.iobuf, 0, acb->bytes);
+    }
+    if (m->nb_reqs > 1) {
+        block_acct_merge_done(&blk->stats,
+                              m->is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ,
+                              m->nb_reqs - 1);
+    }
+
+    co = qemu_coroutine_create(blk_aio_merged_entry, m);
+    bdrv_coroutine_enter(blk_bs(blk), co);
+
+    m->has_returned = true;
+    if (m->done) {
+        aio_bh_schedule_oneshot(blk_get_aio_context(blk),
+                                blk_merge_complete_bh, m);
+    }
+}
+
+static void blk_merge_timer_cb(void *opaque)
+{
+    blk_merge_submit(opaque);
+}
+
+static bool blk_merge_fits(BlockBackend *blk, BlkMergeReq *m, int64_t offset,
+                           QEMUIOVector *qiov, bool is_write)
+{
+    int64_t max_bytes = MIN(blk_get_max_transfer(blk), BDRV_REQUEST_MAX_BYTES);
+
+    return m->is_write == is_write &&
+           m->offset + m->bytes == offset &&
+           m->bytes + qiov->size <= max_bytes &&
+           m->niov + qiov->niov <= blk_get_max_iov(blk);
+}
+
+/*
+ * Queue a read or write for merging with the adjacent requests that follow
+ * it.  The batch is submitted when a request that cannot be merged comes in,
+ * when it reaches the maximum transfer size of the device, on the last
+ * blk_io_unplug(), when the merge window expires, or when draining.
+ */
+static BlockAIOCB *blk_aio_merge(BlockBackend *blk, int64_t offset,
+                                 QEMUIOVector *qiov, bool is_write,
+                                 BlockCompletionFunc *cb, void *opaque)
+{
+    BlkMergeReq *m = blk->merge;
+    BlkAioEmAIOCB *acb;
+
+    if (m && !blk_merge_fits(blk, m, offset, qiov, is_write)) {
+        blk_merge_submit(blk);
+        m = NULL;
+    }
+
+    if (!m) {
+        m = g_new0(BlkMergeReq, 1);
+        m->blk = blk;
+        m->is_write = is_write;
+        m->offset = offset;
+        QSIMPLEQ_INIT(&m->reqs);
+        blk->merge = m;
+
+        if (!blk->plug_depth) {
+            AioContext *ctx = blk_get_aio_context(blk);
+
+            if (blk->merge_timer_ctx != ctx) {
+                if (blk->merge_timer) {
+                    timer_free(blk->merge_timer);
+                }
+                blk->merge_timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME,
+                                                 SCALE_NS, blk_merge_timer_cb,
+                                                 blk);
+                blk->merge_timer_ctx = ctx;
+            }
+            timer_mod(blk->merge_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                      blk->merge_window_ns);
+        }
+    }
+
+    blk_inc_in_flight(blk);
+    acb = blk_aio_get(&blk_aio_em_aiocb_info, blk, cb, opaque);
+    acb->rwco = (BlkRwCo) {
+        .blk    = blk,
+        .offset = offset,
+        .iobuf  = qiov,
+        .ret    = NOT_DONE,
+    };
+    acb->bytes = qiov->size;
+    acb->has_returned = true;
+
+    QSIMPLEQ_INSERT_TAIL(&m->reqs, acb, merge_next);
+    m->bytes += qiov->size;
+    m->niov += qiov->niov;
+    m->nb_reqs++;
+
+    return &acb->common;
+}
+
+static bool blk_merge_active(BlockBackend *blk, BdrvRequestFlags flags)
+{
+    return blk->merge_enabled && !flags && blk_bs(blk) &&
+           !blk->quiesce_counter &&
+           (blk->plug_depth || blk->merge_window_ns);
+}
+
 BlockAIOCB *blk_aio_preadv(BlockBackend *blk, int64_t offset,
                            QEMUIOVector *qiov, BdrvRequestFlags flags,
                            BlockCompletionFunc *cb, void *opaque)
 {
+    if (blk_merge_active(blk, flags)) {
+        return blk_aio_merge(blk, offset, qiov, false, cb, opaque);
+    }
     return blk_aio_prwv(blk, offset, qiov->size, qiov,
                         blk_aio_read_entry, flags, cb, opaque);
 }
@@ -1463,10 +1781,61 @@ BlockAIOCB *blk_aio_pwritev(BlockBackend *blk, int64_t offset,
                             QEMUIOVector *qiov, BdrvRequestFlags flags,
                             BlockCompletionFunc *cb, void *opaque)
 {
+    if (blk_merge_active(blk, flags)) {
+        return blk_aio_merge(blk, offset, qiov, true, cb, opaque);
+    }
     return blk_aio_prwv(blk, offset, qiov->size, qiov,
                         blk_aio_write_entry, flags, cb, opaque);
 }
 
+/*
+ * Enable or disable merging of adjacent aio reads and writes on @blk.
+ *
+ * Requests submitted between blk_io_plug() and blk_io_unplug() are merged
+ * when they are contiguous and go in the same direction, up to the maximum
+ * transfer size of the device.  With a non-zero @window_ns, requests submitted
+ * outside of a plugged section are held for at most that long waiting for an
+ * adjacent one.  Each original request still completes with its own callback.
+ */
+void blk_set_merge(BlockBackend *blk, bool enable, int64_t window_ns)
+{
+    blk_merge_submit(blk);
+    blk->merge_enabled = enable;
+    blk->merge_window_ns = enable ? window_ns : 0;
+}
+
+/*
+ * Enable, reconfigure or disable latency-driven admission control on @blk,
+ * see include/block/latency-qos.h.  @target_ns is the mean latency @blk
+ * should see, 0 if it has none and only yields to the other members of
+ * @group.
+ */
+void blk_set_latency_qos(BlockBackend *blk, bool enable, const char *group,
+                         uint32_t priority, int64_t target_ns)
+{
+    if (blk->latency_qos && enable) {
+        latency_qos_configure(blk->latency_qos, group, priority, target_ns);
+        return;
+    }
+    if (!blk->latency_qos && !enable) {
+        return;
+    }
+
+    /* Requests must see the same member on submission and completion */
+    blk_drain(blk);
+    if (enable) {
+        blk->latency_qos = latency_qos_register(group, priority, target_ns);
+    } else {
+        latency_qos_unregister(blk->latency_qos);
+        blk->latency_qos = NULL;
+    }
+}
+
+LatencyQosMember *blk_get_latency_qos(BlockBackend *blk)
+{
+    return blk->latency_qos;
+}
+
 static void blk_aio_flush_entry(void *opaque)
 {
     BlkAioEmAIOCB *acb = opaque;
@@ -1550,21 +1919,37 @@ BlockAIOCB *blk_aio_ioctl(BlockBackend *blk, unsigned long int req, void *buf,
 
 int blk_co_pdiscard(BlockBackend *blk, int64_t offset, int bytes)
 {
+    int64_t fr_start_ns;
+    uint32_t fr_id = 0;
     int ret = blk_check_byte_request(blk, offset, bytes);
     if (ret < 0) {
         return ret;
     }
 
-    return bdrv_co_pdiscard(blk_bs(blk), offset, bytes);
+    fr_start_ns = blk_flight_record_submit(blk, FLIGHT_RECORDER_DISCARD,
+                                           offset, bytes, &fr_id);
+    ret = bdrv_co_pdiscard(blk_bs(blk), offset, bytes);
+    blk_flight_record_complete(blk, FLIGHT_RECORDER_DISCARD, offset, bytes,
+                               fr_id, ret, fr_start_ns);
+    return ret;
 }
 
 int blk_co_flush(BlockBackend *blk)
 {
+    int64_t fr_start_ns;
+    uint32_t fr_id = 0;
+    int ret;
+
     if (!blk_is_available(blk)) {
         return -ENOMEDIUM;
     }
 
-    return bdrv_co_flush(blk_bs(blk));
+    fr_start_ns = blk_flight_record_submit(blk, FLIGHT_RECORDER_FLUSH, 0, 0,
+                                           &fr_id);
+    ret = bdrv_co_flush(blk_bs(blk));
+    blk_flight_record_complete(blk, FLIGHT_RECORDER_FLUSH, 0, 0, fr_id, ret,
+                               fr_start_ns);
+    return ret;
 }
 
 static void blk_flush_entry(void *opaque)
@@ -1956,6 +2341,7 @@ void blk_io_plug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
+    blk->plug_depth++;
     if (bs) {
         bdrv_io_plug(bs);
     }
@@ -1965,6 +2351,10 @@ void blk_io_unplug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
+    assert(blk->plug_depth);
+    if (--blk->plug_depth == 0) {
+        blk_merge_submit(blk);
+    }
     if (bs) {
         bdrv_io_unplug(bs);
     }
@@ -2185,6 +2575,9 @@ static void blk_root_drained_begin(BdrvChild *child)
         }
     }
 
+    /* Requests held back for merging would never complete otherwise */
+    blk_merge_submit(blk);
+
     /* Note that blk->root may not be accessible here yet if we are just
      * attaching to a BlockDriverState that is drained. Use child instead. */
 
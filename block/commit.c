@@ -29,6 +29,9 @@ enum {
      * contiguous regions of the image is efficient.
      */
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /* Default number of copy operations kept in flight */
+    COMMIT_DEFAULT_MAX_IN_FLIGHT = 16,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
@@ -42,8 +45,25 @@ typedef struct CommitBlockJob {
     BlockdevOnError on_error;
     int base_flags;
     char *backing_file_str;
+
+    /* Copy pipeline: @buf_size bounds the bytes held by data operations */
+    int64_t buf_size;
+    int max_in_flight;
+    int in_flight;
+    int64_t bytes_in_flight;
+    bool waiting_for_io;
+    QTAILQ_HEAD(, CommitOp) failed;
 } CommitBlockJob;
 
+typedef struct CommitOp {
+    CommitBlockJob *s;
+    int64_t offset;
+    int64_t bytes;
+    bool zero;
+    int ret;
+    QTAILQ_ENTRY(CommitOp) next;
+} CommitOp;
+
 static int coroutine_fn commit_populate(BlockBackend *bs, BlockBackend *base,
                                         int64_t offset, uint64_t bytes,
                                         void *buf)
@@ -136,6 +156,105 @@ static void commit_complete(BlockJob *job, void *opaque)
     bdrv_unref(top);
 }
 
+static void coroutine_fn commit_co_op(void *opaque)
+{
+    CommitOp *op = opaque;
+    CommitBlockJob *s = op->s;
+    void *buf;
+    int ret;
+
+    if (op->zero) {
+        ret = blk_co_pwrite_zeroes(s->base, op->offset, op->bytes,
+                                   BDRV_REQ_MAY_UNMAP);
+    } else {
+        buf = blk_blockalign(s->top, op->bytes);
+        ret = commit_populate(s->top, s->base, op->offset, op->bytes, buf);
+        qemu_vfree(buf);
+        s->bytes_in_flight -= op->bytes;
+    }
+    s->in_flight--;
+
+    if (ret < 0) {
+        /* The job coroutine decides whether to retry */
+        op->ret = ret;
+        QTAILQ_INSERT_TAIL(&s->failed, op, next);
+    } else {
+        /* Publish progress */
+        s->common.offset += op->bytes;
+        g_free(op);
+    }
+
+    if (s->waiting_for_io) {
+        aio_co_wake(s->common.co);
+    }
+}
+
+static void coroutine_fn commit_wait_for_io(CommitBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+static void coroutine_fn commit_issue(CommitBlockJob *s, int64_t offset,
+                                      int64_t bytes, bool zero)
+{
+    CommitOp *op;
+    Coroutine *co;
+
+    /* Zero operations hold no buffer, only an in-flight slot */
+    while (s->in_flight >= s->max_in_flight ||
+           (!zero && s->in_flight &&
+            s->bytes_in_flight + bytes > s->buf_size)) {
+        commit_wait_for_io(s);
+    }
+
+    op = g_new(CommitOp, 1);
+    *op = (CommitOp) {
+        .s      = s,
+        .offset = offset,
+        .bytes  = bytes,
+        .zero   = zero,
+    };
+    s->in_flight++;
+    if (!zero) {
+        s->bytes_in_flight += bytes;
+    }
+    co = qemu_coroutine_create(commit_co_op, op);
+    qemu_coroutine_enter(co);
+}
+
+/*
+ * Decide what to do about the operations that failed since the last call.
+ * Returns a negative errno if the job must stop, 1 if some of the
+ * operations were issued again and 0 if nothing failed.
+ */
+static int coroutine_fn commit_handle_failed(CommitBlockJob *s)
+{
+    CommitOp *op;
+    int ret = 0;
+
+    while ((op = QTAILQ_FIRST(&s->failed)) != NULL) {
+        QTAILQ_REMOVE(&s->failed, op, next);
+        if (ret >= 0) {
+            BlockErrorAction action =
+                block_job_error_action(&s->common, s->on_error, false,
+                                       -op->ret);
+            if (action == BLOCK_ERROR_ACTION_REPORT) {
+                ret = op->ret;
+            } else {
+                /* Go through a pause point before retrying */
+                block_job_sleep_ns(&s->common, 0);
+                commit_issue(s, op->offset, op->bytes, op->zero);
+                ret = 1;
+            }
+        }
+        g_free(op);
+    }
+    return ret;
+}
+
 static void coroutine_fn commit_run(void *opaque)
 {
     CommitBlockJob *s = opaque;
@@ -144,8 +263,7 @@ static void coroutine_fn commit_run(void *opaque)
     uint64_t delay_ns = 0;
     int ret = 0;
     int64_t n = 0; /* bytes */
-    void *buf = NULL;
-    int bytes_written = 0;
+    int64_t op_bytes;
     int64_t base_len;
 
     ret = s->common.len = blk_getlength(s->top);
@@ -166,30 +284,35 @@ static void coroutine_fn commit_run(void *opaque)
         }
     }
 
-    buf = blk_blockalign(s->top, COMMIT_BUFFER_SIZE);
+    /* Share the buffer between the operations that may be in flight */
+    op_bytes = MIN(COMMIT_BUFFER_SIZE, s->buf_size / s->max_in_flight);
+    op_bytes = MAX(QEMU_ALIGN_DOWN(op_bytes, BDRV_SECTOR_SIZE),
+                   BDRV_SECTOR_SIZE);
 
     for (offset = 0; offset < s->common.len; offset += n) {
-        bool copy;
-
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * so that bdrv_drain_all() can pause the job; operations still in
+         * flight are waited for by the drain itself.
          */
         block_job_sleep_ns(&s->common, delay_ns);
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
-        /* Copy if allocated above the base */
-        ret = bdrv_is_allocated_above(blk_bs(s->top), blk_bs(s->base),
-                                      offset, COMMIT_BUFFER_SIZE, &n);
-        copy = (ret == 1);
-        trace_commit_one_iteration(s, offset, n, ret);
-        if (copy) {
-            ret = commit_populate(s->top, s->base, offset, n, buf);
-            bytes_written += n;
+
+        ret = commit_handle_failed(s);
+        if (ret < 0) {
+            goto out;
         }
+
+        /* Size the operation after the extent that contains @offset and
+         * copy it if allocated above the base */
+        ret = bdrv_block_status_above(blk_bs(s->top), blk_bs(s->base),
+                                      offset, s->common.len - offset, &n,
+                                      NULL, NULL);
+        trace_commit_one_iteration(s, offset, n, ret);
         if (ret < 0) {
             BlockErrorAction action =
-                block_job_error_action(&s->common, false, s->on_error, -ret);
+                block_job_error_action(&s->common, s->on_error, false, -ret);
             if (action == BLOCK_ERROR_ACTION_REPORT) {
                 goto out;
             } else {
@@ -197,18 +320,49 @@ static void coroutine_fn commit_run(void *opaque)
                 continue;
             }
         }
-        /* Publish progress */
-        s->common.offset += n;
+        if (!(ret & BDRV_BLOCK_ALLOCATED)) {
+            s->common.offset += n;
+            continue;
+        }
 
-        if (copy && s->common.speed) {
-            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+        if (ret & BDRV_BLOCK_ZERO) {
+            n = MIN(n, BDRV_REQUEST_MAX_BYTES);
+            commit_issue(s, offset, n, true);
+        } else {
+            n = MIN(n, op_bytes);
+            commit_issue(s, offset, n, false);
+            if (s->common.speed) {
+                delay_ns = ratelimit_calculate_delay(&s->limit, n);
+            }
         }
     }
 
-    ret = 0;
+    /* Wait for the tail of the pipeline, retrying what fails there */
+    while (!block_job_is_cancelled(&s->common)) {
+        while (s->in_flight) {
+            commit_wait_for_io(s);
+        }
+        ret = commit_handle_failed(s);
+        if (ret <= 0) {
+            break;
+        }
+    }
 
 out:
-    qemu_vfree(buf);
+    while (s->in_flight) {
+        commit_wait_for_io(s);
+    }
+    if (ret >= 0) {
+        ret = 0;
+    }
+    while (!QTAILQ_EMPTY(&s->failed)) {
+        CommitOp *op = QTAILQ_FIRST(&s->failed);
+        QTAILQ_REMOVE(&s->failed, op, next);
+        if (ret == 0) {
+            ret = op->ret;
+        }
+        g_free(op);
+    }
 
     data = g_malloc(sizeof(*data));
     data->ret = ret;
@@ -273,6 +427,7 @@ static BlockDriver bdrv_commit_top = {
 
 void commit_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, BlockDriverState *top, int64_t speed,
+                  int64_t buf_size, int max_in_flight,
                   BlockdevOnError on_error, const char *backing_file_str,
                   const char *filter_node_name, Error **errp)
 {
@@ -378,6 +533,9 @@ void commit_start(const char *job_id, BlockDriverState *bs,
     s->base_flags = orig_base_flags;
     s->backing_file_str = g_strdup(backing_file_str);
     s->on_error = on_error;
+    s->max_in_flight = max_in_flight ?: COMMIT_DEFAULT_MAX_IN_FLIGHT;
+    s->buf_size = buf_size ?: (int64_t)COMMIT_BUFFER_SIZE * s->max_in_flight;
+    QTAILQ_INIT(&s->failed);
 
     trace_commit_start(bs, base, top, s);
     block_job_start(&s->common);
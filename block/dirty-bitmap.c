@@ -244,6 +244,7 @@ int bdrv_dirty_bitmap_create_successor(BlockDriverState *bs,
 
     /* Successor will be on or off based on our current state. */
     child->disabled = bitmap->disabled;
+    bdrv_dirty_bitmap_set_sparse(child, bdrv_dirty_bitmap_get_sparse(bitmap));
 
     /* Install the successor and freeze the parent */
     bitmap->successor = child;
@@ -592,8 +593,11 @@ void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
         hbitmap_reset_all(bitmap->bitmap);
     } else {
         HBitmap *backup = bitmap->bitmap;
-        bitmap->bitmap = hbitmap_alloc(bitmap->size,
-                                       hbitmap_granularity(backup));
+        int granularity = hbitmap_granularity(backup);
+
+        bitmap->bitmap = hbitmap_is_sparse(backup) ?
+            hbitmap_alloc_sparse(bitmap->size, granularity) :
+            hbitmap_alloc(bitmap->size, granularity);
         *out = backup;
     }
     bdrv_dirty_bitmap_unlock(bitmap);
@@ -608,6 +612,89 @@ void bdrv_undo_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *in)
     hbitmap_free(tmp);
 }
 
+typedef bool (*HBitmapCombineFunc)(HBitmap *a, const HBitmap *b);
+
+static void bdrv_combine_dirty_bitmap(BdrvDirtyBitmap *dest,
+                                      BdrvDirtyBitmap *src,
+                                      HBitmapCombineFunc combine,
+                                      Error **errp)
+{
+    assert(!bdrv_dirty_bitmap_frozen(dest));
+    assert(!bdrv_dirty_bitmap_readonly(dest));
+
+    qemu_mutex_lock(dest->mutex);
+    if (src->mutex != dest->mutex) {
+        qemu_mutex_lock(src->mutex);
+    }
+
+    if (!combine(dest->bitmap, src->bitmap)) {
+        error_setg(errp, "Bitmaps are incompatible and can't be combined");
+    }
+
+    if (src->mutex != dest->mutex) {
+        qemu_mutex_unlock(src->mutex);
+    }
+    qemu_mutex_unlock(dest->mutex);
+}
+
+/* Called with BQL taken.  dest := dest | src */
+void bdrv_merge_dirty_bitmap(BdrvDirtyBitmap *dest, BdrvDirtyBitmap *src,
+                             Error **errp)
+{
+    bdrv_combine_dirty_bitmap(dest, src, hbitmap_merge, errp);
+}
+
+/* Called with BQL taken.  dest := dest & src */
+void bdrv_intersect_dirty_bitmap(BdrvDirtyBitmap *dest, BdrvDirtyBitmap *src,
+                                 Error **errp)
+{
+    bdrv_combine_dirty_bitmap(dest, src, hbitmap_intersect, errp);
+}
+
+/* Called with BQL taken.  dest := dest & ~src */
+void bdrv_subtract_dirty_bitmap(BdrvDirtyBitmap *dest, BdrvDirtyBitmap *src,
+                                Error **errp)
+{
+    bdrv_combine_dirty_bitmap(dest, src, hbitmap_subtract, errp);
+}
+
+/**
+ * Mark in @bitmap every range of @bs that is allocated in the backing chain
+ * of @bs above @base, i.e. the data that a snapshot overlay (or a chain of
+ * them) holds on top of @base.
+ * Called with BQL and the AioContext of @bs taken.
+ */
+int bdrv_populate_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                               BlockDriverState *base, Error **errp)
+{
+    int64_t offset = 0;
+
+    assert(!bdrv_dirty_bitmap_frozen(bitmap));
+    assert(!bdrv_dirty_bitmap_readonly(bitmap));
+
+    while (offset < bitmap->size) {
+        int64_t pnum;
+        int ret = bdrv_is_allocated_above(bs, base, offset,
+                                          bitmap->size - offset, &pnum);
+
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Unable to get allocation status");
+            return ret;
+        }
+        if (!pnum) {
+            break;
+        }
+        if (ret) {
+            bdrv_dirty_bitmap_lock(bitmap);
+            hbitmap_set(bitmap->bitmap, offset, pnum);
+            bdrv_dirty_bitmap_unlock(bitmap);
+        }
+        offset += pnum;
+    }
+
+    return 0;
+}
+
 uint64_t bdrv_dirty_bitmap_serialization_size(const BdrvDirtyBitmap *bitmap,
                                               uint64_t offset, uint64_t bytes)
 {
@@ -722,6 +809,19 @@ void bdrv_dirty_bitmap_set_persistance(BdrvDirtyBitmap *bitmap, bool persistent)
     qemu_mutex_unlock(bitmap->mutex);
 }
 
+/* Called with BQL taken. */
+void bdrv_dirty_bitmap_set_sparse(BdrvDirtyBitmap *bitmap, bool sparse)
+{
+    qemu_mutex_lock(bitmap->mutex);
+    hbitmap_set_sparse(bitmap->bitmap, sparse);
+    qemu_mutex_unlock(bitmap->mutex);
+}
+
+bool bdrv_dirty_bitmap_get_sparse(const BdrvDirtyBitmap *bitmap)
+{
+    return hbitmap_is_sparse(bitmap->bitmap);
+}
+
 bool bdrv_dirty_bitmap_get_persistance(BdrvDirtyBitmap *bitmap)
 {
     return bitmap->persistent;
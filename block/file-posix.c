@@ -1511,6 +1511,19 @@ static int aio_worker(void *arg)
     return ret;
 }
 
+/* Keep slow syncs from holding up reads and writes in the thread pool */
+static ThreadPoolClass paio_class(int type)
+{
+    switch (type & QEMU_AIO_TYPE_MASK) {
+    case QEMU_AIO_FLUSH:
+    case QEMU_AIO_DISCARD:
+    case QEMU_AIO_WRITE_ZEROES:
+        return THREAD_POOL_FLUSH;
+    default:
+        return THREAD_POOL_DATA;
+    }
+}
+
 static int paio_submit_co(BlockDriverState *bs, int fd,
                           int64_t offset, QEMUIOVector *qiov,
                           int bytes, int type)
@@ -1533,7 +1546,7 @@ static int paio_submit_co(BlockDriverState *bs, int fd,
 
     trace_paio_submit_co(offset, bytes, type);
     pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
-    return thread_pool_submit_co(pool, aio_worker, acb);
+    return thread_pool_submit_co_class(pool, paio_class(type), aio_worker, acb);
 }
 
 static BlockAIOCB *paio_submit(BlockDriverState *bs, int fd,
@@ -1558,7 +1571,8 @@ static BlockAIOCB *paio_submit(BlockDriverState *bs, int fd,
 
     trace_paio_submit(acb, opaque, offset, bytes, type);
     pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
-    return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
+    return thread_pool_submit_aio_class(pool, paio_class(type), aio_worker,
+                                        acb, cb, opaque);
 }
 
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
@@ -0,0 +1,393 @@
+/*
+ * Flight recorder of block requests
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/flight-recorder.h"
+#include "block/block.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-block-core.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/main-loop.h"
+#include "qemu/notify.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+
+#define FLIGHT_RECORDER_MIN_ENTRIES     16
+#define FLIGHT_RECORDER_MAX_ENTRIES     (1 << 20)
+#define FLIGHT_RECORDER_DEFAULT_ENTRIES 4096
+
+/* Dump to the spike file at most this often */
+#define FLIGHT_RECORDER_SPIKE_INTERVAL_NS   (10 * NANOSECONDS_PER_SECOND)
+
+QEMU_BUILD_BUG_ON(sizeof(FlightRecord) != 32);
+
+typedef struct FlightRecorderRing {
+    /* Only written by the owner thread, read by dumps */
+    uint64_t head;
+
+    /* These fields are protected by flight_recorder_lock */
+    bool in_use;
+    uint32_t thread_id;
+    Notifier exit_notifier;
+    QSLIST_ENTRY(FlightRecorderRing) next;
+
+    FlightRecord records[];
+} FlightRecorderRing;
+
+bool flight_recorder_enabled;
+
+static __thread FlightRecorderRing *flight_recorder_ring;
+
+static QemuMutex flight_recorder_lock;
+/* These are protected by flight_recorder_lock */
+static QSLIST_HEAD(, FlightRecorderRing) flight_recorder_rings;
+static uint32_t flight_recorder_entries;
+
+/* Read from any thread */
+static int64_t flight_recorder_spike_ns;
+static int64_t flight_recorder_last_spike;
+/* This is protected by the global QEMU mutex */
+static char *flight_recorder_spike_path;
+
+static void __attribute__((__constructor__)) flight_recorder_init(void)
+{
+    qemu_mutex_init(&flight_recorder_lock);
+}
+
+static void flight_recorder_thread_exit(Notifier *n, void *unused)
+{
+    FlightRecorderRing *ring = container_of(n, FlightRecorderRing,
+                                            exit_notifier);
+
+    qemu_mutex_lock(&flight_recorder_lock);
+    ring->in_use = false;
+    qemu_mutex_unlock(&flight_recorder_lock);
+    flight_recorder_ring = NULL;
+}
+
+/* Give the current thread a ring, reusing one of an exited thread if any */
+static FlightRecorderRing *flight_recorder_ring_get(void)
+{
+    FlightRecorderRing *ring;
+
+    qemu_mutex_lock(&flight_recorder_lock);
+    QSLIST_FOREACH(ring, &flight_recorder_rings, next) {
+        if (!ring->in_use) {
+            break;
+        }
+    }
+    if (!ring) {
+        ring = g_malloc0(sizeof(*ring) +
+                         flight_recorder_entries * sizeof(FlightRecord));
+        QSLIST_INSERT_HEAD(&flight_recorder_rings, ring, next);
+    }
+    ring->head = 0;
+    ring->in_use = true;
+    ring->thread_id = qemu_get_thread_id();
+    qemu_mutex_unlock(&flight_recorder_lock);
+
+    ring->exit_notifier.notify = flight_recorder_thread_exit;
+    qemu_thread_atexit_add(&ring->exit_notifier);
+    flight_recorder_ring = ring;
+    return ring;
+}
+
+int64_t flight_recorder_do_record(FlightRecorderEvent event,
+                                  FlightRecorderOp op, uint32_t dev,
+                                  uint32_t id, uint64_t offset,
+                                  uint32_t bytes, int result)
+{
+    FlightRecorderRing *ring = flight_recorder_ring;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    FlightRecord *rec;
+    uint64_t head;
+
+    if (!ring) {
+        ring = flight_recorder_ring_get();
+    }
+
+    /* flight_recorder_entries does not change once rings exist */
+    head = ring->head;
+    rec = &ring->records[head & (flight_recorder_entries - 1)];
+    rec->time_ns = now;
+    rec->offset = offset;
+    rec->bytes = bytes;
+    rec->id = id;
+    rec->dev = dev;
+    rec->event = event;
+    rec->op = op;
+    rec->result = MIN(MAX(result, INT16_MIN), INT16_MAX);
+
+    /* Dumps must not see the new head before the record */
+    smp_wmb();
+    atomic_set__nocheck(&ring->head, head + 1);
+
+    return now;
+}
+
+/* Copy the valid records of @ring to @buf, oldest first */
+static uint32_t flight_recorder_copy_ring(FlightRecorderRing *ring,
+                                          GByteArray *buf)
+{
+    uint64_t entries = flight_recorder_entries;
+    FlightRecord *copy = g_new(FlightRecord, entries);
+    uint64_t start, end, first, i;
+
+    start = atomic_read__nocheck(&ring->head);
+    smp_rmb();
+    memcpy(copy, ring->records, entries * sizeof(FlightRecord));
+    smp_rmb();
+    end = atomic_read__nocheck(&ring->head);
+
+    /*
+     * The owner may have been overwriting records up to index @end, which
+     * is not published yet; so a full ring yields one record less.
+     */
+    first = start > entries ? start - entries : 0;
+    if (end >= entries && end - entries + 1 > first) {
+        first = end - entries + 1;
+    }
+    for (i = first; i < start; i++) {
+        g_byte_array_append(buf, (guint8 *)&copy[i & (entries - 1)],
+                            sizeof(FlightRecord));
+    }
+
+    g_free(copy);
+    return start > first ? start - first : 0;
+}
+
+/* Names of the BlockBackends that BLK events may refer to */
+static uint32_t flight_recorder_add_names(GByteArray *buf)
+{
+    static const uint8_t pad[8];
+    BlockBackend *blk = NULL;
+    uint32_t n = 0;
+
+    while ((blk = blk_all_next(blk)) != NULL) {
+        FlightRecorderDumpName hdr;
+        const char *name = blk_name(blk);
+
+        if (!*name && blk_bs(blk)) {
+            name = bdrv_get_node_name(blk_bs(blk));
+        }
+        if (!*name) {
+            continue;
+        }
+
+        hdr.dev = blk_get_flight_id(blk);
+        hdr.len = strlen(name);
+        g_byte_array_append(buf, (guint8 *)&hdr, sizeof(hdr));
+        g_byte_array_append(buf, (const guint8 *)name, hdr.len);
+        g_byte_array_append(buf, pad, ROUND_UP(hdr.len, 8) - hdr.len);
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Return a dump of all rings in the format described in
+ * include/block/flight-recorder.h.  Must be called under the global
+ * QEMU mutex.
+ */
+GByteArray *flight_recorder_dump(uint64_t *nr_records)
+{
+    GByteArray *buf = g_byte_array_new();
+    FlightRecorderDumpHeader hdr = {
+        .version = FLIGHT_RECORDER_VERSION,
+        .record_size = sizeof(FlightRecord),
+        .time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME),
+        .wall_time_ns = g_get_real_time() * SCALE_US,
+    };
+    FlightRecorderRing *ring;
+
+    memcpy(hdr.magic, FLIGHT_RECORDER_MAGIC, sizeof(hdr.magic));
+    g_byte_array_append(buf, (guint8 *)&hdr, sizeof(hdr));
+    hdr.nr_names = flight_recorder_add_names(buf);
+
+    *nr_records = 0;
+    qemu_mutex_lock(&flight_recorder_lock);
+    QSLIST_FOREACH(ring, &flight_recorder_rings, next) {
+        FlightRecorderDumpRing ring_hdr = { .thread_id = ring->thread_id };
+        guint pos = buf->len;
+
+        g_byte_array_append(buf, (guint8 *)&ring_hdr, sizeof(ring_hdr));
+        ring_hdr.nr_records = flight_recorder_copy_ring(ring, buf);
+        memcpy(buf->data + pos, &ring_hdr, sizeof(ring_hdr));
+        *nr_records += ring_hdr.nr_records;
+        hdr.nr_rings++;
+    }
+    qemu_mutex_unlock(&flight_recorder_lock);
+
+    memcpy(buf->data, &hdr, sizeof(hdr));
+    return buf;
+}
+
+int64_t flight_recorder_dump_file(const char *path, Error **errp)
+{
+    uint64_t nr_records;
+    GByteArray *buf = flight_recorder_dump(&nr_records);
+    int64_t ret = nr_records;
+    int fd;
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not create '%s'", path);
+        goto out;
+    }
+    if (qemu_write_full(fd, buf->data, buf->len) != buf->len) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not write '%s'", path);
+    }
+    qemu_close(fd);
+
+out:
+    g_byte_array_free(buf, true);
+    return ret;
+}
+
+static void flight_recorder_spike_bh(void *opaque)
+{
+    Error *local_err = NULL;
+
+    if (!flight_recorder_spike_path) {
+        return;
+    }
+    if (flight_recorder_dump_file(flight_recorder_spike_path,
+                                  &local_err) < 0) {
+        error_report_err(local_err);
+    }
+}
+
+void flight_recorder_check_latency(int64_t start_ns)
+{
+    int64_t threshold = atomic_read__nocheck(&flight_recorder_spike_ns);
+    int64_t now, last;
+
+    if (!start_ns || !threshold) {
+        return;
+    }
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (now - start_ns < threshold) {
+        return;
+    }
+
+    last = atomic_read__nocheck(&flight_recorder_last_spike);
+    if (last && now - last < FLIGHT_RECORDER_SPIKE_INTERVAL_NS) {
+        return;
+    }
+    if (atomic_cmpxchg__nocheck(&flight_recorder_last_spike,
+                                last, now) != last) {
+        return;
+    }
+    aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                            flight_recorder_spike_bh, NULL);
+}
+
+/* The size of the rings cannot change once they exist */
+int flight_recorder_enable(uint32_t entries, Error **errp)
+{
+    int ret = 0;
+
+    if (entries < FLIGHT_RECORDER_MIN_ENTRIES ||
+        entries > FLIGHT_RECORDER_MAX_ENTRIES) {
+        error_setg(errp, "Number of entries must be between %d and %d",
+                   FLIGHT_RECORDER_MIN_ENTRIES, FLIGHT_RECORDER_MAX_ENTRIES);
+        return -EINVAL;
+    }
+    entries = pow2ceil(entries);
+
+    qemu_mutex_lock(&flight_recorder_lock);
+    if (QSLIST_EMPTY(&flight_recorder_rings)) {
+        flight_recorder_entries = entries;
+    } else if (entries != flight_recorder_entries) {
+        error_setg(errp, "The rings already have %" PRIu32 " entries",
+                   flight_recorder_entries);
+        ret = -EBUSY;
+    }
+    qemu_mutex_unlock(&flight_recorder_lock);
+
+    if (!ret) {
+        atomic_set(&flight_recorder_enabled, true);
+    }
+    return ret;
+}
+
+/* Stop recording; the rings are kept so that they can still be dumped */
+void flight_recorder_disable(void)
+{
+    atomic_set(&flight_recorder_enabled, false);
+}
+
+void flight_recorder_set_spike(int64_t threshold_ns, const char *path)
+{
+    g_free(flight_recorder_spike_path);
+    flight_recorder_spike_path = g_strdup(path);
+    atomic_set__nocheck(&flight_recorder_spike_ns,
+                        path ? threshold_ns : 0);
+}
+
+void qmp_x_flight_recorder_set(bool enable, bool has_entries,
+                               uint32_t entries, bool has_spike_threshold,
+                               uint32_t spike_threshold,
+                               bool has_spike_path, const char *spike_path,
+                               Error **errp)
+{
+    if (has_spike_threshold != has_spike_path) {
+        error_setg(errp, "'spike-threshold' and 'spike-path' must be "
+                   "given together");
+        return;
+    }
+
+    if (enable) {
+        uint32_t cur = atomic_read(&flight_recorder_entries);
+
+        if (flight_recorder_enable(has_entries ? entries :
+                                   cur ?: FLIGHT_RECORDER_DEFAULT_ENTRIES,
+                                   errp) < 0) {
+            return;
+        }
+    } else {
+        flight_recorder_disable();
+    }
+
+    if (has_spike_threshold) {
+        flight_recorder_set_spike((int64_t)spike_threshold * SCALE_US,
+                                  spike_threshold ? spike_path : NULL);
+    }
+}
+
+FlightRecorderDumpInfo *qmp_x_flight_recorder_dump(bool has_path,
+                                                   const char *path,
+                                                   Error **errp)
+{
+    FlightRecorderDumpInfo *info;
+    int64_t ret;
+
+    if (has_path) {
+        ret = flight_recorder_dump_file(path, errp);
+        if (ret < 0) {
+            return NULL;
+        }
+        info = g_new0(FlightRecorderDumpInfo, 1);
+        info->records = ret;
+    } else {
+        uint64_t nr_records;
+        GByteArray *buf = flight_recorder_dump(&nr_records);
+
+        info = g_new0(FlightRecorderDumpInfo, 1);
+        info->records = nr_records;
+        info->has_data = true;
+        info->data = g_base64_encode(buf->data, buf->len);
+        g_byte_array_free(buf, true);
+    }
+    return info;
+}
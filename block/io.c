@@ -29,6 +29,7 @@
 #include "block/blockjob.h"
 #include "block/blockjob_int.h"
 #include "block/block_int.h"
+#include "block/status-cache.h"
 #include "qemu/cutils.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
@@ -1123,6 +1124,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BdrvChild *child,
                 ret = bdrv_driver_pwritev(bs, cluster_offset, pnum,
                                           &local_qiov, 0);
             }
+            bdrv_bsc_invalidate_range(bs, cluster_offset, pnum);
 
             if (ret < 0) {
                 /* It might be okay to ignore write errors for guest
@@ -1555,6 +1557,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BdrvChild *child,
 
     atomic_inc(&bs->write_gen);
     bdrv_set_dirty(bs, offset, bytes);
+    bdrv_bsc_invalidate_range(bs, offset, bytes);
 
     stat64_max(&bs->wr_highest_offset, offset + bytes);
 
@@ -1847,6 +1850,165 @@ int bdrv_flush_all(void)
     return result;
 }
 
+typedef struct FlushAllState FlushAllState;
+
+typedef struct FlushAllNode {
+    FlushAllState *s;
+    BlockDriverState *bs;
+    int ret;
+    bool started;
+    bool done;
+} FlushAllNode;
+
+struct FlushAllState {
+    int refcnt;
+    int in_flight;
+    AioWait wait;
+    int nb_nodes;
+    FlushAllNode *nodes;
+};
+
+static void flush_all_state_unref(FlushAllState *s)
+{
+    if (atomic_fetch_dec(&s->refcnt) == 1) {
+        g_free(s->nodes);
+        g_free(s);
+    }
+}
+
+static void coroutine_fn bdrv_flush_all_co_entry(void *opaque)
+{
+    FlushAllNode *node = opaque;
+    FlushAllState *s = node->s;
+
+    node->ret = bdrv_co_flush(node->bs);
+    bdrv_dec_in_flight(node->bs);
+    atomic_mb_set(&node->done, true);
+    atomic_dec(&s->in_flight);
+    aio_wait_kick(&s->wait);
+    flush_all_state_unref(s);
+}
+
+static void bdrv_flush_all_timeout(void *opaque)
+{
+    /* Nothing to do, this only wakes up the polling loop */
+}
+
+void bdrv_flush_failure_free(void *failure)
+{
+    BdrvFlushFailure *f = failure;
+
+    g_free(f->node_name);
+    g_free(f);
+}
+
+/*
+ * Flush all BDSes at once, each one in its own AioContext, keeping at most
+ * @max_in_flight flushes running (0 means no limit).
+ *
+ * If @timeout_ns is not zero, stop waiting after that many nanoseconds; nodes
+ * whose flush has not completed by then count as failed with -ETIMEDOUT.
+ * Flushes that are already running are not cancelled and keep the node busy
+ * until they complete.
+ *
+ * Returns 0 if every node was flushed, or the first error otherwise.  If
+ * @failures is not NULL, it is set to a list of BdrvFlushFailure for the nodes
+ * that could not be flushed, to be freed with bdrv_flush_failure_free().
+ *
+ * Must be called from the main loop.
+ */
+int bdrv_flush_all_parallel(int max_in_flight, int64_t timeout_ns,
+                            GSList **failures)
+{
+    BdrvNextIterator it;
+    BlockDriverState *bs;
+    FlushAllState *s;
+    QEMUTimer *timer = NULL;
+    int64_t deadline = 0;
+    int next = 0, i;
+    int result = 0;
+
+    assert(qemu_get_current_aio_context() == qemu_get_aio_context());
+
+    s = g_new0(FlushAllState, 1);
+    s->refcnt = 1;
+    for (bs = bdrv_first(&it); bs; bs = bdrv_next(&it)) {
+        s->nb_nodes++;
+    }
+    s->nodes = g_new0(FlushAllNode, s->nb_nodes);
+    for (bs = bdrv_first(&it), i = 0; bs; bs = bdrv_next(&it), i++) {
+        bdrv_ref(bs);
+        s->nodes[i].s = s;
+        s->nodes[i].bs = bs;
+    }
+
+    if (timeout_ns) {
+        deadline = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + timeout_ns;
+        timer = aio_timer_new(qemu_get_aio_context(), QEMU_CLOCK_REALTIME,
+                              SCALE_NS, bdrv_flush_all_timeout, NULL);
+        timer_mod(timer, deadline);
+    }
+
+    atomic_inc(&s->wait.num_waiters);
+    for (;;) {
+        while (next < s->nb_nodes &&
+               (!max_in_flight || atomic_read(&s->in_flight) < max_in_flight)) {
+            FlushAllNode *node = &s->nodes[next++];
+            AioContext *aio_context = bdrv_get_aio_context(node->bs);
+            Coroutine *co;
+
+            node->started = true;
+            atomic_inc(&s->refcnt);
+            atomic_inc(&s->in_flight);
+            aio_context_acquire(aio_context);
+            /* Keep the node alive until the coroutine gets to run */
+            bdrv_inc_in_flight(node->bs);
+            co = qemu_coroutine_create(bdrv_flush_all_co_entry, node);
+            bdrv_coroutine_enter(node->bs, co);
+            aio_context_release(aio_context);
+        }
+        if (next == s->nb_nodes && !atomic_read(&s->in_flight)) {
+            break;
+        }
+        if (deadline && qemu_clock_get_ns(QEMU_CLOCK_REALTIME) >= deadline) {
+            break;
+        }
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    atomic_dec(&s->wait.num_waiters);
+
+    if (timer) {
+        timer_del(timer);
+        timer_free(timer);
+    }
+
+    for (i = 0; i < s->nb_nodes; i++) {
+        FlushAllNode *node = &s->nodes[i];
+        int ret = -ETIMEDOUT;
+
+        if (node->started && atomic_mb_read(&node->done)) {
+            ret = node->ret;
+        }
+        if (ret < 0) {
+            if (!result) {
+                result = ret;
+            }
+            if (failures) {
+                BdrvFlushFailure *f = g_new0(BdrvFlushFailure, 1);
+                f->node_name = g_strdup(bdrv_get_device_or_node_name(node->bs));
+                f->ret = ret;
+                *failures = g_slist_prepend(*failures, f);
+            }
+        }
+        bdrv_unref(node->bs);
+    }
+    if (failures) {
+        *failures = g_slist_reverse(*failures);
+    }
+
+    flush_all_state_unref(s);
+    return result;
+}
 
 typedef struct BdrvCoBlockStatusData {
     BlockDriverState *bs;
@@ -2069,26 +2231,45 @@ early_out:
     return ret;
 }
 
-static int coroutine_fn bdrv_co_block_status_above(BlockDriverState *bs,
-                                                   BlockDriverState *base,
-                                                   bool want_zero,
-                                                   int64_t offset,
-                                                   int64_t bytes,
-                                                   int64_t *pnum,
-                                                   int64_t *map,
-                                                   BlockDriverState **file)
+/*
+ * Walk the backing chain from @bs down to (but excluding) @base.  If @depth
+ * is not NULL, it is set to the position of the layer that owns the range
+ * (0 for @bs itself), or -1 if no layer between @bs and @base does.
+ */
+static int coroutine_fn bdrv_co_do_block_status_above(BlockDriverState *bs,
+                                                      BlockDriverState *base,
+                                                      bool want_zero,
+                                                      int64_t offset,
+                                                      int64_t bytes,
+                                                      int64_t *pnum,
+                                                      int64_t *map,
+                                                      BlockDriverState **file,
+                                                      int *depth)
 {
     BlockDriverState *p;
     int ret = 0;
     bool first = true;
+    int d = 0;
 
     assert(bs != base);
-    for (p = bs; p != base; p = backing_bs(p)) {
+    if (depth) {
+        *depth = -1;
+    }
+    for (p = bs; p != base; p = backing_bs(p), d++) {
         ret = bdrv_co_block_status(p, want_zero, offset, bytes, pnum, map,
                                    file);
         if (ret < 0) {
             break;
         }
+        if (!*pnum && !first) {
+            /*
+             * @p is shorter than the layers above it, so nothing below
+             * it shows through in the rest of the unallocated range.
+             */
+            *pnum = bytes;
+            ret = 0;
+            break;
+        }
         if (ret & BDRV_BLOCK_ZERO && ret & BDRV_BLOCK_EOF && !first) {
             /*
              * Reading beyond the end of the file continues to read
@@ -2099,6 +2280,9 @@ static int coroutine_fn bdrv_co_block_status_above(BlockDriverState *bs,
             *pnum = bytes;
         }
         if (ret & (BDRV_BLOCK_ZERO | BDRV_BLOCK_DATA)) {
+            if (depth) {
+                *depth = d;
+            }
             break;
         }
         /* [offset, pnum] unallocated on this layer, which could be only
@@ -2109,6 +2293,49 @@ static int coroutine_fn bdrv_co_block_status_above(BlockDriverState *bs,
     return ret;
 }
 
+static int coroutine_fn bdrv_co_block_status_above(BlockDriverState *bs,
+                                                   BlockDriverState *base,
+                                                   bool want_zero,
+                                                   int64_t offset,
+                                                   int64_t bytes,
+                                                   int64_t *pnum,
+                                                   int64_t *map,
+                                                   BlockDriverState **file)
+{
+    BdrvStatusExtent ext;
+    uint64_t gen;
+    int ret;
+
+    if (!bs->status_cache || !bytes) {
+        return bdrv_co_do_block_status_above(bs, base, want_zero, offset,
+                                             bytes, pnum, map, file, NULL);
+    }
+
+    if (!bdrv_bsc_lookup(bs, want_zero, offset, &ext)) {
+        /* Cache the answer for the whole chain, as far as it extends */
+        gen = bdrv_bsc_generation(bs);
+        ret = bdrv_co_do_block_status_above(bs, NULL, want_zero, offset,
+                                            MAX(bytes, BDRV_REQUEST_MAX_BYTES),
+                                            &ext.bytes, &ext.map, &ext.file,
+                                            &ext.depth);
+        if (ret < 0 || !ext.bytes) {
+            *pnum = 0;
+            if (map) {
+                *map = ext.map;
+            }
+            if (file) {
+                *file = ext.file;
+            }
+            return ret;
+        }
+        ext.offset = offset;
+        ext.ret = ret;
+        bdrv_bsc_insert(bs, want_zero, gen, &ext);
+    }
+
+    return bdrv_bsc_resolve(bs, base, &ext, offset, bytes, pnum, map, file);
+}
+
 /* Coroutine wrapper for bdrv_block_status_above() */
 static void coroutine_fn bdrv_block_status_above_co_entry(void *opaque)
 {
@@ -2211,6 +2438,16 @@ int bdrv_is_allocated_above(BlockDriverState *top,
     int ret;
     int64_t n = bytes;
 
+    if (top->status_cache && top != base) {
+        /* One cached walk answers for every layer at once */
+        ret = bdrv_common_block_status_above(top, base, false, offset, bytes,
+                                             pnum, NULL, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+        return !!(ret & BDRV_BLOCK_ALLOCATED);
+    }
+
     intermediate = top;
     while (intermediate && intermediate != base) {
         int64_t pnum_inter;
@@ -2659,6 +2896,7 @@ int coroutine_fn bdrv_co_pdiscard(BlockDriverState *bs, int64_t offset,
 out:
     atomic_inc(&bs->write_gen);
     bdrv_set_dirty(bs, req.offset, req.bytes);
+    bdrv_bsc_invalidate_range(bs, req.offset, req.bytes);
     tracked_request_end(&req);
     bdrv_dec_in_flight(bs);
     return ret;
@@ -0,0 +1,278 @@
+/*
+ * Latency-driven admission control for block devices
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * This is modelled after the io.latency controller of Linux: rather than
+ * capping rates, it limits the queue depth of low-priority devices while
+ * the latency of more important devices on the same storage suffers.
+ */
+
+#include "qemu/osdep.h"
+#include "block/latency-qos.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+
+#define LATENCY_QOS_WINDOW_NS       (100 * SCALE_MS)
+/* Windows with fewer completions than this say nothing about latency */
+#define LATENCY_QOS_MIN_SAMPLES     4
+/* A depth limit that grows beyond this is lifted */
+#define LATENCY_QOS_MAX_DEPTH       256
+
+typedef struct LatencyQosGroup {
+    char *name;
+    QTAILQ_HEAD(, LatencyQosMember) members;
+    QTAILQ_ENTRY(LatencyQosGroup) list;
+} LatencyQosGroup;
+
+struct LatencyQosMember {
+    /* These fields are protected by the global QEMU mutex */
+    LatencyQosGroup *group;
+    QTAILQ_ENTRY(LatencyQosMember) next;
+    uint32_t priority;
+    int64_t target_ns;
+    uint32_t last_peak;
+    int64_t mean_latency_ns;
+
+    QemuMutex lock; /* This lock protects the following fields */
+    CoQueue queue;
+    unsigned waiting;
+    uint32_t depth_limit;
+    uint32_t in_flight;
+    uint32_t peak_in_flight;
+    uint64_t window_ops;
+    int64_t window_total_ns;
+    uint64_t delayed;
+};
+
+/* These are protected by the global QEMU mutex */
+static QTAILQ_HEAD(, LatencyQosGroup) latency_qos_groups =
+    QTAILQ_HEAD_INITIALIZER(latency_qos_groups);
+static QEMUTimer *latency_qos_timer;
+
+static void latency_qos_timer_cb(void *opaque)
+{
+    latency_qos_update();
+    timer_mod(latency_qos_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                                 LATENCY_QOS_WINDOW_NS);
+}
+
+static LatencyQosGroup *latency_qos_group_get(const char *name)
+{
+    LatencyQosGroup *g;
+
+    QTAILQ_FOREACH(g, &latency_qos_groups, list) {
+        if (!strcmp(g->name, name)) {
+            return g;
+        }
+    }
+
+    if (!latency_qos_timer) {
+        latency_qos_timer = timer_new_ns(QEMU_CLOCK_REALTIME,
+                                         latency_qos_timer_cb, NULL);
+        timer_mod(latency_qos_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                                     LATENCY_QOS_WINDOW_NS);
+    }
+
+    g = g_new0(LatencyQosGroup, 1);
+    g->name = g_strdup(name);
+    QTAILQ_INIT(&g->members);
+    QTAILQ_INSERT_TAIL(&latency_qos_groups, g, list);
+    return g;
+}
+
+static void latency_qos_group_put(LatencyQosGroup *g)
+{
+    if (!QTAILQ_EMPTY(&g->members)) {
+        return;
+    }
+
+    QTAILQ_REMOVE(&latency_qos_groups, g, list);
+    g_free(g->name);
+    g_free(g);
+
+    if (QTAILQ_EMPTY(&latency_qos_groups)) {
+        timer_free(latency_qos_timer);
+        latency_qos_timer = NULL;
+    }
+}
+
+LatencyQosMember *latency_qos_register(const char *group, uint32_t priority,
+                                       int64_t target_ns)
+{
+    LatencyQosMember *m = g_new0(LatencyQosMember, 1);
+
+    qemu_mutex_init(&m->lock);
+    qemu_co_queue_init(&m->queue);
+    latency_qos_configure(m, group, priority, target_ns);
+    return m;
+}
+
+/* The member must not have requests in flight */
+void latency_qos_unregister(LatencyQosMember *m)
+{
+    assert(!m->in_flight && qemu_co_queue_empty(&m->queue));
+
+    QTAILQ_REMOVE(&m->group->members, m, next);
+    latency_qos_group_put(m->group);
+    qemu_mutex_destroy(&m->lock);
+    g_free(m);
+}
+
+void latency_qos_configure(LatencyQosMember *m, const char *group,
+                           uint32_t priority, int64_t target_ns)
+{
+    LatencyQosGroup *old = m->group;
+
+    m->priority = priority;
+    m->target_ns = target_ns;
+
+    if (old && !strcmp(old->name, group)) {
+        return;
+    }
+    m->group = latency_qos_group_get(group);
+    QTAILQ_INSERT_TAIL(&m->group->members, m, next);
+    if (old) {
+        QTAILQ_REMOVE(&old->members, m, next);
+        latency_qos_group_put(old);
+    }
+}
+
+const char *latency_qos_get_group(LatencyQosMember *m)
+{
+    return m->group->name;
+}
+
+uint32_t latency_qos_get_priority(LatencyQosMember *m)
+{
+    return m->priority;
+}
+
+int64_t latency_qos_get_target(LatencyQosMember *m)
+{
+    return m->target_ns;
+}
+
+void latency_qos_get_stats(LatencyQosMember *m, LatencyQosStats *stats)
+{
+    qemu_mutex_lock(&m->lock);
+    stats->depth_limit = m->depth_limit;
+    stats->in_flight = m->in_flight;
+    stats->delayed = m->delayed;
+    qemu_mutex_unlock(&m->lock);
+    stats->mean_latency_ns = m->mean_latency_ns;
+}
+
+static bool latency_qos_full(LatencyQosMember *m)
+{
+    return m->depth_limit && m->in_flight >= m->depth_limit;
+}
+
+int64_t coroutine_fn latency_qos_co_admit(LatencyQosMember *m)
+{
+    qemu_mutex_lock(&m->lock);
+    if (latency_qos_full(m)) {
+        m->delayed++;
+        do {
+            m->waiting++;
+            qemu_co_queue_wait(&m->queue, &m->lock);
+            m->waiting--;
+        } while (latency_qos_full(m));
+    }
+    m->in_flight++;
+    m->peak_in_flight = MAX(m->peak_in_flight, m->in_flight);
+    qemu_mutex_unlock(&m->lock);
+
+    return qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+}
+
+void coroutine_fn latency_qos_co_complete(LatencyQosMember *m,
+                                          int64_t start_ns)
+{
+    int64_t latency_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns;
+
+    qemu_mutex_lock(&m->lock);
+    m->in_flight--;
+    m->window_ops++;
+    m->window_total_ns += latency_ns;
+    if (!latency_qos_full(m)) {
+        qemu_co_queue_next(&m->queue);
+    }
+    qemu_mutex_unlock(&m->lock);
+}
+
+/* Close the window of a member and return whether it missed its target */
+static bool latency_qos_close_window(LatencyQosMember *m)
+{
+    uint64_t ops;
+    int64_t total_ns;
+
+    qemu_mutex_lock(&m->lock);
+    ops = m->window_ops;
+    total_ns = m->window_total_ns;
+    m->last_peak = m->peak_in_flight;
+    m->window_ops = 0;
+    m->window_total_ns = 0;
+    m->peak_in_flight = m->in_flight;
+    qemu_mutex_unlock(&m->lock);
+
+    if (ops) {
+        m->mean_latency_ns = total_ns / ops;
+    }
+    return m->target_ns && ops >= LATENCY_QOS_MIN_SAMPLES &&
+           total_ns / ops > m->target_ns;
+}
+
+static void latency_qos_scale(LatencyQosMember *m, bool down)
+{
+    unsigned n;
+
+    qemu_mutex_lock(&m->lock);
+    if (down) {
+        /* Start from the depth the member actually used */
+        uint32_t depth = m->depth_limit ?: m->last_peak;
+        m->depth_limit = MAX(depth / 2, 1);
+    } else if (m->depth_limit) {
+        m->depth_limit += MAX(m->depth_limit / 4, 1);
+        if (m->depth_limit > LATENCY_QOS_MAX_DEPTH) {
+            m->depth_limit = 0;
+        }
+    }
+
+    /* Let the waiters check the new limit; those that don't fit requeue */
+    for (n = m->waiting; n && !latency_qos_full(m); n--) {
+        if (!qemu_co_enter_next(&m->queue, &m->lock)) {
+            break;
+        }
+    }
+    qemu_mutex_unlock(&m->lock);
+}
+
+static void latency_qos_group_update(LatencyQosGroup *g)
+{
+    LatencyQosMember *m;
+    int64_t missed_priority = -1;
+
+    QTAILQ_FOREACH(m, &g->members, next) {
+        if (latency_qos_close_window(m)) {
+            missed_priority = MAX(missed_priority, (int64_t)m->priority);
+        }
+    }
+
+    QTAILQ_FOREACH(m, &g->members, next) {
+        latency_qos_scale(m, m->priority < missed_priority);
+    }
+}
+
+void latency_qos_update(void)
+{
+    LatencyQosGroup *g;
+
+    QTAILQ_FOREACH(g, &latency_qos_groups, list) {
+        latency_qos_group_update(g);
+    }
+}
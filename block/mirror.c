@@ -73,15 +73,38 @@ typedef struct MirrorBlockJob {
     int target_cluster_size;
     int max_iov;
     bool initial_zeroing_ongoing;
+    MirrorCopyMode copy_mode;
+    QTAILQ_HEAD(, MirrorOp) ops_in_flight;
+    /* Named bitmap that records what is left to copy across job restarts */
+    BdrvDirtyBitmap *checkpoint_bitmap;
+    bool checkpoint_resume;
+    bool checkpoint_ready;
+    uint64_t checkpoint_interval_ns;
+    int64_t last_checkpoint_ns;
 } MirrorBlockJob;
 
+typedef struct MirrorBDSOpaque {
+    MirrorBlockJob *job;
+} MirrorBDSOpaque;
+
 typedef struct MirrorOp {
     MirrorBlockJob *s;
     QEMUIOVector qiov;
     int64_t offset;
     uint64_t bytes;
+
+    /* Active writes that overlap with this operation */
+    CoQueue waiting_requests;
+
+    QTAILQ_ENTRY(MirrorOp) next;
 } MirrorOp;
 
+typedef enum MirrorMethod {
+    MIRROR_METHOD_COPY,
+    MIRROR_METHOD_ZERO,
+    MIRROR_METHOD_DISCARD,
+} MirrorMethod;
+
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
                                             int error)
 {
@@ -124,6 +147,11 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
             s->common.offset += op->bytes;
         }
     }
+
+    QTAILQ_REMOVE(&s->ops_in_flight, op, next);
+    while (qemu_co_enter_next(&op->waiting_requests, NULL)) {
+        /* Requests that still conflict wait on another operation */
+    }
     qemu_iovec_destroy(&op->qiov);
     g_free(op);
 
@@ -226,6 +254,48 @@ static inline void mirror_wait_for_io(MirrorBlockJob *s)
     s->waiting_for_io = false;
 }
 
+/* Wait until no operation other than @self overlaps the chunks covering
+ * [@offset, @offset + @bytes).  Operations are granularity-aligned, so
+ * comparing chunk numbers is enough. */
+static void coroutine_fn mirror_wait_on_conflicts(MirrorOp *self,
+                                                  MirrorBlockJob *s,
+                                                  int64_t offset,
+                                                  uint64_t bytes)
+{
+    int64_t start_chunk = offset / s->granularity;
+    int64_t end_chunk = DIV_ROUND_UP(offset + bytes, s->granularity);
+    MirrorOp *op;
+
+retry:
+    QTAILQ_FOREACH(op, &s->ops_in_flight, next) {
+        int64_t op_start_chunk = op->offset / s->granularity;
+        int64_t op_end_chunk = DIV_ROUND_UP(op->offset + op->bytes,
+                                            s->granularity);
+
+        if (op == self ||
+            op_end_chunk <= start_chunk || op_start_chunk >= end_chunk) {
+            continue;
+        }
+        trace_mirror_yield_on_conflict(s, offset, bytes, op->offset,
+                                       op->bytes);
+        qemu_co_queue_wait(&op->waiting_requests, NULL);
+        goto retry;
+    }
+}
+
+static MirrorOp *mirror_op_new(MirrorBlockJob *s, int64_t offset,
+                               uint64_t bytes)
+{
+    MirrorOp *op = g_new0(MirrorOp, 1);
+
+    op->s = s;
+    op->offset = offset;
+    op->bytes = bytes;
+    qemu_co_queue_init(&op->waiting_requests);
+    QTAILQ_INSERT_TAIL(&s->ops_in_flight, op, next);
+    return op;
+}
+
 /* Submit async read while handling COW.
  * Returns: The number of bytes copied after and including offset,
  *          excluding any bytes copied prior to offset due to alignment.
@@ -268,10 +338,7 @@ static uint64_t mirror_do_read(MirrorBlockJob *s, int64_t offset,
     }
 
     /* Allocate a MirrorOp that is used as an AIO callback.  */
-    op = g_new(MirrorOp, 1);
-    op->s = s;
-    op->offset = offset;
-    op->bytes = bytes;
+    op = mirror_op_new(s, offset, bytes);
 
     /* Now make a QEMUIOVector taking enough granularity-sized chunks
      * from s->buf_free.
@@ -304,10 +371,7 @@ static void mirror_do_zero_or_discard(MirrorBlockJob *s,
 
     /* Allocate a MirrorOp that is used as an AIO callback. The qiov is zeroed
      * so the freeing in mirror_iteration_done is nop. */
-    op = g_new0(MirrorOp, 1);
-    op->s = s;
-    op->offset = offset;
-    op->bytes = bytes;
+    op = mirror_op_new(s, offset, bytes);
 
     s->in_flight++;
     s->bytes_in_flight += bytes;
@@ -324,7 +388,8 @@ static void mirror_do_zero_or_discard(MirrorBlockJob *s,
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->source;
-    int64_t offset, first_chunk;
+    MirrorOp *pseudo_op;
+    int64_t offset;
     uint64_t delay_ns = 0;
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
@@ -341,14 +406,11 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     }
     bdrv_dirty_bitmap_unlock(s->dirty_bitmap);
 
-    first_chunk = offset / s->granularity;
-    while (test_bit(first_chunk, s->in_flight_bitmap)) {
-        trace_mirror_yield_in_flight(s, offset, s->in_flight);
-        mirror_wait_for_io(s);
-    }
-
     block_job_pause_point(&s->common);
 
+    /* Active writes may have claimed the chunk while we were paused */
+    mirror_wait_on_conflicts(NULL, s, offset, 1);
+
     /* Find the number of consective dirty chunks following the first dirty
      * one, and wait for in flight requests in them. */
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
@@ -383,15 +445,16 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     bdrv_dirty_bitmap_unlock(s->dirty_bitmap);
 
     bitmap_set(s->in_flight_bitmap, offset / s->granularity, nb_chunks);
+
+    /* Active writes to the claimed chunks must wait until the real
+     * operations are issued, because the loop below can yield. */
+    pseudo_op = mirror_op_new(s, offset, nb_chunks * s->granularity);
+
     while (nb_chunks > 0 && offset < s->bdev_length) {
         int ret;
         int64_t io_bytes;
         int64_t io_bytes_acct;
-        enum MirrorMethod {
-            MIRROR_METHOD_COPY,
-            MIRROR_METHOD_ZERO,
-            MIRROR_METHOD_DISCARD
-        } mirror_method = MIRROR_METHOD_COPY;
+        MirrorMethod mirror_method = MIRROR_METHOD_COPY;
 
         assert(!(offset % s->granularity));
         ret = bdrv_block_status_above(source, NULL, offset,
@@ -425,7 +488,8 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         }
 
         if (s->ret < 0) {
-            return 0;
+            delay_ns = 0;
+            break;
         }
 
         io_bytes = mirror_clip_bytes(s, offset, io_bytes);
@@ -453,6 +517,11 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             delay_ns = ratelimit_calculate_delay(&s->limit, io_bytes_acct);
         }
     }
+
+    QTAILQ_REMOVE(&s->ops_in_flight, pseudo_op, next);
+    qemu_co_queue_restart_all(&pseudo_op->waiting_requests);
+    g_free(pseudo_op);
+
     return delay_ns;
 }
 
@@ -473,6 +542,51 @@ static void mirror_free_init(MirrorBlockJob *s)
     }
 }
 
+/* Mark everything that is dirty in @src dirty in @dest too.  The bitmaps
+ * belong to the same node, so they share a lock, but may have different
+ * granularities.  Called within bdrv_dirty_bitmap_lock..unlock. */
+static void mirror_copy_dirty_locked(BdrvDirtyBitmap *dest,
+                                     BdrvDirtyBitmap *src)
+{
+    BdrvDirtyBitmapIter *iter = bdrv_dirty_iter_new(src);
+    int64_t size = bdrv_dirty_bitmap_size(src);
+    int64_t offset, end;
+
+    while ((offset = bdrv_dirty_iter_next(iter)) >= 0) {
+        end = bdrv_dirty_bitmap_next_zero(src, offset);
+        if (end < 0) {
+            end = size;
+        }
+        bdrv_set_dirty_bitmap_locked(dest, offset, end - offset);
+        if (end >= size) {
+            break;
+        }
+        bdrv_set_dirty_iter(iter, end);
+    }
+    bdrv_dirty_iter_free(iter);
+}
+
+/* Reset the checkpoint bitmap to what is left to copy: the dirty bitmap
+ * plus every range that an operation has claimed but not finished.  The
+ * checkpoint bitmap stays enabled, so guest writes after this are recorded
+ * in it too and it never claims that the target has data it lacks. */
+static void mirror_checkpoint(MirrorBlockJob *s)
+{
+    BdrvDirtyBitmap *bitmap = s->checkpoint_bitmap;
+    MirrorOp *op;
+
+    bdrv_dirty_bitmap_lock(bitmap);
+    bdrv_reset_dirty_bitmap_locked(bitmap, 0, bdrv_dirty_bitmap_size(bitmap));
+    mirror_copy_dirty_locked(bitmap, s->dirty_bitmap);
+    QTAILQ_FOREACH(op, &s->ops_in_flight, next) {
+        bdrv_set_dirty_bitmap_locked(bitmap, op->offset, op->bytes);
+    }
+    bdrv_dirty_bitmap_unlock(bitmap);
+
+    s->last_checkpoint_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    trace_mirror_checkpoint(s, bdrv_get_dirty_count(bitmap));
+}
+
 /* This is also used for the .pause callback. There is no matching
  * mirror_resume() because mirror_run() will begin iterating again
  * when the job is resumed.
@@ -496,9 +610,16 @@ static void mirror_exit(BlockJob *job, void *opaque)
     BlockDriverState *src = s->source;
     BlockDriverState *target_bs = blk_bs(s->target);
     BlockDriverState *mirror_top_bs = s->mirror_top_bs;
+    MirrorBDSOpaque *bs_opaque = mirror_top_bs->opaque;
     Error *local_err = NULL;
 
+    /* The source is still drained, stop copying guest writes */
+    bs_opaque->job = NULL;
+
     bdrv_release_dirty_bitmap(src, s->dirty_bitmap);
+    if (s->checkpoint_bitmap) {
+        bdrv_dirty_bitmap_set_qmp_locked(s->checkpoint_bitmap, false);
+    }
 
     /* Make sure that the source BDS doesn't go away before we called
      * block_job_completed(). */
@@ -770,12 +891,21 @@ static void coroutine_fn mirror_run(void *opaque)
     mirror_free_init(s);
 
     s->last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-    if (!s->is_none_mode) {
+    if (s->checkpoint_resume) {
+        /* The target already has everything the checkpoint calls clean */
+        bdrv_dirty_bitmap_lock(s->dirty_bitmap);
+        mirror_copy_dirty_locked(s->dirty_bitmap, s->checkpoint_bitmap);
+        bdrv_dirty_bitmap_unlock(s->dirty_bitmap);
+    } else if (!s->is_none_mode) {
         ret = mirror_dirty_init(s);
         if (ret < 0 || block_job_is_cancelled(&s->common)) {
             goto immediate_exit;
         }
     }
+    if (s->checkpoint_bitmap) {
+        s->checkpoint_ready = true;
+        mirror_checkpoint(s);
+    }
 
     assert(!s->dbi);
     s->dbi = bdrv_dirty_iter_new(s->dirty_bitmap);
@@ -791,6 +921,12 @@ static void coroutine_fn mirror_run(void *opaque)
 
         block_job_pause_point(&s->common);
 
+        if (s->checkpoint_bitmap &&
+            qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_checkpoint_ns >=
+            s->checkpoint_interval_ns) {
+            mirror_checkpoint(s);
+        }
+
         cnt = bdrv_get_dirty_count(s->dirty_bitmap);
         /* s->common.offset contains the number of bytes already processed so
          * far, cnt is the number of dirty bytes remaining and
@@ -891,10 +1027,6 @@ immediate_exit:
     }
 
     assert(s->in_flight == 0);
-    qemu_vfree(s->buf);
-    g_free(s->cow_bitmap);
-    g_free(s->in_flight_bitmap);
-    bdrv_dirty_iter_free(s->dbi);
 
     data = g_malloc(sizeof(*data));
     data->ret = ret;
@@ -902,6 +1034,18 @@ immediate_exit:
     if (need_drain) {
         bdrv_drained_begin(bs);
     }
+
+    /* Draining the source also drains mirror_top_bs, so there are no active
+     * writes left that could use the bitmaps. */
+    assert(QTAILQ_EMPTY(&s->ops_in_flight));
+    if (s->checkpoint_ready) {
+        mirror_checkpoint(s);
+    }
+    qemu_vfree(s->buf);
+    g_free(s->cow_bitmap);
+    g_free(s->in_flight_bitmap);
+    bdrv_dirty_iter_free(s->dbi);
+
     block_job_defer_to_main_loop(&s->common, mirror_exit, data);
 }
 
@@ -916,6 +1060,17 @@ static void mirror_set_speed(BlockJob *job, int64_t speed, Error **errp)
     ratelimit_set_speed(&s->limit, speed, SLICE_TIME);
 }
 
+static void mirror_set_copy_mode(BlockJob *job, MirrorCopyMode mode,
+                                 Error **errp)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    /* The dirty bitmap keeps tracking all writes in either mode, so guest
+     * writes that were not copied synchronously are still picked up by
+     * mirror_iteration() after a switch. */
+    s->copy_mode = mode;
+}
+
 static void mirror_complete(BlockJob *job, Error **errp)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
@@ -1001,6 +1156,7 @@ static const BlockJobDriver mirror_job_driver = {
     .instance_size          = sizeof(MirrorBlockJob),
     .job_type               = BLOCK_JOB_TYPE_MIRROR,
     .set_speed              = mirror_set_speed,
+    .set_copy_mode          = mirror_set_copy_mode,
     .start                  = mirror_run,
     .complete               = mirror_complete,
     .pause                  = mirror_pause,
@@ -1025,10 +1181,138 @@ static int coroutine_fn bdrv_mirror_top_preadv(BlockDriverState *bs,
     return bdrv_co_preadv(bs->backing, offset, bytes, qiov, flags);
 }
 
+static bool mirror_copy_to_target(MirrorBlockJob *s)
+{
+    /* Until mirror_run() has set up the dirty bitmap iterator the background
+     * copy covers everything anyway. */
+    return s && s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING && s->dbi &&
+           s->ret >= 0 && !block_job_is_cancelled(&s->common);
+}
+
+static MirrorOp *coroutine_fn mirror_active_write_prepare(MirrorBlockJob *s,
+                                                          uint64_t offset,
+                                                          uint64_t bytes)
+{
+    int64_t start_chunk = offset / s->granularity;
+    int64_t end_chunk = DIV_ROUND_UP(offset + bytes, s->granularity);
+
+    mirror_wait_on_conflicts(NULL, s, offset, bytes);
+
+    /* Keep mirror_iteration() away from the range until the target is
+     * written as well */
+    bitmap_set(s->in_flight_bitmap, start_chunk, end_chunk - start_chunk);
+    return mirror_op_new(s, offset, bytes);
+}
+
+static void coroutine_fn mirror_active_write_settle(MirrorOp *op)
+{
+    MirrorBlockJob *s = op->s;
+    int64_t start_chunk = op->offset / s->granularity;
+    int64_t end_chunk = DIV_ROUND_UP(op->offset + op->bytes, s->granularity);
+
+    bitmap_clear(s->in_flight_bitmap, start_chunk, end_chunk - start_chunk);
+    QTAILQ_REMOVE(&s->ops_in_flight, op, next);
+    qemu_co_queue_restart_all(&op->waiting_requests);
+    g_free(op);
+}
+
+/* Copy a guest write that has just reached the source to the target.  The
+ * source write has dirtied the range; the chunks it covers completely are
+ * clean again once the target has the data too, partial chunks at either
+ * end are left to mirror_iteration(). */
+static void coroutine_fn mirror_do_sync_target_write(MirrorBlockJob *s,
+                                                     MirrorMethod method,
+                                                     uint64_t offset,
+                                                     uint64_t bytes,
+                                                     QEMUIOVector *qiov,
+                                                     int flags)
+{
+    int64_t dirty_offset = QEMU_ALIGN_UP(offset, s->granularity);
+    int64_t dirty_end = QEMU_ALIGN_DOWN(offset + bytes, s->granularity);
+    int ret;
+
+    /* Without a backing file the target cannot do COW of partial clusters
+     * on its own, mirror_cow_align() must take care of those first. */
+    if (s->cow_bitmap &&
+        (!test_bit(offset / s->granularity, s->cow_bitmap) ||
+         !test_bit((offset + bytes - 1) / s->granularity, s->cow_bitmap))) {
+        return;
+    }
+
+    if (dirty_end > dirty_offset) {
+        bdrv_reset_dirty_bitmap(s->dirty_bitmap, dirty_offset,
+                                dirty_end - dirty_offset);
+    }
+
+    switch (method) {
+    case MIRROR_METHOD_COPY:
+        ret = blk_co_pwritev(s->target, offset, bytes, qiov, 0);
+        break;
+    case MIRROR_METHOD_ZERO:
+        ret = blk_co_pwrite_zeroes(s->target, offset, bytes,
+                                   s->unmap ? flags & BDRV_REQ_MAY_UNMAP : 0);
+        break;
+    case MIRROR_METHOD_DISCARD:
+        ret = blk_co_pdiscard(s->target, offset, bytes);
+        break;
+    default:
+        abort();
+    }
+    trace_mirror_sync_write(s, offset, bytes, method, ret);
+
+    if (ret < 0) {
+        BlockErrorAction action;
+
+        bdrv_set_dirty_bitmap(s->dirty_bitmap, offset, bytes);
+        action = mirror_error_action(s, false, -ret);
+        if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
+            s->ret = ret;
+        }
+    }
+}
+
+static int coroutine_fn bdrv_mirror_top_do_write(BlockDriverState *bs,
+    MirrorMethod method, uint64_t offset, uint64_t bytes, QEMUIOVector *qiov,
+    int flags)
+{
+    MirrorBDSOpaque *opaque = bs->opaque;
+    MirrorBlockJob *s = opaque->job;
+    MirrorOp *op = NULL;
+    int ret;
+
+    if (mirror_copy_to_target(s)) {
+        op = mirror_active_write_prepare(s, offset, bytes);
+    }
+
+    switch (method) {
+    case MIRROR_METHOD_COPY:
+        ret = bdrv_co_pwritev(bs->backing, offset, bytes, qiov, flags);
+        break;
+    case MIRROR_METHOD_ZERO:
+        ret = bdrv_co_pwrite_zeroes(bs->backing, offset, bytes, flags);
+        break;
+    case MIRROR_METHOD_DISCARD:
+        ret = bdrv_co_pdiscard(bs->backing->bs, offset, bytes);
+        break;
+    default:
+        abort();
+    }
+
+    if (op) {
+        /* The job may have failed or been cancelled while we waited */
+        if (ret >= 0 && mirror_copy_to_target(s)) {
+            mirror_do_sync_target_write(s, method, offset, bytes, qiov, flags);
+        }
+        mirror_active_write_settle(op);
+    }
+    return ret;
+}
+
 static int coroutine_fn bdrv_mirror_top_pwritev(BlockDriverState *bs,
     uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
-    return bdrv_co_pwritev(bs->backing, offset, bytes, qiov, flags);
+    return bdrv_mirror_top_do_write(bs, MIRROR_METHOD_COPY, offset, bytes,
+                                    qiov, flags);
 }
 
 static int coroutine_fn bdrv_mirror_top_flush(BlockDriverState *bs)
@@ -1043,13 +1327,15 @@ static int coroutine_fn bdrv_mirror_top_flush(BlockDriverState *bs)
 static int coroutine_fn bdrv_mirror_top_pwrite_zeroes(BlockDriverState *bs,
     int64_t offset, int bytes, BdrvRequestFlags flags)
 {
-    return bdrv_co_pwrite_zeroes(bs->backing, offset, bytes, flags);
+    return bdrv_mirror_top_do_write(bs, MIRROR_METHOD_ZERO, offset, bytes,
+                                    NULL, flags);
 }
 
 static int coroutine_fn bdrv_mirror_top_pdiscard(BlockDriverState *bs,
     int64_t offset, int bytes)
 {
-    return bdrv_co_pdiscard(bs->backing->bs, offset, bytes);
+    return bdrv_mirror_top_do_write(bs, MIRROR_METHOD_DISCARD, offset, bytes,
+                                    NULL, 0);
 }
 
 static void bdrv_mirror_top_refresh_filename(BlockDriverState *bs, QDict *opts)
@@ -1087,6 +1373,7 @@ static void bdrv_mirror_top_child_perm(BlockDriverState *bs, BdrvChild *c,
  * from its backing file and that allows writes on the backing file chain. */
 static BlockDriver bdrv_mirror_top = {
     .format_name                = "mirror_top",
+    .instance_size              = sizeof(MirrorBDSOpaque),
     .bdrv_co_preadv             = bdrv_mirror_top_preadv,
     .bdrv_co_pwritev            = bdrv_mirror_top_pwritev,
     .bdrv_co_pwrite_zeroes      = bdrv_mirror_top_pwrite_zeroes,
@@ -1098,6 +1385,32 @@ static BlockDriver bdrv_mirror_top = {
     .bdrv_child_perm            = bdrv_mirror_top_child_perm,
 };
 
+/* A bitmap to resume from must have seen every write since the checkpoint
+ * that produced it, and must stay that way while the job updates it. */
+static bool mirror_checkpoint_usable(BdrvDirtyBitmap *bitmap, Error **errp)
+{
+    const char *name = bdrv_dirty_bitmap_name(bitmap);
+
+    if (bdrv_dirty_bitmap_frozen(bitmap)) {
+        error_setg(errp, "Bitmap '%s' is currently frozen and cannot be used "
+                   "for a mirror checkpoint", name);
+        return false;
+    } else if (bdrv_dirty_bitmap_qmp_locked(bitmap)) {
+        error_setg(errp, "Bitmap '%s' is currently locked and cannot be used "
+                   "for a mirror checkpoint", name);
+        return false;
+    } else if (!bdrv_dirty_bitmap_enabled(bitmap)) {
+        error_setg(errp, "Bitmap '%s' is disabled and may have missed writes",
+                   name);
+        return false;
+    } else if (bdrv_dirty_bitmap_readonly(bitmap)) {
+        error_setg(errp, "Bitmap '%s' is readonly and cannot be modified",
+                   name);
+        return false;
+    }
+    return true;
+}
+
 static void mirror_start_job(const char *job_id, BlockDriverState *bs,
                              int creation_flags, BlockDriverState *target,
                              const char *replaces, int64_t speed,
@@ -1111,11 +1424,16 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
                              const BlockJobDriver *driver,
                              bool is_none_mode, BlockDriverState *base,
                              bool auto_complete, const char *filter_node_name,
-                             bool is_mirror,
+                             bool is_mirror, MirrorCopyMode copy_mode,
+                             const char *checkpoint_name,
+                             int64_t checkpoint_interval, bool resume,
                              Error **errp)
 {
     MirrorBlockJob *s;
+    MirrorBDSOpaque *bs_opaque;
     BlockDriverState *mirror_top_bs;
+    BdrvDirtyBitmap *checkpoint = NULL;
+    bool checkpoint_created = false;
     bool target_graph_mod;
     bool target_is_backing;
     Error *local_err = NULL;
@@ -1136,6 +1454,13 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
 
+    if (checkpoint_name) {
+        checkpoint = bdrv_find_dirty_bitmap(bs, checkpoint_name);
+        if (checkpoint && !mirror_checkpoint_usable(checkpoint, errp)) {
+            return;
+        }
+    }
+
     /* In the case of active commit, add dummy driver to provide consistent
      * reads on the top, while disabling it in the intermediate nodes, and make
      * the backing chain writable. */
@@ -1217,6 +1542,8 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->copy_mode = copy_mode;
+    QTAILQ_INIT(&s->ops_in_flight);
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -1226,6 +1553,32 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
         goto fail;
     }
 
+    if (checkpoint && resume) {
+        s->checkpoint_resume = true;
+    } else if (checkpoint_name) {
+        if (!checkpoint) {
+            checkpoint = bdrv_create_dirty_bitmap(bs, granularity,
+                                                  checkpoint_name, errp);
+            if (!checkpoint) {
+                goto fail;
+            }
+            checkpoint_created = true;
+            bdrv_dirty_bitmap_set_persistance(checkpoint,
+                bdrv_can_store_new_dirty_bitmap(bs, checkpoint_name,
+                                                granularity, NULL));
+        }
+        /* Nothing has been copied yet, so the checkpoint starts out dirty
+         * everywhere until mirror_dirty_init() has had its say */
+        bdrv_set_dirty_bitmap(checkpoint, 0,
+                              bdrv_dirty_bitmap_size(checkpoint));
+    }
+    if (checkpoint) {
+        bdrv_dirty_bitmap_set_qmp_locked(checkpoint, true);
+        s->checkpoint_bitmap = checkpoint;
+        s->checkpoint_interval_ns = checkpoint_interval *
+                                    NANOSECONDS_PER_SECOND;
+    }
+
     /* Required permissions are already taken with blk_new() */
     block_job_add_bdrv(&s->common, "target", target, 0, BLK_PERM_ALL,
                        &error_abort);
@@ -1248,6 +1601,9 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
         }
     }
 
+    bs_opaque = mirror_top_bs->opaque;
+    bs_opaque->job = s;
+
     trace_mirror_start(bs, s, opaque);
     block_job_start(&s->common);
     return;
@@ -1258,6 +1614,12 @@ fail:
          * changes below */
         bdrv_ref(mirror_top_bs);
 
+        if (s->checkpoint_bitmap) {
+            bdrv_dirty_bitmap_set_qmp_locked(s->checkpoint_bitmap, false);
+            if (checkpoint_created) {
+                bdrv_release_dirty_bitmap(bs, s->checkpoint_bitmap);
+            }
+        }
         g_free(s->replaces);
         blk_unref(s->target);
         block_job_early_fail(&s->common);
@@ -1276,7 +1638,9 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap, const char *filter_node_name, Error **errp)
+                  bool unmap, const char *filter_node_name,
+                  MirrorCopyMode copy_mode, const char *checkpoint,
+                  int64_t checkpoint_interval, bool resume, Error **errp)
 {
     bool is_none_mode;
     BlockDriverState *base;
@@ -1285,13 +1649,19 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
         error_setg(errp, "Sync mode 'incremental' not supported");
         return;
     }
+    if (mode == MIRROR_SYNC_MODE_NONE && checkpoint) {
+        error_setg(errp, "Sync mode 'none' does not support a checkpoint "
+                   "bitmap");
+        return;
+    }
     is_none_mode = mode == MIRROR_SYNC_MODE_NONE;
     base = mode == MIRROR_SYNC_MODE_TOP ? backing_bs(bs) : NULL;
     mirror_start_job(job_id, bs, BLOCK_JOB_DEFAULT, target, replaces,
                      speed, granularity, buf_size, backing_mode,
                      on_source_error, on_target_error, unmap, NULL, NULL,
                      &mirror_job_driver, is_none_mode, base, false,
-                     filter_node_name, true, errp);
+                     filter_node_name, true, copy_mode, checkpoint,
+                     checkpoint_interval, resume, errp);
 }
 
 void commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -1314,7 +1684,8 @@ void commit_active_start(const char *job_id, BlockDriverState *bs,
                      MIRROR_LEAVE_BACKING_CHAIN,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, false, base, auto_complete,
-                     filter_node_name, false, &local_err);
+                     filter_node_name, false, MIRROR_COPY_MODE_BACKGROUND,
+                     NULL, 0, false, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         goto error_restore_flags;
@@ -34,6 +34,9 @@
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
 
+/* Writes at least this large are checked for being all zeroes */
+#define NBD_SPARSE_WRITE_MIN (64 * 1024)
+
 static void nbd_recv_coroutines_wake_all(NBDClientSession *s)
 {
     int i;
@@ -824,6 +827,15 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
+    /* Keep zeroes off the wire.  Like any write, this must leave the range
+     * allocated.  Writes that are only partly zero go out whole, splitting
+     * them would turn one request into several round trips. */
+    if (client->info.flags & NBD_FLAG_SEND_WRITE_ZEROES &&
+        bytes >= NBD_SPARSE_WRITE_MIN && qemu_iovec_is_zero(qiov)) {
+        request.type = NBD_CMD_WRITE_ZEROES;
+        request.flags |= NBD_CMD_FLAG_NO_HOLE;
+        return nbd_co_request(bs, &request, NULL);
+    }
     return nbd_co_request(bs, &request, qiov);
 }
 
@@ -412,16 +412,21 @@ static uint64List *uint64_list(uint64_t *list, int size)
     return out_list;
 }
 
-static void bdrv_latency_histogram_stats(BlockLatencyHistogram *hist,
+static void bdrv_latency_histogram_stats(BlockAcctStats *stats,
+                                         enum BlockAcctType type,
                                          bool *not_null,
                                          BlockLatencyHistogramInfo **info)
 {
-    *not_null = hist->bins != NULL;
+    BlockLatencyHistogram hist;
+
+    *not_null = block_latency_histogram_get(stats, type, &hist);
     if (*not_null) {
         *info = g_new0(BlockLatencyHistogramInfo, 1);
 
-        (*info)->boundaries = uint64_list(hist->boundaries, hist->nbins - 1);
-        (*info)->bins = uint64_list(hist->bins, hist->nbins);
+        (*info)->boundaries = uint64_list(hist.boundaries, hist.nbins - 1);
+        (*info)->bins = uint64_list(hist.bins, hist.nbins);
+        g_free(hist.boundaries);
+        g_free(hist.bins);
     }
 }
 
@@ -429,29 +434,32 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
     BlockAcctTimedStats *ts = NULL;
+    BlockAcctCounters c;
+
+    block_acct_get_counters(stats, &c);
 
-    ds->rd_bytes = stats->nr_bytes[BLOCK_ACCT_READ];
-    ds->wr_bytes = stats->nr_bytes[BLOCK_ACCT_WRITE];
-    ds->rd_operations = stats->nr_ops[BLOCK_ACCT_READ];
-    ds->wr_operations = stats->nr_ops[BLOCK_ACCT_WRITE];
+    ds->rd_bytes = c.nr_bytes[BLOCK_ACCT_READ];
+    ds->wr_bytes = c.nr_bytes[BLOCK_ACCT_WRITE];
+    ds->rd_operations = c.nr_ops[BLOCK_ACCT_READ];
+    ds->wr_operations = c.nr_ops[BLOCK_ACCT_WRITE];
 
-    ds->failed_rd_operations = stats->failed_ops[BLOCK_ACCT_READ];
-    ds->failed_wr_operations = stats->failed_ops[BLOCK_ACCT_WRITE];
-    ds->failed_flush_operations = stats->failed_ops[BLOCK_ACCT_FLUSH];
+    ds->failed_rd_operations = c.failed_ops[BLOCK_ACCT_READ];
+    ds->failed_wr_operations = c.failed_ops[BLOCK_ACCT_WRITE];
+    ds->failed_flush_operations = c.failed_ops[BLOCK_ACCT_FLUSH];
 
-    ds->invalid_rd_operations = stats->invalid_ops[BLOCK_ACCT_READ];
-    ds->invalid_wr_operations = stats->invalid_ops[BLOCK_ACCT_WRITE];
+    ds->invalid_rd_operations = c.invalid_ops[BLOCK_ACCT_READ];
+    ds->invalid_wr_operations = c.invalid_ops[BLOCK_ACCT_WRITE];
     ds->invalid_flush_operations =
-        stats->invalid_ops[BLOCK_ACCT_FLUSH];
+        c.invalid_ops[BLOCK_ACCT_FLUSH];
 
-    ds->rd_merged = stats->merged[BLOCK_ACCT_READ];
-    ds->wr_merged = stats->merged[BLOCK_ACCT_WRITE];
-    ds->flush_operations = stats->nr_ops[BLOCK_ACCT_FLUSH];
-    ds->wr_total_time_ns = stats->total_time_ns[BLOCK_ACCT_WRITE];
-    ds->rd_total_time_ns = stats->total_time_ns[BLOCK_ACCT_READ];
-    ds->flush_total_time_ns = stats->total_time_ns[BLOCK_ACCT_FLUSH];
+    ds->rd_merged = c.merged[BLOCK_ACCT_READ];
+    ds->wr_merged = c.merged[BLOCK_ACCT_WRITE];
+    ds->flush_operations = c.nr_ops[BLOCK_ACCT_FLUSH];
+    ds->wr_total_time_ns = c.total_time_ns[BLOCK_ACCT_WRITE];
+    ds->rd_total_time_ns = c.total_time_ns[BLOCK_ACCT_READ];
+    ds->flush_total_time_ns = c.total_time_ns[BLOCK_ACCT_FLUSH];
 
-    ds->has_idle_time_ns = stats->last_access_time_ns > 0;
+    ds->has_idle_time_ns = c.last_access_time_ns > 0;
     if (ds->has_idle_time_ns) {
         ds->idle_time_ns = block_acct_idle_time_ns(stats);
     }
@@ -491,13 +499,13 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
             block_acct_queue_depth(ts, BLOCK_ACCT_WRITE);
     }
 
-    bdrv_latency_histogram_stats(&stats->latency_histogram[BLOCK_ACCT_READ],
+    bdrv_latency_histogram_stats(stats, BLOCK_ACCT_READ,
                                  &ds->has_x_rd_latency_histogram,
                                  &ds->x_rd_latency_histogram);
-    bdrv_latency_histogram_stats(&stats->latency_histogram[BLOCK_ACCT_WRITE],
+    bdrv_latency_histogram_stats(stats, BLOCK_ACCT_WRITE,
                                  &ds->has_x_wr_latency_histogram,
                                  &ds->x_wr_latency_histogram);
-    bdrv_latency_histogram_stats(&stats->latency_histogram[BLOCK_ACCT_FLUSH],
+    bdrv_latency_histogram_stats(stats, BLOCK_ACCT_FLUSH,
                                  &ds->has_x_flush_latency_histogram,
                                  &ds->x_flush_latency_histogram);
 }
@@ -614,6 +622,316 @@ BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
     return head;
 }
 
+/* query-blockstats-delta cursors kept at the same time */
+#define BLOCK_STATS_CURSORS 16
+
+typedef struct BlockStatsSnapshot {
+    int64_t pass;
+    uint64_t counters[BLOCK_STATS_COUNTER__MAX];
+} BlockStatsSnapshot;
+
+/*
+ * The counters of every device as last reported with a cursor, keyed by
+ * 'd' + device name or 'n' + root node name.
+ */
+typedef struct BlockStatsCursor {
+    int64_t id;
+    GHashTable *snapshots;
+} BlockStatsCursor;
+
+static BlockStatsCursor block_stats_cursors[BLOCK_STATS_CURSORS];
+static int64_t block_stats_next_cursor = 1;
+
+static void bdrv_query_blk_counters(BlockBackend *blk, uint64_t *counters)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    BlockAcctCounters c;
+
+    block_acct_get_counters(blk_get_stats(blk), &c);
+
+    counters[BLOCK_STATS_COUNTER_RD_BYTES] = c.nr_bytes[BLOCK_ACCT_READ];
+    counters[BLOCK_STATS_COUNTER_WR_BYTES] = c.nr_bytes[BLOCK_ACCT_WRITE];
+    counters[BLOCK_STATS_COUNTER_RD_OPERATIONS] = c.nr_ops[BLOCK_ACCT_READ];
+    counters[BLOCK_STATS_COUNTER_WR_OPERATIONS] = c.nr_ops[BLOCK_ACCT_WRITE];
+    counters[BLOCK_STATS_COUNTER_FLUSH_OPERATIONS] =
+        c.nr_ops[BLOCK_ACCT_FLUSH];
+    counters[BLOCK_STATS_COUNTER_RD_TOTAL_TIME_NS] =
+        c.total_time_ns[BLOCK_ACCT_READ];
+    counters[BLOCK_STATS_COUNTER_WR_TOTAL_TIME_NS] =
+        c.total_time_ns[BLOCK_ACCT_WRITE];
+    counters[BLOCK_STATS_COUNTER_FLUSH_TOTAL_TIME_NS] =
+        c.total_time_ns[BLOCK_ACCT_FLUSH];
+    counters[BLOCK_STATS_COUNTER_RD_MERGED] = c.merged[BLOCK_ACCT_READ];
+    counters[BLOCK_STATS_COUNTER_WR_MERGED] = c.merged[BLOCK_ACCT_WRITE];
+    counters[BLOCK_STATS_COUNTER_FAILED_RD_OPERATIONS] =
+        c.failed_ops[BLOCK_ACCT_READ];
+    counters[BLOCK_STATS_COUNTER_FAILED_WR_OPERATIONS] =
+        c.failed_ops[BLOCK_ACCT_WRITE];
+    counters[BLOCK_STATS_COUNTER_FAILED_FLUSH_OPERATIONS] =
+        c.failed_ops[BLOCK_ACCT_FLUSH];
+    counters[BLOCK_STATS_COUNTER_INVALID_RD_OPERATIONS] =
+        c.invalid_ops[BLOCK_ACCT_READ];
+    counters[BLOCK_STATS_COUNTER_INVALID_WR_OPERATIONS] =
+        c.invalid_ops[BLOCK_ACCT_WRITE];
+    counters[BLOCK_STATS_COUNTER_INVALID_FLUSH_OPERATIONS] =
+        c.invalid_ops[BLOCK_ACCT_FLUSH];
+    counters[BLOCK_STATS_COUNTER_WR_HIGHEST_OFFSET] =
+        bs ? stat64_get(&bs->wr_highest_offset) : 0;
+}
+
+static void block_stats_delta_set(BlockStatsDelta *d, BlockStatsCounter c,
+                                  int64_t value)
+{
+    switch (c) {
+    case BLOCK_STATS_COUNTER_RD_BYTES:
+        d->has_rd_bytes = true;
+        d->rd_bytes = value;
+        break;
+    case BLOCK_STATS_COUNTER_WR_BYTES:
+        d->has_wr_bytes = true;
+        d->wr_bytes = value;
+        break;
+    case BLOCK_STATS_COUNTER_RD_OPERATIONS:
+        d->has_rd_operations = true;
+        d->rd_operations = value;
+        break;
+    case BLOCK_STATS_COUNTER_WR_OPERATIONS:
+        d->has_wr_operations = true;
+        d->wr_operations = value;
+        break;
+    case BLOCK_STATS_COUNTER_FLUSH_OPERATIONS:
+        d->has_flush_operations = true;
+        d->flush_operations = value;
+        break;
+    case BLOCK_STATS_COUNTER_RD_TOTAL_TIME_NS:
+        d->has_rd_total_time_ns = true;
+        d->rd_total_time_ns = value;
+        break;
+    case BLOCK_STATS_COUNTER_WR_TOTAL_TIME_NS:
+        d->has_wr_total_time_ns = true;
+        d->wr_total_time_ns = value;
+        break;
+    case BLOCK_STATS_COUNTER_FLUSH_TOTAL_TIME_NS:
+        d->has_flush_total_time_ns = true;
+        d->flush_total_time_ns = value;
+        break;
+    case BLOCK_STATS_COUNTER_RD_MERGED:
+        d->has_rd_merged = true;
+        d->rd_merged = value;
+        break;
+    case BLOCK_STATS_COUNTER_WR_MERGED:
+        d->has_wr_merged = true;
+        d->wr_merged = value;
+        break;
+    case BLOCK_STATS_COUNTER_FAILED_RD_OPERATIONS:
+        d->has_failed_rd_operations = true;
+        d->failed_rd_operations = value;
+        break;
+    case BLOCK_STATS_COUNTER_FAILED_WR_OPERATIONS:
+        d->has_failed_wr_operations = true;
+        d->failed_wr_operations = value;
+        break;
+    case BLOCK_STATS_COUNTER_FAILED_FLUSH_OPERATIONS:
+        d->has_failed_flush_operations = true;
+        d->failed_flush_operations = value;
+        break;
+    case BLOCK_STATS_COUNTER_INVALID_RD_OPERATIONS:
+        d->has_invalid_rd_operations = true;
+        d->invalid_rd_operations = value;
+        break;
+    case BLOCK_STATS_COUNTER_INVALID_WR_OPERATIONS:
+        d->has_invalid_wr_operations = true;
+        d->invalid_wr_operations = value;
+        break;
+    case BLOCK_STATS_COUNTER_INVALID_FLUSH_OPERATIONS:
+        d->has_invalid_flush_operations = true;
+        d->invalid_flush_operations = value;
+        break;
+    case BLOCK_STATS_COUNTER_WR_HIGHEST_OFFSET:
+        d->has_wr_highest_offset = true;
+        d->wr_highest_offset = value;
+        break;
+    default:
+        abort();
+    }
+}
+
+typedef struct BlockStatsDeltaState {
+    int64_t pass;
+    BlockStatsDeltaFormat format;
+    BlockStatsDeltaList **p_next;
+    GByteArray *packed;
+} BlockStatsDeltaState;
+
+/*
+ * Report the device @key with the counters in @mask, or as removed if
+ * @counters is NULL.
+ */
+static void block_stats_delta_add(BlockStatsDeltaState *s, const char *key,
+                                  uint32_t mask, const uint64_t *counters)
+{
+    int i;
+
+    if (s->format == BLOCK_STATS_DELTA_FORMAT_PACKED) {
+        uint8_t hdr[2] = { key[0], counters ? 0 : 1 };
+        uint16_t len = cpu_to_le16(strlen(key + 1));
+        uint32_t le_mask = cpu_to_le32(mask);
+
+        g_byte_array_append(s->packed, hdr, sizeof(hdr));
+        g_byte_array_append(s->packed, (uint8_t *)&len, sizeof(len));
+        g_byte_array_append(s->packed, (uint8_t *)key + 1, strlen(key + 1));
+        g_byte_array_append(s->packed, (uint8_t *)&le_mask, sizeof(le_mask));
+        for (i = 0; i < BLOCK_STATS_COUNTER__MAX; i++) {
+            if (mask & (1u << i)) {
+                uint64_t val = cpu_to_le64(counters[i]);
+                g_byte_array_append(s->packed, (uint8_t *)&val, sizeof(val));
+            }
+        }
+    } else {
+        BlockStatsDeltaList *entry = g_new0(BlockStatsDeltaList, 1);
+        BlockStatsDelta *d = g_new0(BlockStatsDelta, 1);
+
+        if (key[0] == 'd') {
+            d->has_device = true;
+            d->device = g_strdup(key + 1);
+        } else {
+            d->has_node_name = true;
+            d->node_name = g_strdup(key + 1);
+        }
+        d->has_removed = !counters;
+        d->removed = !counters;
+        for (i = 0; i < BLOCK_STATS_COUNTER__MAX; i++) {
+            if (mask & (1u << i)) {
+                block_stats_delta_set(d, i, counters[i]);
+            }
+        }
+
+        entry->value = d;
+        *s->p_next = entry;
+        s->p_next = &entry->next;
+    }
+}
+
+static gboolean block_stats_delta_removed(gpointer key, gpointer value,
+                                          gpointer opaque)
+{
+    BlockStatsSnapshot *snap = value;
+    BlockStatsDeltaState *s = opaque;
+
+    if (snap->pass == s->pass) {
+        return false;
+    }
+    block_stats_delta_add(s, key, 0, NULL);
+    return true;
+}
+
+static BlockStatsCursor *block_stats_cursor_get(bool has_cursor,
+                                                int64_t cursor, bool *full)
+{
+    BlockStatsCursor *c, *oldest = NULL;
+    int i;
+
+    for (i = 0; i < BLOCK_STATS_CURSORS; i++) {
+        c = &block_stats_cursors[i];
+        if (has_cursor && c->snapshots && c->id == cursor) {
+            *full = false;
+            return c;
+        }
+        if (!oldest || c->id < oldest->id) {
+            oldest = c;
+        }
+    }
+
+    /* Unknown cursor: start over in the least recently handed out slot */
+    *full = true;
+    if (oldest->snapshots) {
+        g_hash_table_remove_all(oldest->snapshots);
+    } else {
+        oldest->snapshots = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                  g_free, g_free);
+    }
+    return oldest;
+}
+
+BlockStatsDeltaInfo *qmp_query_blockstats_delta(bool has_cursor,
+                                                int64_t cursor,
+                                                bool has_format,
+                                                BlockStatsDeltaFormat format,
+                                                Error **errp)
+{
+    BlockStatsDeltaInfo *info = g_new0(BlockStatsDeltaInfo, 1);
+    BlockStatsDeltaState s = {
+        .format = has_format ? format : BLOCK_STATS_DELTA_FORMAT_JSON,
+        .p_next = &info->devices,
+    };
+    BlockStatsCursor *c;
+    BlockBackend *blk;
+
+    c = block_stats_cursor_get(has_cursor, cursor, &info->full);
+    c->id = s.pass = block_stats_next_cursor++;
+    if (s.format == BLOCK_STATS_DELTA_FORMAT_PACKED) {
+        s.packed = g_byte_array_new();
+    }
+
+    for (blk = blk_all_next(NULL); blk; blk = blk_all_next(blk)) {
+        uint64_t counters[BLOCK_STATS_COUNTER__MAX];
+        AioContext *ctx = blk_get_aio_context(blk);
+        BlockStatsSnapshot *snap;
+        bool is_new = false;
+        uint32_t mask = 0;
+        char *key;
+        int i;
+
+        if (*blk_name(blk)) {
+            key = g_strconcat("d", blk_name(blk), NULL);
+        } else if (blk_bs(blk) && blk_get_attached_dev(blk) &&
+                   bdrv_get_node_name(blk_bs(blk))[0]) {
+            key = g_strconcat("n", bdrv_get_node_name(blk_bs(blk)), NULL);
+        } else {
+            continue;
+        }
+
+        aio_context_acquire(ctx);
+        bdrv_query_blk_counters(blk, counters);
+        aio_context_release(ctx);
+
+        snap = g_hash_table_lookup(c->snapshots, key);
+        if (!snap) {
+            snap = g_new0(BlockStatsSnapshot, 1);
+            g_hash_table_insert(c->snapshots, g_strdup(key), snap);
+            is_new = true;
+        } else if (snap->pass == s.pass) {
+            /* Two BlockBackends with the same root node */
+            g_free(key);
+            continue;
+        }
+        for (i = 0; i < BLOCK_STATS_COUNTER__MAX; i++) {
+            if (counters[i] != snap->counters[i]) {
+                mask |= 1u << i;
+                snap->counters[i] = counters[i];
+            }
+        }
+        snap->pass = s.pass;
+
+        /* New devices are reported even if all of their counters are 0 */
+        if (mask || is_new) {
+            block_stats_delta_add(&s, key, mask, counters);
+        }
+        g_free(key);
+    }
+
+    g_hash_table_foreach_remove(c->snapshots, block_stats_delta_removed, &s);
+
+    info->cursor = s.pass;
+    info->has_devices = s.format == BLOCK_STATS_DELTA_FORMAT_JSON;
+    if (s.packed) {
+        info->has_packed = true;
+        info->packed = g_base64_encode(s.packed->data, s.packed->len);
+        g_byte_array_free(s.packed, true);
+    }
+    return info;
+}
+
 #define NB_SUFFIXES 4
 
 static char *get_human_readable_size(char *buf, int buf_size, int64_t size)
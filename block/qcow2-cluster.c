@@ -537,6 +537,13 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     QCow2ClusterType type;
     int ret;
 
+    if (s->metadata_pending) {
+        ret = qcow2_load_metadata_locked(bs, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     offset_in_cluster = offset_into_cluster(s, offset);
     bytes_needed = (uint64_t) *bytes + offset_in_cluster;
 
@@ -676,6 +683,13 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
     uint64_t *l2_slice = NULL;
     int ret;
 
+    if (s->metadata_pending) {
+        ret = qcow2_load_metadata_locked(bs, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* seek to the l2 offset in the l1 table */
 
     l1_index = offset_to_l1_index(s, offset);
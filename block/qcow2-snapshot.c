@@ -353,6 +353,11 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
         return -EFBIG;
     }
 
+    ret = qcow2_load_metadata(bs, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
     memset(sn, 0, sizeof(*sn));
 
     /* Generate an ID */
@@ -471,6 +476,11 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     int ret;
     uint64_t *sn_l1_table = NULL;
 
+    ret = qcow2_load_metadata(bs, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
     if (snapshot_index < 0) {
@@ -603,6 +613,11 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
     QCowSnapshot sn;
     int snapshot_index, ret;
 
+    ret = qcow2_load_metadata(bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_and_name(bs, snapshot_id, name);
     if (snapshot_index < 0) {
@@ -710,6 +725,12 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 
     assert(bs->read_only);
 
+    /* The active L1 table is about to be replaced */
+    ret = qcow2_load_metadata(bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_and_name(bs, snapshot_id, name);
     if (snapshot_index < 0) {
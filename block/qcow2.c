@@ -569,7 +569,10 @@ static int coroutine_fn qcow2_co_check(BlockDriverState *bs,
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_co_check_locked(bs, result, fix);
+    ret = qcow2_load_metadata_locked(bs, NULL);
+    if (ret == 0) {
+        ret = qcow2_co_check_locked(bs, result, fix);
+    }
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -1147,11 +1150,140 @@ static int qcow2_update_options(BlockDriverState *bs, QDict *options,
 }
 
 /* Called with s->lock held.  */
+static int qcow2_read_l1_table(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i, ret;
+
+    if (s->l1_size == 0) {
+        return 0;
+    }
+
+    s->l1_table = qemu_try_blockalign(bs->file->bs,
+        ROUND_UP(s->l1_size * sizeof(uint64_t), 512));
+    if (s->l1_table == NULL) {
+        error_setg(errp, "Could not allocate L1 table");
+        return -ENOMEM;
+    }
+    ret = bdrv_pread(bs->file, s->l1_table_offset, s->l1_table,
+                     s->l1_size * sizeof(uint64_t));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read L1 table");
+        qemu_vfree(s->l1_table);
+        s->l1_table = NULL;
+        return ret;
+    }
+    for (i = 0; i < s->l1_size; i++) {
+        be64_to_cpus(&s->l1_table[i]);
+    }
+    return 0;
+}
+
+static int qcow2_do_load_metadata(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    ret = qcow2_read_l1_table(bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = qcow2_refcount_init(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not initialize refcount handling");
+        qcow2_refcount_close(bs);
+        s->refcount_table = NULL;
+        qemu_vfree(s->l1_table);
+        s->l1_table = NULL;
+        return ret;
+    }
+
+    s->metadata_pending = false;
+    return 0;
+}
+
+/*
+ * Load the tables that a lazy open left out.  The caller must hold s->lock,
+ * or have the node to itself.  Without @errp, as in the I/O paths, the first
+ * failure of the node is reported on stderr.
+ */
+int qcow2_load_metadata_locked(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Error *local_err = NULL;
+    int ret;
+
+    if (likely(!s->metadata_pending)) {
+        return 0;
+    }
+
+    ret = qcow2_do_load_metadata(bs, &local_err);
+    if (ret < 0) {
+        if (errp) {
+            error_propagate(errp, local_err);
+        } else if (!s->metadata_error_reported) {
+            s->metadata_error_reported = true;
+            error_reportf_err(local_err, "%s: ", bs->filename);
+        } else {
+            error_free(local_err);
+        }
+    }
+    return ret;
+}
+
+typedef struct Qcow2LoadMetadataCo {
+    BlockDriverState *bs;
+    Error **errp;
+    int ret;
+} Qcow2LoadMetadataCo;
+
+static void coroutine_fn qcow2_load_metadata_entry(void *opaque)
+{
+    Qcow2LoadMetadataCo *lmco = opaque;
+    BDRVQcow2State *s = lmco->bs->opaque;
+
+    qemu_co_mutex_lock(&s->lock);
+    lmco->ret = qcow2_load_metadata_locked(lmco->bs, lmco->errp);
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+/* Like qcow2_load_metadata_locked(), but takes s->lock itself */
+int qcow2_load_metadata(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2LoadMetadataCo lmco = {
+        .bs = bs,
+        .errp = errp,
+        .ret = -EINPROGRESS,
+    };
+
+    if (likely(!s->metadata_pending)) {
+        return 0;
+    }
+
+    if (qemu_in_coroutine()) {
+        qcow2_load_metadata_entry(&lmco);
+    } else {
+        Coroutine *co = qemu_coroutine_create(qcow2_load_metadata_entry,
+                                              &lmco);
+        bdrv_coroutine_enter(bs, co);
+        BDRV_POLL_WHILE(bs, lmco.ret == -EINPROGRESS);
+    }
+    return lmco.ret;
+}
+
+static int coroutine_fn qcow2_co_load_metadata(BlockDriverState *bs,
+                                               Error **errp)
+{
+    return qcow2_load_metadata(bs, errp);
+}
+
 static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
                                       int flags, Error **errp)
 {
     BDRVQcow2State *s = bs->opaque;
-    unsigned int len, i;
+    unsigned int len;
     int ret = 0;
     QCowHeader header;
     Error *local_err = NULL;
@@ -1390,23 +1522,17 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
-    if (s->l1_size > 0) {
-        s->l1_table = qemu_try_blockalign(bs->file->bs,
-            ROUND_UP(s->l1_size * sizeof(uint64_t), 512));
-        if (s->l1_table == NULL) {
-            error_setg(errp, "Could not allocate L1 table");
-            ret = -ENOMEM;
-            goto fail;
-        }
-        ret = bdrv_pread(bs->file, s->l1_table_offset, s->l1_table,
-                         s->l1_size * sizeof(uint64_t));
+    /*
+     * Read-only images only need the L1 table once they are read and the
+     * refcount table not at all, so with lazy-open they are loaded on first
+     * use.  This keeps opening a long backing chain cheap.
+     */
+    s->metadata_pending = bs->lazy_open && !(flags & BDRV_O_RDWR);
+    if (!s->metadata_pending) {
+        ret = qcow2_read_l1_table(bs, errp);
         if (ret < 0) {
-            error_setg_errno(errp, -ret, "Could not read L1 table");
             goto fail;
         }
-        for(i = 0;i < s->l1_size; i++) {
-            be64_to_cpus(&s->l1_table[i]);
-        }
     }
 
     /* Parse driver-specific options */
@@ -1418,10 +1544,13 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     s->cluster_cache_offset = -1;
     s->flags = flags;
 
-    ret = qcow2_refcount_init(bs);
-    if (ret != 0) {
-        error_setg_errno(errp, -ret, "Could not initialize refcount handling");
-        goto fail;
+    if (!s->metadata_pending) {
+        ret = qcow2_refcount_init(bs);
+        if (ret != 0) {
+            error_setg_errno(errp, -ret,
+                             "Could not initialize refcount handling");
+            goto fail;
+        }
     }
 
     QLIST_INIT(&s->cluster_allocs);
@@ -1652,6 +1781,14 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
         goto fail;
     }
 
+    /* Lazily opened images need all of their metadata to be written to */
+    if (state->flags & BDRV_O_RDWR) {
+        ret = qcow2_load_metadata(state->bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
         ret = qcow2_reopen_bitmaps_ro(state->bs, errp);
@@ -3308,6 +3445,11 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset,
         return -EINVAL;
     }
 
+    ret = qcow2_load_metadata(bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* cannot proceed if image has snapshots */
     if (s->nb_snapshots) {
         error_setg(errp, "Can't resize an image which has snapshots");
@@ -3791,6 +3933,11 @@ static int qcow2_make_empty(BlockDriverState *bs)
     int step = QEMU_ALIGN_DOWN(INT_MAX, s->cluster_size);
     int l1_clusters, ret = 0;
 
+    ret = qcow2_load_metadata(bs, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
@@ -4208,6 +4355,11 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     QemuOptDesc *desc = opts->list->desc;
     Qcow2AmendHelperCBInfo helper_cb_info;
 
+    ret = qcow2_load_metadata(bs, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
     while (desc && desc->name) {
         if (!qemu_opt_find(opts, desc->name)) {
             /* only change explicitly defined options */
@@ -4557,6 +4709,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_refresh_limits        = qcow2_refresh_limits,
     .bdrv_co_invalidate_cache   = qcow2_co_invalidate_cache,
     .bdrv_inactivate            = qcow2_inactivate,
+    .bdrv_co_load_metadata      = qcow2_co_load_metadata,
 
     .create_opts         = &qcow2_create_opts,
     .bdrv_co_check       = qcow2_co_check,
@@ -269,6 +269,10 @@ typedef struct BDRVQcow2State {
     uint64_t cluster_offset_mask;
     uint64_t l1_table_offset;
     uint64_t *l1_table;
+    /* The L1 and refcount tables are not loaded yet, see lazy-open */
+    bool metadata_pending;
+    /* A failure to load them from an I/O path was reported already */
+    bool metadata_error_reported;
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
@@ -552,6 +556,9 @@ int qcow2_validate_table(BlockDriverState *bs, uint64_t offset,
                          int64_t max_size_bytes, const char *table_name,
                          Error **errp);
 
+int qcow2_load_metadata_locked(BlockDriverState *bs, Error **errp);
+int qcow2_load_metadata(BlockDriverState *bs, Error **errp);
+
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
@@ -0,0 +1,353 @@
+/*
+ * Block device statistics in shared memory
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/stats-shm.h"
+#include "block/accounting.h"
+#include "block/block_int.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-block-core.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+#include <sys/mman.h>
+
+#define BLOCK_STATS_SHM_MAX_DEVICES     65536
+
+QEMU_BUILD_BUG_ON(BLOCK_MAX_IOTYPE != 3);
+
+typedef struct BlockStatsShmEntry {
+    unsigned slot;
+    uint64_t pass;
+} BlockStatsShmEntry;
+
+typedef struct BlockStatsShm {
+    char *path;
+    int fd;
+    void *base;
+    size_t size;
+    BlockStatsShmHeader *hdr;
+    QEMUTimer *timer;
+    /* Device key ('d' + device name or 'n' + node name) to slot */
+    GHashTable *entries;
+    unsigned long *used;
+    uint64_t pass;
+} BlockStatsShm;
+
+static BlockStatsShm *stats_shm;
+
+static BlockStatsShmSlot *block_stats_shm_slot(BlockStatsShm *s, unsigned i)
+{
+    return (BlockStatsShmSlot *)((char *)s->base + s->hdr->header_size +
+                                 (size_t)i * s->hdr->slot_size);
+}
+
+static void block_stats_shm_fill_hist(BlockStatsShmHist *dst,
+                                      BlockAcctStats *stats,
+                                      enum BlockAcctType type)
+{
+    BlockLatencyHistogram hist;
+    int i;
+
+    if (!block_latency_histogram_get(stats, type, &hist)) {
+        return;
+    }
+
+    /* Fold the bins that do not fit into the last one, [b, +inf) */
+    dst->nbins = MIN(hist.nbins, BLOCK_STATS_SHM_HIST_BINS);
+    for (i = 0; i < hist.nbins; i++) {
+        if (i < dst->nbins - 1) {
+            dst->boundaries[i] = hist.boundaries[i];
+        }
+        dst->bins[MIN(i, dst->nbins - 1)] += hist.bins[i];
+    }
+    g_free(hist.boundaries);
+    g_free(hist.bins);
+}
+
+static void block_stats_shm_fill(BlockStatsShmSlot *slot, BlockBackend *blk)
+{
+    BlockAcctStats *stats = blk_get_stats(blk);
+    BlockDriverState *bs = blk_bs(blk);
+    BlockAcctCounters c;
+    int i;
+
+    block_acct_get_counters(stats, &c);
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        slot->nr_bytes[i] = c.nr_bytes[i];
+        slot->nr_ops[i] = c.nr_ops[i];
+        slot->failed_ops[i] = c.failed_ops[i];
+        slot->invalid_ops[i] = c.invalid_ops[i];
+        slot->total_time_ns[i] = c.total_time_ns[i];
+        slot->merged[i] = c.merged[i];
+        block_stats_shm_fill_hist(&slot->latency[i], stats, i);
+    }
+    slot->wr_highest_offset = bs ? stat64_get(&bs->wr_highest_offset) : 0;
+    slot->idle_time_ns = c.last_access_time_ns > 0 ?
+                         block_acct_idle_time_ns(stats) : -1;
+    blk_get_queue_stats(blk, &slot->queue_inflight, &slot->queue_size);
+}
+
+static void block_stats_shm_publish(BlockStatsShmSlot *slot,
+                                    const BlockStatsShmSlot *val)
+{
+    const size_t start = offsetof(BlockStatsShmSlot, in_use);
+
+    seqlock_write_begin(&slot->seqlock);
+    memcpy((char *)slot + start, (char *)val + start, sizeof(*val) - start);
+    seqlock_write_end(&slot->seqlock);
+}
+
+static gboolean block_stats_shm_free_slot(gpointer key, gpointer value,
+                                          gpointer opaque)
+{
+    BlockStatsShmEntry *e = value;
+    BlockStatsShm *s = opaque;
+    BlockStatsShmSlot empty = { .in_use = 0 };
+
+    if (e->pass == s->pass) {
+        return false;
+    }
+    block_stats_shm_publish(block_stats_shm_slot(s, e->slot), &empty);
+    clear_bit(e->slot, s->used);
+    return true;
+}
+
+/* Return the key of @blk in BlockStatsShm.entries, or NULL if unpublished */
+static char *block_stats_shm_key(BlockBackend *blk)
+{
+    if (*blk_name(blk)) {
+        return g_strdup_printf("d%s", blk_name(blk));
+    } else if (blk_bs(blk) && blk_get_attached_dev(blk) &&
+               bdrv_get_node_name(blk_bs(blk))[0]) {
+        return g_strdup_printf("n%s", bdrv_get_node_name(blk_bs(blk)));
+    }
+    return NULL;
+}
+
+static void block_stats_shm_publish_blk(BlockStatsShm *s, BlockBackend *blk,
+                                        const char *key, unsigned i)
+{
+    AioContext *ctx = blk_get_aio_context(blk);
+    BlockStatsShmSlot val = {
+        .in_use = 1,
+        .kind = key[0] == 'd' ? BLOCK_STATS_SHM_DEVICE : BLOCK_STATS_SHM_NODE,
+    };
+
+    pstrcpy(val.name, sizeof(val.name), key + 1);
+    aio_context_acquire(ctx);
+    block_stats_shm_fill(&val, blk);
+    aio_context_release(ctx);
+    block_stats_shm_publish(block_stats_shm_slot(s, i), &val);
+}
+
+/* Publish the current statistics of every block device */
+void block_stats_shm_update(void)
+{
+    BlockStatsShm *s = stats_shm;
+    GSList *new_blks = NULL, *l;
+    BlockBackend *blk;
+    uint64_t dropped = 0;
+
+    if (!s) {
+        return;
+    }
+
+    s->pass++;
+    for (blk = blk_all_next(NULL); blk; blk = blk_all_next(blk)) {
+        BlockStatsShmEntry *e;
+        char *key = block_stats_shm_key(blk);
+
+        if (!key) {
+            continue;
+        }
+        e = g_hash_table_lookup(s->entries, key);
+        if (!e) {
+            /* Only once the slots of removed devices are free */
+            new_blks = g_slist_prepend(new_blks, blk);
+        } else if (e->pass != s->pass) {
+            /* Else two BlockBackends have the same root node */
+            e->pass = s->pass;
+            block_stats_shm_publish_blk(s, blk, key, e->slot);
+        }
+        g_free(key);
+    }
+
+    g_hash_table_foreach_remove(s->entries, block_stats_shm_free_slot, s);
+
+    new_blks = g_slist_reverse(new_blks);
+    for (l = new_blks; l; l = l->next) {
+        BlockStatsShmEntry *e;
+        char *key = block_stats_shm_key(l->data);
+        unsigned i;
+
+        if (g_hash_table_lookup(s->entries, key)) {
+            g_free(key);
+            continue;
+        }
+        i = find_first_zero_bit(s->used, s->hdr->nr_slots);
+        if (i == s->hdr->nr_slots) {
+            g_free(key);
+            dropped++;
+            continue;
+        }
+        set_bit(i, s->used);
+        e = g_new0(BlockStatsShmEntry, 1);
+        e->slot = i;
+        e->pass = s->pass;
+        g_hash_table_insert(s->entries, key, e);
+        block_stats_shm_publish_blk(s, l->data, key, i);
+    }
+    g_slist_free(new_blks);
+
+    s->hdr->dropped = dropped;
+    s->hdr->update_time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+}
+
+static void block_stats_shm_timer_cb(void *opaque)
+{
+    BlockStatsShm *s = opaque;
+
+    block_stats_shm_update();
+    timer_mod(s->timer,
+              qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + s->hdr->interval_ns);
+}
+
+int block_stats_shm_start(const char *path, int64_t interval_ms,
+                          int64_t max_devices, Error **errp)
+{
+    BlockStatsShm *s;
+    uint32_t header_size = ROUND_UP(sizeof(BlockStatsShmHeader), 64);
+    uint32_t slot_size = ROUND_UP(sizeof(BlockStatsShmSlot), 64);
+    bool created;
+    int ret;
+
+    if (stats_shm) {
+        error_setg(errp, "Statistics are already exported to '%s'",
+                   stats_shm->path);
+        return -EBUSY;
+    }
+    if (interval_ms <= 0) {
+        error_setg(errp, "Interval must be positive");
+        return -EINVAL;
+    }
+    if (max_devices <= 0 || max_devices > BLOCK_STATS_SHM_MAX_DEVICES) {
+        error_setg(errp, "Number of devices must be between 1 and %d",
+                   BLOCK_STATS_SHM_MAX_DEVICES);
+        return -EINVAL;
+    }
+
+    s = g_new0(BlockStatsShm, 1);
+    s->size = header_size + (size_t)slot_size * max_devices;
+    /* Only remove the file on failure if it is ours */
+    s->fd = qemu_open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    created = s->fd >= 0;
+    if (s->fd < 0 && errno == EEXIST) {
+        s->fd = qemu_open(path, O_RDWR);
+    }
+    if (s->fd < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not create '%s'", path);
+        g_free(s);
+        return ret;
+    }
+    /* The lock is held for as long as the segment is exported.  A file left
+     * behind by an export that went away is reused, but one that another
+     * process still exports, and that readers have mapped, is not touched. */
+    ret = qemu_lock_fd(s->fd, 0, 0, true);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "'%s' is in use by another export", path);
+        qemu_close(s->fd);
+        g_free(s);
+        return ret;
+    }
+    if (ftruncate(s->fd, s->size) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not resize '%s'", path);
+        goto fail;
+    }
+    s->base = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   s->fd, 0);
+    if (s->base == MAP_FAILED) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not map '%s'", path);
+        goto fail;
+    }
+
+    s->path = g_strdup(path);
+    s->hdr = s->base;
+    s->hdr->version = BLOCK_STATS_SHM_VERSION;
+    s->hdr->header_size = header_size;
+    s->hdr->slot_size = slot_size;
+    s->hdr->nr_slots = max_devices;
+    s->hdr->pid = getpid();
+    s->hdr->interval_ns = interval_ms * SCALE_MS;
+    /* Readers check the magic last */
+    smp_wmb();
+    atomic_set(&s->hdr->magic, BLOCK_STATS_SHM_MAGIC);
+
+    s->entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                       g_free, g_free);
+    s->used = bitmap_new(max_devices);
+    s->timer = timer_new_ns(QEMU_CLOCK_REALTIME, block_stats_shm_timer_cb, s);
+    stats_shm = s;
+
+    block_stats_shm_timer_cb(s);
+    return 0;
+
+fail:
+    qemu_close(s->fd);
+    if (created) {
+        unlink(path);
+    }
+    g_free(s);
+    return ret;
+}
+
+void block_stats_shm_stop(void)
+{
+    BlockStatsShm *s = stats_shm;
+
+    if (!s) {
+        return;
+    }
+    stats_shm = NULL;
+
+    timer_del(s->timer);
+    timer_free(s->timer);
+
+    /* Tell readers that still have it mapped that nothing changes anymore */
+    s->hdr->update_time_ns = 0;
+    munmap(s->base, s->size);
+    qemu_close(s->fd);
+    unlink(s->path);
+
+    g_hash_table_destroy(s->entries);
+    g_free(s->used);
+    g_free(s->path);
+    g_free(s);
+}
+
+void qmp_block_stats_shm_start(const char *path, bool has_interval,
+                               int64_t interval, bool has_max_devices,
+                               int64_t max_devices, Error **errp)
+{
+    block_stats_shm_start(path, has_interval ? interval : 1000,
+                          has_max_devices ? max_devices : 256, errp);
+}
+
+void qmp_block_stats_shm_stop(Error **errp)
+{
+    if (!stats_shm) {
+        error_setg(errp, "Statistics are not being exported");
+        return;
+    }
+    block_stats_shm_stop();
+}
@@ -0,0 +1,314 @@
+/*
+ * Block status cache for backing chains
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ * Mirror, stream, commit and NBD block status replies all end up asking the
+ * same question over and over: which layer of a (possibly long) backing chain
+ * owns a given range.  Every query walks the chain and asks each format
+ * driver in turn, which for qcow2 means L2 table lookups in each layer.
+ *
+ * This cache remembers the result of whole-chain walks started at the node
+ * that holds it.  Each entry records which layer owns the range, so that the
+ * same entry can answer queries that stop at any base below the holder.
+ * Entries are kept in two sorted, non-overlapping arrays, one per query mode
+ * (allocation only and want_zero), because the two modes may legitimately
+ * return different extents for the same offset.
+ *
+ * Anything that may change the answer drops the affected entries: data
+ * writes, write zeroes and discards on any layer of the chain (which share
+ * guest offsets with the holder), resizes, and changes to the backing or file
+ * links of any layer, which covers commit, stream and relink-chain.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "block/block_int.h"
+#include "block/status-cache.h"
+
+struct BdrvStatusCache {
+    QemuMutex lock;
+    GArray *extents[2];     /* of BdrvStatusExtent, indexed by want_zero */
+    uint32_t max_extents;
+    uint64_t generation;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+};
+
+/* Number of nodes with a cache, to keep the write path cheap otherwise */
+static int bsc_enabled_count;
+
+/* Index of the last extent starting at or before @offset, or -1 */
+static int bsc_find(GArray *extents, int64_t offset)
+{
+    int lo = 0, hi = extents->len;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (g_array_index(extents, BdrvStatusExtent, mid).offset <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+/* Remove the extents overlapping [offset, end), returns how many went */
+static unsigned bsc_remove_range(GArray *extents, int64_t offset, int64_t end)
+{
+    int first = bsc_find(extents, offset);
+    int last = bsc_find(extents, end - 1);
+
+    if (first < 0 ||
+        g_array_index(extents, BdrvStatusExtent, first).offset +
+        g_array_index(extents, BdrvStatusExtent, first).bytes <= offset) {
+        first++;
+    }
+    if (last < first) {
+        return 0;
+    }
+    g_array_remove_range(extents, first, last - first + 1);
+    return last - first + 1;
+}
+
+void bdrv_bsc_enable(BlockDriverState *bs, uint32_t max_extents)
+{
+    BdrvStatusCache *bsc = bs->status_cache;
+    int i;
+
+    if (!max_extents) {
+        max_extents = BDRV_BSC_DEFAULT_MAX_EXTENTS;
+    }
+    if (bsc) {
+        qemu_mutex_lock(&bsc->lock);
+        bsc->max_extents = max_extents;
+        for (i = 0; i < ARRAY_SIZE(bsc->extents); i++) {
+            if (bsc->extents[i]->len > max_extents) {
+                g_array_set_size(bsc->extents[i], 0);
+            }
+        }
+        qemu_mutex_unlock(&bsc->lock);
+        return;
+    }
+
+    bsc = g_new0(BdrvStatusCache, 1);
+    qemu_mutex_init(&bsc->lock);
+    for (i = 0; i < ARRAY_SIZE(bsc->extents); i++) {
+        bsc->extents[i] = g_array_new(false, false, sizeof(BdrvStatusExtent));
+    }
+    bsc->max_extents = max_extents;
+    bs->status_cache = bsc;
+    atomic_inc(&bsc_enabled_count);
+}
+
+void bdrv_bsc_disable(BlockDriverState *bs)
+{
+    BdrvStatusCache *bsc = bs->status_cache;
+    int i;
+
+    if (!bsc) {
+        return;
+    }
+    bs->status_cache = NULL;
+    atomic_dec(&bsc_enabled_count);
+    for (i = 0; i < ARRAY_SIZE(bsc->extents); i++) {
+        g_array_free(bsc->extents[i], true);
+    }
+    qemu_mutex_destroy(&bsc->lock);
+    g_free(bsc);
+}
+
+bool bdrv_bsc_is_enabled(BlockDriverState *bs)
+{
+    return bs->status_cache != NULL;
+}
+
+bool bdrv_bsc_lookup(BlockDriverState *bs, bool want_zero, int64_t offset,
+                     BdrvStatusExtent *ext)
+{
+    BdrvStatusCache *bsc = bs->status_cache;
+    GArray *extents = bsc->extents[want_zero];
+    bool found = false;
+    int i;
+
+    qemu_mutex_lock(&bsc->lock);
+    i = bsc_find(extents, offset);
+    if (i >= 0) {
+        *ext = g_array_index(extents, BdrvStatusExtent, i);
+        found = offset < ext->offset + ext->bytes;
+    }
+    if (found) {
+        bsc->hits++;
+    } else {
+        bsc->misses++;
+    }
+    qemu_mutex_unlock(&bsc->lock);
+    return found;
+}
+
+uint64_t bdrv_bsc_generation(BlockDriverState *bs)
+{
+    return atomic_read(&bs->status_cache->generation);
+}
+
+void bdrv_bsc_insert(BlockDriverState *bs, bool want_zero, uint64_t gen,
+                     const BdrvStatusExtent *ext)
+{
+    BdrvStatusCache *bsc = bs->status_cache;
+    GArray *extents;
+
+    if (!bsc || ext->bytes <= 0) {
+        return;
+    }
+
+    qemu_mutex_lock(&bsc->lock);
+    if (bsc->generation != gen) {
+        /* Something changed under our walk, its result may be stale */
+        goto out;
+    }
+    extents = bsc->extents[want_zero];
+
+    /* A concurrent walk may have cached (part of) the same range */
+    bsc_remove_range(extents, ext->offset, ext->offset + ext->bytes);
+    if (extents->len >= bsc->max_extents) {
+        g_array_set_size(extents, 0);
+    }
+    g_array_insert_vals(extents, bsc_find(extents, ext->offset) + 1, ext, 1);
+out:
+    qemu_mutex_unlock(&bsc->lock);
+}
+
+int bdrv_bsc_resolve(BlockDriverState *bs, BlockDriverState *base,
+                     const BdrvStatusExtent *ext, int64_t offset,
+                     int64_t bytes, int64_t *pnum, int64_t *map,
+                     BlockDriverState **file)
+{
+    BlockDriverState *p, *last = bs;
+    int64_t delta = offset - ext->offset;
+    int64_t n = MIN(ext->bytes - delta, bytes);
+    int base_depth = 0;
+    int ret;
+
+    assert(delta >= 0 && delta < ext->bytes);
+
+    for (p = bs; p != base; p = backing_bs(p)) {
+        last = p;
+        base_depth++;
+    }
+
+    *pnum = n;
+    if (ext->depth >= 0 && ext->depth < base_depth) {
+        ret = ext->ret;
+        if (delta + n < ext->bytes) {
+            ret &= ~BDRV_BLOCK_EOF;
+        }
+        if (map) {
+            *map = ext->map + (ret & BDRV_BLOCK_OFFSET_VALID ? delta : 0);
+        }
+        if (file) {
+            *file = ext->file;
+        }
+        return ret;
+    }
+
+    /* Not allocated anywhere between @bs and @base */
+    ret = 0;
+    if (offset + n == bdrv_getlength(last)) {
+        ret |= BDRV_BLOCK_EOF;
+    }
+    if (map) {
+        *map = 0;
+    }
+    if (file) {
+        *file = NULL;
+    }
+    return ret;
+}
+
+static void bsc_invalidate(BlockDriverState *bs, int64_t offset, int64_t end)
+{
+    BdrvStatusCache *bsc = bs->status_cache;
+    BdrvChild *c;
+
+    if (bsc) {
+        unsigned removed = 0;
+        int i;
+
+        qemu_mutex_lock(&bsc->lock);
+        bsc->generation++;
+        for (i = 0; i < ARRAY_SIZE(bsc->extents); i++) {
+            removed += bsc_remove_range(bsc->extents[i], offset, end);
+        }
+        bsc->invalidations += removed;
+        qemu_mutex_unlock(&bsc->lock);
+    }
+
+    /* Nodes using @bs as backing file see the same guest offsets */
+    QLIST_FOREACH(c, &bs->parents, next_parent) {
+        if (c->role == &child_backing) {
+            bsc_invalidate(c->opaque, offset, end);
+        }
+    }
+}
+
+void bdrv_bsc_invalidate_range(BlockDriverState *bs, int64_t offset,
+                               int64_t bytes)
+{
+    if (!atomic_read(&bsc_enabled_count) || !bytes) {
+        return;
+    }
+    bsc_invalidate(bs, offset, offset + bytes);
+}
+
+void bdrv_bsc_invalidate(BlockDriverState *bs)
+{
+    if (!atomic_read(&bsc_enabled_count)) {
+        return;
+    }
+    bsc_invalidate(bs, 0, INT64_MAX);
+}
+
+void bdrv_bsc_get_stats(BlockDriverState *bs, BdrvStatusCacheStats *stats)
+{
+    BdrvStatusCache *bsc = bs->status_cache;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!bsc) {
+        return;
+    }
+    qemu_mutex_lock(&bsc->lock);
+    stats->enabled = true;
+    stats->max_extents = bsc->max_extents;
+    stats->nr_extents = bsc->extents[0]->len + bsc->extents[1]->len;
+    stats->hits = bsc->hits;
+    stats->misses = bsc->misses;
+    stats->invalidations = bsc->invalidations;
+    qemu_mutex_unlock(&bsc->lock);
+}
+
+void bdrv_bsc_foreach_extent(BlockDriverState *bs,
+                             void (*fn)(void *opaque, bool want_zero,
+                                        const BdrvStatusExtent *ext),
+                             void *opaque)
+{
+    BdrvStatusCache *bsc = bs->status_cache;
+    int i, j;
+
+    if (!bsc) {
+        return;
+    }
+    qemu_mutex_lock(&bsc->lock);
+    for (i = 0; i < ARRAY_SIZE(bsc->extents); i++) {
+        for (j = 0; j < bsc->extents[i]->len; j++) {
+            fn(opaque, i, &g_array_index(bsc->extents[i],
+                                         BdrvStatusExtent, j));
+        }
+    }
+    qemu_mutex_unlock(&bsc->lock);
+}
@@ -27,6 +27,9 @@ enum {
      * contiguous regions of the image is efficient.
      */
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /* Default number of copy-on-read operations kept in flight */
+    STREAM_DEFAULT_MAX_IN_FLIGHT = 16,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
@@ -38,8 +41,24 @@ typedef struct StreamBlockJob {
     BlockdevOnError on_error;
     char *backing_file_str;
     int bs_flags;
+
+    /* Copy pipeline: @buf_size bounds the bytes held by operations */
+    int64_t buf_size;
+    int max_in_flight;
+    int in_flight;
+    int64_t bytes_in_flight;
+    bool waiting_for_io;
+    QTAILQ_HEAD(, StreamOp) failed;
 } StreamBlockJob;
 
+typedef struct StreamOp {
+    StreamBlockJob *s;
+    int64_t offset;
+    int64_t bytes;
+    int ret;
+    QTAILQ_ENTRY(StreamOp) next;
+} StreamOp;
+
 static int coroutine_fn stream_populate(BlockBackend *blk,
                                         int64_t offset, uint64_t bytes,
                                         void *buf)
@@ -100,6 +119,104 @@ out:
     g_free(data);
 }
 
+static void coroutine_fn stream_co_op(void *opaque)
+{
+    StreamOp *op = opaque;
+    StreamBlockJob *s = op->s;
+    BlockBackend *blk = s->common.blk;
+    void *buf;
+    int ret;
+
+    buf = blk_blockalign(blk, op->bytes);
+    ret = stream_populate(blk, op->offset, op->bytes, buf);
+    qemu_vfree(buf);
+    s->bytes_in_flight -= op->bytes;
+    s->in_flight--;
+
+    if (ret < 0) {
+        /* The job coroutine decides whether to retry */
+        op->ret = ret;
+        QTAILQ_INSERT_TAIL(&s->failed, op, next);
+    } else {
+        /* Publish progress */
+        s->common.offset += op->bytes;
+        g_free(op);
+    }
+
+    if (s->waiting_for_io) {
+        aio_co_wake(s->common.co);
+    }
+}
+
+static void coroutine_fn stream_wait_for_io(StreamBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+static void coroutine_fn stream_issue(StreamBlockJob *s, int64_t offset,
+                                      int64_t bytes)
+{
+    StreamOp *op;
+    Coroutine *co;
+
+    while (s->in_flight >= s->max_in_flight ||
+           (s->in_flight && s->bytes_in_flight + bytes > s->buf_size)) {
+        stream_wait_for_io(s);
+    }
+
+    op = g_new(StreamOp, 1);
+    *op = (StreamOp) {
+        .s      = s,
+        .offset = offset,
+        .bytes  = bytes,
+    };
+    s->in_flight++;
+    s->bytes_in_flight += bytes;
+    co = qemu_coroutine_create(stream_co_op, op);
+    qemu_coroutine_enter(co);
+}
+
+/*
+ * Decide what to do about the operations that failed since the last call.
+ * Errors that are reported or ignored are recorded in @error.  Returns a
+ * negative errno if the job must stop, 1 if some of the operations were
+ * issued again and 0 otherwise.
+ */
+static int coroutine_fn stream_handle_failed(StreamBlockJob *s, int *error)
+{
+    StreamOp *op;
+    int ret = 0;
+
+    while ((op = QTAILQ_FIRST(&s->failed)) != NULL) {
+        QTAILQ_REMOVE(&s->failed, op, next);
+        if (ret >= 0) {
+            BlockErrorAction action =
+                block_job_error_action(&s->common, s->on_error, true, -op->ret);
+            if (action == BLOCK_ERROR_ACTION_STOP) {
+                /* Go through a pause point before retrying */
+                block_job_sleep_ns(&s->common, 0);
+                stream_issue(s, op->offset, op->bytes);
+                ret = 1;
+            } else {
+                if (*error == 0) {
+                    *error = op->ret;
+                }
+                if (action == BLOCK_ERROR_ACTION_REPORT) {
+                    ret = op->ret;
+                } else {
+                    /* Ignored, count it as done like the loop below does */
+                    s->common.offset += op->bytes;
+                }
+            }
+        }
+        g_free(op);
+    }
+    return ret;
+}
+
 static void coroutine_fn stream_run(void *opaque)
 {
     StreamBlockJob *s = opaque;
@@ -112,7 +229,7 @@ static void coroutine_fn stream_run(void *opaque)
     int error = 0;
     int ret = 0;
     int64_t n = 0; /* bytes */
-    void *buf;
+    int64_t op_bytes;
 
     if (!bs->backing) {
         goto out;
@@ -124,7 +241,10 @@ static void coroutine_fn stream_run(void *opaque)
         goto out;
     }
 
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+    /* Share the buffer between the operations that may be in flight */
+    op_bytes = MIN(STREAM_BUFFER_SIZE, s->buf_size / s->max_in_flight);
+    op_bytes = MAX(QEMU_ALIGN_DOWN(op_bytes, BDRV_SECTOR_SIZE),
+                   BDRV_SECTOR_SIZE);
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -139,34 +259,47 @@ static void coroutine_fn stream_run(void *opaque)
         bool copy;
 
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * so that bdrv_drain_all() can pause the job; operations still in
+         * flight are waited for by the drain itself.
          */
         block_job_sleep_ns(&s->common, delay_ns);
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
 
+        if (stream_handle_failed(s, &error) < 0) {
+            break;
+        }
+
         copy = false;
 
-        ret = bdrv_is_allocated(bs, offset, STREAM_BUFFER_SIZE, &n);
+        ret = bdrv_is_allocated(bs, offset, s->common.len - offset, &n);
         if (ret == 1) {
             /* Allocated in the top, no need to copy.  */
         } else if (ret >= 0) {
             /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [offset, offset+n*BDRV_SECTOR_SIZE).  */
-            ret = bdrv_is_allocated_above(backing_bs(bs), base,
-                                          offset, n, &n);
+             * known-unallocated area [offset, offset+n*BDRV_SECTOR_SIZE).
+             * Zero extents go through copy-on-read as well, which writes
+             * them as zeroes; a write zeroes request from here would not
+             * be serialised against guest writes to the same clusters.  */
+            ret = bdrv_block_status_above(backing_bs(bs), base,
+                                          offset, n, &n, NULL, NULL);
 
             /* Finish early if end of backing file has been reached */
-            if (ret == 0 && n == 0) {
+            if (ret >= 0 && !(ret & BDRV_BLOCK_ALLOCATED) && n == 0) {
                 n = s->common.len - offset;
             }
 
-            copy = (ret == 1);
+            copy = ret >= 0 && (ret & BDRV_BLOCK_ALLOCATED);
         }
         trace_stream_one_iteration(s, offset, n, ret);
         if (copy) {
-            ret = stream_populate(blk, offset, n, buf);
+            n = MIN(n, op_bytes);
+            stream_issue(s, offset, n);
+            if (s->common.speed) {
+                delay_ns = ratelimit_calculate_delay(&s->limit, n);
+            }
+            continue;
         }
         if (ret < 0) {
             BlockErrorAction action =
@@ -186,9 +319,27 @@ static void coroutine_fn stream_run(void *opaque)
 
         /* Publish progress */
         s->common.offset += n;
-        if (copy && s->common.speed) {
-            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+    }
+
+    /* Wait for the tail of the pipeline, retrying what fails there */
+    while (!block_job_is_cancelled(&s->common)) {
+        while (s->in_flight) {
+            stream_wait_for_io(s);
         }
+        if (stream_handle_failed(s, &error) <= 0) {
+            break;
+        }
+    }
+    while (s->in_flight) {
+        stream_wait_for_io(s);
+    }
+    while (!QTAILQ_EMPTY(&s->failed)) {
+        StreamOp *op = QTAILQ_FIRST(&s->failed);
+        QTAILQ_REMOVE(&s->failed, op, next);
+        if (error == 0) {
+            error = op->ret;
+        }
+        g_free(op);
     }
 
     if (!base) {
@@ -198,8 +349,6 @@ static void coroutine_fn stream_run(void *opaque)
     /* Do not remove the backing file if an error was there but ignored.  */
     ret = error;
 
-    qemu_vfree(buf);
-
 out:
     /* Modify backing chain and close BDSes in main loop */
     data = g_malloc(sizeof(*data));
@@ -227,7 +376,8 @@ static const BlockJobDriver stream_job_driver = {
 
 void stream_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, const char *backing_file_str,
-                  int64_t speed, BlockdevOnError on_error, Error **errp)
+                  int64_t speed, int64_t buf_size, int max_in_flight,
+                  BlockdevOnError on_error, Error **errp)
 {
     StreamBlockJob *s;
     BlockDriverState *iter;
@@ -269,6 +419,9 @@ void stream_start(const char *job_id, BlockDriverState *bs,
     s->bs_flags = orig_bs_flags;
 
     s->on_error = on_error;
+    s->max_in_flight = max_in_flight ?: STREAM_DEFAULT_MAX_IN_FLIGHT;
+    s->buf_size = buf_size ?: (int64_t)STREAM_BUFFER_SIZE * s->max_in_flight;
+    QTAILQ_INIT(&s->failed);
     trace_stream_start(bs, base, s);
     block_job_start(&s->common);
     return;
@@ -30,6 +30,7 @@
 #include "qemu/thread.h"
 #include "sysemu/qtest.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-block-core.h"
 #include "qapi/qapi-visit-block-core.h"
 #include "qom/object.h"
 #include "qom/object_interfaces.h"
@@ -60,6 +61,11 @@ static void throttle_group_obj_complete(UserCreatable *obj, Error **errp);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * Groups can be nested: a request to a member of a group with a parent
+ * must also be allowed by the parent (and its ancestors), unless it is
+ * within the group's guarantee. A group and its ancestors are locked in
+ * that order, from child to parent.
  */
 typedef struct ThrottleGroup {
     Object parent_obj;
@@ -75,8 +81,14 @@ typedef struct ThrottleGroup {
     bool any_timer_armed[2];
     QEMUClockType clock_type;
 
-    /* This field is protected by the global QEMU mutex */
+    /* These are written under both the global QEMU mutex and lock */
+    struct ThrottleGroup *parent;
+    ThrottleState guarantee;
+    bool has_guarantee;
+
+    /* These fields are protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
+    bool monitor_owned;
 } ThrottleGroup;
 
 /* This is protected by the global QEMU mutex */
@@ -243,6 +255,73 @@ static ThrottleGroupMember *next_throttle_token(ThrottleGroupMember *tgm,
     return token;
 }
 
+/* Return how long an I/O request to a group has to wait, taking its
+ * ancestors into account.
+ *
+ * The group's own limits always apply. Beyond that the request has to
+ * wait for the parent unless the group's guarantee has room for it, so
+ * siblings share whatever the parent allows and none of them is starved
+ * below its guarantee.
+ *
+ * A waiting request is not checked again when its timer fires, so a
+ * parent can be exceeded by about one request per child group.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tg:         the ThrottleGroup
+ * @is_write:   the type of operation (read/write)
+ * @now:        the current time in tg->clock_type
+ * @ret:        the time to wait in ns, 0 if the request can go through
+ */
+static int64_t throttle_group_compute_wait(ThrottleGroup *tg, bool is_write,
+                                           int64_t now)
+{
+    ThrottleGroup *parent = tg->parent;
+    int64_t wait;
+
+    wait = throttle_leak_and_compute_wait(&tg->ts, is_write, now);
+    if (wait || !parent) {
+        return wait;
+    }
+
+    if (tg->has_guarantee &&
+        !throttle_leak_and_compute_wait(&tg->guarantee, is_write, now)) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&parent->lock);
+    wait = throttle_group_compute_wait(parent, is_write, now);
+    qemu_mutex_unlock(&parent->lock);
+
+    return wait;
+}
+
+/* Do the accounting for an I/O request that is about to be executed, in
+ * the group and all its ancestors.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tg:         the ThrottleGroup
+ * @is_write:   the type of operation (read/write)
+ * @bytes:      the number of bytes for this I/O
+ */
+static void throttle_group_account(ThrottleGroup *tg, bool is_write,
+                                   unsigned int bytes)
+{
+    ThrottleGroup *parent = tg->parent;
+
+    throttle_account(&tg->ts, is_write, bytes);
+    if (tg->has_guarantee) {
+        throttle_account(&tg->guarantee, is_write, bytes);
+    }
+
+    if (parent) {
+        qemu_mutex_lock(&parent->lock);
+        throttle_group_account(parent, is_write, bytes);
+        qemu_mutex_unlock(&parent->lock);
+    }
+}
+
 /* Check if the next I/O request for a ThrottleGroupMember needs to be
  * throttled or not. If there's no timer set in this group, set one and update
  * the token accordingly.
@@ -259,7 +338,7 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     ThrottleTimers *tt = &tgm->throttle_timers;
-    bool must_wait;
+    int64_t now, wait;
 
     if (atomic_read(&tgm->io_limits_disabled)) {
         return false;
@@ -270,15 +349,21 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
         return true;
     }
 
-    must_wait = throttle_schedule_timer(ts, tt, is_write);
+    now = qemu_clock_get_ns(tg->clock_type);
+    wait = throttle_group_compute_wait(tg, is_write, now);
+    if (!wait) {
+        return false;
+    }
 
-    /* If a timer just got armed, set tgm as the current token */
-    if (must_wait) {
-        tg->tokens[is_write] = tgm;
-        tg->any_timer_armed[is_write] = true;
+    if (!timer_pending(tt->timers[is_write])) {
+        timer_mod(tt->timers[is_write], now + wait);
     }
 
-    return must_wait;
+    /* A timer just got armed, set tgm as the current token */
+    tg->tokens[is_write] = tgm;
+    tg->any_timer_armed[is_write] = true;
+
+    return true;
 }
 
 /* Start the next pending I/O request for a ThrottleGroupMember. Return whether
@@ -372,7 +457,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     }
 
     /* The I/O will be executed, so do the accounting */
-    throttle_account(tgm->throttle_state, is_write, bytes);
+    throttle_group_account(tg, is_write, bytes);
 
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
@@ -616,6 +701,209 @@ void throttle_group_detach_aio_context(ThrottleGroupMember *tgm)
     tgm->aio_context = NULL;
 }
 
+/* Restart the throttled requests of all members of a group, e.g. after
+ * its configuration changed.
+ *
+ * This function reads the member list and must be called under the
+ * global mutex.
+ */
+static void throttle_group_restart_members(ThrottleGroup *tg)
+{
+    ThrottleGroupMember *tgm;
+
+    QLIST_FOREACH(tgm, &tg->head, round_robin) {
+        throttle_group_restart_tgm(tgm);
+    }
+}
+
+void qmp_x_throttle_group_set(const char *group, bool has_parent,
+                              const char *parent, bool has_limits,
+                              ThrottleLimits *limits, bool has_guarantee,
+                              ThrottleLimits *guarantee, Error **errp)
+{
+    ThrottleGroup *tg, *new_parent = NULL, *old_parent = NULL, *iter;
+    ThrottleConfig cfg, guarantee_cfg;
+    Error *local_err = NULL;
+
+    tg = throttle_group_by_name(group);
+
+    if (has_parent && *parent) {
+        new_parent = throttle_group_by_name(parent);
+        if (!new_parent) {
+            error_setg(errp, "Throttle group '%s' not found", parent);
+            return;
+        }
+        for (iter = new_parent; iter; iter = iter->parent) {
+            if (iter == tg) {
+                error_setg(errp, "Throttle group '%s' cannot be nested in "
+                           "'%s'", group, parent);
+                return;
+            }
+        }
+    }
+
+    if (tg) {
+        qemu_mutex_lock(&tg->lock);
+        throttle_get_config(&tg->ts, &cfg);
+        throttle_get_config(&tg->guarantee, &guarantee_cfg);
+        qemu_mutex_unlock(&tg->lock);
+    } else {
+        throttle_config_init(&cfg);
+        throttle_config_init(&guarantee_cfg);
+    }
+
+    if (has_limits) {
+        throttle_limits_to_config(limits, &cfg, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+        if (!throttle_is_valid(&cfg, errp)) {
+            return;
+        }
+    }
+    if (has_guarantee) {
+        throttle_limits_to_config(guarantee, &guarantee_cfg, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+        if (!throttle_is_valid(&guarantee_cfg, errp)) {
+            return;
+        }
+    }
+
+    /* The monitor keeps a reference until x-throttle-group-del */
+    if (!tg) {
+        tg = container_of(throttle_group_incref(group), ThrottleGroup, ts);
+        tg->monitor_owned = true;
+    } else if (!tg->monitor_owned) {
+        object_ref(OBJECT(tg));
+        tg->monitor_owned = true;
+    }
+    if (new_parent) {
+        object_ref(OBJECT(new_parent));
+    }
+
+    qemu_mutex_lock(&tg->lock);
+    if (has_limits) {
+        throttle_config(&tg->ts, tg->clock_type, &cfg);
+    }
+    if (has_guarantee) {
+        throttle_config(&tg->guarantee, tg->clock_type, &guarantee_cfg);
+        tg->has_guarantee = throttle_enabled(&guarantee_cfg);
+    }
+    if (has_parent) {
+        old_parent = tg->parent;
+        tg->parent = new_parent;
+    }
+    qemu_mutex_unlock(&tg->lock);
+
+    if (old_parent) {
+        object_unref(OBJECT(old_parent));
+    }
+
+    throttle_group_restart_members(tg);
+}
+
+void qmp_x_throttle_group_del(const char *group, Error **errp)
+{
+    ThrottleGroup *tg = throttle_group_by_name(group);
+
+    if (!tg) {
+        error_setg(errp, "Throttle group '%s' not found", group);
+        return;
+    }
+    if (!tg->monitor_owned) {
+        error_setg(errp, "Throttle group '%s' was not created by "
+                   "x-throttle-group-set", group);
+        return;
+    }
+
+    tg->monitor_owned = false;
+    object_unref(OBJECT(tg));
+}
+
+QEMU_BUILD_BUG_ON((int)THROTTLE_BUCKET__MAX != (int)BUCKETS_COUNT);
+
+/* Return the levels of the buckets of @ts that have a limit.
+ *
+ * This assumes that the lock of the group that @ts belongs to is held.
+ */
+static ThrottleBucketLevelList *throttle_group_levels(ThrottleState *ts,
+                                                      int64_t now)
+{
+    ThrottleBucketLevelList *head = NULL, **p_next = &head;
+    int i;
+
+    throttle_do_leak(ts, now);
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        LeakyBucket *bkt = &ts->cfg.buckets[i];
+        ThrottleBucketLevelList *elem;
+
+        if (!bkt->avg) {
+            continue;
+        }
+
+        elem = g_new0(ThrottleBucketLevelList, 1);
+        elem->value = g_new0(ThrottleBucketLevel, 1);
+        elem->value->bucket = (ThrottleBucket)i;
+        elem->value->level = bkt->level;
+        elem->value->burst_level = bkt->burst_level;
+
+        *p_next = elem;
+        p_next = &elem->next;
+    }
+
+    return head;
+}
+
+ThrottleGroupInfoList *qmp_query_throttle_groups(Error **errp)
+{
+    ThrottleGroupInfoList *head = NULL, **p_next = &head;
+    ThrottleGroup *tg;
+
+    QTAILQ_FOREACH(tg, &throttle_groups, list) {
+        ThrottleGroupInfoList *elem = g_new0(ThrottleGroupInfoList, 1);
+        ThrottleGroupInfo *info = g_new0(ThrottleGroupInfo, 1);
+        ThrottleGroupMember *tgm;
+        ThrottleConfig cfg;
+        int64_t now = qemu_clock_get_ns(tg->clock_type);
+
+        info->name = g_strdup(tg->name);
+        if (tg->parent) {
+            info->has_parent = true;
+            info->parent = g_strdup(tg->parent->name);
+        }
+        QLIST_FOREACH(tgm, &tg->head, round_robin) {
+            info->members++;
+        }
+
+        qemu_mutex_lock(&tg->lock);
+        throttle_get_config(&tg->ts, &cfg);
+        info->limits = g_new0(ThrottleLimits, 1);
+        throttle_config_to_limits(&cfg, info->limits);
+        info->levels = throttle_group_levels(&tg->ts, now);
+        if (tg->has_guarantee) {
+            throttle_get_config(&tg->guarantee, &cfg);
+            info->has_guarantee = true;
+            info->guarantee = g_new0(ThrottleLimits, 1);
+            throttle_config_to_limits(&cfg, info->guarantee);
+            info->has_guarantee_levels = true;
+            info->guarantee_levels = throttle_group_levels(&tg->guarantee,
+                                                           now);
+        }
+        qemu_mutex_unlock(&tg->lock);
+
+        elem->value = info;
+        *p_next = elem;
+        p_next = &elem->next;
+    }
+
+    return head;
+}
+
 #undef THROTTLE_OPT_PREFIX
 #define THROTTLE_OPT_PREFIX "x-"
 
@@ -724,6 +1012,7 @@ static void throttle_group_obj_init(Object *obj)
     tg->is_initialized = false;
     qemu_mutex_init(&tg->lock);
     throttle_init(&tg->ts);
+    throttle_init(&tg->guarantee);
     QLIST_INIT(&tg->head);
 }
 
@@ -765,6 +1054,9 @@ static void throttle_group_obj_finalize(Object *obj)
     if (tg->is_initialized) {
         QTAILQ_REMOVE(&throttle_groups, tg, list);
     }
+    if (tg->parent) {
+        object_unref(OBJECT(tg->parent));
+    }
     qemu_mutex_destroy(&tg->lock);
     g_free(tg->name);
 }
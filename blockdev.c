@@ -67,6 +67,7 @@
 #include "qemu/throttle-options.h"
 #ifdef CONFIG_QEMUDP
 #include "qemu/id.h"
+#include "block/status-cache.h"
 #endif
 
 static QTAILQ_HEAD(, BlockDriverState) monitor_bdrv_states =
@@ -2092,6 +2093,7 @@ static void block_dirty_bitmap_add_prepare(BlkActionState *common,
                                action->has_granularity, action->granularity,
                                action->has_persistent, action->persistent,
                                action->has_autoload, action->autoload,
+                               action->has_sparse, action->sparse,
                                &local_err);
 
     if (!local_err) {
@@ -2821,6 +2823,7 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
                                 bool has_persistent, bool persistent,
                                 bool has_autoload, bool autoload,
+                                bool has_sparse, bool sparse,
                                 Error **errp)
 {
     BlockDriverState *bs;
@@ -2867,6 +2870,9 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
     }
 
     bdrv_dirty_bitmap_set_persistance(bitmap, persistent);
+    if (has_sparse && sparse) {
+        bdrv_dirty_bitmap_set_sparse(bitmap, true);
+    }
 }
 
 void qmp_block_dirty_bitmap_remove(const char *node, const char *name,
@@ -2943,6 +2949,133 @@ void qmp_block_dirty_bitmap_clear(const char *node, const char *name,
     bdrv_clear_dirty_bitmap(bitmap, NULL);
 }
 
+/*
+ * Look up the destination and source bitmaps of a merge, intersect or
+ * subtract command.  Returns NULL if the destination can't be modified.
+ */
+static BdrvDirtyBitmap *block_dirty_bitmap_combine_lookup(
+    const char *node, const char *dst_name, const char *src_name,
+    BdrvDirtyBitmap **psrc, Error **errp)
+{
+    BdrvDirtyBitmap *dst, *src;
+    BlockDriverState *bs;
+
+    dst = block_dirty_bitmap_lookup(node, dst_name, &bs, errp);
+    if (!dst || !bs) {
+        return NULL;
+    }
+
+    if (bdrv_dirty_bitmap_frozen(dst)) {
+        error_setg(errp,
+                   "Bitmap '%s' is currently frozen and cannot be modified",
+                   dst_name);
+        return NULL;
+    } else if (bdrv_dirty_bitmap_qmp_locked(dst)) {
+        error_setg(errp,
+                   "Bitmap '%s' is currently locked and cannot be modified",
+                   dst_name);
+        return NULL;
+    } else if (bdrv_dirty_bitmap_readonly(dst)) {
+        error_setg(errp, "Bitmap '%s' is readonly and cannot be modified",
+                   dst_name);
+        return NULL;
+    }
+
+    src = bdrv_find_dirty_bitmap(bs, src_name);
+    if (!src) {
+        error_setg(errp, "Dirty bitmap '%s' not found", src_name);
+        return NULL;
+    }
+
+    *psrc = src;
+    return dst;
+}
+
+void qmp_block_dirty_bitmap_merge(const char *node, const char *dst_name,
+                                  const char *src_name, Error **errp)
+{
+    BdrvDirtyBitmap *dst, *src;
+
+    dst = block_dirty_bitmap_combine_lookup(node, dst_name, src_name, &src,
+                                            errp);
+    if (dst) {
+        bdrv_merge_dirty_bitmap(dst, src, errp);
+    }
+}
+
+void qmp_block_dirty_bitmap_intersect(const char *node, const char *dst_name,
+                                      const char *src_name, Error **errp)
+{
+    BdrvDirtyBitmap *dst, *src;
+
+    dst = block_dirty_bitmap_combine_lookup(node, dst_name, src_name, &src,
+                                            errp);
+    if (dst) {
+        bdrv_intersect_dirty_bitmap(dst, src, errp);
+    }
+}
+
+void qmp_block_dirty_bitmap_subtract(const char *node, const char *dst_name,
+                                     const char *src_name, Error **errp)
+{
+    BdrvDirtyBitmap *dst, *src;
+
+    dst = block_dirty_bitmap_combine_lookup(node, dst_name, src_name, &src,
+                                            errp);
+    if (dst) {
+        bdrv_subtract_dirty_bitmap(dst, src, errp);
+    }
+}
+
+void qmp_block_dirty_bitmap_populate(const char *node, const char *name,
+                                     bool has_base, const char *base,
+                                     Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    BlockDriverState *bs, *base_bs;
+    AioContext *aio_context;
+
+    bitmap = block_dirty_bitmap_lookup(node, name, &bs, errp);
+    if (!bitmap || !bs) {
+        return;
+    }
+
+    if (bdrv_dirty_bitmap_frozen(bitmap)) {
+        error_setg(errp,
+                   "Bitmap '%s' is currently frozen and cannot be modified",
+                   name);
+        return;
+    } else if (bdrv_dirty_bitmap_qmp_locked(bitmap)) {
+        error_setg(errp,
+                   "Bitmap '%s' is currently locked and cannot be modified",
+                   name);
+        return;
+    } else if (bdrv_dirty_bitmap_readonly(bitmap)) {
+        error_setg(errp, "Bitmap '%s' is readonly and cannot be modified",
+                   name);
+        return;
+    }
+
+    if (has_base) {
+        base_bs = bdrv_lookup_bs(NULL, base, errp);
+        if (!base_bs) {
+            return;
+        }
+        if (bs == base_bs || !bdrv_chain_contains(bs, base_bs)) {
+            error_setg(errp, "Node '%s' is not a backing image of '%s'",
+                       base, node);
+            return;
+        }
+    } else {
+        base_bs = backing_bs(bs);
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+    bdrv_populate_dirty_bitmap(bs, bitmap, base_bs, errp);
+    aio_context_release(aio_context);
+}
+
 BlockDirtyBitmapSha256 *qmp_x_debug_block_dirty_bitmap_sha256(const char *node,
                                                               const char *name,
                                                               Error **errp)
@@ -3079,11 +3212,34 @@ out:
     aio_context_release(aio_context);
 }
 
+/* Validate the copy pipeline arguments of block-stream and block-commit */
+static bool block_job_check_pipeline(bool has_buf_size, int64_t buf_size,
+                                     bool has_max_in_flight,
+                                     int64_t max_in_flight, Error **errp)
+{
+    if (has_buf_size &&
+        (buf_size < BDRV_SECTOR_SIZE || buf_size > INT_MAX ||
+         !QEMU_IS_ALIGNED(buf_size, BDRV_SECTOR_SIZE))) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "buf-size",
+                   "a multiple of 512 between 512 and 2G");
+        return false;
+    }
+    if (has_max_in_flight &&
+        (max_in_flight < 1 || max_in_flight > BLOCK_JOB_MAX_IN_FLIGHT)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-in-flight",
+                   "a value between 1 and " stringify(BLOCK_JOB_MAX_IN_FLIGHT));
+        return false;
+    }
+    return true;
+}
+
 void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
                       bool has_base, const char *base,
                       bool has_base_node, const char *base_node,
                       bool has_backing_file, const char *backing_file,
                       bool has_speed, int64_t speed,
+                      bool has_buf_size, int64_t buf_size,
+                      bool has_max_in_flight, int64_t max_in_flight,
                       bool has_on_error, BlockdevOnError on_error,
                       Error **errp)
 {
@@ -3096,6 +3252,10 @@ void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
     if (!has_on_error) {
         on_error = BLOCKDEV_ON_ERROR_REPORT;
     }
+    if (!block_job_check_pipeline(has_buf_size, buf_size,
+                                  has_max_in_flight, max_in_flight, errp)) {
+        return;
+    }
 
     bs = bdrv_lookup_bs(device, device, errp);
     if (!bs) {
@@ -3154,7 +3314,8 @@ void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
     base_name = has_backing_file ? backing_file : base_name;
 
     stream_start(has_job_id ? job_id : NULL, bs, base_bs, base_name,
-                 has_speed ? speed : 0, on_error, &local_err);
+                 has_speed ? speed : 0, has_buf_size ? buf_size : 0,
+                 has_max_in_flight ? max_in_flight : 0, on_error, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         goto out;
@@ -3171,6 +3332,8 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
                       bool has_top, const char *top,
                       bool has_backing_file, const char *backing_file,
                       bool has_speed, int64_t speed,
+                      bool has_buf_size, int64_t buf_size,
+                      bool has_max_in_flight, int64_t max_in_flight,
                       bool has_filter_node_name, const char *filter_node_name,
                       Error **errp)
 {
@@ -3190,6 +3353,12 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
     if (!has_filter_node_name) {
         filter_node_name = NULL;
     }
+    if (!has_buf_size) {
+        buf_size = 0;
+    }
+    if (!has_max_in_flight) {
+        max_in_flight = 0;
+    }
 
     /* Important Note:
      *  libvirt relies on the DeviceNotFound error class in order to probe for
@@ -3209,6 +3378,11 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
         return;
     }
 
+    if (!block_job_check_pipeline(has_buf_size, buf_size,
+                                  has_max_in_flight, max_in_flight, errp)) {
+        return;
+    }
+
     aio_context = bdrv_get_aio_context(bs);
     aio_context_acquire(aio_context);
 
@@ -3263,6 +3437,11 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
                              " but 'top' is the active layer");
             goto out;
         }
+        if (has_buf_size || has_max_in_flight) {
+            error_setg(errp, "'buf-size' and 'max-in-flight' are not"
+                             " supported when 'top' is the active layer");
+            goto out;
+        }
         commit_active_start(has_job_id ? job_id : NULL, bs, base_bs,
                             BLOCK_JOB_DEFAULT, speed, on_error,
                             filter_node_name, NULL, NULL, false, &local_err);
@@ -3272,7 +3451,8 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
             goto out;
         }
         commit_start(has_job_id ? job_id : NULL, bs, base_bs, top_bs, speed,
-                     on_error, has_backing_file ? backing_file : NULL,
+                     buf_size, max_in_flight, on_error,
+                     has_backing_file ? backing_file : NULL,
                      filter_node_name, &local_err);
     }
     if (local_err != NULL) {
@@ -3323,6 +3503,12 @@ static BlockJob *do_drive_backup(DriveBackup *backup, BlockJobTxn *txn,
     if (!backup->has_compress) {
         backup->compress = false;
     }
+    if (!backup->has_max_workers) {
+        backup->max_workers = 0;
+    }
+    if (!backup->has_max_chunk) {
+        backup->max_chunk = 0;
+    }
 
     bs = qmp_get_root_bs(backup->device, errp);
     if (!bs) {
@@ -3426,6 +3612,7 @@ static BlockJob *do_drive_backup(DriveBackup *backup, BlockJobTxn *txn,
 
     job = backup_job_create(backup->job_id, bs, target_bs, backup->speed,
                             backup->sync, bmap, backup->compress,
+                            backup->max_workers, backup->max_chunk,
                             backup->on_source_error, backup->on_target_error,
                             job_flags, NULL, NULL, txn, &local_err);
     bdrv_unref(target_bs);
@@ -3485,6 +3672,12 @@ BlockJob *do_blockdev_backup(BlockdevBackup *backup, BlockJobTxn *txn,
     if (!backup->has_compress) {
         backup->compress = false;
     }
+    if (!backup->has_max_workers) {
+        backup->max_workers = 0;
+    }
+    if (!backup->has_max_chunk) {
+        backup->max_chunk = 0;
+    }
 
     bs = qmp_get_root_bs(backup->device, errp);
     if (!bs) {
@@ -3518,6 +3711,7 @@ BlockJob *do_blockdev_backup(BlockdevBackup *backup, BlockJobTxn *txn,
     }
     job = backup_job_create(backup->job_id, bs, target_bs, backup->speed,
                             backup->sync, NULL, backup->compress,
+                            backup->max_workers, backup->max_chunk,
                             backup->on_source_error, backup->on_target_error,
                             job_flags, NULL, NULL, txn, &local_err);
     if (local_err != NULL) {
@@ -3555,7 +3749,12 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                                    bool has_unmap, bool unmap,
                                    bool has_filter_node_name,
                                    const char *filter_node_name,
-                                   Error **errp)
+                                   bool has_copy_mode,
+                                   MirrorCopyMode copy_mode,
+                                   bool has_bitmap, const char *bitmap,
+                                   bool has_checkpoint_interval,
+                                   int64_t checkpoint_interval,
+                                   bool resume, Error **errp)
 {
 
     if (!has_speed) {
@@ -3579,6 +3778,25 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
     if (!has_filter_node_name) {
         filter_node_name = NULL;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
+    if (!has_bitmap) {
+        bitmap = NULL;
+    }
+    if (!has_checkpoint_interval) {
+        checkpoint_interval = 10;
+    }
+
+    if (has_checkpoint_interval && !has_bitmap) {
+        error_setg(errp, "Parameter 'checkpoint-interval' requires 'bitmap'");
+        return;
+    }
+    if (checkpoint_interval <= 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "checkpoint-interval",
+                   "a positive number of seconds");
+        return;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
@@ -3609,7 +3827,7 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                  has_replaces ? replaces : NULL,
                  speed, granularity, buf_size, sync, backing_mode,
                  on_source_error, on_target_error, unmap, filter_node_name,
-                 errp);
+                 copy_mode, bitmap, checkpoint_interval, resume, errp);
 }
 
 void qmp_drive_mirror(DriveMirror *arg, Error **errp)
@@ -3755,6 +3973,11 @@ void qmp_drive_mirror(DriveMirror *arg, Error **errp)
                            arg->has_on_target_error, arg->on_target_error,
                            arg->has_unmap, arg->unmap,
                            false, NULL,
+                           arg->has_copy_mode, arg->copy_mode,
+                           arg->has_bitmap, arg->bitmap,
+                           arg->has_checkpoint_interval,
+                           arg->checkpoint_interval,
+                           arg->mode == NEW_IMAGE_MODE_EXISTING,
                            &local_err);
     bdrv_unref(target_bs);
     error_propagate(errp, local_err);
@@ -3775,6 +3998,10 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                          BlockdevOnError on_target_error,
                          bool has_filter_node_name,
                          const char *filter_node_name,
+                         bool has_copy_mode, MirrorCopyMode copy_mode,
+                         bool has_bitmap, const char *bitmap,
+                         bool has_checkpoint_interval,
+                         int64_t checkpoint_interval,
                          Error **errp)
 {
     BlockDriverState *bs;
@@ -3807,7 +4034,10 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                            has_on_target_error, on_target_error,
                            true, true,
                            has_filter_node_name, filter_node_name,
-                           &local_err);
+                           has_copy_mode, copy_mode,
+                           has_bitmap, bitmap,
+                           has_checkpoint_interval, checkpoint_interval,
+                           true, &local_err);
     error_propagate(errp, local_err);
 
     aio_context_release(aio_context);
@@ -3850,6 +4080,20 @@ void qmp_block_job_set_speed(const char *device, int64_t speed, Error **errp)
     aio_context_release(aio_context);
 }
 
+void qmp_block_job_set_copy_mode(const char *device, MirrorCopyMode copy_mode,
+                                 Error **errp)
+{
+    AioContext *aio_context;
+    BlockJob *job = find_block_job(device, &aio_context, errp);
+
+    if (!job) {
+        return;
+    }
+
+    block_job_set_copy_mode(job, copy_mode, errp);
+    aio_context_release(aio_context);
+}
+
 void qmp_block_job_cancel(const char *device,
                           bool has_force, bool force, Error **errp)
 {
@@ -4059,9 +4303,10 @@ out:
     qemu_opts_del(opts);
 }
 
-void qmp_blockdev_add(BlockdevOptions *options, Error **errp)
+static BlockDriverState *blockdev_add_node(BlockdevOptions *options,
+                                          Error **errp)
 {
-    BlockDriverState *bs;
+    BlockDriverState *bs = NULL;
     QObject *obj;
     Visitor *v = qobject_output_visitor_new(&obj);
     QDict *qdict;
@@ -4092,6 +4337,12 @@ void qmp_blockdev_add(BlockdevOptions *options, Error **errp)
 
 fail:
     visit_free(v);
+    return bs;
+}
+
+void qmp_blockdev_add(BlockdevOptions *options, Error **errp)
+{
+    blockdev_add_node(options, errp);
 }
 
 void qmp_blockdev_del(const char *node_name, Error **errp)
@@ -4269,6 +4520,7 @@ void qmp_x_block_latency_histogram_set(
 {
     BlockBackend *blk = blk_by_name(device);
     BlockAcctStats *stats;
+    AioContext *aio_context;
 
     if (!blk) {
         error_setg(errp, "Device '%s' not found", device);
@@ -4276,11 +4528,17 @@ void qmp_x_block_latency_histogram_set(
     }
     stats = blk_get_stats(blk);
 
+    /* Requests complete into the bins of their thread's shard, so replace
+     * them only while nothing is in flight */
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+    blk_drain(blk);
+
     if (!has_boundaries && !has_boundaries_read && !has_boundaries_write &&
         !has_boundaries_flush)
     {
         block_latency_histograms_clear(stats);
-        return;
+        goto out;
     }
 
     if (has_boundaries || has_boundaries_read) {
@@ -4300,6 +4558,9 @@ void qmp_x_block_latency_histogram_set(
             stats, BLOCK_ACCT_FLUSH,
             has_boundaries_flush ? boundaries_flush : boundaries);
     }
+
+out:
+    aio_context_release(aio_context);
 }
 
 #ifdef CONFIG_QEMUDP
@@ -4379,6 +4640,7 @@ void qmp_relink_chain(const char *device,
     qdict_copy_default(new_base_bs_options, base_bs->explicit_options, BDRV_OPT_CACHE_DIRECT);
     qdict_copy_default(new_base_bs_options, base_bs->explicit_options, BDRV_OPT_READ_ONLY);
     qdict_copy_default(new_base_bs_options, base_bs->explicit_options, BDRV_OPT_DISCARD);
+    qdict_copy_default(new_base_bs_options, base_bs->explicit_options, BDRV_OPT_LAZY_OPEN);
 
     /* Make sure the filename is in the new options */
     qdict_put_str(new_base_bs_options, "file.driver", "file");
@@ -4416,6 +4678,9 @@ void qmp_relink_chain(const char *device,
      * in the QCOW2 cache cleaner */
     bdrv_drop_intermediate_clear(top_bs, base_bs, NULL, true);
 
+    /* The external commit changed the data of base_bs behind our back */
+    bdrv_bsc_invalidate(base_bs);
+
     if (top_bs_child_ro) {
         bdrv_reopen(top_bs_child, top_bs_child->open_flags & ~BDRV_O_RDWR, NULL);
     }
@@ -4425,6 +4690,310 @@ out_drain:
 out:
     aio_context_release(aio_context);
 }
+
+void qmp_block_status_cache_set(const char *node_name, bool enable,
+                                bool has_max_extents, uint32_t max_extents,
+                                Error **errp)
+{
+    BlockDriverState *bs;
+    AioContext *aio_context;
+
+    bs = bdrv_find_node(node_name);
+    if (!bs) {
+        error_setg(errp, "Device '%s' not found", node_name);
+        return;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    /* Make sure no walk is in flight while the cache comes and goes */
+    bdrv_drained_begin(bs);
+    if (enable) {
+        bdrv_bsc_enable(bs, has_max_extents ? max_extents : 0);
+    } else {
+        bdrv_bsc_disable(bs);
+    }
+    bdrv_drained_end(bs);
+
+    aio_context_release(aio_context);
+}
+
+typedef struct BlockStatusCacheListState {
+    BlockDriverState *bs;
+    BlockStatusCacheExtentList **tail;
+} BlockStatusCacheListState;
+
+static void block_status_cache_list_extent(void *opaque, bool want_zero,
+                                           const BdrvStatusExtent *ext)
+{
+    BlockStatusCacheListState *s = opaque;
+    BlockStatusCacheExtentList *entry = g_new0(BlockStatusCacheExtentList, 1);
+    BlockStatusCacheExtent *value = g_new0(BlockStatusCacheExtent, 1);
+    BlockDriverState *owner = s->bs;
+    int i;
+
+    value->offset = ext->offset;
+    value->length = ext->bytes;
+    value->want_zero = want_zero;
+    value->depth = ext->depth;
+    value->flags = ext->ret;
+    for (i = 0; owner && i < ext->depth; i++) {
+        owner = backing_bs(owner);
+    }
+    if (owner && ext->depth >= 0) {
+        value->has_owner = true;
+        value->owner = g_strdup(bdrv_get_node_name(owner));
+    }
+
+    entry->value = value;
+    *s->tail = entry;
+    s->tail = &entry->next;
+}
+
+BlockStatusCacheInfo *qmp_query_block_status_cache(const char *node_name,
+                                                   bool has_extents,
+                                                   bool extents,
+                                                   Error **errp)
+{
+    BlockDriverState *bs;
+    AioContext *aio_context;
+    BdrvStatusCacheStats stats;
+    BlockStatusCacheInfo *info;
+
+    bs = bdrv_find_node(node_name);
+    if (!bs) {
+        error_setg(errp, "Device '%s' not found", node_name);
+        return NULL;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    bdrv_bsc_get_stats(bs, &stats);
+    info = g_new0(BlockStatusCacheInfo, 1);
+    info->enabled = stats.enabled;
+    info->max_extents = stats.max_extents;
+    info->nr_extents = stats.nr_extents;
+    info->hits = stats.hits;
+    info->misses = stats.misses;
+    info->invalidations = stats.invalidations;
+
+    if (has_extents && extents) {
+        BlockStatusCacheListState s = {
+            .bs = bs,
+            .tail = &info->extents,
+        };
+
+        bdrv_bsc_foreach_extent(bs, block_status_cache_list_extent, &s);
+        info->has_extents = true;
+    }
+
+    aio_context_release(aio_context);
+    return info;
+}
+
+FlushAllFailureList *qmp_x_flush_all(bool has_timeout, uint64_t timeout,
+                                     bool has_max_in_flight,
+                                     uint32_t max_in_flight,
+                                     Error **errp)
+{
+    FlushAllFailureList *head = NULL, **tail = &head;
+    GSList *failures = NULL, *l;
+
+    if (has_timeout && timeout > INT64_MAX / SCALE_MS) {
+        error_setg(errp, "timeout must be at most %" PRId64 " ms",
+                   INT64_MAX / SCALE_MS);
+        return NULL;
+    }
+
+    bdrv_flush_all_parallel(has_max_in_flight ? max_in_flight : 0,
+                            has_timeout ? timeout * SCALE_MS : 0,
+                            &failures);
+
+    for (l = failures; l; l = l->next) {
+        BdrvFlushFailure *f = l->data;
+        FlushAllFailureList *entry = g_new0(FlushAllFailureList, 1);
+
+        entry->value = g_new0(FlushAllFailure, 1);
+        entry->value->node_name = g_strdup(f->node_name);
+        entry->value->error = g_strdup(f->ret == -ETIMEDOUT ?
+                                       "Timed out" : strerror(-f->ret));
+        *tail = entry;
+        tail = &entry->next;
+    }
+    g_slist_free_full(failures, bdrv_flush_failure_free);
+
+    return head;
+}
+
+void qmp_x_block_set_merge(const char *node_name, bool enable,
+                           bool has_window, uint32_t window, Error **errp)
+{
+    BlockDriverState *bs;
+    BlockBackend *blk = NULL;
+    AioContext *aio_context;
+    bool found = false;
+
+    bs = bdrv_find_node(node_name);
+    if (!bs) {
+        error_setg(errp, "Device '%s' not found", node_name);
+        return;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    while ((blk = blk_all_next(blk)) != NULL) {
+        if (blk_bs(blk) == bs) {
+            blk_set_merge(blk, enable, has_window ? window * SCALE_US : 0);
+            found = true;
+        }
+    }
+    if (!found) {
+        error_setg(errp, "Node '%s' has no device attached", node_name);
+    }
+
+    aio_context_release(aio_context);
+}
+
+void qmp_x_block_latency_qos_set(const char *node_name, bool enable,
+                                 bool has_group, const char *group,
+                                 bool has_priority, uint32_t priority,
+                                 bool has_target, uint32_t target,
+                                 Error **errp)
+{
+    BlockDriverState *bs;
+    BlockBackend *blk = NULL;
+    AioContext *aio_context;
+    bool found = false;
+
+    bs = bdrv_find_node(node_name);
+    if (!bs) {
+        error_setg(errp, "Device '%s' not found", node_name);
+        return;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    while ((blk = blk_all_next(blk)) != NULL) {
+        if (blk_bs(blk) == bs) {
+            blk_set_latency_qos(blk, enable, has_group ? group : "",
+                                has_priority ? priority : 0,
+                                has_target ? (int64_t)target * SCALE_US : 0);
+            found = true;
+        }
+    }
+    if (!found) {
+        error_setg(errp, "Node '%s' has no device attached", node_name);
+    }
+
+    aio_context_release(aio_context);
+}
+
+BlockLatencyQosInfoList *qmp_query_block_latency_qos(Error **errp)
+{
+    BlockLatencyQosInfoList *head = NULL, **tail = &head;
+    BlockBackend *blk = NULL;
+
+    while ((blk = blk_all_next(blk)) != NULL) {
+        LatencyQosMember *m = blk_get_latency_qos(blk);
+        BlockLatencyQosInfoList *entry;
+        BlockLatencyQosInfo *info;
+        LatencyQosStats stats;
+
+        if (!m || !blk_bs(blk)) {
+            continue;
+        }
+
+        latency_qos_get_stats(m, &stats);
+        info = g_new0(BlockLatencyQosInfo, 1);
+        info->node_name = g_strdup(bdrv_get_node_name(blk_bs(blk)));
+        info->group = g_strdup(latency_qos_get_group(m));
+        info->priority = latency_qos_get_priority(m);
+        info->target = latency_qos_get_target(m) / SCALE_US;
+        info->depth_limit = stats.depth_limit;
+        info->in_flight = stats.in_flight;
+        info->latency = stats.mean_latency_ns / SCALE_US;
+        info->delayed = stats.delayed;
+
+        entry = g_new0(BlockLatencyQosInfoList, 1);
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
+static void coroutine_fn blockdev_warm_co(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    Error *local_err = NULL;
+
+    if (bdrv_co_load_metadata(bs, &local_err) < 0) {
+        error_reportf_err(local_err, "Failed to warm node '%s': ",
+                          bdrv_get_node_name(bs));
+    }
+    bdrv_dec_in_flight(bs);
+}
+
+/* The in-flight reference keeps bs around until the coroutine is done */
+static void blockdev_warm_start(BlockDriverState *bs)
+{
+    Coroutine *co;
+
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(blockdev_warm_co, bs);
+    bdrv_coroutine_enter(bs, co);
+}
+
+void qmp_x_blockdev_preopen(BlockdevOptions *options, Error **errp)
+{
+    BlockDriverState *bs;
+    AioContext *aio_context;
+
+    if (!options->has_lazy_open) {
+        options->has_lazy_open = true;
+        options->lazy_open = true;
+    }
+
+    bs = blockdev_add_node(options, errp);
+    if (!bs) {
+        return;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+    blockdev_warm_start(bs);
+    aio_context_release(aio_context);
+}
+
+void qmp_x_blockdev_warm(const char *node_name,
+                         bool has_background, bool background,
+                         Error **errp)
+{
+    BlockDriverState *bs;
+    AioContext *aio_context;
+
+    bs = bdrv_find_node(node_name);
+    if (!bs) {
+        error_setg(errp, "Device '%s' not found", node_name);
+        return;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    if (has_background && background) {
+        blockdev_warm_start(bs);
+    } else {
+        bdrv_load_metadata(bs, errp);
+    }
+
+    aio_context_release(aio_context);
+}
 #endif
 
 QemuOptsList qemu_common_drive_opts = {
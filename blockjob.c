@@ -67,6 +67,7 @@ bool BlockJobVerbTable[BLOCK_JOB_VERB__MAX][BLOCK_JOB_STATUS__MAX] = {
     [BLOCK_JOB_VERB_COMPLETE]             = {0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0},
     [BLOCK_JOB_VERB_FINALIZE]             = {0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0},
     [BLOCK_JOB_VERB_DISMISS]              = {0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0},
+    [BLOCK_JOB_VERB_SET_COPY_MODE]        = {0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
 };
 
 static void block_job_state_transition(BlockJob *job, BlockJobStatus s1)
@@ -684,6 +685,18 @@ void block_job_set_speed(BlockJob *job, int64_t speed, Error **errp)
     block_job_enter_cond(job, block_job_timer_pending);
 }
 
+void block_job_set_copy_mode(BlockJob *job, MirrorCopyMode mode, Error **errp)
+{
+    if (!job->driver->set_copy_mode) {
+        error_setg(errp, QERR_UNSUPPORTED);
+        return;
+    }
+    if (block_job_apply_verb(job, BLOCK_JOB_VERB_SET_COPY_MODE, errp)) {
+        return;
+    }
+    job->driver->set_copy_mode(job, mode, errp);
+}
+
 void block_job_complete(BlockJob *job, Error **errp)
 {
     /* Should not be reachable via external interface for internal jobs */
@@ -0,0 +1,201 @@
+/*
+ * Print the block statistics that qemu-dp exports in shared memory
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The export is started with the block-stats-shm-start QMP command.
+ * Reading it does not involve qemu-dp at all, so it can be sampled as
+ * often as needed.
+ */
+
+#include "qemu/osdep.h"
+#include "block/stats-shm.h"
+#include <sys/mman.h>
+
+/* Give up on a slot that is being written for longer than this */
+#define QEMU_DP_STATS_MAX_RETRIES   1000
+
+static const char *const type_names[] = { "rd", "wr", "flush" };
+
+static void qemu_dp_stats_usage(const char *name, int code)
+{
+    fprintf(stderr, "Usage: %s [-h] [-l] [-i <seconds> [-n <count>]] <path>\n",
+            name);
+    fprintf(stderr, "  -h: show this help\n");
+    fprintf(stderr, "  -l: print latency histograms too\n");
+    fprintf(stderr, "  -i: print the statistics every <seconds>\n");
+    fprintf(stderr, "  -n: stop after <count> samples\n");
+    exit(code);
+}
+
+/* Copy a consistent snapshot of @slot into @copy */
+static bool qemu_dp_stats_read_slot(BlockStatsShmSlot *slot,
+                                    BlockStatsShmSlot *copy)
+{
+    unsigned seq;
+    int i;
+
+    for (i = 0; i < QEMU_DP_STATS_MAX_RETRIES; i++) {
+        seq = seqlock_read_begin(&slot->seqlock);
+        memcpy(copy, slot, sizeof(*copy));
+        if (!seqlock_read_retry(&slot->seqlock, seq)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void qemu_dp_stats_print_hist(const char *type,
+                                     const BlockStatsShmHist *hist)
+{
+    uint32_t i, nbins = MIN(hist->nbins, BLOCK_STATS_SHM_HIST_BINS);
+
+    if (!nbins) {
+        return;
+    }
+    printf("    %s latency:", type);
+    for (i = 0; i < nbins; i++) {
+        printf(" [%" PRIu64 ",", i ? hist->boundaries[i - 1] : 0);
+        if (i < nbins - 1) {
+            printf("%" PRIu64 ")", hist->boundaries[i]);
+        } else {
+            printf("inf)");
+        }
+        printf("=%" PRIu64, hist->bins[i]);
+    }
+    printf("\n");
+}
+
+static void qemu_dp_stats_print(BlockStatsShmHeader *hdr, bool latency)
+{
+    BlockStatsShmSlot slot;
+    uint32_t i;
+    int t;
+
+    printf("pid %" PRIu32 ", updated at %" PRIu64 " ns, "
+           "%" PRIu64 " devices dropped\n",
+           hdr->pid, atomic_read__nocheck(&hdr->update_time_ns),
+           atomic_read__nocheck(&hdr->dropped));
+
+    for (i = 0; i < hdr->nr_slots; i++) {
+        BlockStatsShmSlot *p = (BlockStatsShmSlot *)
+            ((char *)hdr + hdr->header_size + (size_t)i * hdr->slot_size);
+
+        if (!qemu_dp_stats_read_slot(p, &slot)) {
+            fprintf(stderr, "slot %" PRIu32 " is busy, skipped\n", i);
+            continue;
+        }
+        if (!slot.in_use) {
+            continue;
+        }
+        slot.name[sizeof(slot.name) - 1] = '\0';
+
+        printf("%s %s:", slot.kind == BLOCK_STATS_SHM_DEVICE ?
+                         "device" : "node", slot.name);
+        for (t = 0; t < 3; t++) {
+            printf(" %s_ops=%" PRIu64 " %s_bytes=%" PRIu64
+                   " %s_time_ns=%" PRIu64,
+                   type_names[t], slot.nr_ops[t],
+                   type_names[t], slot.nr_bytes[t],
+                   type_names[t], slot.total_time_ns[t]);
+        }
+        printf(" failed=%" PRIu64 "/%" PRIu64 "/%" PRIu64,
+               slot.failed_ops[0], slot.failed_ops[1], slot.failed_ops[2]);
+        printf(" idle_ns=%" PRId64, slot.idle_time_ns);
+        if (slot.queue_size) {
+            printf(" queue=%" PRIu32 "/%" PRIu32,
+                   slot.queue_inflight, slot.queue_size);
+        }
+        printf("\n");
+
+        if (latency) {
+            for (t = 0; t < 3; t++) {
+                qemu_dp_stats_print_hist(type_names[t], &slot.latency[t]);
+            }
+        }
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    BlockStatsShmHeader *hdr;
+    bool latency = false;
+    int interval = 0, count = 0;
+    struct stat st;
+    void *base;
+    int c, fd;
+
+    while ((c = getopt(argc, argv, "hli:n:")) != -1) {
+        switch (c) {
+        case 'h':
+            qemu_dp_stats_usage(argv[0], 0);
+            break;
+        case 'l':
+            latency = true;
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        default:
+            qemu_dp_stats_usage(argv[0], 1);
+            break;
+        }
+    }
+    if (optind != argc - 1 || interval < 0 || count < 0) {
+        qemu_dp_stats_usage(argv[0], 1);
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    if (st.st_size < sizeof(*hdr)) {
+        fprintf(stderr, "%s: not a statistics segment\n", argv[optind]);
+        return 1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    close(fd);
+
+    hdr = base;
+    if (atomic_read(&hdr->magic) != BLOCK_STATS_SHM_MAGIC) {
+        fprintf(stderr, "%s: not a statistics segment\n", argv[optind]);
+        return 1;
+    }
+    smp_rmb();
+    if (hdr->version != BLOCK_STATS_SHM_VERSION ||
+        hdr->slot_size < sizeof(BlockStatsShmSlot) ||
+        hdr->header_size < sizeof(*hdr) ||
+        hdr->header_size + (uint64_t)hdr->nr_slots * hdr->slot_size >
+        st.st_size) {
+        fprintf(stderr, "%s: unsupported statistics segment\n",
+                argv[optind]);
+        return 1;
+    }
+
+    for (;;) {
+        if (!atomic_read__nocheck(&hdr->update_time_ns)) {
+            fprintf(stderr, "%s: export stopped\n", argv[optind]);
+            return 1;
+        }
+        qemu_dp_stats_print(hdr, latency);
+        if (!interval || (count && --count == 0)) {
+            break;
+        }
+        sleep(interval);
+    }
+
+    munmap(base, st.st_size);
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include "qemu/osdep.h"
 #include "qemu-version.h"
 #include "qemu/thread.h"
+#include "qemu/coroutine.h"
 #include "chardev/char-fe.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qjson.h"
@@ -93,24 +94,23 @@ static void dp_monitor_flush_locked(DPMonitor *m)
     }
 }
 
-/* flush at every end of line */
-static void dp_monitor_puts(DPMonitor *m, const char *str)
+/*
+ * Queue @json, a complete line, for output and write it out.  Lines are
+ * handed to the chardev in one piece; they are only copied to outbuf if
+ * earlier output is still pending or the chardev does not take all of it.
+ * Takes over the caller's reference to @json.
+ */
+static void dp_monitor_write_line(DPMonitor *m, QString *json)
 {
-    char c;
-
     qemu_mutex_lock(&m->out_lock);
-    for(;;) {
-        c = *str++;
-        if (c == '\0')
-            break;
-        if (c == '\n') {
-            qstring_append_chr(m->outbuf, '\r');
-        }
-        qstring_append_chr(m->outbuf, c);
-        if (c == '\n') {
-            dp_monitor_flush_locked(m);
-        }
+    if (qstring_get_length(m->outbuf)) {
+        qstring_append(m->outbuf, qstring_get_str(json));
+        QDECREF(json);
+    } else {
+        QDECREF(m->outbuf);
+        m->outbuf = json;
     }
+    dp_monitor_flush_locked(m);
     qemu_mutex_unlock(&m->out_lock);
 }
 
@@ -121,10 +121,9 @@ static void dp_monitor_json_emitter(DPMonitor *m, const QObject *data)
     json = qobject_to_json(data);
     assert(json != NULL);
 
-    qstring_append_chr(json, '\n');
-    dp_monitor_puts(m, qstring_get_str(json));
-
-    QDECREF(json);
+    /* qobject_to_json() escapes newlines, so this is the only one */
+    qstring_append(json, "\r\n");
+    dp_monitor_write_line(m, json);
 }
 
 static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
@@ -258,6 +257,20 @@ VersionInfo *qmp_query_version(Error **errp)
     return info;
 }
 
+CoroutinePoolInfo *qmp_query_coroutine_pool(Error **errp)
+{
+    CoroutinePoolInfo *info = g_new0(CoroutinePoolInfo, 1);
+    CoroutinePoolStats stats;
+
+    qemu_coroutine_get_pool_stats(&stats);
+    info->batch_size = stats.batch_size;
+    info->hits = stats.hits;
+    info->misses = stats.misses;
+    info->steals = stats.steals;
+
+    return info;
+}
+
 void qmp_qmp_capabilities(bool has_enable, QMPCapabilityList *enable,
                           Error **errp)
 {
@@ -29,6 +29,8 @@
 #include "sysemu/blockdev.h"
 #include "sysemu/iothread.h"
 #include "sysemu/block-backend.h"
+#include "block/aio-wait.h"
+#include "block/flight-recorder.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
@@ -60,6 +62,9 @@ struct ioreq {
     struct XenBlkDev    *blkdev;
     QLIST_ENTRY(ioreq)   list;
     BlockAcctCookie     acct;
+
+    /* when the request was consumed, 0 if the flight recorder is off */
+    int64_t             fr_start_ns;
 };
 
 #define MAX_RING_PAGE_ORDER 4
@@ -123,10 +128,51 @@ static void ioreq_reset(struct ioreq *ioreq)
     ioreq->blkdev = NULL;
     memset(&ioreq->list, 0, sizeof(ioreq->list));
     memset(&ioreq->acct, 0, sizeof(ioreq->acct));
+    ioreq->fr_start_ns = 0;
 
     qemu_iovec_reset(&ioreq->v);
 }
 
+static int64_t ioreq_flight_record(struct ioreq *ioreq,
+                                   FlightRecorderEvent event, int result)
+{
+    struct XenDevice *xendev = &ioreq->blkdev->xendev;
+    FlightRecorderOp op;
+    uint64_t offset = ioreq->start;
+    uint32_t bytes = ioreq->v.size;
+
+    if (likely(!atomic_read(&flight_recorder_enabled))) {
+        return 0;
+    }
+
+    switch (ioreq->req.operation) {
+    case BLKIF_OP_READ:
+        op = FLIGHT_RECORDER_READ;
+        break;
+    case BLKIF_OP_WRITE:
+        op = FLIGHT_RECORDER_WRITE;
+        break;
+    case BLKIF_OP_FLUSH_DISKCACHE:
+        op = FLIGHT_RECORDER_FLUSH;
+        break;
+    case BLKIF_OP_DISCARD:
+    {
+        struct blkif_request_discard *req = (void *)&ioreq->req;
+        op = FLIGHT_RECORDER_DISCARD;
+        offset = req->sector_number << BDRV_SECTOR_BITS;
+        bytes = MIN(req->nr_sectors << BDRV_SECTOR_BITS, UINT32_MAX);
+        break;
+    }
+    default:
+        op = FLIGHT_RECORDER_OTHER;
+        break;
+    }
+
+    return flight_recorder_do_record(event, op,
+                                     xendev->dom << 16 | (xendev->dev & 0xffff),
+                                     ioreq->req.id, offset, bytes, result);
+}
+
 static struct ioreq *ioreq_start(struct XenBlkDev *blkdev)
 {
     struct ioreq *ioreq = NULL;
@@ -175,6 +221,15 @@ static void ioreq_release(struct ioreq *ioreq)
     blkdev->requests_inflight--;
 }
 
+/* Ring occupancy, for the statistics export */
+static void blk_queue_stats(void *opaque, unsigned *inflight, unsigned *size)
+{
+    struct XenBlkDev *blkdev = opaque;
+
+    *inflight = atomic_read(&blkdev->requests_inflight);
+    *size = blkdev->max_requests;
+}
+
 /* Avoid log flooding of errors by turning them
  * raising the required log level if we have had too
  * many consecutive ones. Avoids flooding logs
@@ -366,6 +421,7 @@ static void qemu_aio_complete(void *opaque, int ret)
     }
 
     ioreq->status = ioreq->aio_errors ? BLKIF_RSP_ERROR : BLKIF_RSP_OKAY;
+    ioreq_flight_record(ioreq, FLIGHT_RECORDER_XEN_COMPLETE, ioreq->status);
     ioreq_finish(ioreq);
 
     switch (ioreq->req.operation) {
@@ -528,6 +584,11 @@ static int blk_send_response(struct ioreq *ioreq)
 
     blkdev->rings.common.rsp_prod_pvt++;
 
+    if (ioreq->fr_start_ns) {
+        ioreq_flight_record(ioreq, FLIGHT_RECORDER_XEN_RESPONSE, resp->status);
+        flight_recorder_check_latency(ioreq->fr_start_ns);
+    }
+
     RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&blkdev->rings.common, send_notify);
     if (blkdev->rings.common.rsp_prod_pvt == blkdev->rings.common.req_cons) {
         /*
@@ -573,6 +634,7 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
     struct ioreq *ioreq;
     int inflight_atstart = blkdev->requests_inflight;
     int batched = 0;
+    int rc_parse;
 
     blkdev->more_work = 0;
 
@@ -603,7 +665,11 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
         blkdev->rings.common.req_cons = ++rc;
 
         /* parse them */
-        if (ioreq_parse(ioreq) != 0) {
+        rc_parse = ioreq_parse(ioreq);
+        ioreq->fr_start_ns = ioreq_flight_record(ioreq,
+                                                 FLIGHT_RECORDER_XEN_CONSUME,
+                                                 rc_parse ? BLKIF_RSP_ERROR : 0);
+        if (rc_parse != 0) {
 
             switch (ioreq->req.operation) {
             case BLKIF_OP_READ:
@@ -631,6 +697,7 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
         if (inflight_atstart > IO_PLUG_THRESHOLD && batched >= inflight_atstart) {
             blk_io_unplug(blkdev->blk);
         }
+        ioreq_flight_record(ioreq, FLIGHT_RECORDER_XEN_SUBMIT, 0);
         ioreq_runio_qemu_aio(ioreq);
         if (inflight_atstart > IO_PLUG_THRESHOLD) {
             if (batched >= inflight_atstart) {
@@ -787,6 +854,20 @@ out_error:
     return -1;
 }
 
+/* Serve the disk from the IOThread that the toolstack picked for it. Other
+ * users of the same node follow it there. */
+static void blk_move_to_iothread(struct XenBlkDev *blkdev)
+{
+    AioContext *old_context = blk_get_aio_context(blkdev->blk);
+
+    if (!blkdev->xendev.ctx || old_context == blkdev->xendev.ctx) {
+        return;
+    }
+    aio_context_acquire(old_context);
+    blk_set_aio_context(blkdev->blk, blkdev->xendev.ctx);
+    aio_context_release(old_context);
+}
+
 static int blk_connect(struct XenDevice *xendev)
 {
     struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
@@ -800,6 +881,50 @@ static int blk_connect(struct XenDevice *xendev)
 
     trace_xen_disk_connect(xendev->name);
 
+    /* Reading the frontend's keys waits for xenstore, so it must be done
+     * before the IOThread's AioContext is taken.  The writes below only go
+     * into the transition's batch. */
+    if (xenstore_read_fe_int(&blkdev->xendev, "ring-page-order",
+                             &order) == -1) {
+        blkdev->nr_ring_ref = 1;
+
+        if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref",
+                                 &ring_ref) == -1) {
+            return -1;
+        }
+        blkdev->ring_ref[0] = ring_ref;
+
+    } else if (order >= 0 && order <= MAX_RING_PAGE_ORDER) {
+        blkdev->nr_ring_ref = 1 << order;
+
+        for (i = 0; i < blkdev->nr_ring_ref; i++) {
+            char *key;
+
+            key = g_strdup_printf("ring-ref%u", i);
+            if (!key) {
+                return -1;
+            }
+
+            if (xenstore_read_fe_int(&blkdev->xendev, key,
+                                     &ring_ref) == -1) {
+                g_free(key);
+                return -1;
+            }
+            blkdev->ring_ref[i] = ring_ref;
+
+            g_free(key);
+        }
+    } else {
+        xen_pv_printf(xendev, 0, "invalid ring-page-order: %d\n",
+                      order);
+        return -1;
+    }
+
+    if (xenstore_read_fe_int(&blkdev->xendev, "event-channel",
+                             &blkdev->xendev.remote_port) == -1) {
+        return -1;
+    }
+
     /* read-only ? */
     if (blkdev->directiosafe) {
         qflags = BDRV_O_NOCACHE | BDRV_O_NATIVE_AIO;
@@ -841,6 +966,7 @@ static int blk_connect(struct XenDevice *xendev)
             error_free(local_err);
             return -1;
         }
+        blk_move_to_iothread(blkdev);
         /* Acquire the AIO context as soon as we know what it is */
         ctx = blk_get_aio_context(blkdev->blk);
         aio_context_acquire(ctx);
@@ -864,6 +990,7 @@ static int blk_connect(struct XenDevice *xendev)
         blk_ref(blkdev->blk);
     }
     blk_attach_dev_legacy(blkdev->blk, blkdev);
+    blk_set_queue_stats_fn(blkdev->blk, blk_queue_stats, blkdev);
     blkdev->file_size = blk_getlength(blkdev->blk);
     if (blkdev->file_size < 0) {
         BlockDriverState *bs = blk_bs(blkdev->blk);
@@ -884,47 +1011,6 @@ static int blk_connect(struct XenDevice *xendev)
     xenstore_write_be_int64(&blkdev->xendev, "sectors",
                             blkdev->file_size / blkdev->file_blk);
 
-    if (xenstore_read_fe_int(&blkdev->xendev, "ring-page-order",
-                             &order) == -1) {
-        blkdev->nr_ring_ref = 1;
-
-        if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref",
-                                 &ring_ref) == -1) {
-            goto error_ctx_release;
-        }
-        blkdev->ring_ref[0] = ring_ref;
-
-    } else if (order >= 0 && order <= MAX_RING_PAGE_ORDER) {
-        blkdev->nr_ring_ref = 1 << order;
-
-        for (i = 0; i < blkdev->nr_ring_ref; i++) {
-            char *key;
-
-            key = g_strdup_printf("ring-ref%u", i);
-            if (!key) {
-                goto error_ctx_release;
-            }
-
-            if (xenstore_read_fe_int(&blkdev->xendev, key,
-                                     &ring_ref) == -1) {
-                g_free(key);
-                goto error_ctx_release;
-            }
-            blkdev->ring_ref[i] = ring_ref;
-
-            g_free(key);
-        }
-    } else {
-        xen_pv_printf(xendev, 0, "invalid ring-page-order: %d\n",
-                      order);
-        goto error_ctx_release;
-    }
-
-    if (xenstore_read_fe_int(&blkdev->xendev, "event-channel",
-                             &blkdev->xendev.remote_port) == -1) {
-        goto error_ctx_release;
-    }
-
     if (!blkdev->xendev.protocol) {
         blkdev->protocol = BLKIF_PROTOCOL_NATIVE;
     } else if (strcmp(blkdev->xendev.protocol, XEN_IO_PROTO_ABI_NATIVE) == 0) {
@@ -970,6 +1056,9 @@ static int blk_connect(struct XenDevice *xendev)
         goto error_ctx_release;
     }
 
+    /* Each request in flight runs in its own coroutine */
+    qemu_coroutine_inc_pool_size(blkdev->max_requests);
+
     switch (blkdev->protocol) {
     case BLKIF_PROTOCOL_NATIVE:
     {
@@ -1009,6 +1098,17 @@ error_ctx_release:
     return -1;
 }
 
+/* Runs in the IOThread, so neither the event channel handler nor blk_bh()
+ * can be half-way through when they go away */
+static void blk_stop_bh(void *opaque)
+{
+    struct XenBlkDev *blkdev = opaque;
+
+    xen_pv_unbind_evtchn(&blkdev->xendev);
+    qemu_bh_delete(blkdev->bh);
+    blkdev->bh = NULL;
+}
+
 static void blk_disconnect(struct XenDevice *xendev)
 {
     struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
@@ -1019,12 +1119,13 @@ static void blk_disconnect(struct XenDevice *xendev)
         AioContext *ctx = blk_get_aio_context(blkdev->blk);
         BlockDriverState *bs = blk_bs(blkdev->blk);
 
+        /* blk_bh() may be running in an IOThread */
+        aio_context_acquire(ctx);
+
         do {
             blk_handle_requests(blkdev);
         } while (blkdev->more_work);
 
-        aio_context_acquire(ctx);
-
         if (bs) {
             /* Take steps to ensure that all I/O has finished. This code
              * is modelled on bdrv_set_aio_context()
@@ -1033,16 +1134,24 @@ static void blk_disconnect(struct XenDevice *xendev)
             bdrv_parent_drained_begin(bs, NULL);
             bdrv_drain(bs); /* ensure there are no in-flight requests */
 
-            while (aio_poll(ctx, false)) {
-                /* wait for all bottom halves to execute */
+            if (!xendev->ctx) {
+                while (aio_poll(ctx, false)) {
+                    /* wait for all bottom halves to execute */
+                }
             }
             bdrv_parent_drained_end(bs, NULL);
+            /* Other devices may share the IOThread */
+            aio_enable_external(ctx);
         }
 
+        if (xendev->ctx) {
+            aio_wait_bh_oneshot(ctx, blk_stop_bh, blkdev);
+        } else {
+            qemu_bh_delete(blkdev->bh);
+        }
         blk_detach_dev(blkdev->blk, blkdev);
         blk_unref(blkdev->blk);
         blkdev->blk = NULL;
-        qemu_bh_delete(blkdev->bh);
         aio_context_release(ctx);
     }
     xen_pv_unbind_evtchn(&blkdev->xendev);
@@ -1051,6 +1160,7 @@ static void blk_disconnect(struct XenDevice *xendev)
         xen_be_unmap_grant_refs(xendev, blkdev->sring,
                                 blkdev->nr_ring_ref);
         blkdev->sring = NULL;
+        qemu_coroutine_dec_pool_size(blkdev->max_requests);
     }
 }
 
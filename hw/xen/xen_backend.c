@@ -32,8 +32,10 @@
 #include "qapi/error.h"
 #include "hw/xen/xen_backend.h"
 #include "hw/xen/xen_pvdev.h"
+#include "hw/xen/xen_store.h"
 #include "monitor/qdev.h"
 #ifdef CONFIG_QEMUDP
+#include "sysemu/iothread.h"
 #include "dp-qapi/qapi-commands-xen.h"
 #endif
 
@@ -49,22 +51,43 @@ struct xs_handle *xenstore = NULL;
 const char *xen_protocol;
 bool xen_feature_grant_copy;
 
+/* A watch event waiting for the device's state machine coroutine */
+struct XenDevEvent {
+    bool frontend;
+    char *node;
+    QSIMPLEQ_ENTRY(XenDevEvent) next;
+};
+
 /* private */
 static int debug;
 
+/* Inside a state transition, writes are committed together at its end */
 int xenstore_write_be_str(struct XenDevice *xendev, const char *node, const char *val)
 {
+    char abspath[XEN_BUFSIZE];
+
+    if (xendev->batch) {
+        snprintf(abspath, sizeof(abspath), "%s/%s", xendev->be, node);
+        xen_store_batch_write(xendev->batch, abspath, val);
+        return 0;
+    }
     return xenstore_write_str(xendev->be, node, val);
 }
 
 int xenstore_write_be_int(struct XenDevice *xendev, const char *node, int ival)
 {
-    return xenstore_write_int(xendev->be, node, ival);
+    char val[12];
+
+    snprintf(val, sizeof(val), "%d", ival);
+    return xenstore_write_be_str(xendev, node, val);
 }
 
 int xenstore_write_be_int64(struct XenDevice *xendev, const char *node, int64_t ival)
 {
-    return xenstore_write_int64(xendev->be, node, ival);
+    char val[21];
+
+    snprintf(val, sizeof(val), "%"PRId64, ival);
+    return xenstore_write_be_str(xendev, node, val);
 }
 
 char *xenstore_read_be_str(struct XenDevice *xendev, const char *node)
@@ -128,7 +151,7 @@ void *xen_be_map_grant_refs(struct XenDevice *xendev, uint32_t *refs,
     assert(xendev->ops->flags & DEVOPS_FLAG_NEED_GNTDEV);
 
     ptr = xengnttab_map_domain_grant_refs(xendev->gnttabdev, nr_refs,
-                                          xen_domid, refs, prot);
+                                          xendev->dom, refs, prot);
     if (!ptr) {
         xen_pv_printf(xendev, 0,
                       "xengnttab_map_domain_grant_refs failed: %s\n",
@@ -167,7 +190,7 @@ static int compat_copy_grant_refs(struct XenDevice *xendev,
     }
 
     pages = xengnttab_map_domain_grant_refs(xendev->gnttabdev, nr_segs,
-                                            xen_domid, refs, prot);
+                                            xendev->dom, refs, prot);
     if (!pages) {
         xen_pv_printf(xendev, 0,
                       "xengnttab_map_domain_grant_refs failed: %s\n",
@@ -221,13 +244,13 @@ int xen_be_copy_grant_refs(struct XenDevice *xendev,
 
         if (to_domain) {
             xengnttab_seg->flags = GNTCOPY_dest_gref;
-            xengnttab_seg->dest.foreign.domid = xen_domid;
+            xengnttab_seg->dest.foreign.domid = xendev->dom;
             xengnttab_seg->dest.foreign.ref = seg->dest.foreign.ref;
             xengnttab_seg->dest.foreign.offset = seg->dest.foreign.offset;
             xengnttab_seg->source.virt = seg->source.virt;
         } else {
             xengnttab_seg->flags = GNTCOPY_source_gref;
-            xengnttab_seg->source.foreign.domid = xen_domid;
+            xengnttab_seg->source.foreign.domid = xendev->dom;
             xengnttab_seg->source.foreign.ref = seg->source.foreign.ref;
             xengnttab_seg->source.foreign.offset =
                 seg->source.foreign.offset;
@@ -288,10 +311,14 @@ static struct XenDevice *xen_be_get_xendev(const char *type, int dom, int dev,
     xendev = g_malloc0(ops->size);
     object_initialize(&xendev->qdev, ops->size, TYPE_XENBACKEND);
     OBJECT(xendev)->free = xendevice_free;
-#ifndef CONFIG_QEMUDP
+#ifdef CONFIG_QEMUDP
+    /* Devices of several domains live side by side */
+    qdev_set_id(DEVICE(xendev), g_strdup_printf("xen-%s-%d-%d", type, dom,
+                                                dev));
+#else
     qdev_set_parent_bus(DEVICE(xendev), xen_sysbus);
-#endif
     qdev_set_id(DEVICE(xendev), g_strdup_printf("xen-%s-%d", type, dev));
+#endif
     qdev_init_nofail(DEVICE(xendev));
     object_unref(OBJECT(xendev));
 
@@ -302,11 +329,17 @@ static struct XenDevice *xen_be_get_xendev(const char *type, int dom, int dev,
 
     snprintf(xendev->be, sizeof(xendev->be), "backend/%s/%d/%d",
              xendev->type, xendev->dom, xendev->dev);
+#ifdef CONFIG_QEMUDP
+    snprintf(xendev->name, sizeof(xendev->name), "%s-%d-%d",
+             xendev->type, xendev->dom, xendev->dev);
+#else
     snprintf(xendev->name, sizeof(xendev->name), "%s-%d",
              xendev->type, xendev->dev);
+#endif
 
     xendev->debug      = debug;
     xendev->local_port = -1;
+    QSIMPLEQ_INIT(&xendev->events);
 
     xendev->evtchndev = xenevtchn_open(NULL, 0);
     if (xendev->evtchndev == NULL) {
@@ -456,6 +489,59 @@ static int xen_be_try_init(struct XenDevice *xendev)
     return 0;
 }
 
+/* A device callback the state machine coroutine waits for */
+typedef struct XenDevCall {
+    struct XenDevice *xendev;
+    int (*fn)(struct XenDevice *xendev);
+    int ret;
+    Coroutine *co;
+} XenDevCall;
+
+static void xen_be_call_bh(void *opaque)
+{
+    XenDevCall *data = opaque;
+
+    data->ret = data->fn(data->xendev);
+    aio_co_wake(data->co);
+}
+
+/*
+ * Devices open, move and drain their block backends when they connect and
+ * disconnect, which runs nested event loops and so must not happen in
+ * coroutine context.  Run @fn from a main loop bottom half instead, and
+ * wait for its result.
+ */
+static int coroutine_fn xen_be_co_call(struct XenDevice *xendev,
+                                       int (*fn)(struct XenDevice *))
+{
+    XenDevCall data = {
+        .xendev = xendev,
+        .fn = fn,
+        .co = qemu_coroutine_self(),
+    };
+
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), xen_be_call_bh, &data);
+    qemu_coroutine_yield();
+    return data.ret;
+}
+
+static int xen_be_call_initialise(struct XenDevice *xendev)
+{
+    return xendev->ops->initialise(xendev);
+}
+
+static int xen_be_call_connected(struct XenDevice *xendev)
+{
+    xendev->ops->connected(xendev);
+    return 0;
+}
+
+static int xen_be_call_disconnect(struct XenDevice *xendev)
+{
+    xendev->ops->disconnect(xendev);
+    return 0;
+}
+
 /*
  * Try to initialise xendev.  Depends on the frontend being ready
  * for it (shared ring and evtchn info in xenstore, state being
@@ -463,7 +549,7 @@ static int xen_be_try_init(struct XenDevice *xendev)
  *
  * Goes to Connected on success.
  */
-static int xen_be_try_initialise(struct XenDevice *xendev)
+static int coroutine_fn xen_be_try_initialise(struct XenDevice *xendev)
 {
     int rc = 0;
 
@@ -488,7 +574,7 @@ static int xen_be_try_initialise(struct XenDevice *xendev)
     }
 
     if (xendev->ops->initialise) {
-        rc = xendev->ops->initialise(xendev);
+        rc = xen_be_co_call(xendev, xen_be_call_initialise);
     }
     if (rc != 0) {
         xen_pv_printf(xendev, 0, "initialise() failed\n");
@@ -504,7 +590,7 @@ static int xen_be_try_initialise(struct XenDevice *xendev)
  * frontend being Connected.  Note that this may be called more
  * than once since the backend state is not modified.
  */
-static void xen_be_try_connected(struct XenDevice *xendev)
+static void coroutine_fn xen_be_try_connected(struct XenDevice *xendev)
 {
     if (!xendev->ops->connected) {
         return;
@@ -519,7 +605,7 @@ static void xen_be_try_connected(struct XenDevice *xendev)
         }
     }
 
-    xendev->ops->connected(xendev);
+    xen_be_co_call(xendev, xen_be_call_connected);
 }
 
 /*
@@ -527,12 +613,13 @@ static void xen_be_try_connected(struct XenDevice *xendev)
  *
  * Goes to Closed when done.
  */
-static void xen_be_disconnect(struct XenDevice *xendev, enum xenbus_state state)
+static void coroutine_fn xen_be_disconnect(struct XenDevice *xendev,
+                                           enum xenbus_state state)
 {
     if (xendev->be_state != XenbusStateClosing &&
         xendev->be_state != XenbusStateClosed  &&
         xendev->ops->disconnect) {
-        xendev->ops->disconnect(xendev);
+        xen_be_co_call(xendev, xen_be_call_disconnect);
     }
     if (xendev->gnttabdev) {
         xengnttab_close(xendev->gnttabdev);
@@ -557,22 +644,42 @@ static int xen_be_try_reset(struct XenDevice *xendev)
     return 0;
 }
 
+static void xen_be_begin_batch(struct XenDevice *xendev)
+{
+    assert(!xendev->batch);
+    xendev->batch = xen_store_batch_new();
+}
+
+static void xen_be_commit_batch(struct XenDevice *xendev)
+{
+    XenStoreBatch *batch = xendev->batch;
+
+    xendev->batch = NULL;
+    xen_store_batch_commit(batch);
+}
+
 /*
  * state change dispatcher function
+ *
+ * Each transition is one xenstore transaction, so the frontend sees the
+ * new backend state together with everything published for it.
  */
-void xen_be_check_state(struct XenDevice *xendev)
+static void coroutine_fn xen_be_co_check_state(struct XenDevice *xendev)
 {
     int rc = 0;
 
     /* frontend may request shutdown from almost anywhere */
     if (xendev->fe_state == XenbusStateClosing ||
         xendev->fe_state == XenbusStateClosed) {
+        xen_be_begin_batch(xendev);
         xen_be_disconnect(xendev, xendev->fe_state);
+        xen_be_commit_batch(xendev);
         return;
     }
 
     /* check for possible backend state transitions */
     for (;;) {
+        xen_be_begin_batch(xendev);
         switch (xendev->be_state) {
         case XenbusStateUnknown:
             rc = xen_be_try_setup(xendev);
@@ -594,12 +701,106 @@ void xen_be_check_state(struct XenDevice *xendev)
         default:
             rc = -1;
         }
+        xen_be_commit_batch(xendev);
         if (rc != 0) {
             break;
         }
     }
 }
 
+/*
+ * The state machine stopped for a deleted device.  check_co stays set until
+ * here, so that watch events meanwhile are only queued.
+ */
+static int xen_be_del_finished(struct XenDevice *xendev)
+{
+    xendev->check_co = NULL;
+    xen_be_del_xendev(xendev);
+    return 0;
+}
+
+/*
+ * Every device runs its state machine in a coroutine, so that a device
+ * waiting for xenstore does not hold up the main loop and the I/O of the
+ * others.  Watch events that arrive meanwhile are queued for it.
+ */
+static void coroutine_fn xen_be_check_state_co(void *opaque)
+{
+    struct XenDevice *xendev = opaque;
+    struct XenDevEvent *event;
+    char *bepath;
+
+    do {
+        xendev->check_again = false;
+        while (!xendev->deleted &&
+               (event = QSIMPLEQ_FIRST(&xendev->events)) != NULL) {
+            QSIMPLEQ_REMOVE_HEAD(&xendev->events, next);
+            if (event->frontend) {
+                xen_be_frontend_changed(xendev, event->node);
+            } else {
+                bepath = xenstore_read_path(xendev->be);
+                if (bepath == NULL) {
+                    xendev->deleted = true;
+                } else {
+                    g_free(bepath);
+                    xen_be_backend_changed(xendev, event->node);
+                }
+            }
+            g_free(event->node);
+            g_free(event);
+        }
+        if (!xendev->deleted) {
+            xen_be_co_check_state(xendev);
+        }
+    } while (!xendev->deleted &&
+             (xendev->check_again || !QSIMPLEQ_EMPTY(&xendev->events)));
+
+    if (xendev->deleted) {
+        /* Does not return to xendev, it is gone by the time we are woken */
+        xen_be_co_call(xendev, xen_be_del_finished);
+        return;
+    }
+    xendev->check_co = NULL;
+}
+
+void xen_be_check_state(struct XenDevice *xendev)
+{
+    if (xendev->check_co) {
+        xendev->check_again = true;
+        return;
+    }
+    xendev->check_co = qemu_coroutine_create(xen_be_check_state_co, xendev);
+    aio_co_enter(qemu_get_aio_context(), xendev->check_co);
+}
+
+static void xen_be_queue_event(struct XenDevice *xendev, bool frontend,
+                               const char *node)
+{
+    struct XenDevEvent *event = g_new(struct XenDevEvent, 1);
+
+    event->frontend = frontend;
+    event->node = g_strdup(node);
+    QSIMPLEQ_INSERT_TAIL(&xendev->events, event, next);
+    xen_be_check_state(xendev);
+}
+
+/* Waits for the state machine to stop if it is running */
+void xen_be_del_xendev(struct XenDevice *xendev)
+{
+    struct XenDevEvent *event;
+
+    if (xendev->check_co) {
+        xendev->deleted = true;
+        return;
+    }
+    while ((event = QSIMPLEQ_FIRST(&xendev->events)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&xendev->events, next);
+        g_free(event->node);
+        g_free(event);
+    }
+    xen_pv_del_xendev(xendev);
+}
+
 /* ------------------------------------------------------------- */
 
 static int xenstore_scan(const char *type, int dom, struct XenDevOps *ops)
@@ -638,7 +839,7 @@ void xenstore_update_be(char *watch, char *type, int dom,
                         struct XenDevOps *ops)
 {
     struct XenDevice *xendev;
-    char path[XEN_BUFSIZE], *bepath;
+    char path[XEN_BUFSIZE];
     unsigned int len, dev;
 
     len = snprintf(path, sizeof(path), "backend/%s/%d", type, dom);
@@ -656,15 +857,8 @@ void xenstore_update_be(char *watch, char *type, int dom,
     }
 
     xendev = xen_be_get_xendev(type, dom, dev, ops);
-    if (xendev != NULL) {
-        bepath = xs_read(xenstore, 0, xendev->be, &len);
-        if (bepath == NULL) {
-            xen_pv_del_xendev(xendev);
-        } else {
-            free(bepath);
-            xen_be_backend_changed(xendev, path);
-            xen_be_check_state(xendev);
-        }
+    if (xendev != NULL && !xendev->deleted) {
+        xen_be_queue_event(xendev, false, path);
     }
 }
 
@@ -682,8 +876,9 @@ void xenstore_update_fe(char *watch, struct XenDevice *xendev)
     }
     node = watch + len + 1;
 
-    xen_be_frontend_changed(xendev, node);
-    xen_be_check_state(xendev);
+    if (!xendev->deleted) {
+        xen_be_queue_event(xendev, true, node);
+    }
 }
 /* -------------------------------------------------------------------- */
 
@@ -699,6 +894,9 @@ int xen_be_init(void)
 
     qemu_set_fd_handler(xs_fileno(xenstore), xenstore_update, NULL, NULL);
 
+    /* Without it, xenstore is accessed synchronously */
+    xen_store_init();
+
     if (xen_xc == NULL || xen_fmem == NULL) {
         /* Check if xen_init() have been called */
         goto err;
@@ -722,6 +920,7 @@ int xen_be_init(void)
     return 0;
 
 err:
+    xen_store_cleanup();
     qemu_set_fd_handler(xs_fileno(xenstore), NULL, NULL, NULL);
     xs_daemon_close(xenstore);
     xenstore = NULL;
@@ -790,8 +989,14 @@ int xen_be_bind_evtchn(struct XenDevice *xendev)
         return -1;
     }
     xen_pv_printf(xendev, 2, "bind evtchn port %d\n", xendev->local_port);
-    qemu_set_fd_handler(xenevtchn_fd(xendev->evtchndev),
-                        xen_pv_evtchn_event, NULL, xendev);
+    if (xendev->ctx) {
+        /* External, so that draining the IOThread holds back new requests */
+        aio_set_fd_handler(xendev->ctx, xenevtchn_fd(xendev->evtchndev), true,
+                           xen_pv_evtchn_event, NULL, NULL, xendev);
+    } else {
+        qemu_set_fd_handler(xenevtchn_fd(xendev->evtchndev),
+                            xen_pv_evtchn_event, NULL, xendev);
+    }
     return 0;
 }
 
@@ -873,15 +1078,43 @@ static void xenbe_register_types(void)
 }
 
 #ifdef CONFIG_QEMUDP
-void qmp_xen_watch_device(int64_t domid, int64_t devid, const char *type, const char *blocknode, const char *devicename, Error **errp)
+/* Devices are spread over IOThreads by name; the first device that names
+ * one creates it, since qemu-dp has no object-add. */
+static AioContext *xen_be_get_iothread_context(const char *id, Error **errp)
+{
+    IOThread *iothread = iothread_by_id(id);
+    Object *obj;
+
+    if (!iothread) {
+        obj = object_new_with_props(TYPE_IOTHREAD, object_get_objects_root(),
+                                    id, errp, NULL);
+        if (!obj) {
+            return NULL;
+        }
+        iothread = IOTHREAD(obj);
+    }
+    return iothread_get_aio_context(iothread);
+}
+
+void qmp_xen_watch_device(int64_t domid, int64_t devid, const char *type,
+                          const char *blocknode, const char *devicename,
+                          bool has_iothread, const char *iothread,
+                          Error **errp)
 {
     struct XenDevice *xendev = NULL;
+    AioContext *ctx = NULL;
 
     if (strcmp(type, "qdisk")) {
         error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
                   "Device type '%s' not supported", type);
         return;
     }
+    if (has_iothread) {
+        ctx = xen_be_get_iothread_context(iothread, errp);
+        if (!ctx) {
+            return;
+        }
+    }
     /* Important! The "type" argument must be a pointer to a static string
      * because everything else assumes it will be. The pointer gets stored
      * when xen_be_get_xendev() auto-creates the structure.
@@ -895,18 +1128,27 @@ void qmp_xen_watch_device(int64_t domid, int64_t devid, const char *type, const
                   "Device type '%s-%ld' not found in domain %ld", "qdisk", devid, domid);
         return;
     }
+    if (xendev->deleted) {
+        error_setg(errp, "Device '%s' is being removed", xendev->name);
+        return;
+    }
+    if (xendev->local_port != -1 && xendev->ctx != ctx) {
+        error_setg(errp, "Device '%s' is connected and cannot change its "
+                   "iothread", xendev->name);
+        return;
+    }
+    g_free(xendev->blocknode);
     xendev->blocknode = g_strdup(blocknode);
+    g_free(xendev->devicename);
     xendev->devicename = g_strdup(devicename);
-    /* Set the global xen_domid variable to the domid we are given, because
-     * subsequent patches need this */
-    xen_domid = domid;
+    xendev->ctx = ctx;
     xen_be_check_state(xendev);
 }
 
 void qmp_xen_unwatch_device(int64_t domid, int64_t devid, const char *type, Error **errp)
 {
     struct XenDevice *xendev = xen_pv_find_xendev(type, domid, devid);
-    if (xendev) xen_pv_del_xendev(xendev);
+    if (xendev) xen_be_del_xendev(xendev);
 }
 #endif
 
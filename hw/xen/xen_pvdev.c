@@ -19,9 +19,11 @@
 
 #include "qemu/osdep.h"
 #include "qemu/log.h"
+#include "block/aio.h"
 #include "hw/qdev-core.h"
 #include "hw/xen/xen_backend.h"
 #include "hw/xen/xen_pvdev.h"
+#include "hw/xen/xen_store.h"
 
 /* private */
 static int debug;
@@ -92,14 +94,23 @@ int xenstore_write_str(const char *base, const char *node, const char *val)
     return 0;
 }
 
-char *xenstore_read_str(const char *base, const char *node)
+/*
+ * Coroutines in the main loop wait for the reply without blocking it.  If
+ * the asynchronous connection goes away meanwhile, ask again the old way.
+ */
+char *xenstore_read_path(const char *path)
 {
-    char abspath[XEN_BUFSIZE];
     unsigned int len;
     char *str, *ret = NULL;
 
-    snprintf(abspath, sizeof(abspath), "%s/%s", base, node);
-    str = xs_read(xenstore, 0, abspath, &len);
+    if (xen_store_can_yield()) {
+        ret = xen_store_co_read(path);
+        if (ret || xen_store_can_yield()) {
+            return ret;
+        }
+    }
+
+    str = xs_read(xenstore, 0, path, &len);
     if (str != NULL) {
         /* move to qemu-allocated memory to make sure
          * callers can savely g_free() stuff. */
@@ -109,6 +120,14 @@ char *xenstore_read_str(const char *base, const char *node)
     return ret;
 }
 
+char *xenstore_read_str(const char *base, const char *node)
+{
+    char abspath[XEN_BUFSIZE];
+
+    snprintf(abspath, sizeof(abspath), "%s/%s", base, node);
+    return xenstore_read_path(abspath);
+}
+
 int xenstore_write_int(const char *base, const char *node, int ival)
 {
     char val[12];
@@ -252,7 +271,12 @@ void xen_pv_unbind_evtchn(struct XenDevice *xendev)
     if (xendev->local_port == -1) {
         return;
     }
-    qemu_set_fd_handler(xenevtchn_fd(xendev->evtchndev), NULL, NULL, NULL);
+    if (xendev->ctx) {
+        aio_set_fd_handler(xendev->ctx, xenevtchn_fd(xendev->evtchndev), true,
+                           NULL, NULL, NULL, NULL);
+    } else {
+        qemu_set_fd_handler(xenevtchn_fd(xendev->evtchndev), NULL, NULL, NULL);
+    }
     xenevtchn_unbind(xendev->evtchndev, xendev->local_port);
     xen_pv_printf(xendev, 2, "unbind evtchn port %d\n", xendev->local_port);
     xendev->local_port = -1;
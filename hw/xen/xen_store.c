@@ -0,0 +1,441 @@
+/*
+ * Asynchronous xenstore client
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <xen/io/xs_wire.h>
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+#include "qemu/queue.h"
+#include "qemu/sockets.h"
+#include "block/aio.h"
+#include "hw/xen/xen_backend.h"
+#include "hw/xen/xen_store.h"
+#include "trace.h"
+
+typedef struct XenStoreRequest {
+    struct xsd_sockmsg hdr;
+    Coroutine *co;
+    bool done;
+    int ret;
+    char *reply;
+    QTAILQ_ENTRY(XenStoreRequest) next;
+} XenStoreRequest;
+
+typedef struct XenStoreWrite {
+    char *path;
+    char *val;
+    QSIMPLEQ_ENTRY(XenStoreWrite) next;
+} XenStoreWrite;
+
+struct XenStoreBatch {
+    QSIMPLEQ_HEAD(, XenStoreWrite) writes;
+    unsigned int nr_writes;
+};
+
+static struct {
+    int fd;
+    uint32_t next_req_id;
+    /* Sent or queued for sending, in the order xenstored answers them */
+    QTAILQ_HEAD(, XenStoreRequest) requests;
+    GByteArray *out;
+    /* The reply being received */
+    struct xsd_sockmsg in_hdr;
+    char *in_buf;
+    size_t in_len;
+} xs = {
+    .fd = -1,
+    .requests = QTAILQ_HEAD_INITIALIZER(xs.requests),
+};
+
+static void xen_store_read(void *opaque);
+static void xen_store_write(void *opaque);
+
+static void xen_store_wake(XenStoreRequest *req)
+{
+    /* A coroutine that fails its own requests sees them done anyway */
+    if (req->co != qemu_coroutine_self()) {
+        aio_co_wake(req->co);
+    }
+}
+
+static void xen_store_set_handlers(void)
+{
+    qemu_set_fd_handler(xs.fd, xen_store_read,
+                        xs.out->len ? xen_store_write : NULL, NULL);
+}
+
+/* Fail everything in flight; later requests take the synchronous path */
+static void xen_store_disconnect(int ret)
+{
+    XenStoreRequest *req;
+
+    if (xs.fd < 0) {
+        return;
+    }
+    xen_pv_printf(NULL, 0, "async xenstore connection lost: %s\n",
+                  strerror(-ret));
+    qemu_set_fd_handler(xs.fd, NULL, NULL, NULL);
+    close(xs.fd);
+    xs.fd = -1;
+    g_byte_array_set_size(xs.out, 0);
+    g_free(xs.in_buf);
+    xs.in_buf = NULL;
+    xs.in_len = 0;
+
+    while ((req = QTAILQ_FIRST(&xs.requests))) {
+        QTAILQ_REMOVE(&xs.requests, req, next);
+        req->ret = ret;
+        req->done = true;
+        xen_store_wake(req);
+    }
+}
+
+static void xen_store_flush(void)
+{
+    ssize_t n;
+
+    while (xs.fd >= 0 && xs.out->len) {
+        n = write(xs.fd, xs.out->data, xs.out->len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                xen_store_disconnect(-errno);
+            }
+            break;
+        }
+        g_byte_array_remove_range(xs.out, 0, n);
+    }
+    if (xs.fd >= 0) {
+        xen_store_set_handlers();
+    }
+}
+
+static void xen_store_write(void *opaque)
+{
+    xen_store_flush();
+}
+
+static int xen_store_errno(const char *name)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(xsd_errors); i++) {
+        if (!strcmp(name, xsd_errors[i].errstring)) {
+            return xsd_errors[i].errnum;
+        }
+    }
+    return EIO;
+}
+
+static void xen_store_complete(char *payload)
+{
+    XenStoreRequest *req = QTAILQ_FIRST(&xs.requests);
+
+    if (xs.in_hdr.type == XS_WATCH_EVENT) {
+        /* No watches are registered on this connection */
+        g_free(payload);
+        return;
+    }
+    if (!req || req->hdr.req_id != xs.in_hdr.req_id) {
+        g_free(payload);
+        xen_store_disconnect(-EPROTO);
+        return;
+    }
+
+    QTAILQ_REMOVE(&xs.requests, req, next);
+    if (xs.in_hdr.type == XS_ERROR) {
+        req->ret = -xen_store_errno(payload);
+        g_free(payload);
+    } else {
+        req->reply = payload;
+    }
+    req->done = true;
+    xen_store_wake(req);
+}
+
+static void xen_store_read(void *opaque)
+{
+    size_t hdr_len = sizeof(xs.in_hdr);
+    char *payload;
+    ssize_t n;
+
+    while (xs.fd >= 0) {
+        if (xs.in_len < hdr_len) {
+            n = read(xs.fd, (char *)&xs.in_hdr + xs.in_len,
+                     hdr_len - xs.in_len);
+        } else {
+            n = read(xs.fd, xs.in_buf + xs.in_len - hdr_len,
+                     hdr_len + xs.in_hdr.len - xs.in_len);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (n <= 0) {
+            xen_store_disconnect(n < 0 ? -errno : -ECONNRESET);
+            return;
+        }
+
+        xs.in_len += n;
+        if (xs.in_len == hdr_len) {
+            if (xs.in_hdr.len > XENSTORE_PAYLOAD_MAX) {
+                xen_store_disconnect(-EPROTO);
+                return;
+            }
+            xs.in_buf = g_malloc(xs.in_hdr.len + 1);
+        }
+        if (xs.in_len == hdr_len + xs.in_hdr.len) {
+            /* Replies are not NUL-terminated */
+            payload = xs.in_buf;
+            payload[xs.in_hdr.len] = '\0';
+            xs.in_buf = NULL;
+            xs.in_len = 0;
+            xen_store_complete(payload);
+        }
+    }
+}
+
+/*
+ * Queue a request for the current coroutine.  Nothing is sent until the
+ * coroutine waits, so that a series of requests goes out in one write.
+ */
+static XenStoreRequest *xen_store_queue(enum xsd_sockmsg_type type,
+                                        uint32_t tx_id, const char *arg,
+                                        const char *val)
+{
+    XenStoreRequest *req = g_new0(XenStoreRequest, 1);
+    size_t arg_len = strlen(arg) + 1;
+    size_t val_len = val ? strlen(val) : 0;
+
+    req->co = qemu_coroutine_self();
+    req->hdr.type = type;
+    req->hdr.req_id = xs.next_req_id++;
+    req->hdr.tx_id = tx_id;
+    req->hdr.len = arg_len + val_len;
+
+    if (xs.fd < 0 || req->hdr.len > XENSTORE_PAYLOAD_MAX) {
+        req->ret = xs.fd < 0 ? -ENOTCONN : -E2BIG;
+        req->done = true;
+        return req;
+    }
+
+    g_byte_array_append(xs.out, (guint8 *)&req->hdr, sizeof(req->hdr));
+    g_byte_array_append(xs.out, (const guint8 *)arg, arg_len);
+    if (val_len) {
+        g_byte_array_append(xs.out, (const guint8 *)val, val_len);
+    }
+    QTAILQ_INSERT_TAIL(&xs.requests, req, next);
+    return req;
+}
+
+/* Returns the request's result and frees it, leaving the reply in *reply */
+static int coroutine_fn xen_store_co_wait(XenStoreRequest *req, char **reply)
+{
+    int ret;
+
+    xen_store_flush();
+    while (!req->done) {
+        qemu_coroutine_yield();
+    }
+
+    ret = req->ret;
+    if (reply) {
+        *reply = req->reply;
+    } else {
+        g_free(req->reply);
+    }
+    g_free(req);
+    return ret;
+}
+
+bool xen_store_can_yield(void)
+{
+    return xs.fd >= 0 && qemu_in_coroutine() &&
+           qemu_get_current_aio_context() == qemu_get_aio_context();
+}
+
+char *coroutine_fn xen_store_co_read(const char *path)
+{
+    XenStoreRequest *req = xen_store_queue(XS_READ, XBT_NULL, path, NULL);
+    char *val = NULL;
+    int ret;
+
+    ret = xen_store_co_wait(req, &val);
+    if (ret < 0) {
+        errno = -ret;
+        return NULL;
+    }
+    return val;
+}
+
+XenStoreBatch *xen_store_batch_new(void)
+{
+    XenStoreBatch *batch = g_new0(XenStoreBatch, 1);
+
+    QSIMPLEQ_INIT(&batch->writes);
+    return batch;
+}
+
+void xen_store_batch_write(XenStoreBatch *batch, const char *path,
+                           const char *val)
+{
+    XenStoreWrite *w = g_new(XenStoreWrite, 1);
+
+    w->path = g_strdup(path);
+    w->val = g_strdup(val);
+    QSIMPLEQ_INSERT_TAIL(&batch->writes, w, next);
+    batch->nr_writes++;
+}
+
+static void xen_store_batch_free(XenStoreBatch *batch)
+{
+    XenStoreWrite *w, *next;
+
+    QSIMPLEQ_FOREACH_SAFE(w, &batch->writes, next, next) {
+        g_free(w->path);
+        g_free(w->val);
+        g_free(w);
+    }
+    g_free(batch);
+}
+
+/*
+ * Once the transaction has started, the writes are sent back to back without
+ * waiting for each other.  The transaction is only committed if all of them
+ * succeeded, and aborted otherwise, so that xenstore never sees part of a
+ * batch.
+ */
+static int coroutine_fn xen_store_co_commit(XenStoreBatch *batch)
+{
+    XenStoreRequest **reqs;
+    XenStoreWrite *w;
+    char *reply = NULL;
+    uint32_t tx_id;
+    unsigned int i;
+    int ret, ret2;
+
+    ret = xen_store_co_wait(xen_store_queue(XS_TRANSACTION_START, XBT_NULL,
+                                            "", NULL), &reply);
+    if (ret < 0) {
+        return ret;
+    }
+    tx_id = strtoul(reply, NULL, 10);
+    g_free(reply);
+
+    reqs = g_new(XenStoreRequest *, batch->nr_writes);
+    i = 0;
+    QSIMPLEQ_FOREACH(w, &batch->writes, next) {
+        reqs[i++] = xen_store_queue(XS_WRITE, tx_id, w->path, w->val);
+    }
+    for (i = 0; i < batch->nr_writes; i++) {
+        ret2 = xen_store_co_wait(reqs[i], NULL);
+        if (ret2 < 0 && ret == 0) {
+            ret = ret2;
+        }
+    }
+    g_free(reqs);
+
+    ret2 = xen_store_co_wait(xen_store_queue(XS_TRANSACTION_END, tx_id,
+                                             ret < 0 ? "F" : "T", NULL),
+                             NULL);
+    return ret < 0 ? ret : ret2;
+}
+
+static int xen_store_sync_commit(XenStoreBatch *batch)
+{
+    XenStoreWrite *w;
+    xs_transaction_t t;
+    int ret = 0;
+
+    t = xs_transaction_start(xenstore);
+    if (t == XBT_NULL) {
+        return -errno;
+    }
+    QSIMPLEQ_FOREACH(w, &batch->writes, next) {
+        if (!xs_write(xenstore, t, w->path, w->val, strlen(w->val))) {
+            ret = -errno;
+            xen_pv_printf(NULL, 0, "xs_write %s: failed\n", w->path);
+            break;
+        }
+    }
+    if (!xs_transaction_end(xenstore, t, ret < 0) && ret == 0) {
+        return -errno;
+    }
+    return ret;
+}
+
+int xen_store_batch_commit(XenStoreBatch *batch)
+{
+    int ret = 0;
+
+    while (batch->nr_writes) {
+        bool async = xen_store_can_yield();
+
+        if (async) {
+            ret = xen_store_co_commit(batch);
+        } else {
+            ret = xen_store_sync_commit(batch);
+        }
+        trace_xen_store_commit(batch->nr_writes, async, ret);
+        /* Writes are idempotent, so a lost connection is retried too */
+        if (ret != -EAGAIN && !(async && xs.fd < 0)) {
+            break;
+        }
+    }
+    if (ret < 0) {
+        xen_pv_printf(NULL, 0, "committing %u xenstore writes failed: %s\n",
+                      batch->nr_writes, strerror(-ret));
+    }
+    xen_store_batch_free(batch);
+    return ret;
+}
+
+/* -------------------------------------------------------------------- */
+
+int xen_store_init(void)
+{
+    const char *path = getenv("XENSTORED_PATH");
+    const char *rundir = getenv("XENSTORED_RUNDIR");
+    char *default_path = NULL;
+    Error *local_err = NULL;
+
+    if (!path) {
+        default_path = g_strdup_printf("%s/socket",
+                                       rundir ? rundir : "/var/run/xenstored");
+        path = default_path;
+    }
+
+    xs.fd = unix_connect(path, &local_err);
+    g_free(default_path);
+    if (xs.fd < 0) {
+        xen_pv_printf(NULL, 1, "async xenstore unavailable: %s\n",
+                      error_get_pretty(local_err));
+        error_free(local_err);
+        return -1;
+    }
+    qemu_set_nonblock(xs.fd);
+    xs.out = g_byte_array_new();
+    xen_store_set_handlers();
+    return 0;
+}
+
+void xen_store_cleanup(void)
+{
+    if (xs.fd >= 0) {
+        xen_store_disconnect(-ESHUTDOWN);
+    }
+    if (xs.out) {
+        g_byte_array_free(xs.out, true);
+        xs.out = NULL;
+    }
+}
@@ -27,10 +27,12 @@
 
 #include "qemu/timed-average.h"
 #include "qemu/thread.h"
+#include "qemu/stats64.h"
 #include "qapi/qapi-builtin-types.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
 typedef struct BlockAcctStats BlockAcctStats;
+typedef struct BlockAcctShard BlockAcctShard;
 
 enum BlockAcctType {
     BLOCK_ACCT_READ,
@@ -76,8 +78,8 @@ typedef struct BlockLatencyHistogram {
     uint64_t *bins;
 } BlockLatencyHistogram;
 
-struct BlockAcctStats {
-    QemuMutex lock;
+/* Totals of a BlockAcctStats, see block_acct_get_counters() */
+typedef struct BlockAcctCounters {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
     uint64_t invalid_ops[BLOCK_MAX_IOTYPE];
@@ -85,9 +87,33 @@ struct BlockAcctStats {
     uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
     uint64_t merged[BLOCK_MAX_IOTYPE];
     int64_t last_access_time_ns;
+} BlockAcctCounters;
+
+/* Each thread accounts into one of these, so that I/O in different
+ * threads does not share cache lines.  Threads beyond the first few
+ * share the last shard and update it atomically.
+ */
+#define BLOCK_ACCT_SHARDS 8
+
+struct BlockAcctShard {
+    Stat64 nr_bytes[BLOCK_MAX_IOTYPE];
+    Stat64 nr_ops[BLOCK_MAX_IOTYPE];
+    Stat64 invalid_ops[BLOCK_MAX_IOTYPE];
+    Stat64 failed_ops[BLOCK_MAX_IOTYPE];
+    Stat64 total_time_ns[BLOCK_MAX_IOTYPE];
+    Stat64 merged[BLOCK_MAX_IOTYPE];
+    Stat64 last_access_time_ns;
+    /* latency_histogram[type].nbins counters, or NULL */
+    Stat64 *latency_bins[BLOCK_MAX_IOTYPE];
+} QEMU_ALIGNED(64);
+
+struct BlockAcctStats {
+    BlockAcctShard *shards; /* BLOCK_ACCT_SHARDS of them */
+    QemuMutex lock; /* protects intervals */
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
     bool account_invalid;
     bool account_failed;
+    /* Only boundaries are used here, bins live in the shards */
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
 };
 
@@ -111,11 +137,16 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie);
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                            int num_requests);
+void block_acct_get_counters(BlockAcctStats *stats,
+                             BlockAcctCounters *counters);
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
+bool block_latency_histogram_get(BlockAcctStats *stats,
+                                 enum BlockAcctType type,
+                                 BlockLatencyHistogram *hist);
 
 #endif
@@ -0,0 +1,36 @@
+/*
+ * Sidecar file for persistent dirty bitmaps
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+#ifndef BLOCK_BITMAP_STORE_H
+#define BLOCK_BITMAP_STORE_H
+
+#include "block/block.h"
+
+/*
+ * bdrv_bitmap_store_load:
+ *
+ * Create the persistent dirty bitmaps recorded in the sidecar file of @bs
+ * (bs->bitmap_store).  A missing file is an empty store.  If the file was
+ * not saved cleanly after its last load, its bitmaps can't be trusted and
+ * are dropped with a warning.  On writable nodes the file is marked in use
+ * until the next bdrv_bitmap_store_save().
+ */
+int bdrv_bitmap_store_load(BlockDriverState *bs, Error **errp);
+
+/*
+ * bdrv_bitmap_store_save:
+ *
+ * Write all persistent dirty bitmaps of @bs to its sidecar file, replacing
+ * the previous contents atomically.  Does nothing for read-only nodes.
+ */
+int bdrv_bitmap_store_save(BlockDriverState *bs, Error **errp);
+
+bool bdrv_bitmap_store_can_store(BlockDriverState *bs, const char *name,
+                                 uint32_t granularity, Error **errp);
+
+#endif
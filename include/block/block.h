@@ -102,6 +102,8 @@ typedef struct HDGeometry {
 #define BDRV_OPT_READ_ONLY      "read-only"
 #define BDRV_OPT_DISCARD        "discard"
 #define BDRV_OPT_FORCE_SHARE    "force-share"
+#define BDRV_OPT_BITMAP_STORE   "bitmap-store"
+#define BDRV_OPT_LAZY_OPEN      "lazy-open"
 
 
 #define BDRV_SECTOR_BITS   9
@@ -365,12 +367,26 @@ int bdrv_co_ioctl(BlockDriverState *bs, int req, void *buf);
 /* Invalidate any cached metadata used by image formats */
 void bdrv_invalidate_cache(BlockDriverState *bs, Error **errp);
 void bdrv_invalidate_cache_all(Error **errp);
+
+/* Load the metadata that a lazy open deferred, for a node and its children */
+int coroutine_fn bdrv_co_load_metadata(BlockDriverState *bs, Error **errp);
+int bdrv_load_metadata(BlockDriverState *bs, Error **errp);
+
 int bdrv_inactivate_all(void);
 
 /* Ensure contents are flushed to disk.  */
 int bdrv_flush(BlockDriverState *bs);
 int coroutine_fn bdrv_co_flush(BlockDriverState *bs);
 int bdrv_flush_all(void);
+
+typedef struct BdrvFlushFailure {
+    char *node_name;
+    int ret;
+} BdrvFlushFailure;
+
+int bdrv_flush_all_parallel(int max_in_flight, int64_t timeout_ns,
+                            GSList **failures);
+void bdrv_flush_failure_free(void *failure);
 void bdrv_close_all(void);
 void bdrv_drain(BlockDriverState *bs);
 void coroutine_fn bdrv_co_drain(BlockDriverState *bs);
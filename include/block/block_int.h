@@ -233,6 +233,14 @@ struct BlockDriver {
                                                   Error **errp);
     int (*bdrv_inactivate)(BlockDriverState *bs);
 
+    /*
+     * Load the metadata that was left out because bs->lazy_open was set.
+     * Drivers must also load it on demand when it is first needed; this
+     * only allows doing it ahead of time.
+     */
+    int coroutine_fn (*bdrv_co_load_metadata)(BlockDriverState *bs,
+                                              Error **errp);
+
     /*
      * Flushes all data for all layers by calling bdrv_co_flush for underlying
      * layers, if needed. This function is needed for deterministic
@@ -632,6 +640,7 @@ struct BlockDriverState {
     bool sg;        /* if true, the device is a /dev/sg* */
     bool probed;    /* if true, format was probed rather than specified */
     bool force_share; /* if true, always allow all shared permissions */
+    bool lazy_open; /* if true, the driver may defer loading metadata */
     bool implicit;  /* if true, this filter node was automatically inserted */
 
     BlockDriver *drv; /* NULL means no media */
@@ -716,9 +725,15 @@ struct BlockDriverState {
     QemuMutex dirty_bitmap_mutex;
     QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
 
+    /* Sidecar file of the persistent dirty bitmaps, see block/bitmap-store.c */
+    char *bitmap_store;
+
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /* Cached whole-chain block status, see block/status-cache.c */
+    struct BdrvStatusCache *status_cache;
+
     /* If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
      * ops.
@@ -885,6 +900,9 @@ void bdrv_wakeup(BlockDriverState *bs);
 int is_windows_drive(const char *filename);
 #endif
 
+/* Upper bound for the max_in_flight argument of stream and commit jobs */
+#define BLOCK_JOB_MAX_IN_FLIGHT 1024
+
 /**
  * stream_start:
  * @job_id: The id of the newly-created job, or %NULL to use the
@@ -895,6 +913,10 @@ int is_windows_drive(const char *filename);
  * @backing_file_str: The file name that will be written to @bs as the
  * the new backing file if the job completes. Ignored if @base is %NULL.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @buf_size: The amount of data held by copy operations in flight, or 0
+ * for the default.
+ * @max_in_flight: The maximum number of copy operations in flight, or 0
+ * for the default.
  * @on_error: The action to take upon error.
  * @errp: Error object.
  *
@@ -907,7 +929,8 @@ int is_windows_drive(const char *filename);
  */
 void stream_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, const char *backing_file_str,
-                  int64_t speed, BlockdevOnError on_error, Error **errp);
+                  int64_t speed, int64_t buf_size, int max_in_flight,
+                  BlockdevOnError on_error, Error **errp);
 
 /**
  * commit_start:
@@ -917,6 +940,10 @@ void stream_start(const char *job_id, BlockDriverState *bs,
  * @top: Top block device to be committed.
  * @base: Block device that will be written into, and become the new top.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @buf_size: The amount of data held by copy operations in flight, or 0
+ * for the default.
+ * @max_in_flight: The maximum number of copy and write zeroes operations
+ * in flight, or 0 for the default.
  * @on_error: The action to take upon error.
  * @backing_file_str: String to use as the backing file in @top's overlay
  * @filter_node_name: The node name that should be assigned to the filter
@@ -927,6 +954,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
  */
 void commit_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, BlockDriverState *top, int64_t speed,
+                  int64_t buf_size, int max_in_flight,
                   BlockdevOnError on_error, const char *backing_file_str,
                   const char *filter_node_name, Error **errp);
 /**
@@ -973,6 +1001,13 @@ void commit_active_start(const char *job_id, BlockDriverState *bs,
  * @filter_node_name: The node name that should be assigned to the filter
  * driver that the mirror job inserts into the graph above @bs. NULL means that
  * a node name should be autogenerated.
+ * @copy_mode: When to trigger writes to the target.
+ * @checkpoint: Name of a dirty bitmap on @bs to resume from and to record
+ * progress in, or NULL.
+ * @checkpoint_interval: Seconds between updates of @checkpoint.
+ * @resume: Whether @target already holds the data that an existing
+ * @checkpoint marks clean.  If not, the checkpoint is reset and everything
+ * is copied.
  * @errp: Error object.
  *
  * Start a mirroring operation on @bs.  Clusters that are allocated
@@ -986,7 +1021,9 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap, const char *filter_node_name, Error **errp);
+                  bool unmap, const char *filter_node_name,
+                  MirrorCopyMode copy_mode, const char *checkpoint,
+                  int64_t checkpoint_interval, bool resume, Error **errp);
 
 /*
  * backup_job_create:
@@ -997,6 +1034,11 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_INCREMENTAL.
+ * @compress: True to compress data written to @target.
+ * @max_workers: The maximum number of background copy operations in flight,
+ * or 0 for the default.
+ * @max_chunk: The maximum size of a copy operation in bytes, rounded up to
+ * the backup cluster size, or 0 for the default.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @creation_flags: Flags that control the behavior of the Job lifetime.
@@ -1012,7 +1054,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                             BlockDriverState *target, int64_t speed,
                             MirrorSyncMode sync_mode,
                             BdrvDirtyBitmap *sync_bitmap,
-                            bool compress,
+                            bool compress, int64_t max_workers,
+                            int64_t max_chunk,
                             BlockdevOnError on_source_error,
                             BlockdevOnError on_target_error,
                             int creation_flags,
@@ -224,6 +224,16 @@ void block_job_remove_all_bdrv(BlockJob *job);
  */
 void block_job_set_speed(BlockJob *job, int64_t speed, Error **errp);
 
+/**
+ * block_job_set_copy_mode:
+ * @job: The job to change.
+ * @mode: The new copy mode.
+ * @errp: Error object.
+ *
+ * Switch a mirror job between background and write-blocking copying.
+ */
+void block_job_set_copy_mode(BlockJob *job, MirrorCopyMode mode, Error **errp);
+
 /**
  * block_job_start:
  * @job: A job that has not yet been started.
@@ -44,6 +44,9 @@ struct BlockJobDriver {
     /** Optional callback for job types that support setting a speed limit */
     void (*set_speed)(BlockJob *job, int64_t speed, Error **errp);
 
+    /** Optional callback for job types that can copy synchronously */
+    void (*set_copy_mode)(BlockJob *job, MirrorCopyMode mode, Error **errp);
+
     /** Mandatory: Entrypoint for the Coroutine. */
     CoroutineEntry *start;
 
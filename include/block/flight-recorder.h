@@ -0,0 +1,122 @@
+/*
+ * Flight recorder of block requests
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_FLIGHT_RECORDER_H
+#define BLOCK_FLIGHT_RECORDER_H
+
+#include "qemu/atomic.h"
+
+/*
+ * Each thread that records an event gets its own ring of fixed-size
+ * records, so recording takes no lock and touches no shared cache line.
+ * Old records are overwritten once the ring is full.  The rings can be
+ * dumped at any time; scripts/flight-recorder.py decodes the dump.
+ *
+ * A dump is a FlightRecorderDumpHeader, then @nr_names device names,
+ * each a FlightRecorderDumpName followed by @len bytes of name padded to
+ * a multiple of 8, then @nr_rings rings, each a FlightRecorderDumpRing
+ * followed by @nr_records FlightRecords, oldest first.  All values are
+ * in host byte order.
+ */
+
+#define FLIGHT_RECORDER_MAGIC       "QEMUFREC"
+#define FLIGHT_RECORDER_VERSION     1
+
+typedef enum FlightRecorderEvent {
+    /* @dev is domid << 16 | virtual device, @id the ring request id */
+    FLIGHT_RECORDER_XEN_CONSUME = 1,
+    FLIGHT_RECORDER_XEN_SUBMIT,
+    FLIGHT_RECORDER_XEN_COMPLETE,
+    FLIGHT_RECORDER_XEN_RESPONSE,
+    /* @dev is the flight recorder id of the BlockBackend */
+    FLIGHT_RECORDER_BLK_SUBMIT,
+    FLIGHT_RECORDER_BLK_COMPLETE,
+} FlightRecorderEvent;
+
+typedef enum FlightRecorderOp {
+    FLIGHT_RECORDER_READ,
+    FLIGHT_RECORDER_WRITE,
+    FLIGHT_RECORDER_FLUSH,
+    FLIGHT_RECORDER_DISCARD,
+    /* Requests that were rejected without knowing what they are */
+    FLIGHT_RECORDER_OTHER,
+} FlightRecorderOp;
+
+typedef struct FlightRecord {
+    /* QEMU_CLOCK_REALTIME */
+    uint64_t time_ns;
+    uint64_t offset;
+    uint32_t bytes;
+    uint32_t id;
+    uint32_t dev;
+    uint8_t event;
+    uint8_t op;
+    /* Status of completions: BLKIF_RSP_* or a negative errno */
+    int16_t result;
+} FlightRecord;
+
+typedef struct FlightRecorderDumpHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    /* QEMU_CLOCK_REALTIME and wall-clock time of the dump */
+    uint64_t time_ns;
+    uint64_t wall_time_ns;
+    uint32_t nr_names;
+    uint32_t nr_rings;
+} FlightRecorderDumpHeader;
+
+typedef struct FlightRecorderDumpName {
+    uint32_t dev;
+    uint32_t len;
+} FlightRecorderDumpName;
+
+typedef struct FlightRecorderDumpRing {
+    uint32_t thread_id;
+    uint32_t nr_records;
+} FlightRecorderDumpRing;
+
+extern bool flight_recorder_enabled;
+
+int64_t flight_recorder_do_record(FlightRecorderEvent event,
+                                  FlightRecorderOp op, uint32_t dev,
+                                  uint32_t id, uint64_t offset,
+                                  uint32_t bytes, int result);
+
+/*
+ * Record an event in the ring of the current thread.  Returns the
+ * timestamp of the record, or 0 if the recorder is disabled.
+ */
+static inline int64_t flight_recorder_record(FlightRecorderEvent event,
+                                             FlightRecorderOp op,
+                                             uint32_t dev, uint32_t id,
+                                             uint64_t offset, uint32_t bytes,
+                                             int result)
+{
+    if (likely(!atomic_read(&flight_recorder_enabled))) {
+        return 0;
+    }
+    return flight_recorder_do_record(event, op, dev, id, offset, bytes,
+                                     result);
+}
+
+/*
+ * Dump the rings to the spike file if a request that started at
+ * @start_ns, as returned by flight_recorder_record(), took too long.
+ */
+void flight_recorder_check_latency(int64_t start_ns);
+
+int flight_recorder_enable(uint32_t entries, Error **errp);
+void flight_recorder_disable(void);
+void flight_recorder_set_spike(int64_t threshold_ns, const char *path);
+
+GByteArray *flight_recorder_dump(uint64_t *nr_records);
+int64_t flight_recorder_dump_file(const char *path, Error **errp);
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * Latency-driven admission control for block devices
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_LATENCY_QOS_H
+#define BLOCK_LATENCY_QOS_H
+
+#include "qemu/coroutine.h"
+
+typedef struct LatencyQosMember LatencyQosMember;
+
+typedef struct LatencyQosStats {
+    /* Requests that may be in flight at the same time, 0 if unlimited */
+    uint32_t depth_limit;
+    uint32_t in_flight;
+    /* Mean latency in the last window that had any I/O */
+    int64_t mean_latency_ns;
+    /* Requests that had to wait because the depth limit was reached */
+    uint64_t delayed;
+} LatencyQosStats;
+
+/*
+ * Members of the same group are assumed to share storage.  Every window
+ * the mean completion latency of each member is compared to its target.
+ * If a member misses its target, the queue depth of all members of the
+ * group with a lower priority is halved; once no member with a higher
+ * priority misses its target anymore, it grows back until the member is
+ * unlimited again.
+ *
+ * Members are created, configured and destroyed under the global mutex;
+ * admission and completion may run in any AioContext.
+ */
+LatencyQosMember *latency_qos_register(const char *group, uint32_t priority,
+                                       int64_t target_ns);
+void latency_qos_unregister(LatencyQosMember *m);
+void latency_qos_configure(LatencyQosMember *m, const char *group,
+                           uint32_t priority, int64_t target_ns);
+
+const char *latency_qos_get_group(LatencyQosMember *m);
+uint32_t latency_qos_get_priority(LatencyQosMember *m);
+int64_t latency_qos_get_target(LatencyQosMember *m);
+void latency_qos_get_stats(LatencyQosMember *m, LatencyQosStats *stats);
+
+/* Wait until a request may be submitted; returns its start timestamp */
+int64_t coroutine_fn latency_qos_co_admit(LatencyQosMember *m);
+/* Account a request that latency_qos_co_admit() returned @start_ns for */
+void coroutine_fn latency_qos_co_complete(LatencyQosMember *m,
+                                          int64_t start_ns);
+
+/* Close the current window of all groups and adjust the depth limits */
+void latency_qos_update(void);
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * Block device statistics in shared memory
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_STATS_SHM_H
+#define BLOCK_STATS_SHM_H
+
+#include "qemu/seqlock.h"
+
+/*
+ * The segment is a BlockStatsShmHeader followed by @nr_slots slots of
+ * @slot_size bytes each.  The header does not change after the segment
+ * is created, except for @update_time_ns and @dropped.
+ *
+ * Each slot describes one block device and is protected by its own
+ * seqlock: a reader copies the slot between seqlock_read_begin() and
+ * seqlock_read_retry() and starts over if the latter fails.  Slots with
+ * @in_use clear are free.  A device keeps its slot for as long as it
+ * exists, but a slot may be reused for another device once freed.
+ *
+ * All values are in host byte order.
+ */
+
+#define BLOCK_STATS_SHM_MAGIC       0x53544251 /* "QBTS" */
+#define BLOCK_STATS_SHM_VERSION     1
+
+#define BLOCK_STATS_SHM_NAME_LEN    64
+#define BLOCK_STATS_SHM_HIST_BINS   16
+
+typedef struct BlockStatsShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t slot_size;
+    uint32_t nr_slots;
+    uint32_t pid;
+    uint64_t interval_ns;
+    /* QEMU_CLOCK_REALTIME of the last update, 0 once export stopped */
+    uint64_t update_time_ns;
+    /* Devices not published by the last update, all slots were in use */
+    uint64_t dropped;
+} BlockStatsShmHeader;
+
+/* BlockStatsShmSlot.kind */
+#define BLOCK_STATS_SHM_DEVICE      1   /* @name is the device name */
+#define BLOCK_STATS_SHM_NODE        2   /* @name is the root node name */
+
+typedef struct BlockStatsShmHist {
+    /* Same meaning as in BlockLatencyHistogram, 0 if not enabled */
+    uint32_t nbins;
+    uint32_t pad;
+    uint64_t boundaries[BLOCK_STATS_SHM_HIST_BINS - 1];
+    uint64_t bins[BLOCK_STATS_SHM_HIST_BINS];
+} BlockStatsShmHist;
+
+typedef struct BlockStatsShmSlot {
+    QemuSeqLock seqlock;
+    uint32_t in_use;
+    uint32_t kind;
+    char name[BLOCK_STATS_SHM_NAME_LEN];
+
+    /* As in BlockDeviceStats, indexed by enum BlockAcctType */
+    uint64_t nr_bytes[3];
+    uint64_t nr_ops[3];
+    uint64_t failed_ops[3];
+    uint64_t invalid_ops[3];
+    uint64_t total_time_ns[3];
+    uint64_t merged[3];
+    uint64_t wr_highest_offset;
+    /* Time since the last I/O, -1 if there was none */
+    int64_t idle_time_ns;
+
+    /*
+     * Requests the device has taken from the guest and not completed,
+     * and how many it can take at most; 0 if it has no queue.
+     */
+    uint32_t queue_inflight;
+    uint32_t queue_size;
+
+    /* Latencies, indexed by enum BlockAcctType */
+    BlockStatsShmHist latency[3];
+} BlockStatsShmSlot;
+
+int block_stats_shm_start(const char *path, int64_t interval_ms,
+                          int64_t max_devices, Error **errp);
+void block_stats_shm_stop(void);
+void block_stats_shm_update(void);
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * Block status cache for backing chains
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+#ifndef BLOCK_STATUS_CACHE_H
+#define BLOCK_STATUS_CACHE_H
+
+#include "block/block.h"
+
+#define BDRV_BSC_DEFAULT_MAX_EXTENTS 4096
+
+typedef struct BdrvStatusCache BdrvStatusCache;
+
+/*
+ * A cached result of a block status walk down the whole backing chain of the
+ * node that holds the cache.
+ *
+ * @depth is the position in the chain (0 being the holder itself) of the
+ * layer that owns the range, i.e. the first one reporting it as DATA or
+ * ZERO, or -1 if no layer in the chain does.  @ret, @map and @file are what
+ * that layer reported.
+ */
+typedef struct BdrvStatusExtent {
+    int64_t offset;
+    int64_t bytes;
+    int64_t map;
+    BlockDriverState *file;
+    int ret;
+    int depth;
+} BdrvStatusExtent;
+
+typedef struct BdrvStatusCacheStats {
+    bool enabled;
+    uint32_t max_extents;
+    uint32_t nr_extents;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+} BdrvStatusCacheStats;
+
+/*
+ * bdrv_bsc_enable:
+ *
+ * Start caching block status results for queries on @bs, keeping at most
+ * @max_extents entries per query mode (0 selects the default).  Calling it
+ * on a node that already has a cache just updates the limit.
+ */
+void bdrv_bsc_enable(BlockDriverState *bs, uint32_t max_extents);
+
+/*
+ * bdrv_bsc_disable:
+ *
+ * Drop the cache of @bs, if any.
+ */
+void bdrv_bsc_disable(BlockDriverState *bs);
+
+bool bdrv_bsc_is_enabled(BlockDriverState *bs);
+
+/*
+ * bdrv_bsc_lookup:
+ *
+ * Find the cached extent covering @offset for the given query mode and copy
+ * it to @ext.  Returns false on a miss.
+ */
+bool bdrv_bsc_lookup(BlockDriverState *bs, bool want_zero, int64_t offset,
+                     BdrvStatusExtent *ext);
+
+/*
+ * bdrv_bsc_generation:
+ *
+ * Sample the invalidation generation of the cache of @bs before starting a
+ * chain walk; bdrv_bsc_insert() discards the result if anything was
+ * invalidated in the meantime.
+ */
+uint64_t bdrv_bsc_generation(BlockDriverState *bs);
+void bdrv_bsc_insert(BlockDriverState *bs, bool want_zero, uint64_t gen,
+                     const BdrvStatusExtent *ext);
+
+/*
+ * bdrv_bsc_resolve:
+ *
+ * Translate the chain-wide extent @ext into the result a walk from @bs down
+ * to (but excluding) @base would have returned for [@offset, @offset +
+ * @bytes).  @base must be NULL or a node in the backing chain of @bs.
+ */
+int bdrv_bsc_resolve(BlockDriverState *bs, BlockDriverState *base,
+                     const BdrvStatusExtent *ext, int64_t offset,
+                     int64_t bytes, int64_t *pnum, int64_t *map,
+                     BlockDriverState **file);
+
+/*
+ * bdrv_bsc_invalidate_range:
+ *
+ * Drop cached extents overlapping [@offset, @offset + @bytes) from @bs and
+ * from every node that has @bs in its backing chain.  Called after guest
+ * visible data of @bs has changed.
+ */
+void bdrv_bsc_invalidate_range(BlockDriverState *bs, int64_t offset,
+                               int64_t bytes);
+
+/*
+ * bdrv_bsc_invalidate:
+ *
+ * Like bdrv_bsc_invalidate_range() for the whole disk; used on resize and
+ * on graph changes.
+ */
+void bdrv_bsc_invalidate(BlockDriverState *bs);
+
+void bdrv_bsc_get_stats(BlockDriverState *bs, BdrvStatusCacheStats *stats);
+
+/*
+ * bdrv_bsc_foreach_extent:
+ *
+ * Call @fn for every cached extent of @bs, in offset order, first for the
+ * allocation-only view and then for the want_zero view.  The cache lock is
+ * held during the walk, so @fn must not call back into the cache.
+ */
+void bdrv_bsc_foreach_extent(BlockDriverState *bs,
+                             void (*fn)(void *opaque, bool want_zero,
+                                        const BdrvStatusExtent *ext),
+                             void *opaque);
+
+#endif
@@ -24,14 +24,72 @@ typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPool ThreadPool;
 
+/*
+ * Requests are queued separately by class, so that slow syncs (fsync,
+ * fallocate, discard) can be kept from starving reads and writes.
+ */
+typedef enum ThreadPoolClass {
+    THREAD_POOL_DATA,
+    THREAD_POOL_FLUSH,
+    THREAD_POOL_NR_CLASSES,
+} ThreadPoolClass;
+
+/* Highest CPU number that can appear in ThreadPoolParams.cpus */
+#define THREAD_POOL_MAX_CPUS 1024
+
+typedef struct ThreadPoolParams {
+    int min_threads;        /* workers kept alive even when idle */
+    int max_threads;
+    int max_flush_threads;  /* workers busy with flushes at once, 0: any */
+    bool data_first;        /* serve data before flushes, else FIFO */
+    unsigned long *cpus;    /* bitmap of THREAD_POOL_MAX_CPUS, NULL: any */
+} ThreadPoolParams;
+
+typedef struct ThreadPoolClassStats {
+    uint64_t queued;        /* waiting for a worker */
+    uint64_t active;        /* being serviced */
+    uint64_t completed;
+    uint64_t wait_ns;       /* total time spent queued */
+    uint64_t service_ns;    /* total time spent in the worker */
+} ThreadPoolClassStats;
+
+typedef struct ThreadPoolStats {
+    int cur_threads;
+    int idle_threads;
+    ThreadPoolClassStats cls[THREAD_POOL_NR_CLASSES];
+} ThreadPoolStats;
+
 ThreadPool *thread_pool_new(struct AioContext *ctx);
 void thread_pool_free(ThreadPool *pool);
 
 BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg,
         BlockCompletionFunc *cb, void *opaque);
+BlockAIOCB *thread_pool_submit_aio_class(ThreadPool *pool,
+        ThreadPoolClass cls, ThreadPoolFunc *func, void *arg,
+        BlockCompletionFunc *cb, void *opaque);
 int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg);
+int coroutine_fn thread_pool_submit_co_class(ThreadPool *pool,
+        ThreadPoolClass cls, ThreadPoolFunc *func, void *arg);
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
 
+/*
+ * thread_pool_set_params:
+ *
+ * Reconfigure @pool.  The caller keeps ownership of @params->cpus.  A new
+ * CPU affinity is applied by each worker the next time it wakes up; workers
+ * above a lowered limit go away once they are idle.
+ */
+void thread_pool_set_params(ThreadPool *pool, const ThreadPoolParams *params);
+
+/*
+ * thread_pool_get_params:
+ *
+ * Fill @params with the configuration of @pool.  @params->cpus, if not
+ * NULL, is a copy that the caller must free with g_free().
+ */
+void thread_pool_get_params(ThreadPool *pool, ThreadPoolParams *params);
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats);
+
 #endif
@@ -35,6 +35,7 @@ int xenstore_read_fe_uint64(struct XenDevice *xendev, const char *node,
                             uint64_t *uval);
 
 void xen_be_check_state(struct XenDevice *xendev);
+void xen_be_del_xendev(struct XenDevice *xendev);
 
 /* xen backend driver bits */
 int xen_be_init(void);
@@ -2,6 +2,7 @@
 #define QEMU_HW_XEN_PVDEV_H
 
 #include "hw/xen/xen_common.h"
+#include "qemu/coroutine.h"
 /* ------------------------------------------------------------- */
 
 #define XEN_BUFSIZE 1024
@@ -38,6 +39,15 @@ struct XenDevice {
 
     char*              blocknode;
     char*              devicename;
+    /* Event loop of the data path, NULL for the main loop */
+    AioContext         *ctx;
+
+    /* See xen_be_check_state() */
+    Coroutine          *check_co;
+    bool               check_again;
+    bool               deleted;
+    QSIMPLEQ_HEAD(, XenDevEvent) events;
+    struct XenStoreBatch *batch;
 
     enum xenbus_state  be_state;
     enum xenbus_state  fe_state;
@@ -61,6 +71,7 @@ struct XenDevice {
 int xenstore_write_str(const char *base, const char *node, const char *val);
 int xenstore_write_int(const char *base, const char *node, int ival);
 int xenstore_write_int64(const char *base, const char *node, int64_t ival);
+char *xenstore_read_path(const char *path);
 char *xenstore_read_str(const char *base, const char *node);
 int xenstore_read_int(const char *base, const char *node, int *ival);
 int xenstore_read_uint64(const char *base, const char *node, uint64_t *uval);
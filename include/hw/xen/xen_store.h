@@ -0,0 +1,41 @@
+#ifndef QEMU_HW_XEN_STORE_H
+#define QEMU_HW_XEN_STORE_H
+
+#include "qemu/coroutine.h"
+
+/*
+ * Asynchronous xenstore client.
+ *
+ * A second connection to xenstored, next to the libxenstore handle that
+ * carries the watches.  Requests from any number of coroutines in the
+ * main loop are pipelined on it and the replies are picked up by an fd
+ * handler, so that a device waiting for xenstore does not hold up the
+ * I/O of the others.
+ *
+ * Writes are collected in a XenStoreBatch and committed together in one
+ * transaction.  Reads do not see writes that are still queued.  Callers
+ * outside of a main loop coroutine, or without a connection, get the old
+ * synchronous behaviour.
+ */
+
+typedef struct XenStoreBatch XenStoreBatch;
+
+int xen_store_init(void);
+void xen_store_cleanup(void);
+
+/* Whether xen_store_co_*() may be called from the current context */
+bool xen_store_can_yield(void);
+
+/* Returns the value as a NUL-terminated string, or NULL with errno set */
+char *coroutine_fn xen_store_co_read(const char *path);
+
+XenStoreBatch *xen_store_batch_new(void);
+void xen_store_batch_write(XenStoreBatch *batch, const char *path,
+                           const char *val);
+/*
+ * Commits and frees @batch, retrying while xenstored says EAGAIN.  Yields
+ * if xen_store_can_yield(), blocks otherwise.
+ */
+int xen_store_batch_commit(XenStoreBatch *batch);
+
+#endif /* QEMU_HW_XEN_STORE_H */
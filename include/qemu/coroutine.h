@@ -117,6 +117,32 @@ bool qemu_in_coroutine(void);
  */
 bool qemu_coroutine_entered(Coroutine *co);
 
+typedef struct CoroutinePoolStats {
+    unsigned int batch_size;    /* current per-thread pool size */
+    unsigned long hits;         /* coroutines reused from a pool */
+    unsigned long misses;       /* coroutines that had to be allocated */
+    unsigned long steals;       /* refills taken from another thread */
+} CoroutinePoolStats;
+
+/**
+ * Grow the coroutine pool for @n more concurrently running coroutines
+ *
+ * Devices call this with the number of requests they can have in flight, so
+ * that the pool does not fall back to allocating stacks under load.  The
+ * size each thread keeps is capped.
+ */
+void qemu_coroutine_inc_pool_size(unsigned int n);
+
+/**
+ * Undo a previous qemu_coroutine_inc_pool_size() call
+ */
+void qemu_coroutine_dec_pool_size(unsigned int n);
+
+/**
+ * Get the counters of the coroutine pool, summed over all threads
+ */
+void qemu_coroutine_get_pool_stats(CoroutinePoolStats *stats);
+
 /**
  * Provides a mutex that can be used to synchronise coroutines
  */
@@ -61,6 +61,45 @@ struct HBitmapIter {
  */
 HBitmap *hbitmap_alloc(uint64_t size, int granularity);
 
+/**
+ * hbitmap_alloc_sparse:
+ * @size: Number of bits in the bitmap.
+ * @granularity: Granularity of the bitmap.
+ *
+ * Allocate a new HBitmap like hbitmap_alloc(), but only allocate the last
+ * level for the parts of the bitmap that have bits set.  This saves memory
+ * for mostly clean bitmaps of large disks, at the cost of an extra
+ * indirection on each access.
+ */
+HBitmap *hbitmap_alloc_sparse(uint64_t size, int granularity);
+
+/**
+ * hbitmap_is_sparse:
+ * @hb: HBitmap to operate on.
+ *
+ * Return whether the last level of @hb is allocated sparsely.
+ */
+bool hbitmap_is_sparse(const HBitmap *hb);
+
+/**
+ * hbitmap_set_sparse:
+ * @hb: HBitmap to operate on.
+ * @sparse: Whether the last level should be allocated sparsely.
+ *
+ * Convert @hb between the dense and the sparse representation.  The
+ * contents are unchanged.  This may invalidate existing HBitmapIterators.
+ */
+void hbitmap_set_sparse(HBitmap *hb, bool sparse);
+
+/**
+ * hbitmap_memory_size:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bytes currently allocated for @hb, not counting its
+ * meta bitmap.
+ */
+uint64_t hbitmap_memory_size(const HBitmap *hb);
+
 /**
  * hbitmap_truncate:
  * @hb: The bitmap to change the size of.
@@ -84,6 +123,30 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size);
  */
 bool hbitmap_merge(HBitmap *a, const HBitmap *b);
 
+/**
+ * hbitmap_intersect:
+ * @a: The bitmap to store the result in.
+ * @b: The bitmap to intersect with @a.
+ * @return true if the intersection was computed,
+ *         false if it was not attempted.
+ *
+ * A := A (BITAND) B.
+ * B is left unmodified.
+ */
+bool hbitmap_intersect(HBitmap *a, const HBitmap *b);
+
+/**
+ * hbitmap_subtract:
+ * @a: The bitmap to store the result in.
+ * @b: The bitmap whose bits are cleared from @a.
+ * @return true if the subtraction was computed,
+ *         false if it was not attempted.
+ *
+ * A := A (BITAND) (BITNOT B).
+ * B is left unmodified.
+ */
+bool hbitmap_subtract(HBitmap *a, const HBitmap *b);
+
 /**
  * hbitmap_empty:
  * @hb: HBitmap to operate on.
@@ -156,6 +156,11 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              ThrottleTimers *tt,
                              bool is_write);
 
+void throttle_do_leak(ThrottleState *ts, int64_t now);
+
+int64_t throttle_leak_and_compute_wait(ThrottleState *ts, bool is_write,
+                                       int64_t now);
+
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
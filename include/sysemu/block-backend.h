@@ -15,6 +15,7 @@
 
 #include "qemu/iov.h"
 #include "block/throttle-groups.h"
+#include "block/latency-qos.h"
 
 /*
  * TODO Have to include block/block.h for a bunch of block layer
@@ -68,6 +69,9 @@ typedef struct BlockDevOps {
     void (*drained_end)(void *opaque);
 } BlockDevOps;
 
+typedef void BlkQueueStatsFn(void *opaque, unsigned *inflight,
+                             unsigned *size);
+
 /* This struct is embedded in (the private) BlockBackend struct and contains
  * fields that must be public. This is in particular for QLIST_ENTRY() and
  * friends so that BlockBackends can be kept in lists outside block-backend.c
@@ -113,6 +117,10 @@ int blk_attach_dev(BlockBackend *blk, DeviceState *dev);
 void blk_attach_dev_legacy(BlockBackend *blk, void *dev);
 void blk_detach_dev(BlockBackend *blk, void *dev);
 void *blk_get_attached_dev(BlockBackend *blk);
+void blk_set_queue_stats_fn(BlockBackend *blk, BlkQueueStatsFn *fn,
+                            void *opaque);
+bool blk_get_queue_stats(BlockBackend *blk, unsigned *inflight,
+                         unsigned *size);
 char *blk_get_attached_dev_id(BlockBackend *blk);
 BlockBackend *blk_by_dev(void *dev);
 BlockBackend *blk_by_qdev_id(const char *id, Error **errp);
@@ -199,6 +207,11 @@ void blk_add_remove_bs_notifier(BlockBackend *blk, Notifier *notify);
 void blk_add_insert_bs_notifier(BlockBackend *blk, Notifier *notify);
 void blk_io_plug(BlockBackend *blk);
 void blk_io_unplug(BlockBackend *blk);
+void blk_set_merge(BlockBackend *blk, bool enable, int64_t window_ns);
+void blk_set_latency_qos(BlockBackend *blk, bool enable, const char *group,
+                         uint32_t priority, int64_t target_ns);
+LatencyQosMember *blk_get_latency_qos(BlockBackend *blk);
+uint32_t blk_get_flight_id(BlockBackend *blk);
 BlockAcctStats *blk_get_stats(BlockBackend *blk);
 BlockBackendRootState *blk_get_root_state(BlockBackend *blk);
 void blk_update_root_state(BlockBackend *blk);
@@ -19,7 +19,13 @@
 #include "block/block.h"
 #include "sysemu/iothread.h"
 #include "qapi/error.h"
+#ifdef CONFIG_QEMUDP
+#include "dp-qapi/qapi-commands-misc.h"
+#include "block/thread-pool.h"
+#include "qemu/bitmap.h"
+#else
 #include "qapi/qapi-commands-misc.h"
+#endif
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
 #include "qemu/main-loop.h"
@@ -371,3 +377,169 @@ IOThread *iothread_by_id(const char *id)
 {
     return IOTHREAD(object_resolve_path_type(id, TYPE_IOTHREAD, NULL));
 }
+
+#ifdef CONFIG_QEMUDP
+void qmp_x_thread_pool_set(bool has_iothread, const char *iothread,
+                           bool has_min_workers, int64_t min_workers,
+                           bool has_max_workers, int64_t max_workers,
+                           bool has_max_flush_workers,
+                           int64_t max_flush_workers,
+                           bool has_data_first, bool data_first,
+                           bool has_cpus, uint16List *cpus,
+                           Error **errp)
+{
+    AioContext *ctx = qemu_get_aio_context();
+    ThreadPool *pool;
+    ThreadPoolParams params;
+    uint16List *l;
+
+    if (has_iothread) {
+        IOThread *obj = iothread_by_id(iothread);
+        if (!obj) {
+            error_setg(errp, "Cannot find iothread %s", iothread);
+            return;
+        }
+        ctx = iothread_get_aio_context(obj);
+    }
+
+    /* Check the ranges before the values are narrowed to int */
+    if (has_max_workers && (max_workers < 1 || max_workers > INT_MAX)) {
+        error_setg(errp, "max-workers must be between 1 and %d", INT_MAX);
+        return;
+    }
+    if (has_min_workers && (min_workers < 0 || min_workers > INT_MAX)) {
+        error_setg(errp, "min-workers must be between 0 and max-workers");
+        return;
+    }
+    if (has_max_flush_workers &&
+        (max_flush_workers < 0 || max_flush_workers > INT_MAX)) {
+        error_setg(errp, "max-flush-workers must be between 0 and %d",
+                   INT_MAX);
+        return;
+    }
+
+    /* The IOThread creates its pool lazily, under its AioContext */
+    aio_context_acquire(ctx);
+    pool = aio_get_thread_pool(ctx);
+    thread_pool_get_params(pool, &params);
+
+    if (has_min_workers) {
+        params.min_threads = min_workers;
+    }
+    if (has_max_workers) {
+        params.max_threads = max_workers;
+    }
+    if (has_max_flush_workers) {
+        params.max_flush_threads = max_flush_workers;
+    }
+    if (has_data_first) {
+        params.data_first = data_first;
+    }
+    if (has_cpus) {
+        g_free(params.cpus);
+        params.cpus = NULL;
+        for (l = cpus; l; l = l->next) {
+            if (l->value >= THREAD_POOL_MAX_CPUS) {
+                error_setg(errp, "CPU %d out of range", l->value);
+                goto out;
+            }
+            if (!params.cpus) {
+                params.cpus = bitmap_new(THREAD_POOL_MAX_CPUS);
+            }
+            set_bit(l->value, params.cpus);
+        }
+    }
+
+    if (params.min_threads > params.max_threads) {
+        error_setg(errp, "min-workers must be between 0 and max-workers");
+        goto out;
+    }
+
+    thread_pool_set_params(pool, &params);
+out:
+    aio_context_release(ctx);
+    g_free(params.cpus);
+}
+
+static ThreadPoolQueueInfo *thread_pool_queue_info(ThreadPoolClassStats *cls)
+{
+    ThreadPoolQueueInfo *info = g_new0(ThreadPoolQueueInfo, 1);
+
+    info->queued = cls->queued;
+    info->active = cls->active;
+    info->completed = cls->completed;
+    info->wait_ns = cls->wait_ns;
+    info->service_ns = cls->service_ns;
+    return info;
+}
+
+static ThreadPoolInfo *thread_pool_info(AioContext *ctx)
+{
+    ThreadPool *pool;
+    ThreadPoolInfo *info = g_new0(ThreadPoolInfo, 1);
+    ThreadPoolParams params;
+    ThreadPoolStats stats;
+
+    aio_context_acquire(ctx);
+    pool = aio_get_thread_pool(ctx);
+    thread_pool_get_params(pool, &params);
+    thread_pool_get_stats(pool, &stats);
+    aio_context_release(ctx);
+
+    info->min_workers = params.min_threads;
+    info->max_workers = params.max_threads;
+    info->max_flush_workers = params.max_flush_threads;
+    info->data_first = params.data_first;
+    if (params.cpus) {
+        uint16List **tail = &info->cpus;
+        long cpu;
+
+        for (cpu = find_first_bit(params.cpus, THREAD_POOL_MAX_CPUS);
+             cpu < THREAD_POOL_MAX_CPUS;
+             cpu = find_next_bit(params.cpus, THREAD_POOL_MAX_CPUS, cpu + 1)) {
+            *tail = g_new0(uint16List, 1);
+            (*tail)->value = cpu;
+            tail = &(*tail)->next;
+        }
+        info->has_cpus = true;
+        g_free(params.cpus);
+    }
+    info->workers = stats.cur_threads;
+    info->idle_workers = stats.idle_threads;
+    info->data = thread_pool_queue_info(&stats.cls[THREAD_POOL_DATA]);
+    info->flush = thread_pool_queue_info(&stats.cls[THREAD_POOL_FLUSH]);
+    return info;
+}
+
+static int query_one_thread_pool(Object *object, void *opaque)
+{
+    ThreadPoolInfoList ***prev = opaque;
+    ThreadPoolInfoList *elem;
+    IOThread *iothread;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (!iothread) {
+        return 0;
+    }
+
+    elem = g_new0(ThreadPoolInfoList, 1);
+    elem->value = thread_pool_info(iothread->ctx);
+    elem->value->has_iothread = true;
+    elem->value->iothread = iothread_get_id(iothread);
+
+    **prev = elem;
+    *prev = &elem->next;
+    return 0;
+}
+
+ThreadPoolInfoList *qmp_query_thread_pools(Error **errp)
+{
+    ThreadPoolInfoList *head = g_new0(ThreadPoolInfoList, 1);
+    ThreadPoolInfoList **prev = &head->next;
+    Object *container = object_get_objects_root();
+
+    head->value = thread_pool_info(qemu_get_aio_context());
+    object_child_foreach(container, query_one_thread_pool, &prev);
+    return head;
+}
+#endif
@@ -1,7 +1,8 @@
-#include <stdarg.h>
-#include <stdio.h>
+#include "qemu/osdep.h"
 #include <syslog.h>
 #include "logging.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
 
 #undef fprintf
 #undef printf
@@ -9,6 +10,65 @@
 
 int logging_redirect_output = 0;
 
+/*
+ * While output is redirected, messages are not sent to syslog by the
+ * thread that prints them, because vsyslog() blocks when the log daemon
+ * is slow and the caller may be an I/O path.  Instead each thread
+ * assembles its output up to a newline, then puts the line in a bounded
+ * lock-free queue; if the queue is full the line is dropped and counted.
+ * A helper thread drains the queue, folds repeats of the last message and
+ * limits each call site (identified by the format strings that built the
+ * line) to LOGGING_RATE_BURST lines per LOGGING_RATE_INTERVAL, reporting
+ * how many lines it suppressed.
+ */
+
+#define LOGGING_MSG_SIZE        1024
+#define LOGGING_QUEUE_SIZE      256
+#define LOGGING_RATE_BURST      10
+#define LOGGING_RATE_INTERVAL   (5 * G_USEC_PER_SEC)
+/* How often the helper thread wakes up to report repeats and suppressions */
+#define LOGGING_TICK_MS         1000
+
+typedef struct LoggingSlot {
+    unsigned long seq;
+    uintptr_t site;
+    char msg[LOGGING_MSG_SIZE];
+} LoggingSlot;
+
+typedef struct LoggingSite {
+    int64_t window_start;
+    unsigned count;
+    unsigned suppressed;
+    char *sample;
+} LoggingSite;
+
+static void logging_syslog(const char *msg)
+{
+    syslog(LOG_DAEMON | LOG_NOTICE, "%s", msg);
+}
+
+static void (*logging_output)(const char *msg) = logging_syslog;
+
+/* The line each thread is assembling */
+static __thread char logging_line[LOGGING_MSG_SIZE];
+static __thread size_t logging_line_len;
+static __thread uintptr_t logging_line_site;
+
+static bool logging_async;
+static LoggingSlot logging_queue[LOGGING_QUEUE_SIZE];
+static unsigned long logging_head;
+static unsigned logging_dropped;
+static QemuSemaphore logging_sem;
+static QemuThread logging_thread;
+
+/* logging_lock protects the consumer side of the queue and what follows */
+static QemuMutex logging_lock;
+static unsigned long logging_tail;
+static GHashTable *logging_sites;
+static char logging_last[LOGGING_MSG_SIZE];
+static uintptr_t logging_last_site;
+static unsigned logging_repeats;
+
 /* the use of logging_set_prefix() is optional */
 void logging_set_prefix(const char *ident)
 {
@@ -16,14 +76,262 @@ void logging_set_prefix(const char *ident)
     openlog(ident, LOG_NOWAIT | LOG_PID, LOG_DAEMON);
 }
 
+static void logging_flush_repeats(void)
+{
+    char buf[64];
+
+    if (logging_repeats) {
+        snprintf(buf, sizeof(buf), "last message repeated %u times",
+                 logging_repeats);
+        logging_output(buf);
+        logging_repeats = 0;
+    }
+    logging_last[0] = '\0';
+}
+
+static void logging_report_suppressed(LoggingSite *s)
+{
+    char *buf;
+
+    if (s->suppressed) {
+        buf = g_strdup_printf("suppressed %u messages like: %s",
+                              s->suppressed, s->sample);
+        logging_output(buf);
+        g_free(buf);
+    }
+    g_free(s->sample);
+    s->sample = NULL;
+    s->suppressed = 0;
+}
+
+static void logging_site_free(gpointer data)
+{
+    LoggingSite *s = data;
+
+    g_free(s->sample);
+    g_free(s);
+}
+
+static gboolean logging_site_expire(gpointer key, gpointer value,
+                                    gpointer opaque)
+{
+    LoggingSite *s = value;
+    int64_t now = *(int64_t *)opaque;
+
+    if (now - s->window_start < LOGGING_RATE_INTERVAL) {
+        return false;
+    }
+    logging_report_suppressed(s);
+    return true;
+}
+
+static void logging_emit(uintptr_t site, const char *msg, int64_t now)
+{
+    LoggingSite *s;
+
+    if (site == logging_last_site && !strcmp(msg, logging_last)) {
+        logging_repeats++;
+        return;
+    }
+
+    s = g_hash_table_lookup(logging_sites, (gpointer)site);
+    if (!s) {
+        s = g_new0(LoggingSite, 1);
+        s->window_start = now;
+        g_hash_table_insert(logging_sites, (gpointer)site, s);
+    } else if (now - s->window_start >= LOGGING_RATE_INTERVAL) {
+        logging_report_suppressed(s);
+        s->window_start = now;
+        s->count = 0;
+    }
+    if (s->count >= LOGGING_RATE_BURST) {
+        if (!s->suppressed++) {
+            s->sample = g_strdup(msg);
+        }
+        return;
+    }
+    s->count++;
+
+    logging_flush_repeats();
+    logging_output(msg);
+    g_strlcpy(logging_last, msg, sizeof(logging_last));
+    logging_last_site = site;
+}
+
+/* Called with logging_lock held */
+static void logging_drain(bool tick)
+{
+    int64_t now = g_get_monotonic_time();
+    unsigned dropped;
+    char buf[64];
+
+    for (;;) {
+        LoggingSlot *slot = &logging_queue[logging_tail % LOGGING_QUEUE_SIZE];
+
+        if (atomic_load_acquire(&slot->seq) != logging_tail + 1) {
+            break;
+        }
+        logging_emit(slot->site, slot->msg, now);
+        atomic_store_release(&slot->seq, logging_tail + LOGGING_QUEUE_SIZE);
+        logging_tail++;
+    }
+
+    dropped = atomic_xchg(&logging_dropped, 0);
+    if (dropped) {
+        snprintf(buf, sizeof(buf), "logging queue full, dropped %u messages",
+                 dropped);
+        logging_output(buf);
+    }
+
+    if (tick) {
+        logging_flush_repeats();
+        g_hash_table_foreach_remove(logging_sites, logging_site_expire, &now);
+    }
+}
+
+static void *logging_thread_fn(void *opaque)
+{
+    int64_t last_tick = g_get_monotonic_time();
+
+    for (;;) {
+        int64_t now;
+        bool tick;
+
+        qemu_sem_timedwait(&logging_sem, LOGGING_TICK_MS);
+        now = g_get_monotonic_time();
+        tick = now - last_tick >= LOGGING_TICK_MS * 1000;
+        if (tick) {
+            last_tick = now;
+        }
+
+        qemu_mutex_lock(&logging_lock);
+        logging_drain(tick);
+        qemu_mutex_unlock(&logging_lock);
+    }
+    return NULL;
+}
+
+/* Never blocks; the line is dropped if the queue is full */
+static void logging_enqueue(uintptr_t site, const char *msg, size_t len)
+{
+    unsigned long pos = atomic_read(&logging_head);
+    LoggingSlot *slot;
+
+    for (;;) {
+        unsigned long seq, old;
+
+        slot = &logging_queue[pos % LOGGING_QUEUE_SIZE];
+        seq = atomic_load_acquire(&slot->seq);
+        if (seq == pos) {
+            old = atomic_cmpxchg(&logging_head, pos, pos + 1);
+            if (old == pos) {
+                break;
+            }
+            pos = old;
+        } else if ((long)(seq - pos) < 0) {
+            atomic_inc(&logging_dropped);
+            return;
+        } else {
+            pos = atomic_read(&logging_head);
+        }
+    }
+
+    memcpy(slot->msg, msg, len);
+    slot->msg[len] = '\0';
+    slot->site = site;
+    atomic_store_release(&slot->seq, pos + 1);
+    qemu_sem_post(&logging_sem);
+}
+
+static void logging_start(void)
+{
+    unsigned long i;
+
+    if (logging_async) {
+        return;
+    }
+
+    for (i = 0; i < LOGGING_QUEUE_SIZE; i++) {
+        logging_queue[i].seq = i;
+    }
+    qemu_mutex_init(&logging_lock);
+    qemu_sem_init(&logging_sem, 0);
+    logging_sites = g_hash_table_new_full(NULL, NULL, NULL,
+                                          logging_site_free);
+    qemu_thread_create(&logging_thread, "logging", logging_thread_fn, NULL,
+                       QEMU_THREAD_DETACHED);
+    atexit(logging_flush);
+    atomic_set(&logging_async, true);
+}
+
 void logging_set_redirect(int redirect)
 {
+    if (redirect) {
+        logging_start();
+    } else {
+        logging_flush();
+    }
     logging_redirect_output = redirect;
 }
 
-static inline void __syslog_vfprintf(const char *format, va_list ap)
+/* Only meant for tests */
+void logging_set_output(void (*output)(const char *msg))
 {
-    vsyslog(LOG_DAEMON | LOG_NOTICE, format, ap);
+    logging_flush();
+    logging_output = output ?: logging_syslog;
+}
+
+/*
+ * Send out everything that is queued, including pending reports of repeats
+ * and suppressed lines, and then the partial line of the calling thread.
+ * The latter does not go through the queue, where it could be dropped:
+ * assert() flushes its message like this just before aborting.
+ */
+void logging_flush(void)
+{
+    if (!atomic_read(&logging_async)) {
+        return;
+    }
+
+    qemu_mutex_lock(&logging_lock);
+    logging_drain(false);
+    logging_flush_repeats();
+    g_hash_table_foreach_remove(logging_sites, logging_site_expire,
+                                &(int64_t){ INT64_MAX });
+    if (logging_line_len) {
+        logging_output(logging_line);
+        logging_line_len = 0;
+        logging_line_site = 0;
+    }
+    qemu_mutex_unlock(&logging_lock);
+}
+
+static void __syslog_vfprintf(const char *format, va_list ap)
+{
+    size_t len = logging_line_len;
+    int ret;
+
+    ret = vsnprintf(logging_line + len, sizeof(logging_line) - len,
+                    format, ap);
+    if (ret < 0) {
+        return;
+    }
+    len = MIN(len + ret, sizeof(logging_line) - 1);
+    logging_line_site = logging_line_site * 31 + (uintptr_t)format;
+
+    if (len && logging_line[len - 1] != '\n' &&
+        len < sizeof(logging_line) - 1) {
+        logging_line_len = len;
+        return;
+    }
+
+    /* syslog() does not need the newline */
+    if (len && logging_line[len - 1] == '\n') {
+        len--;
+    }
+    logging_enqueue(logging_line_site, logging_line, len);
+    logging_line_len = 0;
+    logging_line_site = 0;
 }
 
 int qemu_log_vfprintf(FILE *stream, const char *format, va_list ap)
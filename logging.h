@@ -28,6 +28,7 @@
     if (!(expr)) { \
         if (logging_redirect_output) { \
             qemu_log_printf("%s:%s:%d Assertion `%s' failed.", __FILE__, __FUNCTION__, __LINE__, #expr); \
+            logging_flush(); \
             abort(); \
         } else { \
             __assert_fail(#expr, __FILE__, __LINE__, __ASSERT_FUNCTION); \
@@ -42,6 +43,8 @@
 
 void logging_set_redirect(int redirect);
 void logging_set_prefix(const char *ident);
+void logging_set_output(void (*output)(const char *msg));
+void logging_flush(void);
 int qemu_log_vfprintf(FILE *stream, const char *format, va_list ap);
 int qemu_log_printf(const char *format, ...)
   __attribute__ ((format (printf, 1, 2)));
@@ -21,8 +21,16 @@
 #include "qapi/error.h"
 #include "trace.h"
 #include "nbd-internal.h"
+#include "block/dirty-bitmap.h"
 
 #define NBD_META_ID_BASE_ALLOCATION 0
+#define NBD_META_ID_DIRTY_BITMAP 1
+
+/* NBD_MAX_BITMAP_EXTENTS: 1 mb of extents data. An empirical
+ * constant. If an increase is needed, note that the NBD protocol
+ * recommends no larger than 32 mb, so that the client won't consider
+ * the reply as a denial of service attack. */
+#define NBD_MAX_BITMAP_EXTENTS (0x100000 / sizeof(NBDExtent))
 
 static int system_errno_to_nbd_errno(int err)
 {
@@ -60,6 +68,7 @@ struct NBDRequestData {
     QSIMPLEQ_ENTRY(NBDRequestData) entry;
     NBDClient *client;
     uint8_t *data;
+    size_t data_size; /* allocated size of @data, kept when pooled */
     bool complete;
 };
 
@@ -80,6 +89,9 @@ struct NBDExport {
 
     BlockBackend *eject_notifier_blk;
     Notifier eject_notifier;
+
+    BdrvDirtyBitmap *export_bitmap;
+    char *export_bitmap_context;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -89,9 +101,11 @@ static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
  * NBD_OPT_LIST_META_CONTEXT. */
 typedef struct NBDExportMetaContexts {
     char export_name[NBD_MAX_NAME_SIZE + 1];
+    NBDExport *exp;
     bool valid; /* means that negotiation of the option finished without
                    errors */
     bool base_allocation; /* export base:allocation context (block status) */
+    bool bitmap; /* export qemu:dirty-bitmap:<export bitmap name> */
 } NBDExportMetaContexts;
 
 struct NBDClient {
@@ -113,6 +127,9 @@ struct NBDClient {
     int nb_requests;
     bool closing;
 
+    /* Finished requests kept for reuse, with their data buffers */
+    QSIMPLEQ_HEAD(, NBDRequestData) free_requests;
+
     bool structured_reply;
     NBDExportMetaContexts export_meta;
 
@@ -734,10 +751,66 @@ static int nbd_negotiate_send_meta_context(NBDClient *client,
     return qio_channel_writev_all(client->ioc, iov, 2, errp) < 0 ? -EIO : 0;
 }
 
+/* Read strlen(@pattern) bytes, and set @match to true if they match @pattern.
+ * @match is never set to false.
+ *
+ * Return -errno on I/O error, 0 if option was completely handled by
+ * sending a reply about inconsistent lengths, or 1 on success. */
+static int nbd_meta_pattern(NBDClient *client, const char *pattern,
+                            bool *match, Error **errp)
+{
+    int ret;
+    char *query;
+    size_t len = strlen(pattern);
+
+    assert(len);
+
+    query = g_malloc(len);
+    ret = nbd_opt_read(client, query, len, errp);
+    if (ret <= 0) {
+        g_free(query);
+        return ret;
+    }
+
+    if (strncmp(query, pattern, len) == 0) {
+        trace_nbd_negotiate_meta_query_parse(pattern);
+        *match = true;
+    } else {
+        trace_nbd_negotiate_meta_query_skip("pattern not matched");
+    }
+    g_free(query);
+
+    return 1;
+}
+
+/* Read @len bytes, and set @match to true if they match @pattern, or if @len
+ * is 0 and the client is performing _LIST_. @match is never set to false.
+ *
+ * Return -errno on I/O error, 0 if option was completely handled by
+ * sending a reply about inconsistent lengths, or 1 on success. */
+static int nbd_meta_empty_or_pattern(NBDClient *client, const char *pattern,
+                                     uint32_t len, bool *match, Error **errp)
+{
+    if (len == 0) {
+        if (client->opt == NBD_OPT_LIST_META_CONTEXT) {
+            *match = true;
+        }
+        trace_nbd_negotiate_meta_query_parse("empty");
+        return 1;
+    }
+
+    if (len != strlen(pattern)) {
+        trace_nbd_negotiate_meta_query_skip("different lengths");
+        return nbd_opt_skip(client, len, errp);
+    }
+
+    return nbd_meta_pattern(client, pattern, match, errp);
+}
+
 /* nbd_meta_base_query
  *
- * Handle query to 'base' namespace. For now, only base:allocation context is
- * available in it.  'len' is the amount of text remaining to be read from
+ * Handle queries to 'base' namespace. For now, only the base:allocation
+ * context is available.  'len' is the amount of text remaining to be read from
  * the current name, after the 'base:' portion has been stripped.
  *
  * Return -errno on I/O error, 0 if option was completely handled by
@@ -745,34 +818,56 @@ static int nbd_negotiate_send_meta_context(NBDClient *client,
 static int nbd_meta_base_query(NBDClient *client, NBDExportMetaContexts *meta,
                                uint32_t len, Error **errp)
 {
+    return nbd_meta_empty_or_pattern(client, "allocation", len,
+                                     &meta->base_allocation, errp);
+}
+
+/* nbd_meta_qemu_query
+ *
+ * Handle queries to 'qemu' namespace. For now, only the qemu:dirty-bitmap:
+ * context is available.  'len' is the amount of text remaining to be read from
+ * the current name, after the 'qemu:' portion has been stripped.
+ *
+ * Return -errno on I/O error, 0 if option was completely handled by
+ * sending a reply about inconsistent lengths, or 1 on success. */
+static int nbd_meta_qemu_query(NBDClient *client, NBDExportMetaContexts *meta,
+                               uint32_t len, Error **errp)
+{
+    bool dirty_bitmap = false;
+    size_t dirty_bitmap_len = strlen("dirty-bitmap:");
     int ret;
-    char query[sizeof("allocation") - 1];
-    size_t alen = strlen("allocation");
+
+    if (!meta->exp->export_bitmap) {
+        trace_nbd_negotiate_meta_query_skip("no dirty-bitmap exported");
+        return nbd_opt_skip(client, len, errp);
+    }
 
     if (len == 0) {
         if (client->opt == NBD_OPT_LIST_META_CONTEXT) {
-            meta->base_allocation = true;
+            meta->bitmap = true;
         }
-        trace_nbd_negotiate_meta_query_parse("base:");
+        trace_nbd_negotiate_meta_query_parse("empty");
         return 1;
     }
 
-    if (len != alen) {
-        trace_nbd_negotiate_meta_query_skip("not base:allocation");
+    if (len < dirty_bitmap_len) {
+        trace_nbd_negotiate_meta_query_skip("not dirty-bitmap:");
         return nbd_opt_skip(client, len, errp);
     }
 
-    ret = nbd_opt_read(client, query, len, errp);
+    len -= dirty_bitmap_len;
+    ret = nbd_meta_pattern(client, "dirty-bitmap:", &dirty_bitmap, errp);
     if (ret <= 0) {
         return ret;
     }
-
-    if (strncmp(query, "allocation", alen) == 0) {
-        meta->base_allocation = true;
+    if (!dirty_bitmap) {
+        trace_nbd_negotiate_meta_query_skip("not dirty-bitmap:");
+        return nbd_opt_skip(client, len, errp);
     }
 
-    trace_nbd_negotiate_meta_query_parse("base:allocation");
-    return 1;
+    return nbd_meta_empty_or_pattern(
+            client, meta->exp->export_bitmap_context +
+            strlen("qemu:dirty-bitmap:"), len, &meta->bitmap, errp);
 }
 
 /* nbd_negotiate_meta_query
@@ -780,7 +875,7 @@ static int nbd_meta_base_query(NBDClient *client, NBDExportMetaContexts *meta,
  * Parse namespace name and call corresponding function to parse body of the
  * query.
  *
- * The only supported namespace now is 'base'.
+ * The only supported namespaces are 'base' and 'qemu'.
  *
  * The function aims not wasting time and memory to read long unknown namespace
  * names.
@@ -790,9 +885,14 @@ static int nbd_meta_base_query(NBDClient *client, NBDExportMetaContexts *meta,
 static int nbd_negotiate_meta_query(NBDClient *client,
                                     NBDExportMetaContexts *meta, Error **errp)
 {
+    /*
+     * Both 'qemu' and 'base' namespaces have length = 5 including a
+     * colon. If another length namespace is later introduced, this
+     * should certainly be refactored.
+     */
     int ret;
-    char query[sizeof("base:") - 1];
-    size_t baselen = strlen("base:");
+    size_t ns_len = 5;
+    char ns[5];
     uint32_t len;
 
     ret = nbd_opt_read(client, &len, sizeof(len), errp);
@@ -801,24 +901,27 @@ static int nbd_negotiate_meta_query(NBDClient *client,
     }
     cpu_to_be32s(&len);
 
-    /* The only supported namespace for now is 'base'. So query should start
-     * with 'base:'. Otherwise, we can ignore it and skip the remainder. */
-    if (len < baselen) {
+    if (len < ns_len) {
         trace_nbd_negotiate_meta_query_skip("length too short");
         return nbd_opt_skip(client, len, errp);
     }
 
-    len -= baselen;
-    ret = nbd_opt_read(client, query, baselen, errp);
+    len -= ns_len;
+    ret = nbd_opt_read(client, ns, ns_len, errp);
     if (ret <= 0) {
         return ret;
     }
-    if (strncmp(query, "base:", baselen) != 0) {
-        trace_nbd_negotiate_meta_query_skip("not for base: namespace");
-        return nbd_opt_skip(client, len, errp);
+
+    if (!strncmp(ns, "base:", ns_len)) {
+        trace_nbd_negotiate_meta_query_parse("base:");
+        return nbd_meta_base_query(client, meta, len, errp);
+    } else if (!strncmp(ns, "qemu:", ns_len)) {
+        trace_nbd_negotiate_meta_query_parse("qemu:");
+        return nbd_meta_qemu_query(client, meta, len, errp);
     }
 
-    return nbd_meta_base_query(client, meta, len, errp);
+    trace_nbd_negotiate_meta_query_skip("unknown namespace");
+    return nbd_opt_skip(client, len, errp);
 }
 
 /* nbd_negotiate_meta_queries
@@ -829,7 +932,6 @@ static int nbd_negotiate_meta_queries(NBDClient *client,
                                       NBDExportMetaContexts *meta, Error **errp)
 {
     int ret;
-    NBDExport *exp;
     NBDExportMetaContexts local_meta;
     uint32_t nb_queries;
     int i;
@@ -853,8 +955,8 @@ static int nbd_negotiate_meta_queries(NBDClient *client,
         return ret;
     }
 
-    exp = nbd_export_find(meta->export_name);
-    if (exp == NULL) {
+    meta->exp = nbd_export_find(meta->export_name);
+    if (meta->exp == NULL) {
         return nbd_opt_drop(client, NBD_REP_ERR_UNKNOWN, errp,
                             "export '%s' not present", meta->export_name);
     }
@@ -870,6 +972,7 @@ static int nbd_negotiate_meta_queries(NBDClient *client,
     if (client->opt == NBD_OPT_LIST_META_CONTEXT && !nb_queries) {
         /* enable all known contexts */
         meta->base_allocation = true;
+        meta->bitmap = !!meta->exp->export_bitmap;
     } else {
         for (i = 0; i < nb_queries; ++i) {
             ret = nbd_negotiate_meta_query(client, meta, errp);
@@ -888,6 +991,16 @@ static int nbd_negotiate_meta_queries(NBDClient *client,
         }
     }
 
+    if (meta->bitmap) {
+        ret = nbd_negotiate_send_meta_context(client,
+                                              meta->exp->export_bitmap_context,
+                                              NBD_META_ID_DIRTY_BITMAP,
+                                              errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     ret = nbd_negotiate_send_rep(client, NBD_REP_ACK, errp);
     if (ret == 0) {
         meta->valid = true;
@@ -1231,6 +1344,10 @@ static int nbd_receive_request(QIOChannel *ioc, NBDRequest *request,
 
 #define MAX_NBD_REQUESTS 16
 
+/* Data buffers up to this size stay with pooled requests; larger ones are
+ * rare enough that allocating them each time is fine. */
+#define NBD_POOL_MAX_DATA_SIZE (4 * 1024 * 1024)
+
 void nbd_client_get(NBDClient *client)
 {
     client->refcount++;
@@ -1251,6 +1368,13 @@ void nbd_client_put(NBDClient *client)
             object_unref(OBJECT(client->tlscreds));
         }
         g_free(client->tlsaclname);
+        while (!QSIMPLEQ_EMPTY(&client->free_requests)) {
+            NBDRequestData *req = QSIMPLEQ_FIRST(&client->free_requests);
+
+            QSIMPLEQ_REMOVE_HEAD(&client->free_requests, entry);
+            qemu_vfree(req->data);
+            g_free(req);
+        }
         if (client->exp) {
             QTAILQ_REMOVE(&client->exp->clients, client, next);
             nbd_export_put(client->exp);
@@ -1286,20 +1410,42 @@ static NBDRequestData *nbd_request_get(NBDClient *client)
     assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
     client->nb_requests++;
 
-    req = g_new0(NBDRequestData, 1);
+    req = QSIMPLEQ_FIRST(&client->free_requests);
+    if (req) {
+        QSIMPLEQ_REMOVE_HEAD(&client->free_requests, entry);
+        req->complete = false;
+    } else {
+        req = g_new0(NBDRequestData, 1);
+    }
     nbd_client_get(client);
     req->client = client;
     return req;
 }
 
+/* Make @req->data at least @size bytes long, reusing the pooled buffer */
+static int nbd_request_alloc_data(NBDRequestData *req, size_t size)
+{
+    if (req->data && req->data_size >= size) {
+        return 0;
+    }
+
+    qemu_vfree(req->data);
+    req->data = blk_try_blockalign(req->client->exp->blk, size);
+    req->data_size = req->data ? size : 0;
+    return req->data ? 0 : -ENOMEM;
+}
+
 static void nbd_request_put(NBDRequestData *req)
 {
     NBDClient *client = req->client;
 
-    if (req->data) {
+    /* At most MAX_NBD_REQUESTS requests exist, so the pool is bounded */
+    if (!client->closing && req->data_size <= NBD_POOL_MAX_DATA_SIZE) {
+        QSIMPLEQ_INSERT_HEAD(&client->free_requests, req, entry);
+    } else {
         qemu_vfree(req->data);
+        g_free(req);
     }
-    g_free(req);
 
     client->nb_requests--;
     nbd_client_receive_next_request(client);
@@ -1348,7 +1494,8 @@ static void nbd_eject_notifier(Notifier *n, void *data)
 }
 
 NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset, off_t size,
-                          uint16_t nbdflags, void (*close)(NBDExport *),
+                          uint16_t nbdflags, const char *bitmap,
+                          void (*close)(NBDExport *),
                           bool writethrough, BlockBackend *on_eject_blk,
                           Error **errp)
 {
@@ -1387,6 +1534,13 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset, off_t size,
     exp->blk = blk;
     exp->dev_offset = dev_offset;
     exp->nbdflags = nbdflags;
+    /* Clients may spread reads over several connections to a read-only
+     * export.  Writable ones can be served from an IOThread while others
+     * write to the node, so flushes there are not known to be consistent
+     * across connections. */
+    if (nbdflags & NBD_FLAG_READ_ONLY) {
+        exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
     exp->size = size < 0 ? blk_getlength(blk) : size;
     if (exp->size < 0) {
         error_setg_errno(errp, -exp->size,
@@ -1395,6 +1549,45 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset, off_t size,
     }
     exp->size -= exp->size % BDRV_SECTOR_SIZE;
 
+    if (bitmap) {
+        BdrvDirtyBitmap *bm = NULL;
+        BlockDriverState *bm_bs = bs;
+
+        /* The bitmap may live below a temporary overlay used for fleecing */
+        while (true) {
+            bm = bdrv_find_dirty_bitmap(bm_bs, bitmap);
+            if (bm != NULL || bm_bs->backing == NULL) {
+                break;
+            }
+            bm_bs = bm_bs->backing->bs;
+        }
+
+        if (bm == NULL) {
+            error_setg(errp, "Bitmap '%s' is not found", bitmap);
+            goto fail;
+        }
+
+        if (bdrv_dirty_bitmap_qmp_locked(bm)) {
+            error_setg(errp, "Bitmap '%s' is locked", bitmap);
+            goto fail;
+        }
+
+        /* Clients of a read-only export could not see why the bitmap
+         * keeps changing under them */
+        if ((nbdflags & NBD_FLAG_READ_ONLY) && !bdrv_is_read_only(bm_bs) &&
+            bdrv_dirty_bitmap_enabled(bm)) {
+            error_setg(errp,
+                       "Enabled bitmap '%s' incompatible with readonly export",
+                       bitmap);
+            goto fail;
+        }
+
+        bdrv_dirty_bitmap_set_qmp_locked(bm, true);
+        exp->export_bitmap = bm;
+        exp->export_bitmap_context = g_strdup_printf("qemu:dirty-bitmap:%s",
+                                                     bitmap);
+    }
+
     exp->close = close;
     exp->ctx = blk_get_aio_context(blk);
     blk_add_aio_context_notifier(blk, blk_aio_attached, blk_aio_detach, exp);
@@ -1516,6 +1709,11 @@ void nbd_export_put(NBDExport *exp)
             exp->blk = NULL;
         }
 
+        if (exp->export_bitmap) {
+            bdrv_dirty_bitmap_set_qmp_locked(exp->export_bitmap, false);
+            g_free(exp->export_bitmap_context);
+        }
+
         g_free(exp);
     }
 }
@@ -1653,6 +1851,44 @@ static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
     return nbd_co_send_iov(client, iov, 1 + !!iov[1].iov_len, errp);
 }
 
+/* Find how much of [offset, offset + bytes) of the export reads the same way
+ * as its start, either as zeroes (*hole) or as data.  Consecutive extents of
+ * the same kind are merged, so that each run costs a single read and a single
+ * reply chunk. */
+static int nbd_sparse_read_extent(NBDExport *exp, uint64_t offset,
+                                  uint64_t bytes, uint64_t *pnum, bool *hole)
+{
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint64_t done = 0;
+
+    *hole = false;
+    while (done < bytes) {
+        int64_t num;
+        bool zero;
+        int ret = bdrv_block_status_above(bs, NULL,
+                                          offset + exp->dev_offset + done,
+                                          bytes - done, &num, NULL, NULL);
+
+        if (ret < 0) {
+            return ret;
+        }
+        assert(num && num <= bytes - done);
+
+        /* The block layer already reports unallocated ranges as zero
+         * where that is safe; holes it cannot vouch for are read */
+        zero = ret & BDRV_BLOCK_ZERO;
+        if (done == 0) {
+            *hole = zero;
+        } else if (zero != *hole) {
+            break;
+        }
+        done += num;
+    }
+
+    *pnum = done;
+    return 0;
+}
+
 /* Do a sparse read and send the structured reply to the client.
  * Returns -errno if sending fails. bdrv_block_status_above() failure is
  * reported to the client, at which point this function succeeds.
@@ -1669,12 +1905,11 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
     size_t progress = 0;
 
     while (progress < size) {
-        int64_t pnum;
-        int status = bdrv_block_status_above(blk_bs(exp->blk), NULL,
-                                             offset + progress,
-                                             size - progress, &pnum, NULL,
-                                             NULL);
+        uint64_t pnum;
+        bool hole;
         bool final;
+        int status = nbd_sparse_read_extent(exp, offset + progress,
+                                            size - progress, &pnum, &hole);
 
         if (status < 0) {
             char *msg = g_strdup_printf("unable to check for holes: %s",
@@ -1685,9 +1920,8 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             g_free(msg);
             return ret;
         }
-        assert(pnum && pnum <= size - progress);
         final = progress + pnum == size;
-        if (status & BDRV_BLOCK_ZERO) {
+        if (hole) {
             NBDStructuredReadHole chunk;
             struct iovec iov[] = {
                 {.iov_base = &chunk, .iov_len = sizeof(chunk)},
@@ -1759,8 +1993,8 @@ static int blockstatus_to_extent_be(BlockDriverState *bs, uint64_t offset,
 /* nbd_co_send_extents
  * @extents should be in big-endian */
 static int nbd_co_send_extents(NBDClient *client, uint64_t handle,
-                               NBDExtent *extents, unsigned nb_extents,
-                               uint32_t context_id, Error **errp)
+                               NBDExtent *extents, unsigned int nb_extents,
+                               bool last, uint32_t context_id, Error **errp)
 {
     NBDStructuredMeta chunk;
 
@@ -1769,7 +2003,8 @@ static int nbd_co_send_extents(NBDClient *client, uint64_t handle,
         {.iov_base = extents, .iov_len = nb_extents * sizeof(extents[0])}
     };
 
-    set_be_chunk(&chunk.h, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS,
+    set_be_chunk(&chunk.h, last ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_BLOCK_STATUS,
                  handle, sizeof(chunk) - sizeof(chunk.h) + iov[1].iov_len);
     stl_be_p(&chunk.context_id, context_id);
 
@@ -1779,8 +2014,8 @@ static int nbd_co_send_extents(NBDClient *client, uint64_t handle,
 /* Get block status from the exported device and send it to the client */
 static int nbd_co_send_block_status(NBDClient *client, uint64_t handle,
                                     BlockDriverState *bs, uint64_t offset,
-                                    uint64_t length, uint32_t context_id,
-                                    Error **errp)
+                                    uint64_t length, bool last,
+                                    uint32_t context_id, Error **errp)
 {
     int ret;
     NBDExtent extent;
@@ -1791,7 +2026,87 @@ static int nbd_co_send_block_status(NBDClient *client, uint64_t handle,
                 client, handle, -ret, "can't get block status", errp);
     }
 
-    return nbd_co_send_extents(client, handle, &extent, 1, context_id, errp);
+    return nbd_co_send_extents(client, handle, &extent, 1, last, context_id,
+                               errp);
+}
+
+/* Populate @extents from a dirty bitmap and return the number of extents
+ * used.  Unless @dont_fragment, the final extent may exceed @length. */
+static unsigned int bitmap_to_extents(BdrvDirtyBitmap *bitmap, uint64_t offset,
+                                      uint64_t length, NBDExtent *extents,
+                                      unsigned int nb_extents,
+                                      bool dont_fragment)
+{
+    uint64_t begin = offset, end;
+    uint64_t overall_end = offset + length;
+    unsigned int i = 0;
+    BdrvDirtyBitmapIter *it;
+    bool dirty;
+
+    bdrv_dirty_bitmap_lock(bitmap);
+
+    it = bdrv_dirty_iter_new(bitmap);
+    dirty = bdrv_get_dirty_locked(NULL, bitmap, offset);
+
+    assert(begin < overall_end && nb_extents);
+    while (begin < overall_end && i < nb_extents) {
+        /* Jump over the whole run at once instead of testing each bit */
+        if (dirty) {
+            end = bdrv_dirty_bitmap_next_zero(bitmap, begin);
+        } else {
+            bdrv_set_dirty_iter(it, begin);
+            end = bdrv_dirty_iter_next(it);
+        }
+        if (end == -1 || end - begin > UINT32_MAX) {
+            /* Cap to an aligned value < 4G beyond begin. */
+            end = MIN(bdrv_dirty_bitmap_size(bitmap),
+                      begin + UINT32_MAX + 1 -
+                      bdrv_dirty_bitmap_granularity(bitmap));
+        }
+        if (dont_fragment && end > overall_end) {
+            end = overall_end;
+        }
+
+        extents[i].length = cpu_to_be32(end - begin);
+        extents[i].flags = cpu_to_be32(dirty ? NBD_STATE_DIRTY : 0);
+        i++;
+        begin = end;
+        dirty = !dirty;
+    }
+
+    bdrv_dirty_iter_free(it);
+
+    bdrv_dirty_bitmap_unlock(bitmap);
+
+    return i;
+}
+
+static int nbd_co_send_bitmap(NBDClient *client, uint64_t handle,
+                              BdrvDirtyBitmap *bitmap, uint64_t offset,
+                              uint32_t length, bool dont_fragment, bool last,
+                              uint32_t context_id, Error **errp)
+{
+    int ret;
+    uint64_t granularity = bdrv_dirty_bitmap_granularity(bitmap);
+    unsigned int nb_extents;
+    NBDExtent *extents;
+
+    /* Runs alternate, so a request can't need more than one extent per
+     * granule it touches */
+    nb_extents = dont_fragment ? 1 :
+                 MIN(NBD_MAX_BITMAP_EXTENTS,
+                     DIV_ROUND_UP(offset % granularity + length, granularity));
+    extents = g_new(NBDExtent, nb_extents);
+
+    nb_extents = bitmap_to_extents(bitmap, offset, length, extents,
+                                   nb_extents, dont_fragment);
+
+    ret = nbd_co_send_extents(client, handle, extents, nb_extents, last,
+                              context_id, errp);
+
+    g_free(extents);
+
+    return ret;
 }
 
 /* nbd_co_receive_request
@@ -1833,8 +2148,7 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
             return -EINVAL;
         }
 
-        req->data = blk_try_blockalign(client->exp->blk, request->len);
-        if (req->data == NULL) {
+        if (nbd_request_alloc_data(req, request->len) < 0) {
             error_setg(errp, "No memory");
             return -ENOMEM;
         }
@@ -2007,11 +2321,38 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
                                       "discard failed", errp);
 
     case NBD_CMD_BLOCK_STATUS:
-        if (client->export_meta.valid && client->export_meta.base_allocation) {
-            return nbd_co_send_block_status(client, request->handle,
-                                            blk_bs(exp->blk), request->from,
-                                            request->len,
-                                            NBD_META_ID_BASE_ALLOCATION, errp);
+        if (!request->len) {
+            return nbd_send_generic_reply(client, request->handle, -EINVAL,
+                                          "need non-zero length", errp);
+        }
+        if (client->export_meta.valid &&
+            (client->export_meta.base_allocation ||
+             client->export_meta.bitmap))
+        {
+            if (client->export_meta.base_allocation) {
+                ret = nbd_co_send_block_status(client, request->handle,
+                                               blk_bs(exp->blk), request->from,
+                                               request->len,
+                                               !client->export_meta.bitmap,
+                                               NBD_META_ID_BASE_ALLOCATION,
+                                               errp);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+
+            if (client->export_meta.bitmap) {
+                ret = nbd_co_send_bitmap(client, request->handle,
+                                         client->exp->export_bitmap,
+                                         request->from, request->len,
+                                         request->flags & NBD_CMD_FLAG_REQ_ONE,
+                                         true, NBD_META_ID_DIRTY_BITMAP, errp);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+
+            return 0;
         } else {
             return nbd_send_generic_reply(client, request->handle, -EINVAL,
                                           "CMD_BLOCK_STATUS not negotiated",
@@ -2148,6 +2489,7 @@ void nbd_client_new(NBDExport *exp,
 
     client = g_new0(NBDClient, 1);
     client->refcount = 1;
+    QSIMPLEQ_INIT(&client->free_requests);
     client->exp = exp;
     client->tlscreds = tlscreds;
     if (tlscreds) {
@@ -0,0 +1,151 @@
+#!/usr/bin/env python
+#
+# Decode a dump of the block request flight recorder
+#
+# Copyright (c) 2018 Citrix Systems, Inc.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# The dump is written by x-flight-recorder-dump, either to a file or
+# base64-encoded in the "data" member of its reply; both are accepted.
+# The format is described in include/block/flight-recorder.h.
+
+from __future__ import print_function
+import argparse
+import base64
+import json
+import struct
+import sys
+
+MAGIC = b'QEMUFREC'
+VERSION = 1
+
+HEADER = struct.Struct('=8sIIQQII')
+NAME = struct.Struct('=II')
+RING = struct.Struct('=II')
+RECORD = struct.Struct('=QQIIIBBh')
+
+EVENTS = {
+    1: 'xen-consume',
+    2: 'xen-submit',
+    3: 'xen-complete',
+    4: 'xen-response',
+    5: 'blk-submit',
+    6: 'blk-complete',
+}
+XEN_CONSUME, XEN_RESPONSE = 1, 4
+BLK_SUBMIT, BLK_COMPLETE = 5, 6
+
+OPS = ['read', 'write', 'flush', 'discard', 'other']
+
+
+class Record(object):
+    def __init__(self, thread_id, fields):
+        self.thread_id = thread_id
+        (self.time_ns, self.offset, self.bytes, self.id, self.dev,
+         self.event, self.op, self.result) = fields
+
+    def is_xen(self):
+        return self.event < BLK_SUBMIT
+
+
+def load(data):
+    """Return the header, the device names and the records of a dump"""
+    if not data.startswith(MAGIC):
+        # Maybe the QMP reply, or just its base64 payload
+        try:
+            reply = json.loads(data.decode('ascii'))
+            if 'return' in reply:
+                reply = reply['return']
+            data = base64.b64decode(reply['data'])
+        except ValueError:
+            data = base64.b64decode(data)
+    if not data.startswith(MAGIC):
+        raise ValueError('not a flight recorder dump')
+
+    (magic, version, record_size, time_ns, wall_time_ns,
+     nr_names, nr_rings) = HEADER.unpack_from(data)
+    if version != VERSION or record_size != RECORD.size:
+        raise ValueError('unsupported dump version %d (record size %d)' %
+                         (version, record_size))
+    pos = HEADER.size
+
+    names = {}
+    for i in range(nr_names):
+        dev, length = NAME.unpack_from(data, pos)
+        pos += NAME.size
+        names[dev] = data[pos:pos + length].decode('utf-8', 'replace')
+        pos += (length + 7) & ~7
+
+    records = []
+    for i in range(nr_rings):
+        thread_id, nr_records = RING.unpack_from(data, pos)
+        pos += RING.size
+        for j in range(nr_records):
+            records.append(Record(thread_id, RECORD.unpack_from(data, pos)))
+            pos += RECORD.size
+
+    records.sort(key=lambda r: r.time_ns)
+    return time_ns, wall_time_ns, names, records
+
+
+def dev_name(names, rec):
+    if rec.is_xen():
+        return 'dom%d/%d' % (rec.dev >> 16, rec.dev & 0xffff)
+    return names.get(rec.dev, 'blk%d' % rec.dev)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Decode a block request flight recorder dump')
+    parser.add_argument('dump', help='file written by x-flight-recorder-dump, '
+                        'or its QMP reply; - for stdin')
+    parser.add_argument('-l', '--latency', action='store_true',
+                        help='also show the latency of each completion')
+    parser.add_argument('-d', '--dev',
+                        help='only show records of this device')
+    args = parser.parse_args()
+
+    if args.dump == '-':
+        data = getattr(sys.stdin, 'buffer', sys.stdin).read()
+    else:
+        with open(args.dump, 'rb') as f:
+            data = f.read()
+
+    try:
+        dump_ns, wall_ns, names, records = load(data.strip())
+    except (ValueError, struct.error) as e:
+        sys.stderr.write('%s: %s\n' % (args.dump, e))
+        return 1
+
+    print('# dumped at %.6f, %d records' % (wall_ns / 1e9, len(records)))
+    print('# %12s %8s %-16s %-12s %-7s %10s %16s %10s %6s' %
+          ('time (us)', 'thread', 'device', 'event', 'op', 'id',
+           'offset', 'bytes', 'result'))
+
+    starts = {}
+    for rec in records:
+        name = dev_name(names, rec)
+        key = (rec.is_xen(), rec.dev, rec.id)
+        latency = ''
+        if rec.event in (XEN_CONSUME, BLK_SUBMIT):
+            starts[key] = rec.time_ns
+        elif rec.event in (XEN_RESPONSE, BLK_COMPLETE) and key in starts:
+            latency = '%.1fus' % ((rec.time_ns - starts.pop(key)) / 1e3)
+
+        if args.dev is not None and name != args.dev:
+            continue
+        line = '%14.1f %8d %-16s %-12s %-7s %10d %16d %10d %6d' % (
+            (rec.time_ns - dump_ns) / 1e3, rec.thread_id, name,
+            EVENTS.get(rec.event, str(rec.event)),
+            OPS[rec.op] if rec.op < len(OPS) else str(rec.op),
+            rec.id, rec.offset, rec.bytes, rec.result)
+        if args.latency and latency:
+            line += ' ' + latency
+        print(line)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,127 @@
+/*
+ * Block accounting speed benchmark, shared mutex vs. per-thread shards
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "block/accounting.h"
+
+#define BENCH_SECS      1
+
+/* What block_account_one_io() did before the counters were sharded */
+typedef struct BenchMutexStats {
+    QemuMutex lock;
+    uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
+    uint64_t nr_ops[BLOCK_MAX_IOTYPE];
+    uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
+    int64_t last_access_time_ns;
+} BenchMutexStats;
+
+typedef struct BenchAcct {
+    bool sharded;
+    BenchMutexStats mutex_stats;
+    BlockAcctStats stats;
+    bool stop;
+    QemuEvent go;
+} BenchAcct;
+
+static void bench_mutex_done(BenchMutexStats *s, BlockAcctCookie *cookie)
+{
+    int64_t time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    qemu_mutex_lock(&s->lock);
+    s->nr_bytes[cookie->type] += cookie->bytes;
+    s->nr_ops[cookie->type]++;
+    s->total_time_ns[cookie->type] += time_ns - cookie->start_time_ns;
+    s->last_access_time_ns = time_ns;
+    qemu_mutex_unlock(&s->lock);
+}
+
+static void *bench_thread(void *opaque)
+{
+    BenchAcct *b = opaque;
+    BlockAcctCookie cookie;
+    uint64_t ops = 0;
+
+    qemu_event_wait(&b->go);
+    while (!atomic_read(&b->stop)) {
+        block_acct_start(&b->stats, &cookie, 4096,
+                         ops & 1 ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
+        if (b->sharded) {
+            block_acct_done(&b->stats, &cookie);
+        } else {
+            bench_mutex_done(&b->mutex_stats, &cookie);
+        }
+        ops++;
+    }
+    return (void *)(uintptr_t)ops;
+}
+
+static void bench_acct_speed(const void *opaque)
+{
+    int nr_threads = (uintptr_t)opaque;
+    QemuThread threads[nr_threads];
+    BlockAcctCounters counters;
+    uint64_t ops = 0;
+    BenchAcct b;
+    int pass, i;
+
+    for (pass = 0; pass < 2; pass++) {
+        memset(&b, 0, sizeof(b));
+        b.sharded = pass;
+        qemu_mutex_init(&b.mutex_stats.lock);
+        block_acct_init(&b.stats);
+        qemu_event_init(&b.go, false);
+
+        for (i = 0; i < nr_threads; i++) {
+            qemu_thread_create(&threads[i], "bench-acct", bench_thread, &b,
+                               QEMU_THREAD_JOINABLE);
+        }
+        qemu_event_set(&b.go);
+        g_usleep(BENCH_SECS * G_USEC_PER_SEC);
+        atomic_set(&b.stop, true);
+
+        ops = 0;
+        for (i = 0; i < nr_threads; i++) {
+            ops += (uintptr_t)qemu_thread_join(&threads[i]);
+        }
+
+        if (b.sharded) {
+            block_acct_get_counters(&b.stats, &counters);
+            g_assert_cmpint(counters.nr_ops[BLOCK_ACCT_READ] +
+                            counters.nr_ops[BLOCK_ACCT_WRITE], ==, ops);
+        } else {
+            g_assert_cmpint(b.mutex_stats.nr_ops[BLOCK_ACCT_READ] +
+                            b.mutex_stats.nr_ops[BLOCK_ACCT_WRITE], ==, ops);
+        }
+        g_print("%d threads %s: %.2f Mops/s\n", nr_threads,
+                b.sharded ? "sharded" : "mutex",
+                (double)ops / BENCH_SECS / 1000000);
+
+        qemu_event_destroy(&b.go);
+        block_acct_cleanup(&b.stats);
+        qemu_mutex_destroy(&b.mutex_stats.lock);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const int nr_threads[] = { 1, 2, 4, 8 };
+    char name[64];
+    size_t i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(nr_threads); i++) {
+        snprintf(name, sizeof(name), "/acct/speed/%d-threads", nr_threads[i]);
+        g_test_add_data_func(name, (void *)(uintptr_t)nr_threads[i],
+                             bench_acct_speed);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,175 @@
+/*
+ * HBitmap speed benchmark, dense and sparse
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/hbitmap.h"
+
+#define TiB (1ULL << 40)
+
+typedef struct BenchHBitmapConfig {
+    const char *name;
+    uint64_t size;          /* bytes covered by the bitmap */
+    int granularity;        /* log2 of the bytes per bit */
+    uint64_t extent;        /* bytes set in each dirty extent */
+    uint64_t stride;        /* distance between dirty extents */
+} BenchHBitmapConfig;
+
+typedef struct BenchHBitmapCase {
+    const BenchHBitmapConfig *cfg;
+    bool sparse;
+} BenchHBitmapCase;
+
+static const BenchHBitmapConfig configs[] = {
+    /* A few scattered guest writes: most groups of words are skipped */
+    { "4T-64k-sparse", 4 * TiB, 16, 1 << 20, 1ULL << 32 },
+    { "4T-64k-dense", 4 * TiB, 16, 1 << 20, 2 << 20 },
+    { "1T-4k-sparse", 1 * TiB, 12, 64 << 10, 1ULL << 30 },
+    { "1T-4k-dense", 1 * TiB, 12, 64 << 10, 128 << 10 },
+    /* The disk size that motivated sparse bitmaps */
+    { "64T-64k-sparse", 64 * TiB, 16, 1 << 20, 1ULL << 36 },
+};
+
+static HBitmap *bench_alloc(const BenchHBitmapCase *c, uint64_t shift)
+{
+    const BenchHBitmapConfig *cfg = c->cfg;
+    HBitmap *hb = c->sparse ? hbitmap_alloc_sparse(cfg->size, cfg->granularity)
+                            : hbitmap_alloc(cfg->size, cfg->granularity);
+    uint64_t offset;
+
+    for (offset = shift; offset + cfg->extent <= cfg->size;
+         offset += cfg->stride) {
+        hbitmap_set(hb, offset, cfg->extent);
+    }
+    return hb;
+}
+
+static void bench_report(const BenchHBitmapCase *c, const char *op,
+                         unsigned long iterations, double secs)
+{
+    g_print("%s %s %s: %lu ops in %.2f secs: %.3f us/op\n",
+            c->cfg->name, c->sparse ? "sparse" : "dense", op, iterations,
+            secs, secs * 1000000 / iterations);
+}
+
+/* Guest writes of one extent at pseudo-random offsets, then clearing them
+ * again as a backup job would.
+ */
+static void bench_update(const BenchHBitmapCase *c, HBitmap *hb)
+{
+    const BenchHBitmapConfig *cfg = c->cfg;
+    uint64_t nb_extents = cfg->size / cfg->extent;
+    unsigned long iterations = 0;
+    uint64_t seed = 1;
+
+    g_test_timer_start();
+    do {
+        uint64_t offset;
+
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        offset = ((seed >> 16) % nb_extents) * cfg->extent;
+        hbitmap_set(hb, offset, cfg->extent);
+        hbitmap_reset(hb, offset, cfg->extent);
+        iterations++;
+    } while (g_test_timer_elapsed() < 2.0);
+    bench_report(c, "set+reset", iterations, g_test_timer_last());
+}
+
+static void bench_scan(const BenchHBitmapCase *c, HBitmap *hb)
+{
+    unsigned long iterations = 0;
+
+    g_test_timer_start();
+    do {
+        HBitmapIter hbi;
+        int64_t offset;
+
+        hbitmap_iter_init(&hbi, hb, 0);
+        while ((offset = hbitmap_iter_next(&hbi)) >= 0) {
+            /* Find the end of the extent like a backup job does */
+            offset = hbitmap_next_zero(hb, offset);
+            if (offset < 0) {
+                break;
+            }
+            hbitmap_iter_init(&hbi, hb, offset);
+        }
+        iterations++;
+    } while (g_test_timer_elapsed() < 2.0);
+    bench_report(c, "scan", iterations, g_test_timer_last());
+}
+
+static void bench_combine(const BenchHBitmapCase *c)
+{
+    static const char *const op_names[] = {
+        "merge", "intersect", "subtract+merge"
+    };
+    HBitmap *a, *b;
+    int op;
+
+    /* Half of each extent of b overlaps an extent of a */
+    b = bench_alloc(c, c->cfg->extent / 2);
+
+    for (op = 0; op < ARRAY_SIZE(op_names); op++) {
+        unsigned long iterations = 0;
+
+        a = bench_alloc(c, 0);
+        g_test_timer_start();
+        do {
+            switch (op) {
+            case 0:
+                g_assert(hbitmap_merge(a, b));
+                break;
+            case 1:
+                g_assert(hbitmap_intersect(a, b));
+                break;
+            case 2:
+                g_assert(hbitmap_subtract(a, b));
+                /* Put the bits back for the next round */
+                g_assert(hbitmap_merge(a, b));
+                break;
+            }
+            iterations++;
+        } while (g_test_timer_elapsed() < 2.0);
+        bench_report(c, op_names[op], iterations, g_test_timer_last());
+        hbitmap_free(a);
+    }
+
+    hbitmap_free(b);
+}
+
+static void bench_hbitmap_speed(const void *opaque)
+{
+    const BenchHBitmapCase *c = opaque;
+    HBitmap *hb = bench_alloc(c, 0);
+
+    g_print("%s %s: %" PRIu64 " bytes of memory\n", c->cfg->name,
+            c->sparse ? "sparse" : "dense", hbitmap_memory_size(hb));
+    bench_update(c, hb);
+    bench_scan(c, hb);
+    hbitmap_free(hb);
+
+    bench_combine(c);
+}
+
+int main(int argc, char **argv)
+{
+    BenchHBitmapCase cases[ARRAY_SIZE(configs) * 2];
+    char name[64];
+    size_t i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++) {
+        cases[i].cfg = &configs[i / 2];
+        cases[i].sparse = i % 2;
+        snprintf(name, sizeof(name), "/hbitmap/speed/%s/%s",
+                 cases[i].cfg->name, cases[i].sparse ? "sparse" : "dense");
+        g_test_add_data_func(name, &cases[i], bench_hbitmap_speed);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,239 @@
+/*
+ * Coroutine create/enter/terminate rate across threads
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/processor.h"
+#include "qemu/coroutine.h"
+
+struct thread_info {
+    unsigned int index;
+    unsigned long ops;
+} QEMU_ALIGNED(64);
+
+struct mailbox {
+    Coroutine *co;
+} QEMU_ALIGNED(64);
+
+static QemuThread *threads;
+static struct thread_info *th_info;
+static struct mailbox *mailboxes;
+static unsigned int n_threads;
+static unsigned int n_ready_threads;
+static unsigned int max_threads = 32;
+static unsigned int duration = 1;
+static bool cross_thread;
+static bool test_start;
+static bool test_stop;
+
+static const char commands_string[] =
+    " -n = number of threads (default: 1, 2, 4, ... up to -m)\n"
+    " -m = maximum number of threads when -n is not given (default: 32)\n"
+    " -d = duration in seconds\n"
+    " -x = terminate coroutines in a different thread than their creator";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void coroutine_fn empty_coroutine(void *opaque)
+{
+}
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+/* Each coroutine is created and run to completion by the same thread */
+static void run_local(struct thread_info *info)
+{
+    while (!atomic_read(&test_stop)) {
+        Coroutine *co = qemu_coroutine_create(empty_coroutine, NULL);
+        qemu_coroutine_enter(co);
+        info->ops++;
+    }
+}
+
+/*
+ * Each coroutine yields once and is handed to the next thread, which
+ * terminates it; coroutines thus go back to the pool of another thread.
+ */
+static void run_cross(struct thread_info *info)
+{
+    struct mailbox *mine = &mailboxes[info->index];
+    struct mailbox *next = &mailboxes[(info->index + 1) % n_threads];
+
+    while (!atomic_read(&test_stop)) {
+        Coroutine *co = qemu_coroutine_create(yield_once, NULL);
+        qemu_coroutine_enter(co);
+
+        /* Not picked up in time, finish it ourselves */
+        co = atomic_xchg(&next->co, co);
+        if (co) {
+            qemu_coroutine_enter(co);
+        }
+        co = atomic_xchg(&mine->co, NULL);
+        if (co) {
+            qemu_coroutine_enter(co);
+        }
+        info->ops++;
+    }
+}
+
+static void *thread_func(void *arg)
+{
+    struct thread_info *info = arg;
+
+    atomic_inc(&n_ready_threads);
+    while (!atomic_read(&test_start)) {
+        cpu_relax();
+    }
+
+    if (cross_thread) {
+        run_cross(info);
+    } else {
+        run_local(info);
+    }
+    return NULL;
+}
+
+static void run_test(void)
+{
+    unsigned int remaining;
+    unsigned int i;
+
+    while (atomic_read(&n_ready_threads) != n_threads) {
+        cpu_relax();
+    }
+    atomic_set(&test_start, true);
+    do {
+        remaining = sleep(duration);
+    } while (remaining);
+    atomic_set(&test_stop, true);
+
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+
+    /* Coroutines left in a mailbox are still suspended */
+    for (i = 0; i < n_threads; i++) {
+        if (mailboxes[i].co) {
+            qemu_coroutine_enter(mailboxes[i].co);
+        }
+    }
+}
+
+static void create_threads(void)
+{
+    unsigned int i;
+
+    threads = g_new(QemuThread, n_threads);
+    th_info = qemu_memalign(64, sizeof(*th_info) * n_threads);
+    mailboxes = qemu_memalign(64, sizeof(*mailboxes) * n_threads);
+    memset(th_info, 0, sizeof(*th_info) * n_threads);
+    memset(mailboxes, 0, sizeof(*mailboxes) * n_threads);
+
+    n_ready_threads = 0;
+    test_start = false;
+    test_stop = false;
+
+    for (i = 0; i < n_threads; i++) {
+        th_info[i].index = i;
+        qemu_thread_create(&threads[i], NULL, thread_func, &th_info[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void destroy_threads(void)
+{
+    g_free(threads);
+    qemu_vfree(th_info);
+    qemu_vfree(mailboxes);
+}
+
+static void pr_stats(const CoroutinePoolStats *before)
+{
+    CoroutinePoolStats after;
+    unsigned long long val = 0;
+    unsigned int i;
+    double tx;
+
+    for (i = 0; i < n_threads; i++) {
+        val += th_info[i].ops;
+    }
+    tx = val / duration / 1e6;
+    qemu_coroutine_get_pool_stats(&after);
+
+    printf("%7u %12.2f %18.2f %12lu %12lu %12lu\n", n_threads, tx,
+           tx / n_threads, after.hits - before->hits,
+           after.misses - before->misses, after.steals - before->steals);
+}
+
+static void run_one(void)
+{
+    CoroutinePoolStats before;
+
+    qemu_coroutine_get_pool_stats(&before);
+    create_threads();
+    run_test();
+    pr_stats(&before);
+    destroy_threads();
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hd:m:n:x");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'm':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            n_threads = atoi(optarg);
+            break;
+        case 'x':
+            cross_thread = true;
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+
+    printf("Parameters:\n");
+    printf(" duration:          %u\n", duration);
+    printf(" cross-thread:      %s\n", cross_thread ? "yes" : "no");
+    printf("Results:\n");
+    printf("%7s %12s %18s %12s %12s %12s\n", "threads", "Mops/s",
+           "Mops/s/thread", "hits", "misses", "steals");
+
+    if (n_threads) {
+        run_one();
+        return 0;
+    }
+    for (n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        run_one();
+    }
+    return 0;
+}
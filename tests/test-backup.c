@@ -0,0 +1,322 @@
+/*
+ * Parallel backup job
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "block/blockjob.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qemu/timer.h"
+
+#define TEST_CLUSTER_SIZE   65536
+#define TEST_CLUSTERS       64
+#define TEST_SIZE           (TEST_CLUSTER_SIZE * TEST_CLUSTERS)
+
+enum {
+    TEST_UNALLOCATED,
+    TEST_DATA,
+    TEST_ZERO,
+};
+
+typedef struct BDRVTestState {
+    uint8_t map[TEST_CLUSTERS];
+    uint8_t fill[TEST_CLUSTERS];
+    int64_t read_delay_ns;
+    int reads;
+    int zero_writes;
+} BDRVTestState;
+
+static int reads_in_flight;
+static int reads_max_in_flight;
+
+static void bdrv_test_close(BlockDriverState *bs)
+{
+}
+
+static int64_t bdrv_test_getlength(BlockDriverState *bs)
+{
+    return TEST_SIZE;
+}
+
+static int bdrv_test_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    bdi->cluster_size = TEST_CLUSTER_SIZE;
+    return 0;
+}
+
+static void bdrv_test_mark(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes, uint8_t state, uint8_t fill)
+{
+    BDRVTestState *s = bs->opaque;
+    int64_t i;
+
+    for (i = offset / TEST_CLUSTER_SIZE;
+         i < DIV_ROUND_UP(offset + bytes, TEST_CLUSTER_SIZE); i++) {
+        s->map[i] = state;
+        s->fill[i] = fill;
+    }
+}
+
+static int coroutine_fn bdrv_test_co_preadv(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    BDRVTestState *s = bs->opaque;
+    uint64_t pos = 0;
+
+    s->reads++;
+    if (++reads_in_flight > reads_max_in_flight) {
+        reads_max_in_flight = reads_in_flight;
+    }
+
+    /* Sample the data before sleeping, as a disk would */
+    while (pos < bytes) {
+        int64_t i = (offset + pos) / TEST_CLUSTER_SIZE;
+        uint64_t n = MIN((i + 1) * TEST_CLUSTER_SIZE - offset - pos,
+                         bytes - pos);
+
+        qemu_iovec_memset(qiov, pos,
+                          s->map[i] == TEST_DATA ? s->fill[i] : 0, n);
+        pos += n;
+    }
+    if (s->read_delay_ns) {
+        qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, s->read_delay_ns);
+    }
+
+    reads_in_flight--;
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    uint64_t pos;
+
+    /* Clusters are written whole with a single fill byte */
+    for (pos = 0; pos < bytes; pos += TEST_CLUSTER_SIZE) {
+        uint8_t fill;
+
+        qemu_iovec_to_buf(qiov, pos, &fill, 1);
+        bdrv_test_mark(bs, offset + pos, 1, TEST_DATA, fill);
+    }
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_pwrite_zeroes(BlockDriverState *bs,
+                                                   int64_t offset, int bytes,
+                                                   BdrvRequestFlags flags)
+{
+    BDRVTestState *s = bs->opaque;
+
+    s->zero_writes++;
+    bdrv_test_mark(bs, offset, bytes, TEST_ZERO, 0);
+    return 0;
+}
+
+static BlockDriver bdrv_test = {
+    .format_name            = "test",
+    .instance_size          = sizeof(BDRVTestState),
+
+    .bdrv_close             = bdrv_test_close,
+    .bdrv_getlength         = bdrv_test_getlength,
+    .bdrv_get_info          = bdrv_test_get_info,
+    .bdrv_co_preadv         = bdrv_test_co_preadv,
+    .bdrv_co_pwritev        = bdrv_test_co_pwritev,
+    .bdrv_co_pwrite_zeroes  = bdrv_test_co_pwrite_zeroes,
+
+    .bdrv_child_perm        = bdrv_format_default_perms,
+};
+
+typedef struct TestBackup {
+    BlockDriverState *source;
+    BlockDriverState *target;
+    BlockBackend *blk;
+    bool done;
+    int ret;
+} TestBackup;
+
+static void test_backup_init(TestBackup *t, int64_t read_delay_ns)
+{
+    BDRVTestState *s;
+
+    reads_in_flight = 0;
+    reads_max_in_flight = 0;
+
+    t->source = bdrv_new_open_driver(&bdrv_test, "source",
+                                     BDRV_O_RDWR | BDRV_O_UNMAP, &error_abort);
+    t->target = bdrv_new_open_driver(&bdrv_test, "target",
+                                     BDRV_O_RDWR | BDRV_O_UNMAP, &error_abort);
+    s = t->source->opaque;
+    s->read_delay_ns = read_delay_ns;
+
+    /* The guest device */
+    t->blk = blk_new(BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE, BLK_PERM_ALL);
+    blk_insert_bs(t->blk, t->source, &error_abort);
+
+    /* data 'a' in 0-15, zeroes in 16-31, data 'b' in 32-63 */
+    bdrv_test_mark(t->source, 0, 16 * TEST_CLUSTER_SIZE, TEST_DATA, 'a');
+    bdrv_test_mark(t->source, 32 * TEST_CLUSTER_SIZE, 32 * TEST_CLUSTER_SIZE,
+                   TEST_DATA, 'b');
+    t->done = false;
+}
+
+static void test_backup_cleanup(TestBackup *t)
+{
+    blk_unref(t->blk);
+    bdrv_unref(t->source);
+    bdrv_unref(t->target);
+}
+
+static void test_backup_cb(void *opaque, int ret)
+{
+    TestBackup *t = opaque;
+
+    t->ret = ret;
+    t->done = true;
+}
+
+static void test_backup_start(TestBackup *t, int max_workers,
+                              int64_t max_chunk)
+{
+    BlockJob *job;
+
+    job = backup_job_create("job0", t->source, t->target, 0,
+                            MIRROR_SYNC_MODE_FULL, NULL, false,
+                            max_workers, max_chunk,
+                            BLOCKDEV_ON_ERROR_REPORT, BLOCKDEV_ON_ERROR_REPORT,
+                            BLOCK_JOB_DEFAULT, test_backup_cb, t, NULL,
+                            &error_abort);
+    block_job_start(job);
+}
+
+static void test_backup_wait(TestBackup *t)
+{
+    while (!t->done) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(t->ret, ==, 0);
+}
+
+/* One character per cluster: the fill byte, '0' for zeroes, '-' if none */
+static char *test_node_map(BlockDriverState *bs)
+{
+    BDRVTestState *s = bs->opaque;
+    char *str = g_malloc(TEST_CLUSTERS + 1);
+    int i;
+
+    for (i = 0; i < TEST_CLUSTERS; i++) {
+        switch (s->map[i]) {
+        case TEST_DATA:
+            str[i] = s->fill[i];
+            break;
+        case TEST_ZERO:
+            str[i] = '0';
+            break;
+        default:
+            str[i] = '-';
+        }
+    }
+    str[TEST_CLUSTERS] = 0;
+    return str;
+}
+
+static void test_full(void)
+{
+    TestBackup t;
+    BDRVTestState *source, *target;
+    char *map;
+
+    test_backup_init(&t, 1 * SCALE_MS);
+    source = t.source->opaque;
+    target = t.target->opaque;
+
+    test_backup_start(&t, 4, 4 * TEST_CLUSTER_SIZE);
+    test_backup_wait(&t);
+
+    map = test_node_map(t.target);
+    g_assert_cmpstr(map, ==,
+                    "aaaaaaaaaaaaaaaa0000000000000000"
+                    "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb");
+    g_free(map);
+
+    /* Four clusters per read, four reads at a time */
+    g_assert_cmpint(source->reads, ==, TEST_CLUSTERS / 4);
+    g_assert_cmpint(reads_max_in_flight, ==, 4);
+    g_assert_cmpint(target->zero_writes, >=, 1);
+
+    test_backup_cleanup(&t);
+}
+
+static void test_serial(void)
+{
+    TestBackup t;
+    BDRVTestState *source;
+
+    test_backup_init(&t, 0);
+    source = t.source->opaque;
+
+    test_backup_start(&t, 1, TEST_CLUSTER_SIZE);
+    test_backup_wait(&t);
+
+    g_assert_cmpint(source->reads, ==, TEST_CLUSTERS);
+    g_assert_cmpint(reads_max_in_flight, ==, 1);
+
+    test_backup_cleanup(&t);
+}
+
+static void test_guest_write(void)
+{
+    TestBackup t;
+    char *map;
+    void *buf;
+    int ret;
+
+    test_backup_init(&t, 10 * SCALE_MS);
+    test_backup_start(&t, 1, TEST_CLUSTER_SIZE);
+
+    /* The old data must reach the target before the guest overwrites it,
+     * long before the background copy gets there */
+    buf = qemu_blockalign(t.source, 2 * TEST_CLUSTER_SIZE);
+    memset(buf, 'c', 2 * TEST_CLUSTER_SIZE);
+    ret = blk_pwrite(t.blk, 60 * TEST_CLUSTER_SIZE, buf,
+                     2 * TEST_CLUSTER_SIZE, 0);
+    g_assert_cmpint(ret, >=, 0);
+    g_assert(!t.done);
+    qemu_vfree(buf);
+
+    test_backup_wait(&t);
+
+    map = test_node_map(t.target);
+    g_assert_cmpstr(map, ==,
+                    "aaaaaaaaaaaaaaaa0000000000000000"
+                    "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb");
+    g_free(map);
+    map = test_node_map(t.source);
+    g_assert_cmpstr(map, ==,
+                    "aaaaaaaaaaaaaaaa----------------"
+                    "bbbbbbbbbbbbbbbbbbbbbbbbbbbbccbb");
+    g_free(map);
+
+    test_backup_cleanup(&t);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/backup/full", test_full);
+    g_test_add_func("/backup/serial", test_serial);
+    g_test_add_func("/backup/guest-write", test_guest_write);
+
+    return g_test_run();
+}
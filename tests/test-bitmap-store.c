@@ -0,0 +1,206 @@
+/*
+ * Sidecar file for persistent dirty bitmaps
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "block/dirty-bitmap.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+
+#define TEST_SIZE           (8LL * 1024 * 1024 * 1024)
+#define TEST_GRANULARITY    512
+
+static char *test_dir;
+static char *test_path;
+
+static BlockDriverState *test_open(int flags)
+{
+    QDict *options = qdict_new();
+
+    qdict_put_str(options, "driver", "null-co");
+    qdict_put_int(options, "size", TEST_SIZE);
+    qdict_put_str(options, BDRV_OPT_BITMAP_STORE, test_path);
+    return bdrv_open(NULL, NULL, options, flags, &error_abort);
+}
+
+static BdrvDirtyBitmap *test_add_bitmap(BlockDriverState *bs,
+                                        const char *name)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    g_assert(bdrv_can_store_new_dirty_bitmap(bs, name, TEST_GRANULARITY,
+                                             &error_abort));
+    bitmap = bdrv_create_dirty_bitmap(bs, TEST_GRANULARITY, name,
+                                      &error_abort);
+    bdrv_dirty_bitmap_set_persistance(bitmap, true);
+    return bitmap;
+}
+
+static uint32_t test_file_flags(void)
+{
+    gchar *contents;
+    gsize len;
+    uint32_t flags;
+
+    g_assert(g_file_get_contents(test_path, &contents, &len, NULL));
+    g_assert_cmpint(len, >=, 32);
+    flags = ldl_le_p(contents + 12);
+    g_free(contents);
+    return flags;
+}
+
+/* Create two bitmaps and return the sha256 of the first one */
+static char *test_create_store(void)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    char *sha256;
+
+    unlink(test_path);
+    bs = test_open(BDRV_O_RDWR);
+    g_assert_null(bdrv_dirty_bitmap_next(bs, NULL));
+
+    bitmap = test_add_bitmap(bs, "b0");
+    bdrv_set_dirty_bitmap(bitmap, 0, 4096);
+    bdrv_set_dirty_bitmap(bitmap, 3 * 1024 * 1024 * 1024LL + 512, 65536);
+    bdrv_set_dirty_bitmap(bitmap, TEST_SIZE - 512, 512);
+    sha256 = bdrv_dirty_bitmap_sha256(bitmap, &error_abort);
+
+    bitmap = test_add_bitmap(bs, "b1");
+    bdrv_dirty_bitmap_set_sparse(bitmap, true);
+    bdrv_set_dirty_bitmap(bitmap, 1024 * 1024, 1024 * 1024);
+    bdrv_disable_dirty_bitmap(bitmap);
+
+    /* Not persistent, so not saved */
+    bdrv_create_dirty_bitmap(bs, TEST_GRANULARITY, "b2", &error_abort);
+
+    bdrv_unref(bs);
+    return sha256;
+}
+
+static void test_round_trip(void)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    char *sha256, *loaded;
+    struct stat st;
+
+    sha256 = test_create_store();
+
+    /* Only the dirty chunks of the 2 MB bitmaps take space */
+    g_assert_cmpint(stat(test_path, &st), ==, 0);
+    g_assert_cmpint(st.st_size, <, 512 * 1024);
+    g_assert_cmpint(test_file_flags(), ==, 0);
+
+    bs = test_open(BDRV_O_RDWR);
+    g_assert_cmpint(test_file_flags(), ==, 1);
+
+    bitmap = bdrv_find_dirty_bitmap(bs, "b0");
+    g_assert_nonnull(bitmap);
+    g_assert(bdrv_dirty_bitmap_enabled(bitmap));
+    g_assert(bdrv_dirty_bitmap_get_persistance(bitmap));
+    g_assert(!bdrv_dirty_bitmap_get_sparse(bitmap));
+    g_assert_cmpint(bdrv_get_dirty_count(bitmap), ==, 4096 + 65536 + 512);
+    loaded = bdrv_dirty_bitmap_sha256(bitmap, &error_abort);
+    g_assert_cmpstr(sha256, ==, loaded);
+    g_free(loaded);
+
+    bitmap = bdrv_find_dirty_bitmap(bs, "b1");
+    g_assert_nonnull(bitmap);
+    g_assert(!bdrv_dirty_bitmap_enabled(bitmap));
+    g_assert(bdrv_dirty_bitmap_get_sparse(bitmap));
+    g_assert_cmpint(bdrv_get_dirty_count(bitmap), ==, 1024 * 1024);
+
+    g_assert_null(bdrv_find_dirty_bitmap(bs, "b2"));
+
+    /* Dropping a bitmap removes it from the file on the next save */
+    bdrv_release_dirty_bitmap(bs, bdrv_find_dirty_bitmap(bs, "b1"));
+    bdrv_unref(bs);
+    g_assert_cmpint(test_file_flags(), ==, 0);
+
+    bs = test_open(BDRV_O_RDWR);
+    g_assert_nonnull(bdrv_find_dirty_bitmap(bs, "b0"));
+    g_assert_null(bdrv_find_dirty_bitmap(bs, "b1"));
+    bdrv_unref(bs);
+
+    g_free(sha256);
+}
+
+static void test_unclean_shutdown(void)
+{
+    BlockDriverState *bs;
+    gchar *contents;
+    gsize len;
+
+    g_free(test_create_store());
+
+    /* Keep the file as a crash would have left it */
+    bs = test_open(BDRV_O_RDWR);
+    g_assert(g_file_get_contents(test_path, &contents, &len, NULL));
+    bdrv_unref(bs);
+    g_assert(g_file_set_contents(test_path, contents, len, NULL));
+    g_free(contents);
+
+    bs = test_open(BDRV_O_RDWR);
+    g_assert_null(bdrv_dirty_bitmap_next(bs, NULL));
+    bdrv_unref(bs);
+
+    /* The store is usable again after a clean close */
+    g_assert_cmpint(test_file_flags(), ==, 0);
+}
+
+static void test_read_only(void)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    Error *local_err = NULL;
+
+    g_free(test_create_store());
+
+    bs = test_open(0);
+    g_assert_cmpint(test_file_flags(), ==, 0);
+
+    bitmap = bdrv_find_dirty_bitmap(bs, "b0");
+    g_assert_nonnull(bitmap);
+    g_assert(bdrv_dirty_bitmap_readonly(bitmap));
+    g_assert(!bdrv_can_store_new_dirty_bitmap(bs, "b3", TEST_GRANULARITY,
+                                              &local_err));
+    error_free(local_err);
+    bdrv_unref(bs);
+
+    bs = test_open(BDRV_O_RDWR);
+    g_assert_nonnull(bdrv_find_dirty_bitmap(bs, "b0"));
+    bdrv_unref(bs);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    test_dir = g_dir_make_tmp("test-bitmap-store-XXXXXX", NULL);
+    g_assert(test_dir);
+    test_path = g_build_filename(test_dir, "bitmaps", NULL);
+
+    g_test_add_func("/bitmap-store/round-trip", test_round_trip);
+    g_test_add_func("/bitmap-store/unclean-shutdown", test_unclean_shutdown);
+    g_test_add_func("/bitmap-store/read-only", test_read_only);
+
+    ret = g_test_run();
+
+    unlink(test_path);
+    rmdir(test_dir);
+    g_free(test_path);
+    g_free(test_dir);
+    return ret;
+}
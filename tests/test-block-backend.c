@@ -24,8 +24,11 @@
 
 #include "qemu/osdep.h"
 #include "block/block.h"
+#include "block/block_int.h"
+#include "block/accounting.h"
 #include "sysemu/block-backend.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-block-core.h"
 
 static void test_drain_aio_error_flush_cb(void *opaque, int ret)
 {
@@ -67,6 +70,369 @@ static void test_drain_all_aio_error(void)
     blk_unref(blk);
 }
 
+#define MERGE_REQ_SIZE  4096
+#define MERGE_NB_REQS   8
+
+typedef struct BDRVMergeTestState {
+    int reads;
+    int writes;
+    int64_t last_bytes;
+    int64_t bad_offset;
+} BDRVMergeTestState;
+
+static void bdrv_merge_test_close(BlockDriverState *bs)
+{
+}
+
+static int64_t bdrv_merge_test_getlength(BlockDriverState *bs)
+{
+    return 1024 * 1024;
+}
+
+static int coroutine_fn bdrv_merge_test_co_preadv(BlockDriverState *bs,
+                                                  uint64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov,
+                                                  int flags)
+{
+    BDRVMergeTestState *s = bs->opaque;
+    uint64_t i;
+
+    s->reads++;
+    s->last_bytes = bytes;
+    for (i = 0; i < bytes; i += MERGE_REQ_SIZE) {
+        qemu_iovec_memset(qiov, i, (offset + i) / MERGE_REQ_SIZE,
+                          MERGE_REQ_SIZE);
+    }
+    return 0;
+}
+
+static int coroutine_fn bdrv_merge_test_co_pwritev(BlockDriverState *bs,
+                                                   uint64_t offset,
+                                                   uint64_t bytes,
+                                                   QEMUIOVector *qiov,
+                                                   int flags)
+{
+    BDRVMergeTestState *s = bs->opaque;
+
+    s->writes++;
+    s->last_bytes = bytes;
+    if (s->bad_offset >= (int64_t)offset &&
+        s->bad_offset < (int64_t)(offset + bytes)) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static BlockDriver bdrv_merge_test = {
+    .format_name            = "merge-test",
+    .instance_size          = sizeof(BDRVMergeTestState),
+
+    .bdrv_close             = bdrv_merge_test_close,
+    .bdrv_getlength         = bdrv_merge_test_getlength,
+    .bdrv_co_preadv         = bdrv_merge_test_co_preadv,
+    .bdrv_co_pwritev        = bdrv_merge_test_co_pwritev,
+
+    .bdrv_child_perm        = bdrv_format_default_perms,
+};
+
+typedef struct MergeTestReq {
+    QEMUIOVector qiov;
+    uint8_t buf[MERGE_REQ_SIZE];
+    int ret;
+} MergeTestReq;
+
+static void merge_test_cb(void *opaque, int ret)
+{
+    MergeTestReq *req = opaque;
+    req->ret = ret;
+}
+
+static BlockBackend *merge_test_start(BlockDriverState **pbs)
+{
+    BlockBackend *blk = blk_new(BLK_PERM_ALL, BLK_PERM_ALL);
+    BlockDriverState *bs;
+
+    bs = bdrv_new_open_driver(&bdrv_merge_test, "merge-test", BDRV_O_RDWR,
+                              &error_abort);
+    blk_insert_bs(blk, bs, &error_abort);
+    ((BDRVMergeTestState *)bs->opaque)->bad_offset = -1;
+    *pbs = bs;
+    return blk;
+}
+
+static void merge_test_end(BlockBackend *blk, BlockDriverState *bs)
+{
+    blk_unref(blk);
+    bdrv_unref(bs);
+}
+
+static void merge_test_submit(BlockBackend *blk, MergeTestReq *req,
+                              int64_t offset, bool is_write)
+{
+    qemu_iovec_init(&req->qiov, 1);
+    qemu_iovec_add(&req->qiov, req->buf, MERGE_REQ_SIZE);
+    req->ret = -EINPROGRESS;
+    if (is_write) {
+        blk_aio_pwritev(blk, offset, &req->qiov, 0, merge_test_cb, req);
+    } else {
+        blk_aio_preadv(blk, offset, &req->qiov, 0, merge_test_cb, req);
+    }
+}
+
+static void merge_test_wait(MergeTestReq *reqs, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        while (reqs[i].ret == -EINPROGRESS) {
+            aio_poll(qemu_get_aio_context(), true);
+        }
+        qemu_iovec_destroy(&reqs[i].qiov);
+    }
+}
+
+static void test_merge_plug(void)
+{
+    BlockDriverState *bs;
+    BlockBackend *blk = merge_test_start(&bs);
+    BDRVMergeTestState *s = bs->opaque;
+    MergeTestReq reqs[MERGE_NB_REQS];
+    BlockAcctCounters counters;
+    int i, j;
+
+    blk_set_merge(blk, true, 0);
+
+    blk_io_plug(blk);
+    for (i = 0; i < MERGE_NB_REQS; i++) {
+        merge_test_submit(blk, &reqs[i], i * MERGE_REQ_SIZE, true);
+    }
+    g_assert_cmpint(s->writes, ==, 0);
+    blk_io_unplug(blk);
+    merge_test_wait(reqs, MERGE_NB_REQS);
+
+    g_assert_cmpint(s->writes, ==, 1);
+    g_assert_cmpint(s->last_bytes, ==, MERGE_NB_REQS * MERGE_REQ_SIZE);
+    for (i = 0; i < MERGE_NB_REQS; i++) {
+        g_assert_cmpint(reqs[i].ret, ==, 0);
+    }
+    block_acct_get_counters(blk_get_stats(blk), &counters);
+    g_assert_cmpint(counters.merged[BLOCK_ACCT_WRITE], ==, MERGE_NB_REQS - 1);
+
+    /* Reads are split back into the buffer of each request */
+    blk_io_plug(blk);
+    for (i = 0; i < MERGE_NB_REQS; i++) {
+        merge_test_submit(blk, &reqs[i], i * MERGE_REQ_SIZE, false);
+    }
+    blk_io_unplug(blk);
+    merge_test_wait(reqs, MERGE_NB_REQS);
+
+    g_assert_cmpint(s->reads, ==, 1);
+    for (i = 0; i < MERGE_NB_REQS; i++) {
+        g_assert_cmpint(reqs[i].ret, ==, 0);
+        for (j = 0; j < MERGE_REQ_SIZE; j++) {
+            g_assert_cmpint(reqs[i].buf[j], ==, i);
+        }
+    }
+
+    merge_test_end(blk, bs);
+}
+
+static void test_merge_split(void)
+{
+    BlockDriverState *bs;
+    BlockBackend *blk = merge_test_start(&bs);
+    BDRVMergeTestState *s = bs->opaque;
+    MergeTestReq reqs[5];
+
+    blk_set_merge(blk, true, 0);
+
+    /* Only adjacent requests in the same direction are merged */
+    blk_io_plug(blk);
+    merge_test_submit(blk, &reqs[0], 0, true);
+    merge_test_submit(blk, &reqs[1], MERGE_REQ_SIZE, true);
+    merge_test_submit(blk, &reqs[2], 4 * MERGE_REQ_SIZE, true);
+    merge_test_submit(blk, &reqs[3], 5 * MERGE_REQ_SIZE, false);
+    merge_test_submit(blk, &reqs[4], 6 * MERGE_REQ_SIZE, false);
+    blk_io_unplug(blk);
+    merge_test_wait(reqs, 5);
+
+    g_assert_cmpint(s->writes, ==, 2);
+    g_assert_cmpint(s->reads, ==, 1);
+
+    /* Nothing is held back without a plug or a window */
+    merge_test_submit(blk, &reqs[0], 0, true);
+    g_assert_cmpint(s->writes, ==, 3);
+    merge_test_wait(reqs, 1);
+
+    merge_test_end(blk, bs);
+}
+
+static void test_merge_max_transfer(void)
+{
+    BlockDriverState *bs;
+    BlockBackend *blk = merge_test_start(&bs);
+    BDRVMergeTestState *s = bs->opaque;
+    MergeTestReq reqs[MERGE_NB_REQS];
+    int i;
+
+    bs->bl.max_transfer = 3 * MERGE_REQ_SIZE;
+    blk_set_merge(blk, true, 0);
+
+    blk_io_plug(blk);
+    for (i = 0; i < MERGE_NB_REQS; i++) {
+        merge_test_submit(blk, &reqs[i], i * MERGE_REQ_SIZE, true);
+    }
+    blk_io_unplug(blk);
+    merge_test_wait(reqs, MERGE_NB_REQS);
+
+    g_assert_cmpint(s->writes, ==, DIV_ROUND_UP(MERGE_NB_REQS, 3));
+
+    merge_test_end(blk, bs);
+}
+
+static void test_merge_window(void)
+{
+    BlockDriverState *bs;
+    BlockBackend *blk = merge_test_start(&bs);
+    BDRVMergeTestState *s = bs->opaque;
+    MergeTestReq reqs[MERGE_NB_REQS];
+    int i;
+
+    blk_set_merge(blk, true, 10 * SCALE_MS);
+
+    for (i = 0; i < MERGE_NB_REQS; i++) {
+        merge_test_submit(blk, &reqs[i], i * MERGE_REQ_SIZE, true);
+    }
+    g_assert_cmpint(s->writes, ==, 0);
+    merge_test_wait(reqs, MERGE_NB_REQS);
+    g_assert_cmpint(s->writes, ==, 1);
+
+    /* Draining does not wait for the window to expire */
+    for (i = 0; i < 2; i++) {
+        merge_test_submit(blk, &reqs[i], i * MERGE_REQ_SIZE, true);
+    }
+    blk_drain(blk);
+    g_assert_cmpint(s->writes, ==, 2);
+    g_assert_cmpint(reqs[0].ret, ==, 0);
+    g_assert_cmpint(reqs[1].ret, ==, 0);
+    merge_test_wait(reqs, 2);
+
+    merge_test_end(blk, bs);
+}
+
+static void test_merge_error(void)
+{
+    BlockDriverState *bs;
+    BlockBackend *blk = merge_test_start(&bs);
+    BDRVMergeTestState *s = bs->opaque;
+    MergeTestReq reqs[MERGE_NB_REQS];
+    int i;
+
+    s->bad_offset = 2 * MERGE_REQ_SIZE;
+    blk_set_merge(blk, true, 0);
+
+    blk_io_plug(blk);
+    for (i = 0; i < MERGE_NB_REQS; i++) {
+        merge_test_submit(blk, &reqs[i], i * MERGE_REQ_SIZE, true);
+    }
+    blk_io_unplug(blk);
+    merge_test_wait(reqs, MERGE_NB_REQS);
+
+    /* The merged request failed, so each one was retried on its own */
+    g_assert_cmpint(s->writes, ==, MERGE_NB_REQS + 1);
+    for (i = 0; i < MERGE_NB_REQS; i++) {
+        g_assert_cmpint(reqs[i].ret, ==, i == 2 ? -EIO : 0);
+    }
+
+    merge_test_end(blk, bs);
+}
+
+static BlockStatsDeltaInfo *stats_delta(int64_t cursor,
+                                        BlockStatsDeltaFormat format)
+{
+    return qmp_query_blockstats_delta(cursor > 0, cursor, true, format,
+                                      &error_abort);
+}
+
+static void test_stats_delta(void)
+{
+    BlockDriverState *bs;
+    BlockBackend *blk = merge_test_start(&bs);
+    BlockAcctCookie cookie;
+    BlockStatsDeltaInfo *info;
+    BlockStatsDelta *d;
+    int64_t cursor, old_cursor;
+    guchar *packed;
+    gsize len;
+
+    monitor_add_blk(blk, "drive0", &error_abort);
+
+    /* Without a cursor, every device is reported */
+    info = stats_delta(0, BLOCK_STATS_DELTA_FORMAT_JSON);
+    g_assert(info->full);
+    g_assert(info->devices && !info->devices->next);
+    d = info->devices->value;
+    g_assert_cmpstr(d->device, ==, "drive0");
+    g_assert(!d->has_wr_bytes && !d->removed);
+    cursor = info->cursor;
+    qapi_free_BlockStatsDeltaInfo(info);
+
+    info = stats_delta(cursor, BLOCK_STATS_DELTA_FORMAT_JSON);
+    g_assert(!info->full);
+    g_assert(info->devices == NULL);
+    old_cursor = cursor;
+    cursor = info->cursor;
+    qapi_free_BlockStatsDeltaInfo(info);
+
+    /* Only what changed is reported */
+    block_acct_start(blk_get_stats(blk), &cookie, 4096, BLOCK_ACCT_WRITE);
+    block_acct_done(blk_get_stats(blk), &cookie);
+
+    info = stats_delta(cursor, BLOCK_STATS_DELTA_FORMAT_JSON);
+    g_assert(!info->full);
+    g_assert(info->devices && !info->devices->next);
+    d = info->devices->value;
+    g_assert(d->has_wr_bytes && d->wr_bytes == 4096);
+    g_assert(d->has_wr_operations && d->wr_operations == 1);
+    g_assert(!d->has_rd_bytes && !d->has_flush_operations);
+    cursor = info->cursor;
+    qapi_free_BlockStatsDeltaInfo(info);
+
+    /* A cursor can only be used once */
+    info = stats_delta(old_cursor, BLOCK_STATS_DELTA_FORMAT_JSON);
+    g_assert(info->full);
+    qapi_free_BlockStatsDeltaInfo(info);
+
+    block_acct_start(blk_get_stats(blk), &cookie, 512, BLOCK_ACCT_READ);
+    block_acct_done(blk_get_stats(blk), &cookie);
+
+    info = stats_delta(cursor, BLOCK_STATS_DELTA_FORMAT_PACKED);
+    g_assert(!info->full && !info->has_devices && info->has_packed);
+    packed = g_base64_decode(info->packed, &len);
+    g_assert_cmpint(len, >=, 2 + 2 + 6 + 4 + 2 * 8);
+    g_assert_cmpint(packed[0], ==, 'd');
+    g_assert_cmpint(packed[1], ==, 0);
+    g_assert_cmpint(lduw_le_p(packed + 2), ==, 6);
+    g_assert(!memcmp(packed + 4, "drive0", 6));
+    g_assert(ldl_le_p(packed + 10) & (1 << BLOCK_STATS_COUNTER_RD_BYTES));
+    g_assert(!(ldl_le_p(packed + 10) & (1 << BLOCK_STATS_COUNTER_WR_BYTES)));
+    g_assert_cmpint(ldq_le_p(packed + 14), ==, 512);
+    g_free(packed);
+    cursor = info->cursor;
+    qapi_free_BlockStatsDeltaInfo(info);
+
+    monitor_remove_blk(blk);
+    merge_test_end(blk, bs);
+
+    info = stats_delta(cursor, BLOCK_STATS_DELTA_FORMAT_JSON);
+    g_assert(info->devices && !info->devices->next);
+    d = info->devices->value;
+    g_assert_cmpstr(d->device, ==, "drive0");
+    g_assert(d->has_removed && d->removed);
+    qapi_free_BlockStatsDeltaInfo(info);
+}
+
 int main(int argc, char **argv)
 {
     bdrv_init();
@@ -77,6 +443,13 @@ int main(int argc, char **argv)
     g_test_add_func("/block-backend/drain_aio_error", test_drain_aio_error);
     g_test_add_func("/block-backend/drain_all_aio_error",
                     test_drain_all_aio_error);
+    g_test_add_func("/block-backend/merge/plug", test_merge_plug);
+    g_test_add_func("/block-backend/merge/split", test_merge_split);
+    g_test_add_func("/block-backend/merge/max_transfer",
+                    test_merge_max_transfer);
+    g_test_add_func("/block-backend/merge/window", test_merge_window);
+    g_test_add_func("/block-backend/merge/error", test_merge_error);
+    g_test_add_func("/block-backend/stats-delta", test_stats_delta);
 
     return g_test_run();
 }
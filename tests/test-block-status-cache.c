@@ -0,0 +1,333 @@
+/*
+ * Block status cache tests
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "block/status-cache.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+
+#define TEST_CLUSTER_SIZE   65536
+#define TEST_CLUSTERS       64
+#define TEST_SIZE           (TEST_CLUSTER_SIZE * TEST_CLUSTERS)
+
+enum {
+    TEST_UNALLOCATED,
+    TEST_DATA,
+    TEST_ZERO,
+};
+
+typedef struct BDRVTestState {
+    uint8_t map[TEST_CLUSTERS];
+    int block_status_calls;
+} BDRVTestState;
+
+static void bdrv_test_close(BlockDriverState *bs)
+{
+}
+
+static int64_t bdrv_test_getlength(BlockDriverState *bs)
+{
+    return TEST_SIZE;
+}
+
+static void bdrv_test_mark(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes, uint8_t state)
+{
+    BDRVTestState *s = bs->opaque;
+    int64_t i;
+
+    for (i = offset / TEST_CLUSTER_SIZE;
+         i < DIV_ROUND_UP(offset + bytes, TEST_CLUSTER_SIZE); i++) {
+        s->map[i] = state;
+    }
+}
+
+static int coroutine_fn bdrv_test_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    bdrv_test_mark(bs, offset, bytes, TEST_DATA);
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_pwrite_zeroes(BlockDriverState *bs,
+                                                   int64_t offset, int bytes,
+                                                   BdrvRequestFlags flags)
+{
+    bdrv_test_mark(bs, offset, bytes, TEST_ZERO);
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_pdiscard(BlockDriverState *bs,
+                                              int64_t offset, int bytes)
+{
+    bdrv_test_mark(bs, offset, bytes, TEST_UNALLOCATED);
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_block_status(BlockDriverState *bs,
+                                                  bool want_zero,
+                                                  int64_t offset,
+                                                  int64_t bytes,
+                                                  int64_t *pnum,
+                                                  int64_t *map,
+                                                  BlockDriverState **file)
+{
+    BDRVTestState *s = bs->opaque;
+    int64_t i = offset / TEST_CLUSTER_SIZE;
+    int64_t end = i + 1;
+    uint8_t state = s->map[i];
+
+    s->block_status_calls++;
+    while (end < TEST_CLUSTERS && s->map[end] == state) {
+        end++;
+    }
+    *pnum = MIN(end * TEST_CLUSTER_SIZE - offset, bytes);
+
+    switch (state) {
+    case TEST_DATA:
+        return BDRV_BLOCK_DATA;
+    case TEST_ZERO:
+        return BDRV_BLOCK_ZERO;
+    default:
+        return 0;
+    }
+}
+
+static BlockDriver bdrv_test = {
+    .format_name            = "test",
+    .instance_size          = sizeof(BDRVTestState),
+
+    .bdrv_close             = bdrv_test_close,
+    .bdrv_getlength         = bdrv_test_getlength,
+    .bdrv_co_pwritev        = bdrv_test_co_pwritev,
+    .bdrv_co_pwrite_zeroes  = bdrv_test_co_pwrite_zeroes,
+    .bdrv_co_pdiscard       = bdrv_test_co_pdiscard,
+    .bdrv_co_block_status   = bdrv_test_co_block_status,
+
+    .bdrv_child_perm        = bdrv_format_default_perms,
+};
+
+typedef struct TestChain {
+    BlockDriverState *layer[3];     /* top, mid, base */
+    BlockBackend *blk[3];
+} TestChain;
+
+static void test_chain_init(TestChain *c)
+{
+    static const char *names[] = { "top", "mid", "base" };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(c->layer); i++) {
+        c->layer[i] = bdrv_new_open_driver(&bdrv_test, names[i],
+                                           BDRV_O_RDWR | BDRV_O_UNMAP,
+                                           &error_abort);
+        c->blk[i] = blk_new(BLK_PERM_WRITE | BLK_PERM_CONSISTENT_READ,
+                            BLK_PERM_ALL);
+        blk_insert_bs(c->blk[i], c->layer[i], &error_abort);
+    }
+    bdrv_set_backing_hd(c->layer[1], c->layer[2], &error_abort);
+    bdrv_set_backing_hd(c->layer[0], c->layer[1], &error_abort);
+
+    /* base: data in 0-15, mid: zeroes in 8-11, top: data in 10 */
+    bdrv_test_mark(c->layer[2], 0, 16 * TEST_CLUSTER_SIZE, TEST_DATA);
+    bdrv_test_mark(c->layer[1], 8 * TEST_CLUSTER_SIZE, 4 * TEST_CLUSTER_SIZE,
+                   TEST_ZERO);
+    bdrv_test_mark(c->layer[0], 10 * TEST_CLUSTER_SIZE, TEST_CLUSTER_SIZE,
+                   TEST_DATA);
+}
+
+static void test_chain_cleanup(TestChain *c)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(c->layer); i++) {
+        blk_unref(c->blk[i]);
+    }
+    for (i = 0; i < ARRAY_SIZE(c->layer); i++) {
+        bdrv_unref(c->layer[i]);
+    }
+}
+
+static int test_calls(TestChain *c)
+{
+    int i, n = 0;
+
+    for (i = 0; i < ARRAY_SIZE(c->layer); i++) {
+        n += ((BDRVTestState *)c->layer[i]->opaque)->block_status_calls;
+    }
+    return n;
+}
+
+/*
+ * Walk the whole disk and record the status of each cluster seen from @top
+ * down to @base.  The cache may split extents differently from a plain
+ * walk, so only per-cluster results are compared.
+ */
+static GString *test_map(BlockDriverState *top, BlockDriverState *base)
+{
+    GString *str = g_string_new(NULL);
+    int64_t offset, pnum, i;
+    int ret;
+
+    for (offset = 0; offset < TEST_SIZE; offset += pnum) {
+        ret = bdrv_block_status_above(top, base, offset, TEST_SIZE - offset,
+                                      &pnum, NULL, NULL);
+        g_assert_cmpint(ret, >=, 0);
+        g_assert_cmpint(pnum, >, 0);
+        g_assert(QEMU_IS_ALIGNED(pnum, TEST_CLUSTER_SIZE));
+        for (i = 0; i < pnum / TEST_CLUSTER_SIZE; i++) {
+            g_string_append_printf(str, "%x", ret & ~BDRV_BLOCK_EOF);
+        }
+    }
+    g_string_append_c(str, '/');
+    for (offset = 0; offset < TEST_SIZE; offset += pnum) {
+        ret = bdrv_is_allocated_above(top, base, offset, TEST_SIZE - offset,
+                                      &pnum);
+        g_assert_cmpint(ret, >=, 0);
+        g_assert_cmpint(pnum, >, 0);
+        g_assert(QEMU_IS_ALIGNED(pnum, TEST_CLUSTER_SIZE));
+        for (i = 0; i < pnum / TEST_CLUSTER_SIZE; i++) {
+            g_string_append_printf(str, "%d", ret);
+        }
+    }
+    return str;
+}
+
+/* Compare cached and uncached results for every base below the top */
+static void test_compare(TestChain *c)
+{
+    BlockDriverState *top = c->layer[0];
+    BlockDriverState *base = top;
+
+    do {
+        GString *cached, *uncached;
+
+        base = backing_bs(base);
+        cached = test_map(top, base);
+        bdrv_bsc_disable(top);
+        uncached = test_map(top, base);
+        bdrv_bsc_enable(top, 0);
+        g_assert_cmpstr(cached->str, ==, uncached->str);
+        g_string_free(cached, true);
+        g_string_free(uncached, true);
+    } while (base);
+}
+
+static void test_hit(void)
+{
+    TestChain c;
+    BdrvStatusCacheStats stats;
+    GString *first, *second;
+    int calls;
+
+    test_chain_init(&c);
+    bdrv_bsc_enable(c.layer[0], 0);
+
+    first = test_map(c.layer[0], NULL);
+    calls = test_calls(&c);
+    g_assert_cmpint(calls, >, 0);
+
+    second = test_map(c.layer[0], NULL);
+    g_assert_cmpint(test_calls(&c), ==, calls);
+    g_assert_cmpstr(first->str, ==, second->str);
+
+    bdrv_bsc_get_stats(c.layer[0], &stats);
+    g_assert(stats.enabled);
+    g_assert_cmpint(stats.nr_extents, >, 0);
+    g_assert_cmpint(stats.hits, >, 0);
+    g_assert_cmpint(stats.misses, >, 0);
+
+    g_string_free(first, true);
+    g_string_free(second, true);
+    test_chain_cleanup(&c);
+}
+
+static void test_bases(void)
+{
+    TestChain c;
+
+    test_chain_init(&c);
+    bdrv_bsc_enable(c.layer[0], 0);
+    test_compare(&c);
+    test_chain_cleanup(&c);
+}
+
+static void test_invalidate_write(void)
+{
+    TestChain c;
+    BdrvStatusCacheStats stats;
+    int64_t pnum;
+    int ret;
+
+    test_chain_init(&c);
+    bdrv_bsc_enable(c.layer[0], 0);
+
+    ret = bdrv_is_allocated_above(c.layer[0], NULL, 20 * TEST_CLUSTER_SIZE,
+                                  TEST_CLUSTER_SIZE, &pnum);
+    g_assert_cmpint(ret, ==, 0);
+
+    /* A write to an intermediate layer must be seen from the top */
+    ret = blk_pwrite(c.blk[1], 20 * TEST_CLUSTER_SIZE, NULL,
+                     TEST_CLUSTER_SIZE, BDRV_REQ_ZERO_WRITE);
+    g_assert_cmpint(ret, >=, 0);
+    ret = bdrv_is_allocated_above(c.layer[0], NULL, 20 * TEST_CLUSTER_SIZE,
+                                  TEST_CLUSTER_SIZE, &pnum);
+    g_assert_cmpint(ret, ==, 1);
+    bdrv_bsc_get_stats(c.layer[0], &stats);
+    g_assert_cmpint(stats.invalidations, >, 0);
+    test_compare(&c);
+
+    ret = blk_pdiscard(c.blk[1], 20 * TEST_CLUSTER_SIZE, TEST_CLUSTER_SIZE);
+    g_assert_cmpint(ret, >=, 0);
+    ret = bdrv_is_allocated_above(c.layer[0], NULL, 20 * TEST_CLUSTER_SIZE,
+                                  TEST_CLUSTER_SIZE, &pnum);
+    g_assert_cmpint(ret, ==, 0);
+    test_compare(&c);
+
+    test_chain_cleanup(&c);
+}
+
+static void test_invalidate_graph(void)
+{
+    TestChain c;
+    GString *before, *after;
+
+    test_chain_init(&c);
+    bdrv_bsc_enable(c.layer[0], 0);
+    before = test_map(c.layer[0], NULL);
+
+    /* Drop the intermediate layer, as commit or stream would */
+    bdrv_set_backing_hd(c.layer[0], c.layer[2], &error_abort);
+    after = test_map(c.layer[0], NULL);
+    g_assert_cmpstr(before->str, !=, after->str);
+    test_compare(&c);
+
+    g_string_free(before, true);
+    g_string_free(after, true);
+    test_chain_cleanup(&c);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/block-status-cache/hit", test_hit);
+    g_test_add_func("/block-status-cache/bases", test_bases);
+    g_test_add_func("/block-status-cache/invalidate/write",
+                    test_invalidate_write);
+    g_test_add_func("/block-status-cache/invalidate/graph",
+                    test_invalidate_graph);
+
+    return g_test_run();
+}
@@ -0,0 +1,344 @@
+/*
+ * Pipelined block-commit and block-stream jobs
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "block/blockjob.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qemu/timer.h"
+
+#define TEST_CLUSTER_SIZE   65536
+#define TEST_CLUSTERS       64
+#define TEST_SIZE           (TEST_CLUSTER_SIZE * TEST_CLUSTERS)
+
+enum {
+    TEST_UNALLOCATED,
+    TEST_DATA,
+    TEST_ZERO,
+};
+
+typedef struct BDRVTestState {
+    uint8_t map[TEST_CLUSTERS];
+    uint8_t fill[TEST_CLUSTERS];
+    int64_t read_delay_ns;
+    int zero_writes;
+} BDRVTestState;
+
+static int reads_in_flight;
+static int reads_max_in_flight;
+
+static void bdrv_test_close(BlockDriverState *bs)
+{
+}
+
+static int64_t bdrv_test_getlength(BlockDriverState *bs)
+{
+    return TEST_SIZE;
+}
+
+static void bdrv_test_mark(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes, uint8_t state, uint8_t fill)
+{
+    BDRVTestState *s = bs->opaque;
+    int64_t i;
+
+    for (i = offset / TEST_CLUSTER_SIZE;
+         i < DIV_ROUND_UP(offset + bytes, TEST_CLUSTER_SIZE); i++) {
+        s->map[i] = state;
+        s->fill[i] = fill;
+    }
+}
+
+static int coroutine_fn bdrv_test_co_preadv(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    BDRVTestState *s = bs->opaque;
+    uint64_t pos = 0;
+    int ret = 0;
+
+    if (++reads_in_flight > reads_max_in_flight) {
+        reads_max_in_flight = reads_in_flight;
+    }
+    if (s->read_delay_ns) {
+        qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, s->read_delay_ns);
+    }
+
+    while (pos < bytes) {
+        int64_t i = (offset + pos) / TEST_CLUSTER_SIZE;
+        uint64_t n = MIN((i + 1) * TEST_CLUSTER_SIZE - offset - pos,
+                         bytes - pos);
+
+        if (s->map[i] == TEST_UNALLOCATED && bs->backing) {
+            QEMUIOVector local_qiov;
+
+            qemu_iovec_init(&local_qiov, qiov->niov);
+            qemu_iovec_concat(&local_qiov, qiov, pos, n);
+            ret = bdrv_co_preadv(bs->backing, offset + pos, n, &local_qiov, 0);
+            qemu_iovec_destroy(&local_qiov);
+            if (ret < 0) {
+                break;
+            }
+        } else {
+            qemu_iovec_memset(qiov, pos,
+                              s->map[i] == TEST_DATA ? s->fill[i] : 0, n);
+        }
+        pos += n;
+    }
+
+    reads_in_flight--;
+    return ret;
+}
+
+static int coroutine_fn bdrv_test_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    uint64_t pos;
+
+    /* Clusters are written whole with a single fill byte */
+    for (pos = 0; pos < bytes; pos += TEST_CLUSTER_SIZE) {
+        uint8_t fill;
+
+        qemu_iovec_to_buf(qiov, pos, &fill, 1);
+        bdrv_test_mark(bs, offset + pos, 1, TEST_DATA, fill);
+    }
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_pwrite_zeroes(BlockDriverState *bs,
+                                                   int64_t offset, int bytes,
+                                                   BdrvRequestFlags flags)
+{
+    BDRVTestState *s = bs->opaque;
+
+    s->zero_writes++;
+    bdrv_test_mark(bs, offset, bytes, TEST_ZERO, 0);
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_block_status(BlockDriverState *bs,
+                                                  bool want_zero,
+                                                  int64_t offset,
+                                                  int64_t bytes,
+                                                  int64_t *pnum,
+                                                  int64_t *map,
+                                                  BlockDriverState **file)
+{
+    BDRVTestState *s = bs->opaque;
+    int64_t i = offset / TEST_CLUSTER_SIZE;
+    int64_t end = i + 1;
+    uint8_t state = s->map[i];
+
+    while (end < TEST_CLUSTERS && s->map[end] == state) {
+        end++;
+    }
+    *pnum = MIN(end * TEST_CLUSTER_SIZE - offset, bytes);
+
+    switch (state) {
+    case TEST_DATA:
+        return BDRV_BLOCK_DATA;
+    case TEST_ZERO:
+        return BDRV_BLOCK_ZERO;
+    default:
+        return 0;
+    }
+}
+
+static int bdrv_test_change_backing_file(BlockDriverState *bs,
+                                         const char *backing_file,
+                                         const char *backing_fmt)
+{
+    return 0;
+}
+
+static BlockDriver bdrv_test = {
+    .format_name                = "test",
+    .instance_size              = sizeof(BDRVTestState),
+
+    .bdrv_close                 = bdrv_test_close,
+    .bdrv_getlength             = bdrv_test_getlength,
+    .bdrv_co_preadv             = bdrv_test_co_preadv,
+    .bdrv_co_pwritev            = bdrv_test_co_pwritev,
+    .bdrv_co_pwrite_zeroes      = bdrv_test_co_pwrite_zeroes,
+    .bdrv_co_block_status       = bdrv_test_co_block_status,
+    .bdrv_change_backing_file   = bdrv_test_change_backing_file,
+
+    .bdrv_child_perm            = bdrv_format_default_perms,
+};
+
+typedef struct TestChain {
+    BlockDriverState *layer[3];     /* top, mid, base */
+    BlockBackend *blk;
+} TestChain;
+
+static void test_chain_init(TestChain *c, int64_t read_delay_ns)
+{
+    static const char *names[] = { "top", "mid", "base" };
+    int i;
+
+    reads_in_flight = 0;
+    reads_max_in_flight = 0;
+
+    for (i = 0; i < ARRAY_SIZE(c->layer); i++) {
+        BDRVTestState *s;
+
+        c->layer[i] = bdrv_new_open_driver(&bdrv_test, names[i],
+                                           BDRV_O_RDWR | BDRV_O_UNMAP,
+                                           &error_abort);
+        s = c->layer[i]->opaque;
+        s->read_delay_ns = read_delay_ns;
+    }
+    bdrv_set_backing_hd(c->layer[1], c->layer[2], &error_abort);
+    bdrv_set_backing_hd(c->layer[0], c->layer[1], &error_abort);
+
+    /* The guest device, jobs need the chain to be attached somewhere */
+    c->blk = blk_new(BLK_PERM_CONSISTENT_READ, BLK_PERM_ALL);
+    blk_insert_bs(c->blk, c->layer[0], &error_abort);
+
+    /*
+     * base: data 'a' in 0-15
+     * mid:  data 'b' in 4-7, zeroes in 8-11, data 'c' in 40-63
+     * top:  data 'd' in 5
+     */
+    bdrv_test_mark(c->layer[2], 0, 16 * TEST_CLUSTER_SIZE, TEST_DATA, 'a');
+    bdrv_test_mark(c->layer[1], 4 * TEST_CLUSTER_SIZE, 4 * TEST_CLUSTER_SIZE,
+                   TEST_DATA, 'b');
+    bdrv_test_mark(c->layer[1], 8 * TEST_CLUSTER_SIZE, 4 * TEST_CLUSTER_SIZE,
+                   TEST_ZERO, 0);
+    bdrv_test_mark(c->layer[1], 40 * TEST_CLUSTER_SIZE,
+                   24 * TEST_CLUSTER_SIZE, TEST_DATA, 'c');
+    bdrv_test_mark(c->layer[0], 5 * TEST_CLUSTER_SIZE, TEST_CLUSTER_SIZE,
+                   TEST_DATA, 'd');
+}
+
+static void test_chain_cleanup(TestChain *c)
+{
+    int i;
+
+    blk_unref(c->blk);
+    for (i = 0; i < ARRAY_SIZE(c->layer); i++) {
+        bdrv_unref(c->layer[i]);
+    }
+}
+
+static void test_wait_job(const char *id)
+{
+    while (block_job_get(id)) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+}
+
+/* One character per cluster: the fill byte, '0' for zeroes, '-' if none */
+static char *test_layer_map(BlockDriverState *bs)
+{
+    BDRVTestState *s = bs->opaque;
+    char *str = g_malloc(TEST_CLUSTERS + 1);
+    int i;
+
+    for (i = 0; i < TEST_CLUSTERS; i++) {
+        switch (s->map[i]) {
+        case TEST_DATA:
+            str[i] = s->fill[i];
+            break;
+        case TEST_ZERO:
+            str[i] = '0';
+            break;
+        default:
+            str[i] = '-';
+        }
+    }
+    str[TEST_CLUSTERS] = 0;
+    return str;
+}
+
+static void test_commit(void)
+{
+    TestChain c;
+    BDRVTestState *base;
+    char *map;
+
+    test_chain_init(&c, 1 * SCALE_MS);
+    base = c.layer[2]->opaque;
+
+    commit_start("job0", c.layer[0], c.layer[2], c.layer[1], 0,
+                 4 * TEST_CLUSTER_SIZE, 4, BLOCKDEV_ON_ERROR_REPORT,
+                 NULL, NULL, &error_abort);
+    test_wait_job("job0");
+
+    map = test_layer_map(c.layer[2]);
+    g_assert_cmpstr(map, ==,
+                    "aaaabbbb0000aaaa------------------------"
+                    "cccccccccccccccccccccccc");
+    g_free(map);
+
+    /*
+     * Zeroes go down as a single request, data is read one cluster at a
+     * time (the buffer split between four operations) in parallel
+     */
+    g_assert_cmpint(base->zero_writes, ==, 1);
+    g_assert_cmpint(reads_max_in_flight, ==, 4);
+    g_assert(backing_bs(c.layer[0]) == c.layer[2]);
+
+    test_chain_cleanup(&c);
+}
+
+static void test_commit_serial(void)
+{
+    TestChain c;
+
+    test_chain_init(&c, 1 * SCALE_MS);
+
+    commit_start("job0", c.layer[0], c.layer[2], c.layer[1], 0,
+                 0, 1, BLOCKDEV_ON_ERROR_REPORT, NULL, NULL, &error_abort);
+    test_wait_job("job0");
+
+    g_assert_cmpint(reads_max_in_flight, ==, 1);
+
+    test_chain_cleanup(&c);
+}
+
+static void test_stream(void)
+{
+    TestChain c;
+    char *map;
+
+    test_chain_init(&c, 1 * SCALE_MS);
+
+    stream_start("job0", c.layer[0], NULL, NULL, 0, 0, 4,
+                 BLOCKDEV_ON_ERROR_REPORT, &error_abort);
+    test_wait_job("job0");
+
+    /* Copy-on-read writes the zero extent of mid as zeroes */
+    map = test_layer_map(c.layer[0]);
+    g_assert_cmpstr(map, ==,
+                    "aaaabdbb0000aaaa------------------------"
+                    "cccccccccccccccccccccccc");
+    g_free(map);
+
+    g_assert_cmpint(reads_max_in_flight, >, 1);
+    g_assert(backing_bs(c.layer[0]) == NULL);
+
+    test_chain_cleanup(&c);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/commit-stream/commit", test_commit);
+    g_test_add_func("/commit-stream/commit-serial", test_commit_serial);
+    g_test_add_func("/commit-stream/stream", test_stream);
+
+    return g_test_run();
+}
@@ -292,6 +292,118 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+/*
+ * Check the coroutine pool counters and sizing
+ */
+
+static void test_pool_stats(void)
+{
+    CoroutinePoolStats before, after;
+    Coroutine *coroutine;
+    bool done;
+    int i;
+
+    qemu_coroutine_get_pool_stats(&before);
+    for (i = 0; i < 10; i++) {
+        done = false;
+        coroutine = qemu_coroutine_create(set_and_exit, &done);
+        qemu_coroutine_enter(coroutine);
+        g_assert(done);
+    }
+    qemu_coroutine_get_pool_stats(&after);
+
+    g_assert_cmpint(after.hits + after.misses - before.hits - before.misses,
+                    ==, 10);
+    g_assert_cmpint(after.hits - before.hits, >=, 9);
+
+    qemu_coroutine_inc_pool_size(100);
+    qemu_coroutine_get_pool_stats(&after);
+    g_assert_cmpint(after.batch_size, ==, before.batch_size + 100);
+    qemu_coroutine_dec_pool_size(100);
+    qemu_coroutine_get_pool_stats(&after);
+    g_assert_cmpint(after.batch_size, ==, before.batch_size);
+
+    /* Many devices do not make every thread keep a stack for each request */
+    qemu_coroutine_inc_pool_size(100000);
+    qemu_coroutine_get_pool_stats(&after);
+    g_assert_cmpint(after.batch_size, <=, 512);
+    qemu_coroutine_dec_pool_size(100000);
+    qemu_coroutine_get_pool_stats(&after);
+    g_assert_cmpint(after.batch_size, ==, before.batch_size);
+}
+
+/*
+ * Check that a thread short of coroutines takes the spare ones of another
+ */
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static Coroutine **create_yielding(unsigned int n)
+{
+    Coroutine **co = g_new(Coroutine *, n);
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        co[i] = qemu_coroutine_create(yield_once, NULL);
+        qemu_coroutine_enter(co[i]);
+    }
+    return co;
+}
+
+static void terminate_all(Coroutine **co, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        qemu_coroutine_enter(co[i]);
+    }
+    g_free(co);
+}
+
+static QemuEvent steal_ready, steal_done;
+
+static void *steal_victim(void *opaque)
+{
+    unsigned int n = *(unsigned int *)opaque;
+
+    /* Fill the global pool, then our own pool and spare list */
+    terminate_all(create_yielding(n), n);
+
+    qemu_event_set(&steal_ready);
+    qemu_event_wait(&steal_done);
+    return NULL;
+}
+
+static void test_pool_steal(void)
+{
+    CoroutinePoolStats before, after;
+    QemuThread thread;
+    unsigned int n;
+    Coroutine **co;
+
+    qemu_coroutine_get_pool_stats(&before);
+    n = before.batch_size * 4;
+
+    qemu_event_init(&steal_ready, false);
+    qemu_event_init(&steal_done, false);
+    qemu_thread_create(&thread, "victim", steal_victim, &n,
+                       QEMU_THREAD_JOINABLE);
+    qemu_event_wait(&steal_ready);
+
+    co = create_yielding(n * 3 / 2);
+    qemu_coroutine_get_pool_stats(&after);
+    g_assert_cmpint(after.steals, >, before.steals);
+    terminate_all(co, n * 3 / 2);
+
+    qemu_event_set(&steal_done);
+    qemu_thread_join(&thread);
+    qemu_event_destroy(&steal_ready);
+    qemu_event_destroy(&steal_done);
+}
+
 
 #define RECORD_SIZE 10 /* Leave some room for expansion */
 struct coroutine_position {
@@ -492,6 +604,8 @@ int main(int argc, char **argv)
      */
     if (CONFIG_COROUTINE_POOL) {
         g_test_add_func("/basic/no-dangling-access", test_no_dangling_access);
+        g_test_add_func("/basic/pool-stats", test_pool_stats);
+        g_test_add_func("/basic/pool-steal", test_pool_steal);
     }
 
     g_test_add_func("/basic/lifecycle", test_lifecycle);
@@ -0,0 +1,132 @@
+/*
+ * Block request flight recorder tests
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/flight-recorder.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+
+#define TEST_ENTRIES 16
+
+/* Find the ring of @thread_id in @buf; returns its records */
+static FlightRecord *find_ring(GByteArray *buf, uint32_t thread_id,
+                               uint32_t *nr_records)
+{
+    FlightRecorderDumpHeader *hdr = (FlightRecorderDumpHeader *)buf->data;
+    size_t pos = sizeof(*hdr);
+    uint32_t i;
+
+    g_assert(!memcmp(hdr->magic, FLIGHT_RECORDER_MAGIC, sizeof(hdr->magic)));
+    g_assert_cmpint(hdr->version, ==, FLIGHT_RECORDER_VERSION);
+    g_assert_cmpint(hdr->record_size, ==, sizeof(FlightRecord));
+
+    for (i = 0; i < hdr->nr_names; i++) {
+        FlightRecorderDumpName *name = (void *)(buf->data + pos);
+        pos += sizeof(*name) + ROUND_UP(name->len, 8);
+    }
+
+    for (i = 0; i < hdr->nr_rings; i++) {
+        FlightRecorderDumpRing *ring = (void *)(buf->data + pos);
+
+        pos += sizeof(*ring);
+        if (ring->thread_id == thread_id) {
+            *nr_records = ring->nr_records;
+            return (FlightRecord *)(buf->data + pos);
+        }
+        pos += ring->nr_records * sizeof(FlightRecord);
+    }
+    g_assert_cmpint(pos, ==, buf->len);
+    return NULL;
+}
+
+static void *record_thread(void *opaque)
+{
+    uint32_t *thread_id = opaque;
+
+    *thread_id = qemu_get_thread_id();
+    flight_recorder_record(FLIGHT_RECORDER_BLK_SUBMIT, FLIGHT_RECORDER_FLUSH,
+                           2, 42, 0, 0, 0);
+    return NULL;
+}
+
+static void test_flight_recorder(void)
+{
+    FlightRecord *recs;
+    GByteArray *buf;
+    QemuThread thread;
+    uint64_t nr_records;
+    uint32_t n, other_id;
+    int64_t start;
+    int i;
+
+    /* Nothing is recorded while disabled */
+    g_assert_cmpint(flight_recorder_record(FLIGHT_RECORDER_XEN_CONSUME,
+                                           FLIGHT_RECORDER_READ,
+                                           1, 0, 0, 512, 0), ==, 0);
+    g_assert(flight_recorder_enable(TEST_ENTRIES - 1, NULL) < 0);
+
+    g_assert_cmpint(flight_recorder_enable(TEST_ENTRIES, &error_abort), ==, 0);
+    for (i = 0; i < TEST_ENTRIES + 4; i++) {
+        start = flight_recorder_record(FLIGHT_RECORDER_XEN_CONSUME,
+                                       FLIGHT_RECORDER_WRITE, 1, i,
+                                       i * 4096, 4096, -EIO);
+        g_assert_cmpint(start, >, 0);
+    }
+
+    qemu_thread_create(&thread, "record", record_thread, &other_id,
+                       QEMU_THREAD_JOINABLE);
+    qemu_thread_join(&thread);
+
+    /* The size of existing rings is fixed */
+    g_assert(flight_recorder_enable(TEST_ENTRIES * 2, NULL) < 0);
+    flight_recorder_disable();
+
+    buf = flight_recorder_dump(&nr_records);
+    g_assert_cmpint(nr_records, ==, TEST_ENTRIES);
+
+    /*
+     * Only the newest records are kept, oldest first.  The oldest slot of
+     * a full ring could be in the middle of an update, so it is skipped.
+     */
+    recs = find_ring(buf, qemu_get_thread_id(), &n);
+    g_assert(recs);
+    g_assert_cmpint(n, ==, TEST_ENTRIES - 1);
+    for (i = 0; i < n; i++) {
+        g_assert_cmpint(recs[i].id, ==, i + 5);
+        g_assert_cmpint(recs[i].offset, ==, (i + 5) * 4096);
+        g_assert_cmpint(recs[i].bytes, ==, 4096);
+        g_assert_cmpint(recs[i].event, ==, FLIGHT_RECORDER_XEN_CONSUME);
+        g_assert_cmpint(recs[i].op, ==, FLIGHT_RECORDER_WRITE);
+        g_assert_cmpint(recs[i].result, ==, -EIO);
+        if (i) {
+            g_assert_cmpint(recs[i].time_ns, >=, recs[i - 1].time_ns);
+        }
+    }
+
+    recs = find_ring(buf, other_id, &n);
+    g_assert(recs);
+    g_assert_cmpint(n, ==, 1);
+    g_assert_cmpint(recs[0].dev, ==, 2);
+    g_assert_cmpint(recs[0].id, ==, 42);
+    g_assert_cmpint(recs[0].op, ==, FLIGHT_RECORDER_FLUSH);
+
+    g_byte_array_free(buf, true);
+}
+
+int main(int argc, char **argv)
+{
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/flight-recorder/rings", test_flight_recorder);
+
+    return g_test_run();
+}
@@ -0,0 +1,228 @@
+/*
+ * Parallel flush of all block nodes
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qemu/timer.h"
+#include "iothread.h"
+
+#define TEST_NODES 8
+
+typedef struct BDRVTestState {
+    int64_t delay_ns;
+    int ret;
+    int flush_count;
+} BDRVTestState;
+
+static int flush_in_flight;
+static int flush_max_in_flight;
+
+static void bdrv_test_close(BlockDriverState *bs)
+{
+}
+
+static int coroutine_fn bdrv_test_co_flush(BlockDriverState *bs)
+{
+    BDRVTestState *s = bs->opaque;
+    int n = atomic_fetch_inc(&flush_in_flight) + 1;
+    int max = atomic_read(&flush_max_in_flight);
+
+    while (n > max) {
+        max = atomic_cmpxchg(&flush_max_in_flight, max, n);
+    }
+    qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, s->delay_ns);
+    atomic_inc(&s->flush_count);
+    atomic_dec(&flush_in_flight);
+
+    return s->ret;
+}
+
+static BlockDriver bdrv_test = {
+    .format_name            = "test",
+    .instance_size          = sizeof(BDRVTestState),
+
+    .bdrv_close             = bdrv_test_close,
+    .bdrv_co_flush          = bdrv_test_co_flush,
+
+    .bdrv_child_perm        = bdrv_format_default_perms,
+};
+
+typedef struct TestNodes {
+    BlockDriverState *bs[TEST_NODES];
+    BlockBackend *blk[TEST_NODES];
+} TestNodes;
+
+static void test_nodes_init(TestNodes *t, int64_t delay_ns)
+{
+    int i;
+
+    flush_in_flight = 0;
+    flush_max_in_flight = 0;
+
+    for (i = 0; i < TEST_NODES; i++) {
+        char *name = g_strdup_printf("node%d", i);
+        BDRVTestState *s;
+
+        t->bs[i] = bdrv_new_open_driver(&bdrv_test, name, BDRV_O_RDWR,
+                                        &error_abort);
+        s = t->bs[i]->opaque;
+        s->delay_ns = delay_ns;
+        t->blk[i] = blk_new(BLK_PERM_ALL, BLK_PERM_ALL);
+        blk_insert_bs(t->blk[i], t->bs[i], &error_abort);
+        g_free(name);
+    }
+}
+
+static void test_nodes_cleanup(TestNodes *t)
+{
+    int i;
+
+    for (i = 0; i < TEST_NODES; i++) {
+        blk_unref(t->blk[i]);
+        bdrv_unref(t->bs[i]);
+    }
+}
+
+static int test_flush_count(BlockDriverState *bs)
+{
+    BDRVTestState *s = bs->opaque;
+    return atomic_read(&s->flush_count);
+}
+
+static void test_parallel(void)
+{
+    TestNodes t;
+    GSList *failures = NULL;
+    int i, ret;
+
+    test_nodes_init(&t, 10 * SCALE_MS);
+
+    ret = bdrv_flush_all_parallel(0, 0, &failures);
+    g_assert_cmpint(ret, ==, 0);
+    g_assert(failures == NULL);
+    g_assert_cmpint(flush_max_in_flight, ==, TEST_NODES);
+    for (i = 0; i < TEST_NODES; i++) {
+        g_assert_cmpint(test_flush_count(t.bs[i]), ==, 1);
+    }
+
+    test_nodes_cleanup(&t);
+}
+
+static void test_limit(void)
+{
+    TestNodes t;
+    int i, ret;
+
+    test_nodes_init(&t, 1 * SCALE_MS);
+
+    ret = bdrv_flush_all_parallel(2, 0, NULL);
+    g_assert_cmpint(ret, ==, 0);
+    g_assert_cmpint(flush_max_in_flight, ==, 2);
+    for (i = 0; i < TEST_NODES; i++) {
+        g_assert_cmpint(test_flush_count(t.bs[i]), ==, 1);
+    }
+
+    test_nodes_cleanup(&t);
+}
+
+static void test_failure(void)
+{
+    TestNodes t;
+    GSList *failures = NULL;
+    BdrvFlushFailure *f;
+    BDRVTestState *s;
+    int ret;
+
+    test_nodes_init(&t, 0);
+    s = t.bs[3]->opaque;
+    s->ret = -EIO;
+
+    ret = bdrv_flush_all_parallel(0, 0, &failures);
+    g_assert_cmpint(ret, ==, -EIO);
+    g_assert_cmpint(g_slist_length(failures), ==, 1);
+    f = failures->data;
+    g_assert_cmpstr(f->node_name, ==, "node3");
+    g_assert_cmpint(f->ret, ==, -EIO);
+    g_slist_free_full(failures, bdrv_flush_failure_free);
+
+    test_nodes_cleanup(&t);
+}
+
+static void test_timeout(void)
+{
+    TestNodes t;
+    GSList *failures = NULL;
+    BdrvFlushFailure *f;
+    BDRVTestState *s;
+    int ret;
+
+    test_nodes_init(&t, 0);
+    s = t.bs[5]->opaque;
+    s->delay_ns = 500 * SCALE_MS;
+
+    ret = bdrv_flush_all_parallel(0, 20 * SCALE_MS, &failures);
+    g_assert_cmpint(ret, ==, -ETIMEDOUT);
+    g_assert_cmpint(g_slist_length(failures), ==, 1);
+    f = failures->data;
+    g_assert_cmpstr(f->node_name, ==, "node5");
+    g_assert_cmpint(f->ret, ==, -ETIMEDOUT);
+    g_slist_free_full(failures, bdrv_flush_failure_free);
+
+    /* The flush that timed out still completes */
+    g_assert_cmpint(test_flush_count(t.bs[5]), ==, 0);
+    bdrv_drain_all();
+    g_assert_cmpint(test_flush_count(t.bs[5]), ==, 1);
+
+    test_nodes_cleanup(&t);
+}
+
+static void test_iothread(void)
+{
+    IOThread *iothread = iothread_new();
+    AioContext *ctx = iothread_get_aio_context(iothread);
+    TestNodes t;
+    int i, ret;
+
+    test_nodes_init(&t, 5 * SCALE_MS);
+    for (i = 0; i < TEST_NODES; i += 2) {
+        blk_set_aio_context(t.blk[i], ctx);
+    }
+
+    ret = bdrv_flush_all_parallel(0, 0, NULL);
+    g_assert_cmpint(ret, ==, 0);
+    for (i = 0; i < TEST_NODES; i++) {
+        g_assert_cmpint(test_flush_count(t.bs[i]), ==, 1);
+    }
+
+    for (i = 0; i < TEST_NODES; i += 2) {
+        aio_context_acquire(ctx);
+        blk_set_aio_context(t.blk[i], qemu_get_aio_context());
+        aio_context_release(ctx);
+    }
+    test_nodes_cleanup(&t);
+    iothread_join(iothread);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/flush-all/parallel", test_parallel);
+    g_test_add_func("/flush-all/limit", test_limit);
+    g_test_add_func("/flush-all/failure", test_failure);
+    g_test_add_func("/flush-all/timeout", test_timeout);
+    g_test_add_func("/flush-all/iothread", test_iothread);
+
+    return g_test_run();
+}
@@ -13,6 +13,7 @@
 #include "qemu/hbitmap.h"
 #include "qemu/bitmap.h"
 #include "block/block.h"
+#include "qapi/error.h"
 
 #define LOG_BITS_PER_LONG          (BITS_PER_LONG == 32 ? 5 : 6)
 
@@ -27,6 +28,7 @@ typedef struct TestHBitmapData {
     size_t         size;
     size_t         old_size;
     int            granularity;
+    bool           sparse;
 } TestHBitmapData;
 
 
@@ -80,7 +82,8 @@ static void hbitmap_test_init(TestHBitmapData *data,
                               uint64_t size, int granularity)
 {
     size_t n;
-    data->hb = hbitmap_alloc(size, granularity);
+    data->hb = data->sparse ? hbitmap_alloc_sparse(size, granularity) :
+                              hbitmap_alloc(size, granularity);
 
     n = DIV_ROUND_UP(size, BITS_PER_LONG);
     if (n == 0) {
@@ -902,11 +905,24 @@ static void test_hbitmap_serialize_zeroes(TestHBitmapData *data,
     }
 }
 
+static void hbitmap_test_setup_sparse(TestHBitmapData *data,
+                                      const void *unused)
+{
+    data->sparse = true;
+}
+
+/* Every test runs once with a dense and once with a sparse bitmap */
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
+    char *sparse_path = g_strdup_printf("/hbitmap/sparse%s",
+                                        testpath + strlen("/hbitmap"));
+
     g_test_add(testpath, TestHBitmapData, NULL, NULL, test_func,
                hbitmap_test_teardown);
+    g_test_add(sparse_path, TestHBitmapData, NULL, hbitmap_test_setup_sparse,
+               test_func, hbitmap_test_teardown);
+    g_free(sparse_path);
 }
 
 static void test_hbitmap_iter_and_reset(TestHBitmapData *data,
@@ -980,6 +996,158 @@ static void test_hbitmap_next_zero_4(TestHBitmapData *data, const void *unused)
     test_hbitmap_next_zero_do(data, 4);
 }
 
+typedef enum {
+    TEST_COMBINE_MERGE,
+    TEST_COMBINE_INTERSECT,
+    TEST_COMBINE_SUBTRACT,
+} TestCombineOp;
+
+/* Combine data->hb with a second bitmap covering a few partially and fully
+ * overlapping ranges, and compare the result with the shadow bitmap.
+ */
+static void test_hbitmap_combine_do(TestHBitmapData *data, TestCombineOp op,
+                                    bool meta)
+{
+    TestHBitmapData other = { 0 };
+    size_t n, i;
+    bool ok;
+
+    if (meta) {
+        hbitmap_test_init_meta(data, L3 * 2, 0, 1);
+    } else {
+        hbitmap_test_init(data, L3 * 2, 0);
+    }
+    hbitmap_test_init(&other, L3 * 2, 0);
+
+    hbitmap_test_set(data, 0, L1 * 3);
+    hbitmap_test_set(data, L2 + 7, L1);
+    hbitmap_test_set(data, L3 - 1, L2 + 2);
+    hbitmap_test_set(data, L3 * 2 - 1, 1);
+
+    hbitmap_test_set(&other, L1, L1);
+    hbitmap_test_set(&other, L2, L2);
+    hbitmap_test_set(&other, L3, L1);
+    hbitmap_test_set(&other, L3 + L2 * 3, L1 * 5);
+    if (meta) {
+        hbitmap_reset_all(data->meta);
+    }
+
+    switch (op) {
+    case TEST_COMBINE_MERGE:
+        ok = hbitmap_merge(data->hb, other.hb);
+        break;
+    case TEST_COMBINE_INTERSECT:
+        ok = hbitmap_intersect(data->hb, other.hb);
+        break;
+    case TEST_COMBINE_SUBTRACT:
+        ok = hbitmap_subtract(data->hb, other.hb);
+        break;
+    default:
+        abort();
+    }
+    g_assert(ok);
+
+    n = hbitmap_test_array_size(data->size);
+    for (i = 0; i < n; i++) {
+        unsigned long old = data->bits[i];
+
+        switch (op) {
+        case TEST_COMBINE_MERGE:
+            data->bits[i] |= other.bits[i];
+            break;
+        case TEST_COMBINE_INTERSECT:
+            data->bits[i] &= other.bits[i];
+            break;
+        case TEST_COMBINE_SUBTRACT:
+            data->bits[i] &= ~other.bits[i];
+            break;
+        }
+        if (meta) {
+            g_assert_cmpint(hbitmap_get(data->meta, i * BITS_PER_LONG), ==,
+                            old != data->bits[i]);
+        }
+    }
+    hbitmap_test_check(data, 0);
+    hbitmap_test_check_get(data);
+
+    /* The second bitmap is left alone */
+    hbitmap_test_check(&other, 0);
+    hbitmap_test_teardown(&other, NULL);
+}
+
+static void test_hbitmap_combine_merge(TestHBitmapData *data,
+                                       const void *unused)
+{
+    test_hbitmap_combine_do(data, TEST_COMBINE_MERGE, false);
+}
+
+static void test_hbitmap_combine_intersect(TestHBitmapData *data,
+                                           const void *unused)
+{
+    test_hbitmap_combine_do(data, TEST_COMBINE_INTERSECT, false);
+}
+
+static void test_hbitmap_combine_subtract(TestHBitmapData *data,
+                                          const void *unused)
+{
+    test_hbitmap_combine_do(data, TEST_COMBINE_SUBTRACT, false);
+}
+
+static void test_hbitmap_combine_meta(TestHBitmapData *data,
+                                      const void *unused)
+{
+    test_hbitmap_combine_do(data, TEST_COMBINE_SUBTRACT, true);
+}
+
+static void test_hbitmap_combine_mismatch(TestHBitmapData *data,
+                                          const void *unused)
+{
+    HBitmap *other = hbitmap_alloc(L3, 1);
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, 0, L1);
+    g_assert(!hbitmap_merge(data->hb, other));
+    g_assert(!hbitmap_intersect(data->hb, other));
+    g_assert(!hbitmap_subtract(data->hb, other));
+    hbitmap_test_check(data, 0);
+    hbitmap_free(other);
+}
+
+static void test_hbitmap_convert(TestHBitmapData *data, const void *unused)
+{
+    uint64_t dense_size, sparse_size;
+    char *sha256, *converted;
+
+    hbitmap_test_init(data, L3 * 4, 0);
+    hbitmap_test_set(data, 5, L1 * 2);
+    hbitmap_test_set(data, L3 * 2 + 1, L2);
+    hbitmap_test_set(data, L3 * 4 - 1, 1);
+    sha256 = hbitmap_sha256(data->hb, &error_abort);
+
+    hbitmap_set_sparse(data->hb, !data->sparse);
+    g_assert(hbitmap_is_sparse(data->hb) == !data->sparse);
+    hbitmap_test_check(data, 0);
+    converted = hbitmap_sha256(data->hb, &error_abort);
+    g_assert_cmpstr(sha256, ==, converted);
+    g_free(converted);
+
+    hbitmap_set_sparse(data->hb, true);
+    sparse_size = hbitmap_memory_size(data->hb);
+    hbitmap_set_sparse(data->hb, false);
+    dense_size = hbitmap_memory_size(data->hb);
+    g_assert_cmpint(sparse_size * 8, <, dense_size);
+
+    hbitmap_set_sparse(data->hb, data->sparse);
+    hbitmap_test_check(data, 0);
+
+    /* Clearing everything gives all the chunks back */
+    hbitmap_test_reset(data, 0, L3 * 4);
+    if (data->sparse) {
+        g_assert_cmpint(hbitmap_memory_size(data->hb), <, sparse_size);
+    }
+    g_free(sha256);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1046,6 +1214,17 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_zero/next_zero_4",
                      test_hbitmap_next_zero_4);
 
+    hbitmap_test_add("/hbitmap/combine/merge", test_hbitmap_combine_merge);
+    hbitmap_test_add("/hbitmap/combine/intersect",
+                     test_hbitmap_combine_intersect);
+    hbitmap_test_add("/hbitmap/combine/subtract",
+                     test_hbitmap_combine_subtract);
+    hbitmap_test_add("/hbitmap/combine/meta", test_hbitmap_combine_meta);
+    hbitmap_test_add("/hbitmap/combine/mismatch",
+                     test_hbitmap_combine_mismatch);
+
+    hbitmap_test_add("/hbitmap/convert", test_hbitmap_convert);
+
     g_test_run();
 
     return 0;
@@ -0,0 +1,149 @@
+/*
+ * Latency-driven admission control tests
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/latency-qos.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+
+typedef struct QosRequest {
+    LatencyQosMember *m;
+    int64_t start_ns;
+    int64_t latency_ns;
+    bool admitted;
+} QosRequest;
+
+static void coroutine_fn qos_admit_entry(void *opaque)
+{
+    QosRequest *req = opaque;
+
+    req->start_ns = latency_qos_co_admit(req->m);
+    req->admitted = true;
+}
+
+static void coroutine_fn qos_complete_entry(void *opaque)
+{
+    QosRequest *req = opaque;
+
+    /* Pretend that the request took @latency_ns */
+    latency_qos_co_complete(req->m, req->start_ns - req->latency_ns);
+}
+
+static void qos_admit(QosRequest *req, LatencyQosMember *m)
+{
+    req->m = m;
+    req->admitted = false;
+    qemu_coroutine_enter(qemu_coroutine_create(qos_admit_entry, req));
+}
+
+static void qos_complete(QosRequest *req, int64_t latency_ns)
+{
+    g_assert(req->admitted);
+    req->latency_ns = latency_ns;
+    qemu_coroutine_enter(qemu_coroutine_create(qos_complete_entry, req));
+}
+
+static uint32_t qos_depth_limit(LatencyQosMember *m)
+{
+    LatencyQosStats stats;
+
+    latency_qos_get_stats(m, &stats);
+    return stats.depth_limit;
+}
+
+static void test_latency_qos(void)
+{
+    LatencyQosMember *hi, *lo, *other;
+    QosRequest hi_req, lo_reqs[9], other_reqs[8];
+    LatencyQosStats stats;
+    int i;
+
+    hi = latency_qos_register("sr", 1, 1 * SCALE_MS);
+    lo = latency_qos_register("sr", 0, 0);
+    other = latency_qos_register("other-sr", 0, 0);
+    g_assert_cmpstr(latency_qos_get_group(hi), ==, "sr");
+    g_assert_cmpint(latency_qos_get_priority(hi), ==, 1);
+    g_assert_cmpint(latency_qos_get_target(hi), ==, SCALE_MS);
+
+    for (i = 0; i < 8; i++) {
+        qos_admit(&lo_reqs[i], lo);
+        g_assert(lo_reqs[i].admitted);
+        qos_admit(&other_reqs[i], other);
+    }
+
+    /* Meeting the target does not affect anybody */
+    for (i = 0; i < 4; i++) {
+        qos_admit(&hi_req, hi);
+        qos_complete(&hi_req, 100 * SCALE_US);
+    }
+    latency_qos_update();
+    g_assert_cmpint(qos_depth_limit(lo), ==, 0);
+    latency_qos_get_stats(hi, &stats);
+    g_assert_cmpint(stats.mean_latency_ns, >=, 100 * SCALE_US);
+    g_assert_cmpint(stats.mean_latency_ns, <, SCALE_MS);
+
+    /* Missing it halves the depth of lower priorities in the same group */
+    for (i = 0; i < 4; i++) {
+        qos_admit(&hi_req, hi);
+        qos_complete(&hi_req, 10 * SCALE_MS);
+    }
+    latency_qos_update();
+    g_assert_cmpint(qos_depth_limit(hi), ==, 0);
+    g_assert_cmpint(qos_depth_limit(lo), ==, 4);
+    g_assert_cmpint(qos_depth_limit(other), ==, 0);
+
+    /* New requests wait until enough of the old ones completed */
+    qos_admit(&lo_reqs[8], lo);
+    g_assert(!lo_reqs[8].admitted);
+    for (i = 0; i < 4; i++) {
+        qos_complete(&lo_reqs[i], SCALE_MS);
+        g_assert(!lo_reqs[8].admitted);
+    }
+    qos_complete(&lo_reqs[4], SCALE_MS);
+    g_assert(lo_reqs[8].admitted);
+    latency_qos_get_stats(lo, &stats);
+    g_assert_cmpint(stats.in_flight, ==, 4);
+    g_assert_cmpint(stats.delayed, ==, 1);
+
+    /* Without misses the limit grows back until it is lifted */
+    latency_qos_update();
+    g_assert_cmpint(qos_depth_limit(lo), ==, 5);
+    for (i = 0; i < 100 && qos_depth_limit(lo); i++) {
+        latency_qos_update();
+    }
+    g_assert_cmpint(qos_depth_limit(lo), ==, 0);
+
+    for (i = 5; i < 9; i++) {
+        qos_complete(&lo_reqs[i], SCALE_MS);
+    }
+    for (i = 0; i < 8; i++) {
+        qos_complete(&other_reqs[i], SCALE_MS);
+    }
+
+    /* A member can move to another group */
+    latency_qos_configure(lo, "other-sr", 2, 0);
+    g_assert_cmpstr(latency_qos_get_group(lo), ==, "other-sr");
+    g_assert_cmpint(latency_qos_get_priority(lo), ==, 2);
+
+    latency_qos_unregister(hi);
+    latency_qos_unregister(lo);
+    latency_qos_unregister(other);
+}
+
+int main(int argc, char **argv)
+{
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/latency-qos/depth", test_latency_qos);
+
+    return g_test_run();
+}
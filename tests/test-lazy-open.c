@@ -0,0 +1,157 @@
+/*
+ * Lazy open of read-only qcow2 layers tests
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/main-loop.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "sysemu/block-backend.h"
+
+#define IMG_SIZE (64 * 1024 * 1024)
+#define BUF_SIZE 4096
+
+static char base_disk[] = "/tmp/lazy-open-base-XXXXXX";
+static char top_disk[] = "/tmp/lazy-open-top-XXXXXX";
+
+static void make_temp(char *template)
+{
+    int fd;
+
+    fd = mkstemp(template);
+    g_assert(fd >= 0);
+    close(fd);
+}
+
+static void prepare_imgs(void)
+{
+    BlockBackend *blk;
+    QDict *qdict;
+    char buf[BUF_SIZE];
+
+    make_temp(base_disk);
+    make_temp(top_disk);
+
+    bdrv_img_create(base_disk, "qcow2", NULL, NULL, NULL, IMG_SIZE,
+                    BDRV_O_RDWR, true, &error_abort);
+    bdrv_img_create(top_disk, "qcow2", base_disk, "qcow2", NULL, IMG_SIZE,
+                    BDRV_O_RDWR, true, &error_abort);
+
+    qdict = qdict_new();
+    qdict_put_str(qdict, "driver", "qcow2");
+    qdict_put_str(qdict, "file.filename", base_disk);
+    blk = blk_new_open(NULL, NULL, qdict, BDRV_O_RDWR, &error_abort);
+
+    memset(buf, 0xa5, sizeof(buf));
+    g_assert_cmpint(blk_pwrite(blk, IMG_SIZE / 2, buf, sizeof(buf), 0), ==,
+                    sizeof(buf));
+    blk_unref(blk);
+}
+
+static BlockBackend *open_top(bool lazy)
+{
+    QDict *qdict;
+
+    qdict = qdict_new();
+    qdict_put_str(qdict, "driver", "qcow2");
+    qdict_put_str(qdict, "file.filename", top_disk);
+    qdict_put_bool(qdict, BDRV_OPT_LAZY_OPEN, lazy);
+
+    return blk_new_open(NULL, NULL, qdict, BDRV_O_RDWR, &error_abort);
+}
+
+static BDRVQcow2State *backing_state(BlockBackend *blk)
+{
+    return backing_bs(blk_bs(blk))->opaque;
+}
+
+static void test_lazy_open_read(void)
+{
+    BlockBackend *blk;
+    BDRVQcow2State *top, *base;
+    char buf[BUF_SIZE], pattern[BUF_SIZE];
+
+    blk = open_top(true);
+    top = blk_bs(blk)->opaque;
+    base = backing_state(blk);
+
+    /* Only the read-only layer is opened lazily */
+    g_assert(!top->metadata_pending);
+    g_assert(top->l1_table);
+    g_assert(base->metadata_pending);
+    g_assert(!base->l1_table);
+    g_assert(!base->refcount_table);
+
+    /* The first read through the chain loads the backing file's tables */
+    memset(pattern, 0xa5, sizeof(pattern));
+    g_assert_cmpint(blk_pread(blk, IMG_SIZE / 2, buf, sizeof(buf)), ==,
+                    sizeof(buf));
+    g_assert(!memcmp(buf, pattern, sizeof(buf)));
+    g_assert(!base->metadata_pending);
+    g_assert(base->l1_table);
+    g_assert(base->refcount_table);
+
+    blk_unref(blk);
+}
+
+static void test_lazy_open_load(void)
+{
+    BlockBackend *blk;
+    BDRVQcow2State *base;
+
+    blk = open_top(true);
+    base = backing_state(blk);
+    g_assert(base->metadata_pending);
+
+    g_assert_cmpint(bdrv_load_metadata(blk_bs(blk), &error_abort), ==, 0);
+    g_assert(!base->metadata_pending);
+    g_assert(base->l1_table);
+    g_assert(base->refcount_table);
+
+    /* Loading again is a no-op */
+    g_assert_cmpint(bdrv_load_metadata(blk_bs(blk), &error_abort), ==, 0);
+
+    blk_unref(blk);
+}
+
+static void test_eager_open(void)
+{
+    BlockBackend *blk;
+    BDRVQcow2State *base;
+
+    blk = open_top(false);
+    base = backing_state(blk);
+    g_assert(!base->metadata_pending);
+    g_assert(base->l1_table);
+    blk_unref(blk);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    qemu_init_main_loop(&error_abort);
+    bdrv_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    prepare_imgs();
+
+    g_test_add_func("/lazy-open/read", test_lazy_open_read);
+    g_test_add_func("/lazy-open/load", test_lazy_open_load);
+    g_test_add_func("/lazy-open/eager", test_eager_open);
+
+    ret = g_test_run();
+
+    unlink(base_disk);
+    unlink(top_disk);
+
+    return ret;
+}
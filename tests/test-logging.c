@@ -108,6 +108,78 @@ static void test_parse_path(gconstpointer data)
     error_free_or_abort(&err);
 }
 
+static GPtrArray *redirected;
+
+static void capture_output(const char *msg)
+{
+    g_ptr_array_add(redirected, g_strdup(msg));
+}
+
+static void test_redirect(void)
+{
+    int i;
+
+    redirected = g_ptr_array_new_with_free_func(g_free);
+    logging_set_output(capture_output);
+    logging_set_redirect(1);
+
+    /* Lines are assembled from several calls */
+    fprintf(stderr, "%s: ", "prefix");
+    fprintf(stderr, "message %d\n", 1);
+
+    /* Repeats are folded */
+    for (i = 0; i < 50; i++) {
+        fprintf(stderr, "repeated\n");
+    }
+
+    /* A call site gets a limited number of lines */
+    for (i = 0; i < 50; i++) {
+        fprintf(stderr, "flood %d\n", i);
+    }
+
+    logging_flush();
+    logging_set_redirect(0);
+    logging_set_output(NULL);
+
+    g_assert_cmpint(redirected->len, ==, 14);
+    g_assert_cmpstr(redirected->pdata[0], ==, "prefix: message 1");
+    g_assert_cmpstr(redirected->pdata[1], ==, "repeated");
+    g_assert_cmpstr(redirected->pdata[2], ==,
+                    "last message repeated 49 times");
+    for (i = 0; i < 10; i++) {
+        char *expected = g_strdup_printf("flood %d", i);
+        g_assert_cmpstr(redirected->pdata[3 + i], ==, expected);
+        g_free(expected);
+    }
+    g_assert_cmpstr(redirected->pdata[13], ==,
+                    "suppressed 40 messages like: flood 10");
+    g_ptr_array_free(redirected, true);
+}
+
+/* A partial line is flushed even when a burst has filled the queue */
+static void test_redirect_flush_partial(void)
+{
+    int i;
+
+    redirected = g_ptr_array_new_with_free_func(g_free);
+    logging_set_output(capture_output);
+    logging_set_redirect(1);
+
+    for (i = 0; i < 1000; i++) {
+        fprintf(stderr, "burst %d\n", i);
+    }
+    fprintf(stderr, "%s: assertion failed", "test");
+
+    logging_flush();
+    logging_set_redirect(0);
+    logging_set_output(NULL);
+
+    g_assert_cmpint(redirected->len, >, 0);
+    g_assert_cmpstr(redirected->pdata[redirected->len - 1], ==,
+                    "test: assertion failed");
+    g_ptr_array_free(redirected, true);
+}
+
 /* Remove a directory and all its entries (non-recursive). */
 static void rmdir_full(gchar const *root)
 {
@@ -134,6 +206,9 @@ int main(int argc, char **argv)
 
     g_test_add_func("/logging/parse_range", test_parse_range);
     g_test_add_data_func("/logging/parse_path", tmp_path, test_parse_path);
+    g_test_add_func("/logging/redirect", test_redirect);
+    g_test_add_func("/logging/redirect_flush_partial",
+                    test_redirect_flush_partial);
 
     rc = g_test_run();
 
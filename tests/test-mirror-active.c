@@ -0,0 +1,227 @@
+/*
+ * Write-blocking mirror copy mode
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "block/dirty-bitmap.h"
+#include "block/blockjob.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+
+#define TEST_CLUSTER_SIZE   65536
+#define TEST_CLUSTERS       16
+#define TEST_SIZE           (TEST_CLUSTER_SIZE * TEST_CLUSTERS)
+
+typedef struct BDRVTestState {
+    uint8_t data[TEST_SIZE];
+} BDRVTestState;
+
+static void bdrv_test_close(BlockDriverState *bs)
+{
+}
+
+static int64_t bdrv_test_getlength(BlockDriverState *bs)
+{
+    return TEST_SIZE;
+}
+
+static int bdrv_test_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    bdi->cluster_size = TEST_CLUSTER_SIZE;
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_preadv(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    BDRVTestState *s = bs->opaque;
+
+    qemu_iovec_from_buf(qiov, 0, s->data + offset, bytes);
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    BDRVTestState *s = bs->opaque;
+
+    qemu_iovec_to_buf(qiov, 0, s->data + offset, bytes);
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_pwrite_zeroes(BlockDriverState *bs,
+                                                   int64_t offset, int bytes,
+                                                   BdrvRequestFlags flags)
+{
+    BDRVTestState *s = bs->opaque;
+
+    memset(s->data + offset, 0, bytes);
+    return 0;
+}
+
+static BlockDriver bdrv_test = {
+    .format_name            = "test",
+    .instance_size          = sizeof(BDRVTestState),
+
+    .bdrv_close             = bdrv_test_close,
+    .bdrv_getlength         = bdrv_test_getlength,
+    .bdrv_get_info          = bdrv_test_get_info,
+    .bdrv_co_preadv         = bdrv_test_co_preadv,
+    .bdrv_co_pwritev        = bdrv_test_co_pwritev,
+    .bdrv_co_pwrite_zeroes  = bdrv_test_co_pwrite_zeroes,
+
+    .bdrv_child_perm        = bdrv_format_default_perms,
+};
+
+typedef struct TestMirror {
+    BlockDriverState *source;
+    BlockDriverState *target;
+    BlockBackend *blk;
+    BlockJob *job;
+} TestMirror;
+
+static void test_mirror_start(TestMirror *t, MirrorCopyMode copy_mode)
+{
+    t->source = bdrv_new_open_driver(&bdrv_test, "source", BDRV_O_RDWR,
+                                     &error_abort);
+    t->target = bdrv_new_open_driver(&bdrv_test, "target", BDRV_O_RDWR,
+                                     &error_abort);
+
+    /* The guest device */
+    t->blk = blk_new(BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE, BLK_PERM_ALL);
+    blk_insert_bs(t->blk, t->source, &error_abort);
+
+    mirror_start("job0", t->source, t->target, NULL, 0, 0, 0,
+                 MIRROR_SYNC_MODE_NONE, MIRROR_LEAVE_BACKING_CHAIN,
+                 BLOCKDEV_ON_ERROR_REPORT, BLOCKDEV_ON_ERROR_REPORT,
+                 true, NULL, copy_mode, NULL, 0, false, &error_abort);
+    t->job = block_job_get("job0");
+    g_assert(t->job);
+
+    while (t->job->status != BLOCK_JOB_STATUS_READY) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+}
+
+static void test_mirror_finish(TestMirror *t)
+{
+    BDRVTestState *source = t->source->opaque;
+    BDRVTestState *target = t->target->opaque;
+    int ret;
+
+    /* Cancelling a ready mirror still leaves an identical copy behind */
+    ret = block_job_cancel_sync(t->job);
+    g_assert_cmpint(ret, ==, 0);
+    g_assert(memcmp(source->data, target->data, TEST_SIZE) == 0);
+
+    blk_unref(t->blk);
+    bdrv_unref(t->source);
+    bdrv_unref(t->target);
+}
+
+static int64_t test_dirty_count(TestMirror *t)
+{
+    BlockDirtyInfoList *list = bdrv_query_dirty_bitmaps(t->source);
+    int64_t count;
+
+    g_assert(list && !list->next);
+    count = list->value->count;
+    qapi_free_BlockDirtyInfoList(list);
+    return count;
+}
+
+static void test_write(TestMirror *t, int64_t offset, int bytes, int fill)
+{
+    void *buf = g_malloc(bytes);
+    int ret;
+
+    memset(buf, fill, bytes);
+    ret = blk_pwrite(t->blk, offset, buf, bytes, 0);
+    g_assert_cmpint(ret, >=, 0);
+    g_free(buf);
+}
+
+static bool test_target_is(TestMirror *t, int64_t offset, int bytes, int fill)
+{
+    BDRVTestState *s = t->target->opaque;
+    int i;
+
+    for (i = 0; i < bytes; i++) {
+        if (s->data[offset + i] != fill) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_write_blocking(void)
+{
+    TestMirror t;
+    int ret;
+
+    test_mirror_start(&t, MIRROR_COPY_MODE_WRITE_BLOCKING);
+
+    /* Whole chunks reach the target before the write completes */
+    test_write(&t, 2 * TEST_CLUSTER_SIZE, 2 * TEST_CLUSTER_SIZE, 'a');
+    g_assert(test_target_is(&t, 2 * TEST_CLUSTER_SIZE,
+                            2 * TEST_CLUSTER_SIZE, 'a'));
+    g_assert_cmpint(test_dirty_count(&t), ==, 0);
+
+    /* A partial chunk is copied too, but stays dirty */
+    test_write(&t, 5 * TEST_CLUSTER_SIZE + 4096, 4096, 'b');
+    g_assert(test_target_is(&t, 5 * TEST_CLUSTER_SIZE + 4096, 4096, 'b'));
+    g_assert_cmpint(test_dirty_count(&t), ==, TEST_CLUSTER_SIZE);
+
+    ret = blk_pwrite_zeroes(t.blk, 2 * TEST_CLUSTER_SIZE, TEST_CLUSTER_SIZE,
+                            0);
+    g_assert_cmpint(ret, >=, 0);
+    g_assert(test_target_is(&t, 2 * TEST_CLUSTER_SIZE, TEST_CLUSTER_SIZE, 0));
+    g_assert_cmpint(test_dirty_count(&t), ==, TEST_CLUSTER_SIZE);
+
+    test_mirror_finish(&t);
+}
+
+static void test_switch(void)
+{
+    TestMirror t;
+
+    test_mirror_start(&t, MIRROR_COPY_MODE_BACKGROUND);
+
+    /* The job is idle for a while after becoming ready */
+    test_write(&t, 3 * TEST_CLUSTER_SIZE, TEST_CLUSTER_SIZE, 'c');
+    g_assert_cmpint(test_dirty_count(&t), ==, TEST_CLUSTER_SIZE);
+
+    block_job_set_copy_mode(t.job, MIRROR_COPY_MODE_WRITE_BLOCKING,
+                            &error_abort);
+    test_write(&t, 4 * TEST_CLUSTER_SIZE, TEST_CLUSTER_SIZE, 'd');
+    g_assert(test_target_is(&t, 4 * TEST_CLUSTER_SIZE, TEST_CLUSTER_SIZE,
+                            'd'));
+    g_assert_cmpint(test_dirty_count(&t), <=, TEST_CLUSTER_SIZE);
+
+    block_job_set_copy_mode(t.job, MIRROR_COPY_MODE_BACKGROUND, &error_abort);
+    test_write(&t, 6 * TEST_CLUSTER_SIZE, TEST_CLUSTER_SIZE, 'e');
+    g_assert_cmpint(test_dirty_count(&t), >=, TEST_CLUSTER_SIZE);
+
+    test_mirror_finish(&t);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/mirror-active/write-blocking", test_write_blocking);
+    g_test_add_func("/mirror-active/switch", test_switch);
+
+    return g_test_run();
+}
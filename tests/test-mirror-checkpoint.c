@@ -0,0 +1,285 @@
+/*
+ * Mirror jobs that resume from a checkpoint bitmap
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "block/dirty-bitmap.h"
+#include "block/blockjob.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+
+#define TEST_CLUSTER_SIZE   65536
+#define TEST_CLUSTERS       16
+#define TEST_SIZE           (TEST_CLUSTER_SIZE * TEST_CLUSTERS)
+
+typedef struct BDRVTestState {
+    uint8_t data[TEST_SIZE];
+    bool broken;
+} BDRVTestState;
+
+static void bdrv_test_close(BlockDriverState *bs)
+{
+}
+
+static int64_t bdrv_test_getlength(BlockDriverState *bs)
+{
+    return TEST_SIZE;
+}
+
+static int bdrv_test_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    bdi->cluster_size = TEST_CLUSTER_SIZE;
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_preadv(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    BDRVTestState *s = bs->opaque;
+
+    qemu_iovec_from_buf(qiov, 0, s->data + offset, bytes);
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    BDRVTestState *s = bs->opaque;
+
+    if (s->broken) {
+        return -EIO;
+    }
+    qemu_iovec_to_buf(qiov, 0, s->data + offset, bytes);
+    return 0;
+}
+
+static BlockDriver bdrv_test = {
+    .format_name            = "test",
+    .instance_size          = sizeof(BDRVTestState),
+
+    .bdrv_close             = bdrv_test_close,
+    .bdrv_getlength         = bdrv_test_getlength,
+    .bdrv_get_info          = bdrv_test_get_info,
+    .bdrv_co_preadv         = bdrv_test_co_preadv,
+    .bdrv_co_pwritev        = bdrv_test_co_pwritev,
+
+    .bdrv_child_perm        = bdrv_format_default_perms,
+};
+
+typedef struct TestMirror {
+    BlockDriverState *source;
+    BlockDriverState *target;
+    BlockBackend *blk;
+    BlockJob *job;
+} TestMirror;
+
+static void test_mirror_start(TestMirror *t, bool resume)
+{
+    mirror_start("job0", t->source, t->target, NULL, 0, 0, 0,
+                 MIRROR_SYNC_MODE_FULL, MIRROR_LEAVE_BACKING_CHAIN,
+                 BLOCKDEV_ON_ERROR_REPORT, BLOCKDEV_ON_ERROR_REPORT,
+                 true, NULL, MIRROR_COPY_MODE_BACKGROUND, "ckpt", 3600,
+                 resume, &error_abort);
+    t->job = block_job_get("job0");
+    g_assert(t->job);
+
+    while (t->job->status != BLOCK_JOB_STATUS_READY) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+}
+
+/* Lose the connection to the target and wait for the job to fail */
+static void test_mirror_break(TestMirror *t)
+{
+    BDRVTestState *target = t->target->opaque;
+
+    target->broken = true;
+    while (block_job_get("job0")) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    t->job = NULL;
+    target->broken = false;
+}
+
+static void test_write(TestMirror *t, int64_t offset, int bytes, int fill)
+{
+    void *buf = g_malloc(bytes);
+    int ret;
+
+    memset(buf, fill, bytes);
+    ret = blk_pwrite(t->blk, offset, buf, bytes, 0);
+    g_assert_cmpint(ret, >=, 0);
+    g_free(buf);
+}
+
+static bool test_target_is(TestMirror *t, int64_t offset, int bytes, int fill)
+{
+    BDRVTestState *s = t->target->opaque;
+    int i;
+
+    for (i = 0; i < bytes; i++) {
+        if (s->data[offset + i] != fill) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_resume(void)
+{
+    BDRVTestState *source, *target;
+    BdrvDirtyBitmap *bitmap;
+    TestMirror t;
+    int ret;
+
+    t.source = bdrv_new_open_driver(&bdrv_test, "source", BDRV_O_RDWR,
+                                    &error_abort);
+    t.target = bdrv_new_open_driver(&bdrv_test, "target", BDRV_O_RDWR,
+                                    &error_abort);
+    source = t.source->opaque;
+    target = t.target->opaque;
+    memset(source->data, 'a', TEST_SIZE);
+
+    /* The guest device */
+    t.blk = blk_new(BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE, BLK_PERM_ALL);
+    blk_insert_bs(t.blk, t.source, &error_abort);
+
+    /* A new checkpoint covers the whole disk until the job has scanned it */
+    test_mirror_start(&t, true);
+    bitmap = bdrv_find_dirty_bitmap(t.source, "ckpt");
+    g_assert_nonnull(bitmap);
+    g_assert(bdrv_dirty_bitmap_qmp_locked(bitmap));
+    g_assert(test_target_is(&t, 0, TEST_SIZE, 'a'));
+
+    /* Writes that the job could not copy survive in the checkpoint */
+    test_write(&t, 3 * TEST_CLUSTER_SIZE, TEST_CLUSTER_SIZE, 'b');
+    test_mirror_break(&t);
+    g_assert(!bdrv_dirty_bitmap_qmp_locked(bitmap));
+    g_assert_cmpint(bdrv_get_dirty_count(bitmap), ==, TEST_CLUSTER_SIZE);
+
+    /* ...and so do writes while no job is running */
+    test_write(&t, 7 * TEST_CLUSTER_SIZE + 512, 512, 'c');
+    g_assert_cmpint(bdrv_get_dirty_count(bitmap), ==, 2 * TEST_CLUSTER_SIZE);
+
+    /* Clean areas are not copied again on resume */
+    memset(target->data + 10 * TEST_CLUSTER_SIZE, 'z', TEST_CLUSTER_SIZE);
+    test_mirror_start(&t, true);
+    g_assert(test_target_is(&t, 3 * TEST_CLUSTER_SIZE, TEST_CLUSTER_SIZE,
+                            'b'));
+    g_assert(test_target_is(&t, 7 * TEST_CLUSTER_SIZE + 512, 512, 'c'));
+    g_assert(test_target_is(&t, 10 * TEST_CLUSTER_SIZE, TEST_CLUSTER_SIZE,
+                            'z'));
+
+    /* Nothing is left to copy once the job has caught up */
+    ret = block_job_cancel_sync(t.job);
+    g_assert_cmpint(ret, ==, 0);
+    g_assert_cmpint(bdrv_get_dirty_count(bitmap), ==, 0);
+
+    blk_unref(t.blk);
+    bdrv_unref(t.source);
+    bdrv_unref(t.target);
+}
+
+/* A new target holds none of what an existing checkpoint calls clean */
+static void test_new_target(void)
+{
+    BDRVTestState *source, *target;
+    BdrvDirtyBitmap *bitmap;
+    TestMirror t;
+    int ret;
+
+    t.source = bdrv_new_open_driver(&bdrv_test, "source", BDRV_O_RDWR,
+                                    &error_abort);
+    t.target = bdrv_new_open_driver(&bdrv_test, "target", BDRV_O_RDWR,
+                                    &error_abort);
+    source = t.source->opaque;
+    target = t.target->opaque;
+    memset(source->data, 'a', TEST_SIZE);
+    memset(target->data, 'z', TEST_SIZE);
+
+    t.blk = blk_new(BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE, BLK_PERM_ALL);
+    blk_insert_bs(t.blk, t.source, &error_abort);
+
+    /* A checkpoint left over from a job that copied everything */
+    bitmap = bdrv_create_dirty_bitmap(t.source, TEST_CLUSTER_SIZE, "ckpt",
+                                      &error_abort);
+    test_write(&t, 5 * TEST_CLUSTER_SIZE, TEST_CLUSTER_SIZE, 'b');
+    g_assert_cmpint(bdrv_get_dirty_count(bitmap), ==, TEST_CLUSTER_SIZE);
+
+    test_mirror_start(&t, false);
+    g_assert(bdrv_find_dirty_bitmap(t.source, "ckpt") == bitmap);
+    g_assert(test_target_is(&t, 0, 5 * TEST_CLUSTER_SIZE, 'a'));
+    g_assert(test_target_is(&t, 5 * TEST_CLUSTER_SIZE, TEST_CLUSTER_SIZE,
+                            'b'));
+    g_assert(test_target_is(&t, 6 * TEST_CLUSTER_SIZE,
+                            TEST_SIZE - 6 * TEST_CLUSTER_SIZE, 'a'));
+
+    ret = block_job_cancel_sync(t.job);
+    g_assert_cmpint(ret, ==, 0);
+    g_assert_cmpint(bdrv_get_dirty_count(bitmap), ==, 0);
+
+    blk_unref(t.blk);
+    bdrv_unref(t.source);
+    bdrv_unref(t.target);
+}
+
+static void test_invalid(void)
+{
+    BlockDriverState *source, *target;
+    BdrvDirtyBitmap *bitmap;
+    Error *local_err = NULL;
+
+    source = bdrv_new_open_driver(&bdrv_test, "source", BDRV_O_RDWR,
+                                  &error_abort);
+    target = bdrv_new_open_driver(&bdrv_test, "target", BDRV_O_RDWR,
+                                  &error_abort);
+
+    /* A disabled bitmap may have missed writes */
+    bitmap = bdrv_create_dirty_bitmap(source, TEST_CLUSTER_SIZE, "ckpt",
+                                      &error_abort);
+    bdrv_disable_dirty_bitmap(bitmap);
+    mirror_start("job0", source, target, NULL, 0, 0, 0,
+                 MIRROR_SYNC_MODE_FULL, MIRROR_LEAVE_BACKING_CHAIN,
+                 BLOCKDEV_ON_ERROR_REPORT, BLOCKDEV_ON_ERROR_REPORT,
+                 true, NULL, MIRROR_COPY_MODE_BACKGROUND, "ckpt", 10,
+                 true, &local_err);
+    g_assert_nonnull(local_err);
+    error_free(local_err);
+    local_err = NULL;
+    g_assert_null(block_job_get("job0"));
+
+    /* sync=none has nothing to resume */
+    mirror_start("job0", source, target, NULL, 0, 0, 0,
+                 MIRROR_SYNC_MODE_NONE, MIRROR_LEAVE_BACKING_CHAIN,
+                 BLOCKDEV_ON_ERROR_REPORT, BLOCKDEV_ON_ERROR_REPORT,
+                 true, NULL, MIRROR_COPY_MODE_BACKGROUND, "new", 10,
+                 false, &local_err);
+    g_assert_nonnull(local_err);
+    error_free(local_err);
+    g_assert_null(bdrv_find_dirty_bitmap(source, "new"));
+
+    bdrv_unref(source);
+    bdrv_unref(target);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/mirror-checkpoint/resume", test_resume);
+    g_test_add_func("/mirror-checkpoint/new-target", test_new_target);
+    g_test_add_func("/mirror-checkpoint/invalid", test_invalid);
+
+    return g_test_run();
+}
@@ -0,0 +1,423 @@
+/*
+ * NBD export of a dirty bitmap as a metadata context
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/main-loop.h"
+#include "block/block_int.h"
+#include "block/dirty-bitmap.h"
+#include "block/nbd.h"
+#include "io/channel-socket.h"
+#include "sysemu/block-backend.h"
+#include "nbd/nbd-internal.h"
+
+#define MIB             (1024 * 1024)
+#define GRANULE         (64 * 1024)
+#define IMG_SIZE        (8 * 1024 * 1024 * 1024LL)
+#define EXPORT_NAME     "export"
+#define BITMAP_CONTEXT  "qemu:dirty-bitmap:bitmap0"
+
+typedef struct NBDBitmapTest {
+    BlockBackend *blk;
+    NBDExport *exp;
+    int fd;
+    uint64_t handle;
+    uint32_t base_id;
+    uint32_t bitmap_id;
+} NBDBitmapTest;
+
+typedef struct StatusChunk {
+    uint16_t flags;
+    uint32_t context_id;
+    unsigned int nb_extents;
+    NBDExtent extents[16];
+} StatusChunk;
+
+/*
+ * The server runs in coroutines of the main loop, so the client side runs
+ * the main loop whenever it is waiting for data.
+ */
+static void client_read(NBDBitmapTest *t, void *buf, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = recv(t->fd, (char *)buf + done, len - done, MSG_DONTWAIT);
+
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            main_loop_wait(false);
+            continue;
+        }
+        g_assert_cmpint(n, >, 0);
+        done += n;
+    }
+}
+
+static void client_write(NBDBitmapTest *t, const void *buf, size_t len)
+{
+    g_assert_cmpint(write(t->fd, buf, len), ==, len);
+}
+
+static uint16_t client_read16(NBDBitmapTest *t)
+{
+    uint16_t val;
+
+    client_read(t, &val, sizeof(val));
+    return be16_to_cpu(val);
+}
+
+static uint32_t client_read32(NBDBitmapTest *t)
+{
+    uint32_t val;
+
+    client_read(t, &val, sizeof(val));
+    return be32_to_cpu(val);
+}
+
+static uint64_t client_read64(NBDBitmapTest *t)
+{
+    uint64_t val;
+
+    client_read(t, &val, sizeof(val));
+    return be64_to_cpu(val);
+}
+
+static void client_skip(NBDBitmapTest *t, uint32_t len)
+{
+    char *buf = g_malloc(len);
+
+    client_read(t, buf, len);
+    g_free(buf);
+}
+
+static void client_send_option(NBDBitmapTest *t, uint32_t opt,
+                               const void *data, uint32_t len)
+{
+    struct {
+        uint64_t magic;
+        uint32_t opt;
+        uint32_t len;
+    } QEMU_PACKED hdr = {
+        .magic = cpu_to_be64(NBD_OPTS_MAGIC),
+        .opt = cpu_to_be32(opt),
+        .len = cpu_to_be32(len),
+    };
+
+    client_write(t, &hdr, sizeof(hdr));
+    if (len) {
+        client_write(t, data, len);
+    }
+}
+
+/* Reads the header of an option reply and returns its type */
+static uint32_t client_read_option_reply(NBDBitmapTest *t, uint32_t opt,
+                                         uint32_t *len)
+{
+    uint32_t type;
+
+    g_assert_cmphex(client_read64(t), ==, NBD_REP_MAGIC);
+    g_assert_cmpint(client_read32(t), ==, opt);
+    type = client_read32(t);
+    *len = client_read32(t);
+    return type;
+}
+
+static void client_append32(GByteArray *buf, uint32_t val)
+{
+    val = cpu_to_be32(val);
+    g_byte_array_append(buf, (guint8 *)&val, sizeof(val));
+}
+
+static void client_append_str(GByteArray *buf, const char *str)
+{
+    client_append32(buf, strlen(str));
+    g_byte_array_append(buf, (const guint8 *)str, strlen(str));
+}
+
+/* Negotiates the contexts that are not NULL */
+static void client_negotiate(NBDBitmapTest *t, const char *base_context,
+                             const char *bitmap_context)
+{
+    GByteArray *buf = g_byte_array_new();
+    uint32_t flags = cpu_to_be32(NBD_FLAG_C_FIXED_NEWSTYLE |
+                                 NBD_FLAG_C_NO_ZEROES);
+    uint32_t type, len, id;
+    char name[64];
+    uint16_t zero = 0;
+    char magic[8];
+
+    client_read(t, magic, sizeof(magic));
+    g_assert(!memcmp(magic, "NBDMAGIC", sizeof(magic)));
+    g_assert_cmphex(client_read64(t), ==, NBD_OPTS_MAGIC);
+    client_read16(t);
+    client_write(t, &flags, sizeof(flags));
+
+    client_send_option(t, NBD_OPT_STRUCTURED_REPLY, NULL, 0);
+    g_assert_cmpint(client_read_option_reply(t, NBD_OPT_STRUCTURED_REPLY,
+                                             &len), ==, NBD_REP_ACK);
+    g_assert_cmpint(len, ==, 0);
+
+    client_append_str(buf, EXPORT_NAME);
+    client_append32(buf, !!base_context + !!bitmap_context);
+    if (base_context) {
+        client_append_str(buf, base_context);
+    }
+    if (bitmap_context) {
+        client_append_str(buf, bitmap_context);
+    }
+    client_send_option(t, NBD_OPT_SET_META_CONTEXT, buf->data, buf->len);
+
+    t->base_id = t->bitmap_id = UINT32_MAX;
+    while ((type = client_read_option_reply(t, NBD_OPT_SET_META_CONTEXT,
+                                            &len)) == NBD_REP_META_CONTEXT) {
+        g_assert_cmpint(len, >, 4);
+        g_assert_cmpint(len - 4, <, sizeof(name));
+        id = client_read32(t);
+        client_read(t, name, len - 4);
+        name[len - 4] = '\0';
+        if (!strcmp(name, "base:allocation")) {
+            t->base_id = id;
+        } else {
+            g_assert_cmpstr(name, ==, BITMAP_CONTEXT);
+            t->bitmap_id = id;
+        }
+    }
+    g_assert_cmpint(type, ==, NBD_REP_ACK);
+    g_assert_cmpint(len, ==, 0);
+    g_assert(!base_context == (t->base_id == UINT32_MAX));
+    g_assert(!bitmap_context == (t->bitmap_id == UINT32_MAX));
+
+    g_byte_array_set_size(buf, 0);
+    client_append_str(buf, EXPORT_NAME);
+    g_byte_array_append(buf, (guint8 *)&zero, sizeof(zero));
+    client_send_option(t, NBD_OPT_GO, buf->data, buf->len);
+    while ((type = client_read_option_reply(t, NBD_OPT_GO,
+                                            &len)) == NBD_REP_INFO) {
+        client_skip(t, len);
+    }
+    g_assert_cmpint(type, ==, NBD_REP_ACK);
+
+    g_byte_array_free(buf, true);
+}
+
+static void client_send_request(NBDBitmapTest *t, uint16_t type,
+                                uint16_t flags, uint64_t offset, uint32_t len)
+{
+    struct {
+        uint32_t magic;
+        uint16_t flags;
+        uint16_t type;
+        uint64_t handle;
+        uint64_t offset;
+        uint32_t len;
+    } QEMU_PACKED req = {
+        .magic = cpu_to_be32(NBD_REQUEST_MAGIC),
+        .flags = cpu_to_be16(flags),
+        .type = cpu_to_be16(type),
+        .handle = cpu_to_be64(++t->handle),
+        .offset = cpu_to_be64(offset),
+        .len = cpu_to_be32(len),
+    };
+
+    client_write(t, &req, sizeof(req));
+}
+
+static void client_read_status_chunk(NBDBitmapTest *t, StatusChunk *chunk)
+{
+    uint32_t len;
+    unsigned int i;
+
+    g_assert_cmphex(client_read32(t), ==, NBD_STRUCTURED_REPLY_MAGIC);
+    chunk->flags = client_read16(t);
+    g_assert_cmpint(client_read16(t), ==, NBD_REPLY_TYPE_BLOCK_STATUS);
+    g_assert_cmpint(client_read64(t), ==, t->handle);
+    len = client_read32(t);
+    g_assert_cmpint(len % sizeof(NBDExtent), ==, 4);
+    chunk->nb_extents = (len - 4) / sizeof(NBDExtent);
+    g_assert_cmpint(chunk->nb_extents, >, 0);
+    g_assert_cmpint(chunk->nb_extents, <=, ARRAY_SIZE(chunk->extents));
+
+    chunk->context_id = client_read32(t);
+    for (i = 0; i < chunk->nb_extents; i++) {
+        chunk->extents[i].length = client_read32(t);
+        chunk->extents[i].flags = client_read32(t);
+    }
+}
+
+static void check_extent(StatusChunk *chunk, unsigned int i,
+                         uint32_t length, uint32_t flags)
+{
+    g_assert_cmpint(chunk->extents[i].length, ==, length);
+    g_assert_cmpint(chunk->extents[i].flags, ==, flags);
+}
+
+static bool client_closed;
+
+static void test_client_closed(NBDClient *client, bool negotiated)
+{
+    client_closed = true;
+    nbd_client_put(client);
+}
+
+static bool export_closed;
+
+static void test_export_closed(NBDExport *exp)
+{
+    export_closed = true;
+}
+
+static void test_setup(NBDBitmapTest *t, const char *base_context,
+                       const char *bitmap_context)
+{
+    BdrvDirtyBitmap *bitmap;
+    QIOChannelSocket *sioc;
+    QDict *opts = qdict_new();
+    int fds[2];
+
+    qdict_put_str(opts, "driver", "null-co");
+    qdict_put_int(opts, "size", IMG_SIZE);
+    t->blk = blk_new_open(NULL, NULL, opts, BDRV_O_RDWR, &error_abort);
+
+    bitmap = bdrv_create_dirty_bitmap(blk_bs(t->blk), GRANULE, "bitmap0",
+                                      &error_abort);
+    bdrv_set_dirty_bitmap(bitmap, 1 * MIB, 2 * GRANULE);
+    bdrv_set_dirty_bitmap(bitmap, 2 * MIB, GRANULE);
+
+    t->exp = nbd_export_new(blk_bs(t->blk), 0, -1, 0, "bitmap0",
+                            test_export_closed, false, NULL, &error_abort);
+    nbd_export_set_name(t->exp, EXPORT_NAME);
+    export_closed = false;
+
+    g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    sioc = qio_channel_socket_new_fd(fds[0], &error_abort);
+    client_closed = false;
+    nbd_client_new(NULL, sioc, NULL, NULL, test_client_closed);
+    object_unref(OBJECT(sioc));
+    t->fd = fds[1];
+    t->handle = 0;
+
+    client_negotiate(t, base_context, bitmap_context);
+}
+
+static void test_teardown(NBDBitmapTest *t)
+{
+    client_send_request(t, NBD_CMD_DISC, 0, 0, 0);
+    while (!client_closed) {
+        main_loop_wait(false);
+    }
+    close(t->fd);
+
+    /* The client's last request still holds a reference to the export,
+     * which keeps the bitmap locked until it is dropped. */
+    nbd_export_close(t->exp);
+    nbd_export_put(t->exp);
+    while (!export_closed) {
+        main_loop_wait(false);
+    }
+    blk_unref(t->blk);
+}
+
+static void test_bitmap_extents(void)
+{
+    NBDBitmapTest t;
+    StatusChunk chunk;
+
+    test_setup(&t, NULL, BITMAP_CONTEXT);
+
+    /* The clean run at the end is capped below 4G, past the request */
+    client_send_request(&t, NBD_CMD_BLOCK_STATUS, 0, 0, 4 * MIB);
+    client_read_status_chunk(&t, &chunk);
+    g_assert_cmpint(chunk.flags, ==, NBD_REPLY_FLAG_DONE);
+    g_assert_cmpint(chunk.context_id, ==, t.bitmap_id);
+    g_assert_cmpint(chunk.nb_extents, ==, 5);
+    check_extent(&chunk, 0, 1 * MIB, 0);
+    check_extent(&chunk, 1, 2 * GRANULE, NBD_STATE_DIRTY);
+    check_extent(&chunk, 2, 1 * MIB - 2 * GRANULE, 0);
+    check_extent(&chunk, 3, GRANULE, NBD_STATE_DIRTY);
+    check_extent(&chunk, 4, UINT32_MAX + 1ULL - GRANULE, 0);
+
+    /* A request that starts in the middle of a dirty run */
+    client_send_request(&t, NBD_CMD_BLOCK_STATUS, 0, 1 * MIB + GRANULE,
+                        2 * GRANULE);
+    client_read_status_chunk(&t, &chunk);
+    g_assert_cmpint(chunk.nb_extents, ==, 2);
+    check_extent(&chunk, 0, GRANULE, NBD_STATE_DIRTY);
+    check_extent(&chunk, 1, 1 * MIB - 2 * GRANULE, 0);
+
+    test_teardown(&t);
+}
+
+static void test_bitmap_req_one(void)
+{
+    NBDBitmapTest t;
+    StatusChunk chunk;
+
+    test_setup(&t, NULL, BITMAP_CONTEXT);
+
+    client_send_request(&t, NBD_CMD_BLOCK_STATUS, NBD_CMD_FLAG_REQ_ONE,
+                        0, 4 * MIB);
+    client_read_status_chunk(&t, &chunk);
+    g_assert_cmpint(chunk.nb_extents, ==, 1);
+    check_extent(&chunk, 0, 1 * MIB, 0);
+
+    client_send_request(&t, NBD_CMD_BLOCK_STATUS, NBD_CMD_FLAG_REQ_ONE,
+                        1 * MIB + GRANULE, 4 * MIB);
+    client_read_status_chunk(&t, &chunk);
+    g_assert_cmpint(chunk.nb_extents, ==, 1);
+    check_extent(&chunk, 0, GRANULE, NBD_STATE_DIRTY);
+
+    /* The extent does not go past the request */
+    client_send_request(&t, NBD_CMD_BLOCK_STATUS, NBD_CMD_FLAG_REQ_ONE,
+                        3 * MIB, GRANULE);
+    client_read_status_chunk(&t, &chunk);
+    g_assert_cmpint(chunk.nb_extents, ==, 1);
+    check_extent(&chunk, 0, GRANULE, 0);
+
+    test_teardown(&t);
+}
+
+static void test_bitmap_with_base_allocation(void)
+{
+    NBDBitmapTest t;
+    StatusChunk chunk;
+
+    test_setup(&t, "base:allocation", BITMAP_CONTEXT);
+    g_assert_cmpint(t.base_id, !=, t.bitmap_id);
+
+    /* One chunk per context, and only the last one is flagged done */
+    client_send_request(&t, NBD_CMD_BLOCK_STATUS, 0, 1 * MIB, 2 * GRANULE);
+    client_read_status_chunk(&t, &chunk);
+    g_assert_cmpint(chunk.flags, ==, 0);
+    g_assert_cmpint(chunk.context_id, ==, t.base_id);
+
+    client_read_status_chunk(&t, &chunk);
+    g_assert_cmpint(chunk.flags, ==, NBD_REPLY_FLAG_DONE);
+    g_assert_cmpint(chunk.context_id, ==, t.bitmap_id);
+    g_assert_cmpint(chunk.nb_extents, ==, 1);
+    check_extent(&chunk, 0, 2 * GRANULE, NBD_STATE_DIRTY);
+
+    test_teardown(&t);
+}
+
+int main(int argc, char **argv)
+{
+    module_call_init(MODULE_INIT_QOM);
+    qemu_init_main_loop(&error_abort);
+    bdrv_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/nbd-bitmap/extents", test_bitmap_extents);
+    g_test_add_func("/nbd-bitmap/req-one", test_bitmap_req_one);
+    g_test_add_func("/nbd-bitmap/base-allocation",
+                    test_bitmap_with_base_allocation);
+
+    return g_test_run();
+}
@@ -0,0 +1,190 @@
+/*
+ * Shared memory block statistics tests
+ *
+ * Copyright (c) 2018 Citrix Systems, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block.h"
+#include "block/accounting.h"
+#include "block/stats-shm.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include <sys/mman.h>
+
+typedef struct StatsShmTest {
+    char *path;
+    int fd;
+    void *base;
+    size_t size;
+    BlockStatsShmHeader *hdr;
+} StatsShmTest;
+
+static void stats_shm_map(StatsShmTest *t)
+{
+    struct stat st;
+
+    t->fd = open(t->path, O_RDONLY);
+    g_assert(t->fd >= 0);
+    g_assert(fstat(t->fd, &st) == 0);
+    t->size = st.st_size;
+    t->base = mmap(NULL, t->size, PROT_READ, MAP_SHARED, t->fd, 0);
+    g_assert(t->base != MAP_FAILED);
+    t->hdr = t->base;
+}
+
+static void stats_shm_unmap(StatsShmTest *t)
+{
+    munmap(t->base, t->size);
+    close(t->fd);
+}
+
+/* Return a copy of the slot for @name, or false if there is none */
+static bool stats_shm_find(StatsShmTest *t, const char *name,
+                           BlockStatsShmSlot *copy)
+{
+    uint32_t i;
+    unsigned seq;
+
+    for (i = 0; i < t->hdr->nr_slots; i++) {
+        BlockStatsShmSlot *slot = (BlockStatsShmSlot *)
+            ((char *)t->base + t->hdr->header_size +
+             (size_t)i * t->hdr->slot_size);
+
+        do {
+            seq = seqlock_read_begin(&slot->seqlock);
+            memcpy(copy, slot, sizeof(*copy));
+        } while (seqlock_read_retry(&slot->seqlock, seq));
+
+        if (copy->in_use && !strcmp(copy->name, name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static BlockBackend *stats_shm_blk(const char *name)
+{
+    BlockBackend *blk;
+    QDict *opts = qdict_new();
+
+    qdict_put_str(opts, "driver", "null-co");
+    blk = blk_new_open(NULL, NULL, opts, BDRV_O_RDWR, &error_abort);
+    monitor_add_blk(blk, name, &error_abort);
+    return blk;
+}
+
+static void stats_shm_blk_free(BlockBackend *blk)
+{
+    monitor_remove_blk(blk);
+    blk_unref(blk);
+}
+
+static void test_stats_shm_export(void)
+{
+    StatsShmTest t = {
+        .path = g_strdup_printf("%s/qemu-test-stats-shm-%d",
+                                g_get_tmp_dir(), getpid()),
+    };
+    BlockBackend *blk0 = stats_shm_blk("drive0");
+    BlockBackend *blk1 = stats_shm_blk("drive1");
+    BlockAcctCookie cookie;
+    BlockStatsShmSlot slot;
+
+    block_acct_start(blk_get_stats(blk0), &cookie, 4096, BLOCK_ACCT_WRITE);
+    block_acct_done(blk_get_stats(blk0), &cookie);
+
+    block_stats_shm_start(t.path, 1000, 1, &error_abort);
+    g_assert(block_stats_shm_start(t.path, 1000, 1, NULL) < 0);
+    stats_shm_map(&t);
+
+    g_assert_cmphex(t.hdr->magic, ==, BLOCK_STATS_SHM_MAGIC);
+    g_assert_cmpint(t.hdr->version, ==, BLOCK_STATS_SHM_VERSION);
+    g_assert_cmpint(t.hdr->nr_slots, ==, 1);
+    g_assert_cmpint(t.hdr->pid, ==, getpid());
+    g_assert(t.hdr->update_time_ns != 0);
+
+    /* Only one slot, so the second device does not fit */
+    g_assert(stats_shm_find(&t, "drive0", &slot));
+    g_assert_cmpint(slot.kind, ==, BLOCK_STATS_SHM_DEVICE);
+    g_assert_cmpint(slot.nr_ops[BLOCK_ACCT_WRITE], ==, 1);
+    g_assert_cmpint(slot.nr_bytes[BLOCK_ACCT_WRITE], ==, 4096);
+    g_assert_cmpint(slot.nr_ops[BLOCK_ACCT_READ], ==, 0);
+    g_assert_cmpint(slot.queue_size, ==, 0);
+    g_assert(!stats_shm_find(&t, "drive1", &slot));
+    g_assert_cmpint(t.hdr->dropped, ==, 1);
+
+    /* Updates show up in the same slot */
+    block_acct_start(blk_get_stats(blk0), &cookie, 512, BLOCK_ACCT_READ);
+    block_acct_done(blk_get_stats(blk0), &cookie);
+    block_stats_shm_update();
+    g_assert(stats_shm_find(&t, "drive0", &slot));
+    g_assert_cmpint(slot.nr_ops[BLOCK_ACCT_READ], ==, 1);
+    g_assert_cmpint(slot.nr_bytes[BLOCK_ACCT_READ], ==, 512);
+    g_assert_cmpint(t.hdr->dropped, ==, 1);
+
+    /* A slot freed by a removed device is taken by the next one */
+    stats_shm_blk_free(blk0);
+    block_stats_shm_update();
+    g_assert(!stats_shm_find(&t, "drive0", &slot));
+    g_assert(stats_shm_find(&t, "drive1", &slot));
+    g_assert_cmpint(t.hdr->dropped, ==, 0);
+
+    block_stats_shm_stop();
+    g_assert(t.hdr->update_time_ns == 0);
+    g_assert(access(t.path, F_OK) < 0);
+    stats_shm_unmap(&t);
+
+    stats_shm_blk_free(blk1);
+    g_free(t.path);
+}
+
+/* An existing file is only reused if no other export holds it */
+static void test_stats_shm_existing(void)
+{
+    char *path = g_strdup_printf("%s/qemu-test-stats-shm-existing-%d",
+                                 g_get_tmp_dir(), getpid());
+    struct stat st;
+    int fd;
+
+    if (!qemu_has_ofd_lock()) {
+        /* Locks of the same process do not conflict */
+        g_test_skip("OFD locks not supported");
+        g_free(path);
+        return;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    g_assert(fd >= 0);
+    g_assert(ftruncate(fd, 4096) == 0);
+    g_assert_cmpint(qemu_lock_fd(fd, 0, 0, true), ==, 0);
+
+    g_assert(block_stats_shm_start(path, 1000, 1, NULL) < 0);
+    g_assert(stat(path, &st) == 0);
+    g_assert_cmpint(st.st_size, ==, 4096);
+
+    /* Left behind once its owner is gone */
+    close(fd);
+    block_stats_shm_start(path, 1000, 1, &error_abort);
+    block_stats_shm_stop();
+    g_assert(access(path, F_OK) < 0);
+
+    g_free(path);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/stats-shm/export", test_stats_shm_export);
+    g_test_add_func("/stats-shm/existing", test_stats_shm_existing);
+
+    return g_test_run();
+}
@@ -222,6 +222,187 @@ static void test_cancel_async(void)
     do_test_cancel(false);
 }
 
+static int in_flight, max_in_flight, order;
+static bool gate_open;
+
+static int tracked_cb(void *opaque)
+{
+    WorkerTestData *data = opaque;
+    int n = atomic_fetch_inc(&in_flight) + 1;
+    int max = atomic_read(&max_in_flight);
+
+    while (n > max) {
+        max = atomic_cmpxchg(&max_in_flight, max, n);
+    }
+    g_usleep(20000);
+    atomic_dec(&in_flight);
+    data->n = atomic_fetch_inc(&order);
+    return 0;
+}
+
+static int gate_cb(void *opaque)
+{
+    WorkerTestData *data = opaque;
+
+    atomic_set(&data->n, 1);
+    while (!atomic_read(&gate_open)) {
+        g_usleep(1000);
+    }
+    return 0;
+}
+
+static void set_params(int max_threads, int max_flush_threads,
+                       bool data_first)
+{
+    ThreadPoolParams params = {
+        .max_threads = max_threads,
+        .max_flush_threads = max_flush_threads,
+        .data_first = data_first,
+    };
+
+    thread_pool_set_params(pool, &params);
+}
+
+static void test_flush_limit(void)
+{
+    WorkerTestData data[10];
+    ThreadPoolStats before, after;
+    int i;
+
+    set_params(64, 2, false);
+    thread_pool_get_stats(pool, &before);
+
+    in_flight = max_in_flight = 0;
+    for (i = 0; i < 10; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        thread_pool_submit_aio_class(pool, THREAD_POOL_FLUSH, tracked_cb,
+                                     &data[i], done_cb, &data[i]);
+    }
+
+    active = 10;
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(max_in_flight, <=, 2);
+    for (i = 0; i < 10; i++) {
+        g_assert_cmpint(data[i].ret, ==, 0);
+    }
+
+    thread_pool_get_stats(pool, &after);
+    g_assert_cmpint(after.cls[THREAD_POOL_FLUSH].completed -
+                    before.cls[THREAD_POOL_FLUSH].completed, ==, 10);
+    g_assert_cmpint(after.cls[THREAD_POOL_FLUSH].queued, ==, 0);
+    g_assert_cmpint(after.cls[THREAD_POOL_FLUSH].active, ==, 0);
+    g_assert_cmpint(after.cls[THREAD_POOL_FLUSH].service_ns -
+                    before.cls[THREAD_POOL_FLUSH].service_ns, >=,
+                    10 * 20000 * SCALE_US);
+    g_assert_cmpint(after.cls[THREAD_POOL_FLUSH].wait_ns,
+                    >, before.cls[THREAD_POOL_FLUSH].wait_ns);
+
+    set_params(64, 0, false);
+}
+
+static void do_test_priority(bool data_first)
+{
+    WorkerTestData gate = { .n = 0, .ret = -EINPROGRESS };
+    WorkerTestData flush[3], data[3];
+    ThreadPoolStats stats;
+    int i;
+
+    /* A single worker, kept busy until all requests are queued */
+    set_params(1, 0, data_first);
+    do {
+        g_usleep(1000);
+        thread_pool_get_stats(pool, &stats);
+    } while (stats.cur_threads > 1);
+    gate_open = false;
+    thread_pool_submit_aio(pool, gate_cb, &gate, done_cb, &gate);
+    active = 1;
+    while (!atomic_read(&gate.n)) {
+        aio_poll(ctx, false);
+        g_usleep(1000);
+    }
+
+    order = 0;
+    for (i = 0; i < 3; i++) {
+        flush[i].ret = data[i].ret = -EINPROGRESS;
+        thread_pool_submit_aio_class(pool, THREAD_POOL_FLUSH, tracked_cb,
+                                     &flush[i], done_cb, &flush[i]);
+    }
+    for (i = 0; i < 3; i++) {
+        thread_pool_submit_aio_class(pool, THREAD_POOL_DATA, tracked_cb,
+                                     &data[i], done_cb, &data[i]);
+    }
+    active += 6;
+    atomic_set(&gate_open, true);
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (data_first) {
+            g_assert_cmpint(data[i].n, ==, i);
+            g_assert_cmpint(flush[i].n, ==, i + 3);
+        } else {
+            g_assert_cmpint(flush[i].n, ==, i);
+            g_assert_cmpint(data[i].n, ==, i + 3);
+        }
+    }
+
+    set_params(64, 0, false);
+}
+
+static void test_fifo(void)
+{
+    do_test_priority(false);
+}
+
+static void test_data_first(void)
+{
+    do_test_priority(true);
+}
+
+static void test_cancel_flush(void)
+{
+    WorkerTestData gate = { .n = 0, .ret = -EINPROGRESS };
+    WorkerTestData queued = { .n = 0, .ret = -EINPROGRESS };
+    ThreadPoolStats stats;
+
+    /* The second flush is held back by the limit and can be cancelled */
+    set_params(64, 1, false);
+    gate_open = false;
+    thread_pool_submit_aio_class(pool, THREAD_POOL_FLUSH, gate_cb, &gate,
+                                 done_cb, &gate);
+    queued.aiocb = thread_pool_submit_aio_class(pool, THREAD_POOL_FLUSH,
+                                                worker_cb, &queued,
+                                                done_cb, &queued);
+    active = 2;
+    while (!atomic_read(&gate.n)) {
+        aio_poll(ctx, false);
+        g_usleep(1000);
+    }
+
+    bdrv_aio_cancel_async(queued.aiocb);
+    while (queued.ret == -EINPROGRESS) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(queued.ret, ==, -ECANCELED);
+    g_assert_cmpint(queued.n, ==, 0);
+
+    atomic_set(&gate_open, true);
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(gate.ret, ==, 0);
+
+    thread_pool_get_stats(pool, &stats);
+    g_assert_cmpint(stats.cls[THREAD_POOL_FLUSH].queued, ==, 0);
+    g_assert_cmpint(stats.cls[THREAD_POOL_FLUSH].active, ==, 0);
+
+    set_params(64, 0, false);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -237,6 +418,10 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
+    g_test_add_func("/thread-pool/flush-limit", test_flush_limit);
+    g_test_add_func("/thread-pool/fifo", test_fifo);
+    g_test_add_func("/thread-pool/data-first", test_data_first);
+    g_test_add_func("/thread-pool/cancel-flush", test_cancel_flush);
 
     ret = g_test_run();
 
@@ -16,6 +16,8 @@
 #include <math.h>
 #include "block/aio.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-block-core.h"
+#include "qemu/coroutine.h"
 #include "qemu/throttle.h"
 #include "qemu/error-report.h"
 #include "block/throttle-groups.h"
@@ -734,6 +736,134 @@ static void test_groups(void)
     g_assert(tgm3->throttle_state == NULL);
 }
 
+typedef struct {
+    ThrottleGroupMember *tgm;
+    bool done;
+} HierarchyRequest;
+
+static void coroutine_fn hierarchy_request_entry(void *opaque)
+{
+    HierarchyRequest *req = opaque;
+
+    throttle_group_co_io_limits_intercept(req->tgm, 4096, false);
+    req->done = true;
+}
+
+static void hierarchy_request(HierarchyRequest *req, ThrottleGroupMember *tgm)
+{
+    Coroutine *co = qemu_coroutine_create(hierarchy_request_entry, req);
+
+    req->tgm = tgm;
+    req->done = false;
+    qemu_coroutine_enter(co);
+}
+
+static ThrottleGroupInfo *find_group_info(ThrottleGroupInfoList *list,
+                                          const char *name)
+{
+    for (; list; list = list->next) {
+        if (!strcmp(list->value->name, name)) {
+            return list->value;
+        }
+    }
+    return NULL;
+}
+
+static void test_groups_hierarchy(void)
+{
+    ThrottleLimits vm = { .has_iops_total = true, .iops_total = 10 };
+    ThrottleLimits disk = { .has_iops_total = true, .iops_total = 100 };
+    ThrottleLimits min = { .has_iops_total = true, .iops_total = 10 };
+    ThrottleGroupInfoList *groups;
+    ThrottleGroupInfo *info;
+    BlockBackend *blk1, *blk2;
+    ThrottleGroupMember *tgm1, *tgm2;
+    HierarchyRequest reqs[4];
+    Error *err = NULL;
+
+    /* A parent with a total limit and two children with higher ones */
+    qmp_x_throttle_group_set("vm", false, NULL, true, &vm, false, NULL,
+                             &error_abort);
+    qmp_x_throttle_group_set("disk1", true, "vm", true, &disk, false, NULL,
+                             &error_abort);
+    qmp_x_throttle_group_set("disk2", true, "vm", true, &disk, true, &min,
+                             &error_abort);
+
+    /* Cycles are refused */
+    qmp_x_throttle_group_set("vm", true, "disk1", false, NULL, false, NULL,
+                             &err);
+    error_free_or_abort(&err);
+    qmp_x_throttle_group_set("vm", true, "vm", false, NULL, false, NULL,
+                             &err);
+    error_free_or_abort(&err);
+
+    blk1 = blk_new(0, BLK_PERM_ALL);
+    blk2 = blk_new(0, BLK_PERM_ALL);
+    tgm1 = &blk_get_public(blk1)->throttle_group_member;
+    tgm2 = &blk_get_public(blk2)->throttle_group_member;
+    throttle_group_register_tgm(tgm1, "disk1", blk_get_aio_context(blk1));
+    throttle_group_register_tgm(tgm2, "disk2", blk_get_aio_context(blk2));
+
+    /* disk1 can use all of the parent's bucket, which holds one request */
+    hierarchy_request(&reqs[0], tgm1);
+    g_assert(reqs[0].done);
+    hierarchy_request(&reqs[1], tgm1);
+    g_assert(reqs[1].done);
+
+    /* Then it has to wait for the parent despite its own limit */
+    hierarchy_request(&reqs[2], tgm1);
+    g_assert(!reqs[2].done);
+    g_assert_cmpint(tgm1->pending_reqs[0], ==, 1);
+
+    /* disk2 is still within its guarantee */
+    hierarchy_request(&reqs[3], tgm2);
+    g_assert(reqs[3].done);
+
+    groups = qmp_query_throttle_groups(&error_abort);
+    info = find_group_info(groups, "vm");
+    g_assert(info);
+    g_assert(!info->has_parent);
+    g_assert_cmpint(info->members, ==, 0);
+    g_assert_cmpint(info->limits->iops_total, ==, 10);
+    g_assert(info->levels && !info->levels->next);
+    g_assert_cmpint(info->levels->value->bucket, ==,
+                    THROTTLE_BUCKET_IOPS_TOTAL);
+    g_assert_cmpfloat(info->levels->value->level, >, 2.5);
+    info = find_group_info(groups, "disk2");
+    g_assert(info);
+    g_assert_cmpstr(info->parent, ==, "vm");
+    g_assert_cmpint(info->members, ==, 1);
+    g_assert(info->has_guarantee);
+    g_assert_cmpint(info->guarantee->iops_total, ==, 10);
+    g_assert(info->guarantee_levels);
+    g_assert_cmpfloat(info->guarantee_levels->value->level, >, 0.5);
+    info = find_group_info(groups, "disk1");
+    g_assert(info);
+    g_assert(!info->has_guarantee);
+    qapi_free_ThrottleGroupInfoList(groups);
+
+    /* The throttled request runs once the parent's bucket has leaked */
+    while (!reqs[2].done) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(tgm1->pending_reqs[0], ==, 0);
+
+    throttle_group_unregister_tgm(tgm1);
+    throttle_group_unregister_tgm(tgm2);
+    blk_unref(blk1);
+    blk_unref(blk2);
+
+    /* Children keep their parent alive */
+    qmp_x_throttle_group_del("vm", &error_abort);
+    g_assert(throttle_group_exists("vm"));
+    qmp_x_throttle_group_del("vm", &err);
+    error_free_or_abort(&err);
+    qmp_x_throttle_group_del("disk1", &error_abort);
+    qmp_x_throttle_group_del("disk2", &error_abort);
+    g_assert(!throttle_group_exists("disk1"));
+    g_assert(!throttle_group_exists("vm"));
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -761,6 +891,7 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/groups/hierarchy",   test_groups_hierarchy);
     return g_test_run();
 }
 
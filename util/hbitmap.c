@@ -94,8 +94,88 @@ struct HBitmap {
 
     /* The length of each levels[] array. */
     uint64_t sizes[HBITMAP_LEVELS];
+
+    /* In a sparse HBitmap, the last level is not a single array.  Instead,
+     * each word of the 2nd-last level has a chunk of BITS_PER_LONG words,
+     * which is only allocated while the word is nonzero; levels[] has no
+     * array for the last level.  A mostly clean bitmap for a huge disk then
+     * costs little more than the upper levels.
+     */
+    unsigned long **chunks;
+
+    /* Number of chunks currently allocated.  */
+    uint64_t nb_chunks;
 };
 
+#define HB_LAST_LEVEL           (HBITMAP_LEVELS - 1)
+
+/* Return word POS of LEVEL.  */
+static inline unsigned long hb_word(const HBitmap *hb, int level, uint64_t pos)
+{
+    if (level == HB_LAST_LEVEL && hb->chunks) {
+        const unsigned long *chunk = hb->chunks[pos >> BITS_PER_LEVEL];
+
+        return chunk ? chunk[pos & (BITS_PER_LONG - 1)] : 0;
+    }
+    return hb->levels[level][pos];
+}
+
+/* Return a pointer to word POS of LEVEL, or NULL if it is in a chunk that
+ * is not allocated (and the word is therefore zero).
+ */
+static inline unsigned long *hb_word_lookup(HBitmap *hb, int level,
+                                            uint64_t pos)
+{
+    if (level == HB_LAST_LEVEL && hb->chunks) {
+        unsigned long *chunk = hb->chunks[pos >> BITS_PER_LEVEL];
+
+        return chunk ? &chunk[pos & (BITS_PER_LONG - 1)] : NULL;
+    }
+    return &hb->levels[level][pos];
+}
+
+/* Return a pointer to word POS of LEVEL, allocating its chunk if needed.  */
+static inline unsigned long *hb_word_ptr(HBitmap *hb, int level, uint64_t pos)
+{
+    if (level == HB_LAST_LEVEL && hb->chunks) {
+        unsigned long **chunk = &hb->chunks[pos >> BITS_PER_LEVEL];
+
+        if (!*chunk) {
+            *chunk = g_new0(unsigned long, BITS_PER_LONG);
+            hb->nb_chunks++;
+        }
+        return &(*chunk)[pos & (BITS_PER_LONG - 1)];
+    }
+    return &hb->levels[level][pos];
+}
+
+/* Free the chunks of the 2nd-last level words FIRST to LAST that have
+ * become zero.
+ */
+static void hb_free_empty_chunks(HBitmap *hb, uint64_t first, uint64_t last)
+{
+    uint64_t i;
+
+    for (i = first; i <= last; i++) {
+        if (hb->chunks[i] && !hb->levels[HB_LAST_LEVEL - 1][i]) {
+            g_free(hb->chunks[i]);
+            hb->chunks[i] = NULL;
+            hb->nb_chunks--;
+        }
+    }
+}
+
+static void hb_free_chunks(HBitmap *hb)
+{
+    uint64_t i;
+
+    for (i = 0; i < hb->sizes[HB_LAST_LEVEL - 1]; i++) {
+        g_free(hb->chunks[i]);
+        hb->chunks[i] = NULL;
+    }
+    hb->nb_chunks = 0;
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -131,7 +211,7 @@ unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -144,7 +224,7 @@ unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_word(hbi->hb, HB_LAST_LEVEL, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -177,7 +257,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -191,9 +271,8 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
 int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
     uint64_t sz = hb->sizes[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur = hb_word(hb, HB_LAST_LEVEL, pos);
     unsigned start_bit_offset =
             (start >> hb->granularity) & (BITS_PER_LONG - 1);
     int64_t res;
@@ -204,13 +283,14 @@ int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start)
     if (cur == (unsigned long)-1) {
         do {
             pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+        } while (pos < sz &&
+                 hb_word(hb, HB_LAST_LEVEL, pos) == (unsigned long)-1);
 
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_word(hb, HB_LAST_LEVEL, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -303,18 +383,21 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
+        changed |= hb_set_elem(hb_word_ptr(hb, level, i), start, next - 1);
         for (;;) {
+            unsigned long *elem;
+
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
+            elem = hb_word_ptr(hb, level, i);
+            changed |= (*elem == 0);
+            *elem = ~0UL;
         }
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_elem(hb_word_ptr(hb, level, i), start, last);
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -371,7 +454,10 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
 {
     size_t pos = start >> BITS_PER_LEVEL;
     size_t lastpos = last >> BITS_PER_LEVEL;
+    size_t first_chunk = pos >> BITS_PER_LEVEL;
+    size_t last_chunk = lastpos >> BITS_PER_LEVEL;
     bool changed = false;
+    unsigned long *elem;
     size_t i;
 
     i = pos;
@@ -383,7 +469,8 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
          * unless the lower-level word became entirely zero.  So, remove pos
          * from the upper-level range if bits remain set.
          */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
+        elem = hb_word_lookup(hb, level, i);
+        if (elem && hb_reset_elem(elem, start, next - 1)) {
             changed = true;
         } else {
             pos++;
@@ -395,13 +482,17 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
+            elem = hb_word_lookup(hb, level, i);
+            if (elem) {
+                changed |= (*elem != 0);
+                *elem = 0UL;
+            }
         }
     }
 
     /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
+    elem = hb_word_lookup(hb, level, i);
+    if (elem && hb_reset_elem(elem, start, last)) {
         changed = true;
     } else {
         lastpos--;
@@ -410,6 +501,9 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
     if (level > 0 && changed) {
         hb_reset_between(hb, level - 1, pos, lastpos);
     }
+    if (level == HB_LAST_LEVEL && hb->chunks && changed) {
+        hb_free_empty_chunks(hb, first_chunk, last_chunk);
+    }
 
     return changed;
 
@@ -441,6 +535,10 @@ void hbitmap_reset_all(HBitmap *hb)
 
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
     for (i = HBITMAP_LEVELS; --i >= 1; ) {
+        if (i == HB_LAST_LEVEL && hb->chunks) {
+            hb_free_chunks(hb);
+            continue;
+        }
         memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
     }
 
@@ -473,7 +571,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_word(hb, HB_LAST_LEVEL, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -485,12 +583,37 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
     return UINT64_C(64) << hb->granularity;
 }
 
+/* Set COUNT words of the last level, starting at FIRST, to VALUE.  The
+ * upper levels are left alone for hbitmap_deserialize_finish().
+ */
+static void hb_fill_words(HBitmap *hb, uint64_t first, uint64_t count,
+                          unsigned long value)
+{
+    uint64_t i;
+
+    if (!hb->chunks) {
+        /* VALUE is either all zeroes or all ones */
+        memset(&hb->levels[HB_LAST_LEVEL][first], value & 0xff,
+               count * sizeof(unsigned long));
+        return;
+    }
+
+    for (i = first; i < first + count; i++) {
+        unsigned long *elem = value ? hb_word_ptr(hb, HB_LAST_LEVEL, i) :
+                                      hb_word_lookup(hb, HB_LAST_LEVEL, i);
+
+        if (elem) {
+            *elem = value;
+        }
+    }
+}
+
 /* Start should be aligned to serialization granularity, chunk size should be
  * aligned to serialization granularity too, except for last chunk.
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -504,20 +627,19 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
 uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
-    uint64_t el_count;
-    unsigned long *cur;
+    uint64_t el_count, first;
 
     if (!count) {
         return 0;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
+    serialization_chunk(hb, start, count, &first, &el_count);
 
     return el_count * sizeof(unsigned long);
 }
@@ -525,8 +647,7 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
 void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
-    uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t el_count, cur, end;
 
     if (!count) {
         return;
@@ -535,9 +656,9 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+        unsigned long el = hb_word(hb, HB_LAST_LEVEL, cur);
 
+        el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
         cur++;
@@ -548,8 +669,7 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               uint64_t start, uint64_t count,
                               bool finish)
 {
-    uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t el_count, cur, end;
 
     if (!count) {
         return;
@@ -558,12 +678,16 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
+        unsigned long el;
+
+        memcpy(&el, buf, sizeof(el));
+        el = (BITS_PER_LONG == 32 ? le32_to_cpu(el) : le64_to_cpu(el));
 
-        if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
+        /* Zero words of a sparse bitmap need no chunk */
+        if (el) {
+            *hb_word_ptr(hb, HB_LAST_LEVEL, cur) = el;
         } else {
-            le64_to_cpus((uint64_t *)cur);
+            hb_fill_words(hb, cur, 1, 0);
         }
 
         buf += sizeof(unsigned long);
@@ -577,15 +701,14 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
 void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
-    uint64_t el_count;
-    unsigned long *first;
+    uint64_t el_count, first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, first, el_count, 0);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -594,15 +717,14 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
 void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
-    uint64_t el_count;
-    unsigned long *first;
+    uint64_t el_count, first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, first, el_count, ~0UL);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -622,13 +744,22 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
         for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
+            if (lev + 1 == HB_LAST_LEVEL && bitmap->chunks &&
+                !bitmap->chunks[i >> BITS_PER_LEVEL]) {
+                /* Skip the rest of a missing chunk */
+                i |= BITS_PER_LONG - 1;
+                continue;
+            }
+            if (hb_word(bitmap, lev + 1, i)) {
                 bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
                     1UL << (i & (BITS_PER_LONG - 1));
             }
         }
     }
 
+    if (bitmap->chunks) {
+        hb_free_empty_chunks(bitmap, 0, bitmap->sizes[HB_LAST_LEVEL - 1] - 1);
+    }
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
     bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
 }
@@ -637,13 +768,17 @@ void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
     assert(!hb->meta);
+    if (hb->chunks) {
+        hb_free_chunks(hb);
+        g_free(hb->chunks);
+    }
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
     g_free(hb);
 }
 
-HBitmap *hbitmap_alloc(uint64_t size, int granularity)
+static HBitmap *hb_alloc(uint64_t size, int granularity, bool sparse)
 {
     HBitmap *hb = g_new0(struct HBitmap, 1);
     unsigned i;
@@ -657,8 +792,14 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         hb->sizes[i] = size;
+        if (i == HB_LAST_LEVEL && sparse) {
+            continue;
+        }
         hb->levels[i] = g_new0(unsigned long, size);
     }
+    if (sparse) {
+        hb->chunks = g_new0(unsigned long *, hb->sizes[HB_LAST_LEVEL - 1]);
+    }
 
     /* We necessarily have free bits in level 0 due to the definition
      * of HBITMAP_LEVELS, so use one for a sentinel.  This speeds up
@@ -669,6 +810,85 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     return hb;
 }
 
+HBitmap *hbitmap_alloc(uint64_t size, int granularity)
+{
+    return hb_alloc(size, granularity, false);
+}
+
+HBitmap *hbitmap_alloc_sparse(uint64_t size, int granularity)
+{
+    return hb_alloc(size, granularity, true);
+}
+
+bool hbitmap_is_sparse(const HBitmap *hb)
+{
+    return hb->chunks != NULL;
+}
+
+void hbitmap_set_sparse(HBitmap *hb, bool sparse)
+{
+    unsigned long *words;
+    uint64_t nb_words = hb->sizes[HB_LAST_LEVEL];
+    uint64_t nb_groups = hb->sizes[HB_LAST_LEVEL - 1];
+    uint64_t i;
+
+    if (sparse == hbitmap_is_sparse(hb)) {
+        return;
+    }
+
+    if (sparse) {
+        words = hb->levels[HB_LAST_LEVEL];
+        hb->levels[HB_LAST_LEVEL] = NULL;
+        hb->chunks = g_new0(unsigned long *, nb_groups);
+
+        /* Only words of the 2nd-last level that are nonzero get a chunk */
+        for (i = 0; i < nb_groups; i++) {
+            if (hb->levels[HB_LAST_LEVEL - 1][i]) {
+                uint64_t first = i << BITS_PER_LEVEL;
+
+                hb->chunks[i] = g_new0(unsigned long, BITS_PER_LONG);
+                hb->nb_chunks++;
+                memcpy(hb->chunks[i], &words[first],
+                       MIN(BITS_PER_LONG, nb_words - first) *
+                       sizeof(unsigned long));
+            }
+        }
+        g_free(words);
+    } else {
+        words = g_new0(unsigned long, nb_words);
+        for (i = 0; i < nb_groups; i++) {
+            if (hb->chunks[i]) {
+                uint64_t first = i << BITS_PER_LEVEL;
+
+                memcpy(&words[first], hb->chunks[i],
+                       MIN(BITS_PER_LONG, nb_words - first) *
+                       sizeof(unsigned long));
+            }
+        }
+        hb_free_chunks(hb);
+        g_free(hb->chunks);
+        hb->chunks = NULL;
+        hb->levels[HB_LAST_LEVEL] = words;
+    }
+}
+
+uint64_t hbitmap_memory_size(const HBitmap *hb)
+{
+    uint64_t words = hb->nb_chunks * BITS_PER_LONG;
+    uint64_t bytes = sizeof(*hb);
+    unsigned i;
+
+    for (i = 0; i < HBITMAP_LEVELS; i++) {
+        if (hb->levels[i]) {
+            words += hb->sizes[i];
+        }
+    }
+    if (hb->chunks) {
+        bytes += hb->sizes[HB_LAST_LEVEL - 1] * sizeof(unsigned long *);
+    }
+    return bytes + words * sizeof(unsigned long);
+}
+
 void hbitmap_truncate(HBitmap *hb, uint64_t size)
 {
     bool shrink;
@@ -700,6 +920,22 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         hbitmap_reset(hb, start, fix_count);
     }
 
+    if (hb->chunks) {
+        /* One chunk pointer per word of the 2nd-last level.  Shrinking has
+         * already reset the bits that go away, which freed their chunks.
+         */
+        uint64_t nb_groups = MAX(BITS_TO_LONGS(BITS_TO_LONGS(size)), 1);
+
+        old = hb->sizes[HB_LAST_LEVEL - 1];
+        if (nb_groups != old) {
+            hb->chunks = g_renew(unsigned long *, hb->chunks, nb_groups);
+            if (nb_groups > old) {
+                memset(&hb->chunks[old], 0,
+                       (nb_groups - old) * sizeof(*hb->chunks));
+            }
+        }
+    }
+
     hb->size = size;
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX(BITS_TO_LONGS(size), 1);
@@ -708,6 +944,9 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         }
         old = hb->sizes[i];
         hb->sizes[i] = size;
+        if (i == HB_LAST_LEVEL && hb->chunks) {
+            continue;
+        }
         hb->levels[i] = g_realloc(hb->levels[i], size * sizeof(unsigned long));
         if (!shrink) {
             memset(&hb->levels[i][old], 0x00,
@@ -720,39 +959,150 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
 }
 
 
-/**
- * Given HBitmaps A and B, let A := A (BITOR) B.
- * Bitmap B will not be modified.
- *
- * @return true if the merge was successful,
- *         false if it was not attempted.
+typedef enum HBitmapOp {
+    HBITMAP_OP_OR,
+    HBITMAP_OP_AND,
+    HBITMAP_OP_ANDNOT,
+} HBitmapOp;
+
+/* Combine one group of up to BITS_PER_LONG words of the last level of A
+ * with the same words of B, i.e. the words covered by the GROUP-th word of
+ * the 2nd-last level.  The operation is done on a copy first, so that the
+ * loops have no aliasing and the compiler can vectorize them.  Returns the
+ * change in the number of set bits.
  */
-bool hbitmap_merge(HBitmap *a, const HBitmap *b)
+static int64_t hb_combine_group(HBitmap *a, const HBitmap *b, HBitmapOp op,
+                                uint64_t group)
 {
-    int i;
-    uint64_t j;
+    static const unsigned long zeroes[BITS_PER_LONG];
+    const int last = HBITMAP_LEVELS - 1;
+    uint64_t first = group << BITS_PER_LEVEL;
+    unsigned n = MIN(BITS_PER_LONG, a->sizes[last] - first);
+    unsigned long *dst = hb_word_ptr(a, last, first);
+    const unsigned long *src = hb_word_lookup((HBitmap *)b, last, first);
+    unsigned long res[BITS_PER_LONG];
+    unsigned long summary = 0, old_summary;
+    int64_t delta = 0;
+    unsigned i;
 
-    if ((a->size != b->size) || (a->granularity != b->granularity)) {
-        return false;
+    if (!src) {
+        src = zeroes;
     }
 
-    if (hbitmap_count(b) == 0) {
-        return true;
+    switch (op) {
+    case HBITMAP_OP_OR:
+        for (i = 0; i < n; i++) {
+            res[i] = dst[i] | src[i];
+        }
+        break;
+    case HBITMAP_OP_AND:
+        for (i = 0; i < n; i++) {
+            res[i] = dst[i] & src[i];
+        }
+        break;
+    case HBITMAP_OP_ANDNOT:
+        for (i = 0; i < n; i++) {
+            res[i] = dst[i] & ~src[i];
+        }
+        break;
+    default:
+        abort();
+    }
+
+    for (i = 0; i < n; i++) {
+        if (res[i] == dst[i]) {
+            continue;
+        }
+        delta += (int64_t)ctpopl(res[i]) - ctpopl(dst[i]);
+        if (a->meta) {
+            uint64_t start = (first + i) << BITS_PER_LEVEL;
+            uint64_t count = MIN(BITS_PER_LONG, a->size - start);
+
+            hbitmap_set(a->meta, start << a->granularity,
+                        count << a->granularity);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        summary |= (unsigned long)(res[i] != 0) << i;
     }
+    memcpy(dst, res, n * sizeof(unsigned long));
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /* Only the upper levels above a word that became zero or nonzero need
+     * an update, and hb_set_between/hb_reset_between propagate it.
      */
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
-        for (j = 0; j < a->sizes[i]; j++) {
-            a->levels[i][j] |= b->levels[i][j];
+    old_summary = a->levels[last - 1][group];
+    a->levels[last - 1][group] = summary;
+    if (!old_summary && summary) {
+        hb_set_between(a, last - 2, group, group);
+    } else if (old_summary && !summary) {
+        hb_reset_between(a, last - 2, group, group);
+    }
+    if (a->chunks && !summary) {
+        hb_free_empty_chunks(a, group, group);
+    }
+    return delta;
+}
+
+/* Compute A := A op B on the last level, visiting only the groups of words
+ * where the result can differ from A according to the 2nd-last level.
+ */
+static bool hbitmap_combine(HBitmap *a, const HBitmap *b, HBitmapOp op)
+{
+    const int last = HBITMAP_LEVELS - 1;
+    uint64_t group;
+
+    if ((a->size != b->size) || (a->granularity != b->granularity)) {
+        return false;
+    }
+
+    for (group = 0; group < a->sizes[last - 1]; group++) {
+        unsigned long sa = a->levels[last - 1][group];
+        unsigned long sb = b->levels[last - 1][group];
+        bool skip;
+
+        switch (op) {
+        case HBITMAP_OP_OR:
+            skip = !sb;
+            break;
+        case HBITMAP_OP_AND:
+            skip = !sa;
+            break;
+        case HBITMAP_OP_ANDNOT:
+            skip = !(sa & sb);
+            break;
+        default:
+            abort();
+        }
+        if (!skip) {
+            a->count += hb_combine_group(a, b, op, group);
         }
     }
 
     return true;
 }
 
+/**
+ * Given HBitmaps A and B, let A := A (BITOR) B.
+ * Bitmap B will not be modified.
+ *
+ * @return true if the merge was successful,
+ *         false if it was not attempted.
+ */
+bool hbitmap_merge(HBitmap *a, const HBitmap *b)
+{
+    return hbitmap_combine(a, b, HBITMAP_OP_OR);
+}
+
+bool hbitmap_intersect(HBitmap *a, const HBitmap *b)
+{
+    return hbitmap_combine(a, b, HBITMAP_OP_AND);
+}
+
+bool hbitmap_subtract(HBitmap *a, const HBitmap *b)
+{
+    return hbitmap_combine(a, b, HBITMAP_OP_ANDNOT);
+}
+
 HBitmap *hbitmap_create_meta(HBitmap *hb, int chunk_size)
 {
     assert(!(chunk_size & (chunk_size - 1)));
@@ -771,10 +1121,30 @@ void hbitmap_free_meta(HBitmap *hb)
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
+    static const unsigned long zeroes[BITS_PER_LONG];
     size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
     char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+    uint64_t nb_groups, i;
+    struct iovec *iov;
+
+    if (!bitmap->chunks) {
+        qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+        return hash;
+    }
+
+    /* Hash the same bytes as a dense bitmap would, chunk by chunk */
+    nb_groups = bitmap->sizes[HB_LAST_LEVEL - 1];
+    iov = g_new(struct iovec, nb_groups);
+    for (i = 0; i < nb_groups; i++) {
+        const unsigned long *chunk = bitmap->chunks[i];
+
+        iov[i].iov_base = (void *)(chunk ? chunk : zeroes);
+        iov[i].iov_len = MIN(BITS_PER_LONG * sizeof(unsigned long),
+                             size - i * BITS_PER_LONG * sizeof(unsigned long));
+    }
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, nb_groups, &hash, errp);
+    g_free(iov);
 
     return hash;
 }
@@ -22,25 +22,150 @@
 #include "block/aio.h"
 
 enum {
-    POOL_BATCH_SIZE = 64,
+    POOL_MIN_BATCH_SIZE = 64,
+    POOL_MAX_BATCH_SIZE = 512,
 };
 
-/** Free list to speed up creation */
-static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(pool);
+/*
+ * Free lists to speed up creation.
+ *
+ * Each thread allocates from its own alloc list without any atomic operation.
+ * When it runs dry it refills it in one go, first from its own spare list,
+ * then from the global release_pool, and finally by stealing the spare list
+ * of another thread.  Terminated coroutines go back to the alloc list of the
+ * thread that runs them, then to its spare list, and only then to the
+ * release_pool.
+ *
+ * Each of these lists holds at most coroutine_pool_batch_size() coroutines
+ * (twice that for the release_pool).  The size grows with the number of
+ * requests that devices can have in flight, see
+ * qemu_coroutine_inc_pool_size(), but is capped: those devices are spread
+ * over several threads, and every thread keeps its own lists.
+ */
+typedef QSLIST_HEAD(, Coroutine) CoroutineList;
+
+typedef struct CoroutineThreadPool {
+    /* Only accessed by the owning thread */
+    CoroutineList alloc;
+    unsigned int alloc_size;
+
+    /* Accessed atomically, other threads may steal it */
+    CoroutineList spare;
+    unsigned int spare_size;
+
+    /* Written by the owning thread only */
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long steals;
+
+    /* Protected by pools_lock */
+    bool registered;
+    QLIST_ENTRY(CoroutineThreadPool) next;
+} CoroutineThreadPool;
+
+static unsigned int pool_batch_size = POOL_MIN_BATCH_SIZE;
+static CoroutineList release_pool = QSLIST_HEAD_INITIALIZER(pool);
 static unsigned int release_pool_size;
-static __thread QSLIST_HEAD(, Coroutine) alloc_pool = QSLIST_HEAD_INITIALIZER(pool);
-static __thread unsigned int alloc_pool_size;
+static __thread CoroutineThreadPool local_pool;
 static __thread Notifier coroutine_pool_cleanup_notifier;
 
-static void coroutine_pool_cleanup(Notifier *n, void *value)
+/* Pools of the running threads, and the counters of those that exited */
+static QemuSpin pools_lock;
+static QLIST_HEAD(, CoroutineThreadPool) pools =
+    QLIST_HEAD_INITIALIZER(pools);
+static CoroutinePoolStats exited_stats;
+
+static unsigned int coroutine_pool_batch_size(void)
+{
+    return MIN(atomic_read(&pool_batch_size), POOL_MAX_BATCH_SIZE);
+}
+
+static void coroutine_pool_free_list(CoroutineThreadPool *p)
 {
     Coroutine *co;
     Coroutine *tmp;
 
-    QSLIST_FOREACH_SAFE(co, &alloc_pool, pool_next, tmp) {
-        QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
+    QSLIST_FOREACH_SAFE(co, &p->alloc, pool_next, tmp) {
+        QSLIST_REMOVE_HEAD(&p->alloc, pool_next);
         qemu_coroutine_delete(co);
     }
+    p->alloc_size = 0;
+}
+
+static void coroutine_pool_cleanup(Notifier *n, void *value)
+{
+    CoroutineThreadPool *p = &local_pool;
+
+    qemu_spin_lock(&pools_lock);
+    QLIST_REMOVE(p, next);
+    p->registered = false;
+    exited_stats.hits += p->hits;
+    exited_stats.misses += p->misses;
+    exited_stats.steals += p->steals;
+    qemu_spin_unlock(&pools_lock);
+
+    /* Nobody can steal from us anymore */
+    coroutine_pool_free_list(p);
+    QSLIST_MOVE_ATOMIC(&p->alloc, &p->spare);
+    coroutine_pool_free_list(p);
+}
+
+static void coroutine_pool_register(CoroutineThreadPool *p)
+{
+    /* Slow path; a good place to register the destructor, too.  */
+    coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
+    qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
+
+    qemu_spin_lock(&pools_lock);
+    QLIST_INSERT_HEAD(&pools, p, next);
+    p->registered = true;
+    qemu_spin_unlock(&pools_lock);
+}
+
+/* Move a whole list to the (empty) alloc pool of the current thread */
+static void coroutine_pool_take(CoroutineThreadPool *p,
+                                CoroutineList *list,
+                                unsigned int *size)
+{
+    /* This is not exact; there could be a little skew between the size and
+     * the actual length of the list.  But it is just a heuristic, it does
+     * not need to be perfect.
+     */
+    p->alloc_size = atomic_xchg(size, 0);
+    QSLIST_MOVE_ATOMIC(&p->alloc, list);
+    if (QSLIST_EMPTY(&p->alloc)) {
+        p->alloc_size = 0;
+    }
+}
+
+static void coroutine_pool_refill(CoroutineThreadPool *p)
+{
+    CoroutineThreadPool *victim;
+
+    if (!p->registered) {
+        coroutine_pool_register(p);
+    }
+
+    if (atomic_read(&p->spare_size)) {
+        coroutine_pool_take(p, &p->spare, &p->spare_size);
+    }
+    if (QSLIST_EMPTY(&p->alloc) && atomic_read(&release_pool_size)) {
+        coroutine_pool_take(p, &release_pool, &release_pool_size);
+    }
+    if (QSLIST_EMPTY(&p->alloc)) {
+        qemu_spin_lock(&pools_lock);
+        QLIST_FOREACH(victim, &pools, next) {
+            if (victim != p && atomic_read(&victim->spare_size)) {
+                coroutine_pool_take(p, &victim->spare,
+                                    &victim->spare_size);
+                if (!QSLIST_EMPTY(&p->alloc)) {
+                    atomic_set(&p->steals, p->steals + 1);
+                    break;
+                }
+            }
+        }
+        qemu_spin_unlock(&pools_lock);
+    }
 }
 
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
@@ -48,27 +173,19 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
     Coroutine *co = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
-        co = QSLIST_FIRST(&alloc_pool);
-        if (!co) {
-            if (release_pool_size > POOL_BATCH_SIZE) {
-                /* Slow path; a good place to register the destructor, too.  */
-                if (!coroutine_pool_cleanup_notifier.notify) {
-                    coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
-                    qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
-                }
+        CoroutineThreadPool *p = &local_pool;
 
-                /* This is not exact; there could be a little skew between
-                 * release_pool_size and the actual size of release_pool.  But
-                 * it is just a heuristic, it does not need to be perfect.
-                 */
-                alloc_pool_size = atomic_xchg(&release_pool_size, 0);
-                QSLIST_MOVE_ATOMIC(&alloc_pool, &release_pool);
-                co = QSLIST_FIRST(&alloc_pool);
-            }
+        co = QSLIST_FIRST(&p->alloc);
+        if (!co) {
+            coroutine_pool_refill(p);
+            co = QSLIST_FIRST(&p->alloc);
         }
         if (co) {
-            QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
-            alloc_pool_size--;
+            QSLIST_REMOVE_HEAD(&p->alloc, pool_next);
+            p->alloc_size--;
+            atomic_set(&p->hits, p->hits + 1);
+        } else {
+            atomic_set(&p->misses, p->misses + 1);
         }
     }
 
@@ -87,14 +204,26 @@ static void coroutine_delete(Coroutine *co)
     co->caller = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
-        if (release_pool_size < POOL_BATCH_SIZE * 2) {
-            QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
-            atomic_inc(&release_pool_size);
+        CoroutineThreadPool *p = &local_pool;
+        unsigned int batch_size = coroutine_pool_batch_size();
+
+        if (p->alloc_size < batch_size) {
+            /* So that the thread frees its pool when it exits */
+            if (!p->registered) {
+                coroutine_pool_register(p);
+            }
+            QSLIST_INSERT_HEAD(&p->alloc, co, pool_next);
+            p->alloc_size++;
             return;
         }
-        if (alloc_pool_size < POOL_BATCH_SIZE) {
-            QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
-            alloc_pool_size++;
+        if (atomic_read(&p->spare_size) < batch_size) {
+            QSLIST_INSERT_HEAD_ATOMIC(&p->spare, co, pool_next);
+            atomic_inc(&p->spare_size);
+            return;
+        }
+        if (atomic_read(&release_pool_size) < batch_size * 2) {
+            QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
+            atomic_inc(&release_pool_size);
             return;
         }
     }
@@ -102,6 +231,31 @@ static void coroutine_delete(Coroutine *co)
     qemu_coroutine_delete(co);
 }
 
+void qemu_coroutine_inc_pool_size(unsigned int n)
+{
+    atomic_add(&pool_batch_size, n);
+}
+
+void qemu_coroutine_dec_pool_size(unsigned int n)
+{
+    atomic_sub(&pool_batch_size, n);
+}
+
+void qemu_coroutine_get_pool_stats(CoroutinePoolStats *stats)
+{
+    CoroutineThreadPool *p;
+
+    qemu_spin_lock(&pools_lock);
+    *stats = exited_stats;
+    QLIST_FOREACH(p, &pools, next) {
+        stats->hits += atomic_read(&p->hits);
+        stats->misses += atomic_read(&p->misses);
+        stats->steals += atomic_read(&p->steals);
+    }
+    qemu_spin_unlock(&pools_lock);
+    stats->batch_size = coroutine_pool_batch_size();
+}
+
 void qemu_aio_coroutine_enter(AioContext *ctx, Coroutine *co)
 {
     QSIMPLEQ_HEAD(, Coroutine) pending = QSIMPLEQ_HEAD_INITIALIZER(pending);
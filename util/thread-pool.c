@@ -19,10 +19,15 @@
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/coroutine.h"
+#include "qemu/bitmap.h"
+#include "qemu/timer.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
 
+/* With data_first, serve a flush after this many data requests in a row */
+#define THREAD_POOL_MAX_DATA_STREAK 16
+
 static void do_spawn_thread(ThreadPool *pool);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
@@ -46,6 +51,11 @@ struct ThreadPoolElement {
     enum ThreadState state;
     int ret;
 
+    /* Set at submission time, read by the worker under lock.  */
+    ThreadPoolClass cls;
+    uint64_t seq;
+    int64_t submit_ns;
+
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
@@ -59,24 +69,106 @@ struct ThreadPool {
     QemuMutex lock;
     QemuCond worker_stopped;
     QemuSemaphore sem;
-    int max_threads;
     QEMUBH *new_thread_bh;
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
 
     /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    QTAILQ_HEAD(, ThreadPoolElement) request_list[THREAD_POOL_NR_CLASSES];
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     bool stopping;
+
+    ThreadPoolParams params;
+    unsigned affinity_gen;  /* bumped whenever params.cpus changes */
+
+    /* The semaphore counts queued data requests plus flush_released, i.e.
+     * the queued flushes that workers are currently allowed to pick up,
+     * plus retiring, the wakeups posted to make surplus workers exit after
+     * max_threads was lowered.  Flushes are released as long as
+     * max_flush_threads permits.
+     */
+    int retiring;
+    int flush_active;
+    int flush_released;
+    int data_streak;
+    uint64_t seq;
+    ThreadPoolClassStats stats[THREAD_POOL_NR_CLASSES];
 };
 
+static void thread_pool_apply_affinity(ThreadPool *pool)
+{
+#ifdef CONFIG_LINUX
+    cpu_set_t set;
+    int cpu;
+
+    /* Runs with lock taken.  */
+    CPU_ZERO(&set);
+    for (cpu = 0; cpu < MIN(THREAD_POOL_MAX_CPUS, CPU_SETSIZE); cpu++) {
+        if (!pool->params.cpus || test_bit(cpu, pool->params.cpus)) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+/* Let workers pick up as many queued flushes as max_flush_threads allows */
+static void thread_pool_release_flushes(ThreadPool *pool)
+{
+    int max = pool->params.max_flush_threads;
+
+    /* Runs with lock taken.  */
+    while (pool->flush_released < pool->stats[THREAD_POOL_FLUSH].queued &&
+           (!max || pool->flush_active + pool->flush_released < max)) {
+        pool->flush_released++;
+        qemu_sem_post(&pool->sem);
+    }
+}
+
+/* Dequeue the next request for a worker that was woken up by the semaphore */
+static ThreadPoolElement *thread_pool_next_request(ThreadPool *pool)
+{
+    ThreadPoolElement *data, *flush = NULL;
+    ThreadPoolElement *req;
+
+    /* Runs with lock taken.  */
+    data = QTAILQ_FIRST(&pool->request_list[THREAD_POOL_DATA]);
+    if (pool->flush_released) {
+        flush = QTAILQ_FIRST(&pool->request_list[THREAD_POOL_FLUSH]);
+    }
+
+    if (!flush) {
+        req = data;
+    } else if (!data) {
+        req = flush;
+    } else if (pool->params.data_first) {
+        req = pool->data_streak < THREAD_POOL_MAX_DATA_STREAK ? data : flush;
+    } else {
+        req = flush->seq < data->seq ? flush : data;
+    }
+    assert(req);
+
+    if (req->cls == THREAD_POOL_FLUSH) {
+        pool->flush_released--;
+        pool->flush_active++;
+        pool->data_streak = 0;
+    } else if (flush) {
+        pool->data_streak++;
+    }
+
+    QTAILQ_REMOVE(&pool->request_list[req->cls], req, reqs);
+    pool->stats[req->cls].queued--;
+    return req;
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
+    unsigned affinity_gen = 0;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
@@ -84,32 +176,63 @@ static void *worker_thread(void *opaque)
 
     while (!pool->stopping) {
         ThreadPoolElement *req;
+        ThreadPoolClass cls;
+        int64_t start_ns, end_ns;
         int ret;
 
+        if (affinity_gen != pool->affinity_gen) {
+            thread_pool_apply_affinity(pool);
+            affinity_gen = pool->affinity_gen;
+        }
+
         do {
             pool->idle_threads++;
             qemu_mutex_unlock(&pool->lock);
             ret = qemu_sem_timedwait(&pool->sem, 10000);
             qemu_mutex_lock(&pool->lock);
             pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
+        } while (ret == -1 &&
+                 (pool->stats[THREAD_POOL_DATA].queued ||
+                  pool->stats[THREAD_POOL_FLUSH].queued ||
+                  pool->cur_threads <= pool->params.min_threads));
         if (ret == -1 || pool->stopping) {
             break;
         }
+        if (pool->retiring) {
+            pool->retiring--;
+            if (pool->cur_threads > pool->params.max_threads) {
+                break;
+            }
+            continue;
+        }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
+        req = thread_pool_next_request(pool);
         req->state = THREAD_ACTIVE;
+        cls = req->cls;
+        start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        pool->stats[cls].wait_ns += start_ns - req->submit_ns;
+        pool->stats[cls].active++;
         qemu_mutex_unlock(&pool->lock);
 
         ret = req->func(req->arg);
+        end_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+        /* Account before publishing the result, a completion BH scheduled
+         * by another worker may pick it up right away.  */
+        qemu_mutex_lock(&pool->lock);
+        pool->stats[cls].active--;
+        pool->stats[cls].completed++;
+        pool->stats[cls].service_ns += end_ns - start_ns;
 
         req->ret = ret;
         /* Write ret before state.  */
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
+        if (cls == THREAD_POOL_FLUSH) {
+            pool->flush_active--;
+            thread_pool_release_flushes(pool);
+        }
 
         qemu_bh_schedule(pool->completion_bh);
     }
@@ -212,18 +335,36 @@ static void thread_pool_cancel(BlockAIOCB *acb)
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
     qemu_mutex_lock(&pool->lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
-         */
-        qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
+    if (elem->state == THREAD_QUEUED) {
+        bool stolen;
+
+        if (elem->cls == THREAD_POOL_FLUSH &&
+            pool->stats[THREAD_POOL_FLUSH].queued > pool->flush_released) {
+            /* Some queued flush has not been released to the workers yet,
+             * so there is no semaphore signal to take back.
+             */
+            stolen = true;
+        } else {
+            /* No thread has yet started working on elem. we can try to
+             * "steal" the item from the worker if we can get a signal from
+             * the semaphore.  Because this is non-blocking, we can do it
+             * with the lock taken and ensure that elem will remain
+             * THREAD_QUEUED.
+             */
+            stolen = qemu_sem_timedwait(&pool->sem, 0) == 0;
+            if (stolen && elem->cls == THREAD_POOL_FLUSH) {
+                pool->flush_released--;
+            }
+        }
+
+        if (stolen) {
+            QTAILQ_REMOVE(&pool->request_list[elem->cls], elem, reqs);
+            pool->stats[elem->cls].queued--;
+            qemu_bh_schedule(pool->completion_bh);
 
-        elem->state = THREAD_DONE;
-        elem->ret = -ECANCELED;
+            elem->state = THREAD_DONE;
+            elem->ret = -ECANCELED;
+        }
     }
 
     qemu_mutex_unlock(&pool->lock);
@@ -242,8 +383,8 @@ static const AIOCBInfo thread_pool_aiocb_info = {
     .get_aio_context    = thread_pool_get_aio_context,
 };
 
-BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
-        ThreadPoolFunc *func, void *arg,
+BlockAIOCB *thread_pool_submit_aio_class(ThreadPool *pool,
+        ThreadPoolClass cls, ThreadPoolFunc *func, void *arg,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
@@ -253,21 +394,39 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
+    req->cls = cls;
+    req->submit_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
     trace_thread_pool_submit(pool, req, arg);
 
     qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
+    if (pool->idle_threads == 0 &&
+        pool->cur_threads < pool->params.max_threads) {
         spawn_thread(pool);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
-    qemu_sem_post(&pool->sem);
+    req->seq = pool->seq++;
+    QTAILQ_INSERT_TAIL(&pool->request_list[cls], req, reqs);
+    pool->stats[cls].queued++;
+    if (cls == THREAD_POOL_FLUSH) {
+        thread_pool_release_flushes(pool);
+        qemu_mutex_unlock(&pool->lock);
+    } else {
+        qemu_mutex_unlock(&pool->lock);
+        qemu_sem_post(&pool->sem);
+    }
     return &req->common;
 }
 
+BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
+        ThreadPoolFunc *func, void *arg,
+        BlockCompletionFunc *cb, void *opaque)
+{
+    return thread_pool_submit_aio_class(pool, THREAD_POOL_DATA, func, arg,
+                                        cb, opaque);
+}
+
 typedef struct ThreadPoolCo {
     Coroutine *co;
     int ret;
@@ -281,16 +440,24 @@ static void thread_pool_co_cb(void *opaque, int ret)
     aio_co_wake(co->co);
 }
 
-int coroutine_fn thread_pool_submit_co(ThreadPool *pool, ThreadPoolFunc *func,
-                                       void *arg)
+int coroutine_fn thread_pool_submit_co_class(ThreadPool *pool,
+                                             ThreadPoolClass cls,
+                                             ThreadPoolFunc *func, void *arg)
 {
     ThreadPoolCo tpc = { .co = qemu_coroutine_self(), .ret = -EINPROGRESS };
     assert(qemu_in_coroutine());
-    thread_pool_submit_aio(pool, func, arg, thread_pool_co_cb, &tpc);
+    thread_pool_submit_aio_class(pool, cls, func, arg, thread_pool_co_cb,
+                                 &tpc);
     qemu_coroutine_yield();
     return tpc.ret;
 }
 
+int coroutine_fn thread_pool_submit_co(ThreadPool *pool, ThreadPoolFunc *func,
+                                       void *arg)
+{
+    return thread_pool_submit_co_class(pool, THREAD_POOL_DATA, func, arg);
+}
+
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
 {
     thread_pool_submit_aio(pool, func, arg, NULL, NULL);
@@ -308,11 +475,12 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
     qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
+    pool->params.max_threads = 64;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
+    QTAILQ_INIT(&pool->request_list[THREAD_POOL_DATA]);
+    QTAILQ_INIT(&pool->request_list[THREAD_POOL_FLUSH]);
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -350,5 +518,61 @@ void thread_pool_free(ThreadPool *pool)
     qemu_sem_destroy(&pool->sem);
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
+    g_free(pool->params.cpus);
     g_free(pool);
 }
+
+void thread_pool_set_params(ThreadPool *pool, const ThreadPoolParams *params)
+{
+    assert(params->max_threads > 0);
+    assert(params->min_threads >= 0 &&
+           params->min_threads <= params->max_threads);
+    assert(params->max_flush_threads >= 0);
+
+    qemu_mutex_lock(&pool->lock);
+    pool->params.min_threads = params->min_threads;
+    pool->params.max_threads = params->max_threads;
+    pool->params.max_flush_threads = params->max_flush_threads;
+    pool->params.data_first = params->data_first;
+
+    g_free(pool->params.cpus);
+    pool->params.cpus = NULL;
+    if (params->cpus) {
+        pool->params.cpus = bitmap_new(THREAD_POOL_MAX_CPUS);
+        bitmap_copy(pool->params.cpus, params->cpus, THREAD_POOL_MAX_CPUS);
+    }
+    pool->affinity_gen++;
+
+    /* A higher limit may let more queued flushes through */
+    thread_pool_release_flushes(pool);
+
+    while (pool->cur_threads - pool->retiring > pool->params.max_threads) {
+        pool->retiring++;
+        qemu_sem_post(&pool->sem);
+    }
+
+    while (pool->cur_threads < pool->params.min_threads) {
+        spawn_thread(pool);
+    }
+    qemu_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_get_params(ThreadPool *pool, ThreadPoolParams *params)
+{
+    qemu_mutex_lock(&pool->lock);
+    *params = pool->params;
+    if (pool->params.cpus) {
+        params->cpus = bitmap_new(THREAD_POOL_MAX_CPUS);
+        bitmap_copy(params->cpus, pool->params.cpus, THREAD_POOL_MAX_CPUS);
+    }
+    qemu_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats)
+{
+    qemu_mutex_lock(&pool->lock);
+    stats->cur_threads = pool->cur_threads;
+    stats->idle_threads = pool->idle_threads;
+    memcpy(stats->cls, pool->stats, sizeof(stats->cls));
+    qemu_mutex_unlock(&pool->lock);
+}
@@ -56,7 +56,7 @@ void throttle_leak_bucket(LeakyBucket *bkt, int64_t delta_ns)
  *
  * @now:      the current timestamp in ns
  */
-static void throttle_do_leak(ThrottleState *ts, int64_t now)
+void throttle_do_leak(ThrottleState *ts, int64_t now)
 {
     /* compute the time elapsed since the last leak */
     int64_t delta_ns = now - ts->previous_leak;
@@ -164,6 +164,21 @@ static int64_t throttle_compute_wait_for(ThrottleState *ts,
     return max_wait;
 }
 
+/* Make the buckets leak up to @now and compute the time that I/O of the
+ * given type has to wait, without arming any timer.  This is for users
+ * that combine the verdicts of several ThrottleStates.
+ *
+ * @is_write:   the type of operation
+ * @now:        the current clock timestamp
+ * @ret:        the time to wait in ns, or 0 if the operation can go through
+ */
+int64_t throttle_leak_and_compute_wait(ThrottleState *ts, bool is_write,
+                                       int64_t now)
+{
+    throttle_do_leak(ts, now);
+    return throttle_compute_wait_for(ts, is_write);
+}
+
 /* compute the timer for this type of operation
  *
  * @is_write:   the type of operation